@@ -55,13 +55,358 @@ static int g_iDontForceFlush;
 
 DEFINE_FIXEDSIZE_ALLOCATOR_MT( DataCacheItem_t, 4096/sizeof(DataCacheItem_t), CUtlMemoryPool::GROW_SLOW );
 
-void DataCacheItem_t::DestroyResource()
-{ 
-	if ( pSection )
+
+//-----------------------------------------------------------------------------
+// CDataCacheLRU
+//-----------------------------------------------------------------------------
+
+// A handle is the slot + 1 in the low word, then the shard, then the slot's serial
+#define DC_LRU_SERIAL_BITS	( 16 - DC_LRU_SHARD_BITS )
+#define DC_LRU_SERIAL_MASK	( ( 1 << DC_LRU_SERIAL_BITS ) - 1 )
+#define DC_LRU_MAX_SLOTS	0xfffe		// keeps clear of INVALID_MEMHANDLE
+
+static inline memhandle_t DataCacheLRUHandle( int iShard, int iSlot, unsigned nSerial )
+{
+	return (memhandle_t)(uintp)( ( nSerial << ( 16 + DC_LRU_SHARD_BITS ) ) | ( iShard << 16 ) | ( iSlot + 1 ) );
+}
+
+CDataCacheLRU::CAutoShardLock::CAutoShardLock( Shard_t &shard )
+  :	m_shard( shard )
+{
+	if ( !m_shard.mutex.TryLock() )
+	{
+		m_shard.mutex.Lock();
+		m_shard.stats.nContended++;
+	}
+	m_shard.stats.nAcquires++;
+}
+
+CDataCacheLRU::CDataCacheLRU()
+{
+	for ( int i = 0; i < DC_LRU_SHARDS; i++ )
+	{
+		m_Shards[i].iHand = 0;
+		m_Shards[i].nUnlocked = 0;
+		memset( &m_Shards[i].stats, 0, sizeof(m_Shards[i].stats) );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Resolves a handle within its shard, NULL if it's stale. Shard must be locked
+//-----------------------------------------------------------------------------
+inline DataCacheItem_t *CDataCacheLRU::FromHandle( Shard_t &shard, memhandle_t handle, int *piSlot )
+{
+	unsigned nHandle = (unsigned)(uintp)handle;
+	int iSlot = (int)( nHandle & 0xffff ) - 1;
+	unsigned nSerial = nHandle >> ( 16 + DC_LRU_SHARD_BITS );
+	if ( iSlot < 0 || iSlot >= shard.items.Count() || shard.serials[iSlot] != nSerial )
+		return NULL;
+
+	if ( piSlot )
+	{
+		*piSlot = iSlot;
+	}
+	return shard.items[iSlot];
+}
+
+//-----------------------------------------------------------------------------
+// 
+//-----------------------------------------------------------------------------
+memhandle_t CDataCacheLRU::CreateResource( const DataCacheItemData_t &data, bool bCreateLocked )
+{
+	DataCacheItem_t *pItem = new DataCacheItem_t( data );
+	pItem->nLockCount = ( bCreateLocked ) ? 1 : 0;
+
+	// Items go to the shard their client id hashes to, unless it's full
+	unsigned iHome = HashItem( data.clientId );
+	for ( int i = 0; i < DC_LRU_SHARDS; i++ )
+	{
+		int iShard = ( iHome + i ) & ( DC_LRU_SHARDS - 1 );
+		Shard_t &shard = m_Shards[iShard];
+		CAutoShardLock lock( shard );
+
+		int iSlot;
+		if ( shard.freeSlots.Count() )
+		{
+			iSlot = shard.freeSlots.Tail();
+			shard.freeSlots.RemoveMultipleFromTail( 1 );
+		}
+		else if ( shard.items.Count() < DC_LRU_MAX_SLOTS )
+		{
+			iSlot = shard.items.AddToTail();
+			shard.serials.AddToTail( 0 );
+		}
+		else
+		{
+			continue;
+		}
+
+		shard.items[iSlot] = pItem;
+		shard.nUnlocked += ( bCreateLocked ) ? 0 : 1;
+		shard.stats.nItems++;
+		pItem->hLRU = DataCacheLRUHandle( iShard, iSlot, shard.serials[iSlot] );
+		return pItem->hLRU;
+	}
+
+	delete pItem;
+	return INVALID_MEMHANDLE;
+}
+
+//-----------------------------------------------------------------------------
+// 
+//-----------------------------------------------------------------------------
+DataCacheItem_t *CDataCacheLRU::DetachResource( memhandle_t handle, bool bBreakLock, int *pnLockCount )
+{
+	Shard_t &shard = ShardFromHandle( handle );
+	CAutoShardLock lock( shard );
+
+	int iSlot;
+	DataCacheItem_t *pItem = FromHandle( shard, handle, &iSlot );
+	if ( !pItem || ( pItem->nLockCount && !bBreakLock ) )
+		return NULL;
+
+	if ( pnLockCount )
+	{
+		*pnLockCount = pItem->nLockCount;
+	}
+	if ( !pItem->nLockCount )
+	{
+		shard.nUnlocked--;
+	}
+	pItem->nLockCount = 0;
+
+	shard.items[iSlot] = NULL;
+	shard.serials[iSlot] = ( shard.serials[iSlot] + 1 ) & DC_LRU_SERIAL_MASK;
+	shard.freeSlots.AddToTail( iSlot );
+	shard.stats.nItems--;
+	return pItem;
+}
+
+//-----------------------------------------------------------------------------
+// 
+//-----------------------------------------------------------------------------
+DataCacheItem_t *CDataCacheLRU::LockResource( memhandle_t handle, int *pnLockCount )
+{
+	Shard_t &shard = ShardFromHandle( handle );
+	CAutoShardLock lock( shard );
+
+	DataCacheItem_t *pItem = FromHandle( shard, handle );
+	if ( pItem )
+	{
+		Assert( pItem->nLockCount < 0xffff );
+		if ( !pItem->nLockCount++ )
+		{
+			shard.nUnlocked--;
+		}
+		pItem->bReferenced = true;
+		if ( pnLockCount )
+		{
+			*pnLockCount = pItem->nLockCount;
+		}
+	}
+	return pItem;
+}
+
+int CDataCacheLRU::UnlockResource( memhandle_t handle, unsigned *pnSize )
+{
+	Shard_t &shard = ShardFromHandle( handle );
+	CAutoShardLock lock( shard );
+
+	DataCacheItem_t *pItem = FromHandle( shard, handle );
+	if ( !pItem )
+		return 0;
+
+	Assert( pItem->nLockCount > 0 );
+	if ( pItem->nLockCount > 0 && !--pItem->nLockCount )
+	{
+		shard.nUnlocked++;
+	}
+
+	// Counts as a use, the item was in use until now
+	pItem->bReferenced = true;
+	if ( pnSize )
 	{
-		pSection->DiscardItemData( this, DC_AGE_DISCARD );
+		*pnSize = pItem->size;
 	}
-	delete this; 
+	return pItem->nLockCount;
+}
+
+int CDataCacheLRU::LockCount( memhandle_t handle )
+{
+	Shard_t &shard = ShardFromHandle( handle );
+	CAutoShardLock lock( shard );
+
+	DataCacheItem_t *pItem = FromHandle( shard, handle );
+	return ( pItem ) ? pItem->nLockCount : 0;
+}
+
+int CDataCacheLRU::BreakLock( memhandle_t handle )
+{
+	Shard_t &shard = ShardFromHandle( handle );
+	CAutoShardLock lock( shard );
+
+	DataCacheItem_t *pItem = FromHandle( shard, handle );
+	if ( !pItem )
+		return 0;
+
+	int nBroken = pItem->nLockCount;
+	if ( nBroken )
+	{
+		shard.nUnlocked++;
+	}
+	pItem->nLockCount = 0;
+	return nBroken;
+}
+
+//-----------------------------------------------------------------------------
+// 
+//-----------------------------------------------------------------------------
+DataCacheItem_t *CDataCacheLRU::GetResource( memhandle_t handle, bool bTouch )
+{
+	Shard_t &shard = ShardFromHandle( handle );
+	CAutoShardLock lock( shard );
+
+	DataCacheItem_t *pItem = FromHandle( shard, handle );
+	if ( pItem && bTouch )
+	{
+		pItem->bReferenced = true;
+	}
+	return pItem;
+}
+
+const void *CDataCacheLRU::GetResourceData( memhandle_t handle, bool bTouch )
+{
+	Shard_t &shard = ShardFromHandle( handle );
+	CAutoShardLock lock( shard );
+
+	DataCacheItem_t *pItem = FromHandle( shard, handle );
+	if ( !pItem )
+		return NULL;
+
+	if ( bTouch )
+	{
+		pItem->bReferenced = true;
+	}
+	return pItem->pItemData;
+}
+
+bool CDataCacheLRU::TouchResource( memhandle_t handle )
+{
+	return ( GetResource( handle, true ) != NULL );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Makes the item the next one the clock hand considers
+//-----------------------------------------------------------------------------
+bool CDataCacheLRU::MarkAsStale( memhandle_t handle )
+{
+	Shard_t &shard = ShardFromHandle( handle );
+	CAutoShardLock lock( shard );
+
+	int iSlot;
+	DataCacheItem_t *pItem = FromHandle( shard, handle, &iSlot );
+	if ( !pItem )
+		return false;
+
+	pItem->bReferenced = false;
+	shard.iHand = iSlot;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 
+//-----------------------------------------------------------------------------
+memhandle_t CDataCacheLRU::FindVictim( int iShard, CDataCacheSection *pSection, CDataCacheSection **ppOwner )
+{
+	Shard_t &shard = m_Shards[iShard];
+	CAutoShardLock lock( shard );
+
+	// Loading can hold everything locked, don't sweep a shard for nothing
+	if ( !shard.nUnlocked )
+		return INVALID_MEMHANDLE;
+
+	// Twice round clears every bit on the first pass and must find an item on the second
+	int nSlots = shard.items.Count();
+	for ( int i = 0; i < nSlots * 2; i++ )
+	{
+		if ( shard.iHand >= nSlots )
+		{
+			shard.iHand = 0;
+		}
+		int iSlot = shard.iHand++;
+		shard.stats.nSwept++;
+
+		DataCacheItem_t *pItem = shard.items[iSlot];
+		if ( !pItem || pItem->nLockCount || ( pSection && pItem->pSection != pSection ) )
+			continue;
+
+		if ( pItem->bReferenced )
+		{
+			pItem->bReferenced = false;
+			continue;
+		}
+
+		shard.stats.nEvictions++;
+		if ( ppOwner )
+		{
+			*ppOwner = pItem->pSection;
+		}
+		return DataCacheLRUHandle( iShard, iSlot, shard.serials[iSlot] );
+	}
+
+	return INVALID_MEMHANDLE;
+}
+
+//-----------------------------------------------------------------------------
+// 
+//-----------------------------------------------------------------------------
+void CDataCacheLRU::GetHandleList( CUtlVector<memhandle_t> &list, CDataCacheSection *pSection, bool bLocked )
+{
+	for ( int iShard = 0; iShard < DC_LRU_SHARDS; iShard++ )
+	{
+		Shard_t &shard = m_Shards[iShard];
+		CAutoShardLock lock( shard );
+
+		for ( int iSlot = 0; iSlot < shard.items.Count(); iSlot++ )
+		{
+			DataCacheItem_t *pItem = shard.items[iSlot];
+			if ( pItem && ( pItem->nLockCount != 0 ) == bLocked && ( !pSection || pItem->pSection == pSection ) )
+			{
+				list.AddToTail( DataCacheLRUHandle( iShard, iSlot, shard.serials[iSlot] ) );
+			}
+		}
+	}
+}
+
+memhandle_t CDataCacheLRU::FindClientId( CDataCacheSection *pSection, DataCacheClientID_t clientId )
+{
+	// Start where CreateResource would have put it
+	unsigned iHome = HashItem( clientId );
+	for ( int i = 0; i < DC_LRU_SHARDS; i++ )
+	{
+		int iShard = ( iHome + i ) & ( DC_LRU_SHARDS - 1 );
+		Shard_t &shard = m_Shards[iShard];
+		CAutoShardLock lock( shard );
+
+		for ( int iSlot = 0; iSlot < shard.items.Count(); iSlot++ )
+		{
+			DataCacheItem_t *pItem = shard.items[iSlot];
+			if ( pItem && pItem->clientId == clientId && pItem->pSection == pSection )
+			{
+				return DataCacheLRUHandle( iShard, iSlot, shard.serials[iSlot] );
+			}
+		}
+	}
+
+	return INVALID_MEMHANDLE;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Diagnostics only, read without the shard's lock
+//-----------------------------------------------------------------------------
+void CDataCacheLRU::GetShardStats( int iShard, DataCacheShardStats_t *pStats )
+{
+	*pStats = m_Shards[iShard].stats;
 }
 
 
@@ -205,10 +550,11 @@ bool CDataCacheSection::AddEx( DataCacheClientID_t clientId, const void *pItemDa
 	};
 
 	memhandle_t hMem = m_LRU.CreateResource( itemData, true );
-
-	Assert( hMem != (memhandle_t)0 && hMem != (memhandle_t)DC_INVALID_HANDLE );
-
-	AccessItem( hMem )->hLRU = hMem;
+	if ( hMem == INVALID_MEMHANDLE )
+	{
+		AssertMsg( 0, "Data cache is out of handles" );
+		return false;
+	}
 
 	if ( pHandle )
 	{
@@ -258,31 +604,12 @@ DataCacheHandle_t CDataCacheSection::Find( DataCacheClientID_t clientId )
 //---------------------------------------------------------
 DataCacheHandle_t CDataCacheSection::DoFind( DataCacheClientID_t clientId )
 {
-	AUTO_LOCK( m_mutex );
-	memhandle_t hCurrent;
-
-	hCurrent = GetFirstUnlockedItem();
-
-	while ( hCurrent != INVALID_MEMHANDLE )
-	{
-		if ( AccessItem( hCurrent )->clientId == clientId )
-		{
-			m_status.nFindHits++;
-			return (DataCacheHandle_t)hCurrent;
-		}
-		hCurrent = GetNextItem( hCurrent );
-	}
+	memhandle_t hCurrent = m_LRU.FindClientId( this, clientId );
 
-	hCurrent = GetFirstLockedItem();
-
-	while ( hCurrent != INVALID_MEMHANDLE )
+	if ( hCurrent != INVALID_MEMHANDLE )
 	{
-		if ( AccessItem( hCurrent )->clientId == clientId )
-		{
-			m_status.nFindHits++;
-			return (DataCacheHandle_t)hCurrent;
-		}
-		hCurrent = GetNextItem( hCurrent );
+		m_status.nFindHits++;
+		return (DataCacheHandle_t)hCurrent;
 	}
 
 	return DC_INVALID_HANDLE;
@@ -319,7 +646,11 @@ DataCacheRemoveResult_t CDataCacheSection::Remove( DataCacheHandle_t handle, con
 				*pItemSize = pItem->size;
 			}
 
-			DiscardItem( lruHandle, ( bNotify ) ? DC_REMOVED : DC_NONE );
+			// Locked since the check above
+			if ( !DiscardItem( lruHandle, ( bNotify ) ? DC_REMOVED : DC_NONE, false ) )
+			{
+				return DC_LOCKED;
+			}
 
 			return DC_OK;
 		}
@@ -334,7 +665,7 @@ DataCacheRemoveResult_t CDataCacheSection::Remove( DataCacheHandle_t handle, con
 //-----------------------------------------------------------------------------
 bool CDataCacheSection::IsPresent( DataCacheHandle_t handle )
 {
-	return ( m_LRU.GetResource_NoLockNoLRUTouch( (memhandle_t)handle ) != NULL );
+	return ( AccessItem( (memhandle_t)handle ) != NULL );
 }
 
 
@@ -350,10 +681,11 @@ void *CDataCacheSection::Lock( DataCacheHandle_t handle )
 
 	if ( handle != DC_INVALID_HANDLE )
 	{
-		DataCacheItem_t *pItem = m_LRU.LockResource( (memhandle_t)handle );
+		int nLockCount;
+		DataCacheItem_t *pItem = m_LRU.LockResource( (memhandle_t)handle, &nLockCount );
 		if ( pItem )
 		{
-			if ( m_LRU.LockCount( (memhandle_t)handle ) == 1 )
+			if ( nLockCount == 1 )
 			{
 				NoteLock( pItem->size );
 			}
@@ -377,14 +709,8 @@ int CDataCacheSection::Unlock( DataCacheHandle_t handle )
 	{
 		AssertMsg( AccessItem( (memhandle_t)handle ) != NULL, "Attempted to unlock nonexistent cache entry" );
 		unsigned nBytesUnlocked = 0;
-		m_mutex.Lock();
-		iNewLockCount = m_LRU.UnlockResource( (memhandle_t)handle );
-		if ( iNewLockCount == 0 )
-		{
-			nBytesUnlocked = AccessItem( (memhandle_t)handle )->size;
-		}
-		m_mutex.Unlock();
-		if ( nBytesUnlocked )
+		iNewLockCount = m_LRU.UnlockResource( (memhandle_t)handle, &nBytesUnlocked );
+		if ( iNewLockCount == 0 && nBytesUnlocked )
 		{
 			NoteUnlock( nBytesUnlocked );
 			EnsureCapacity( 0 );
@@ -428,12 +754,8 @@ void *CDataCacheSection::Get( DataCacheHandle_t handle, bool bFrameLock )
 		if ( bFrameLock && IsFrameLocking() )
 			return FrameLock( handle );
 
-		AUTO_LOCK( m_mutex );
-		DataCacheItem_t *pItem = m_LRU.GetResource_NoLock( (memhandle_t)handle );
-		if ( pItem )
-		{
-			return const_cast<void *>( pItem->pItemData );
-		}
+		// A hit only sets the item's reference bit
+		return const_cast<void *>( m_LRU.GetResourceData( (memhandle_t)handle, true ) );
 	}
 
 	return NULL;
@@ -452,12 +774,7 @@ void *CDataCacheSection::GetNoTouch( DataCacheHandle_t handle, bool bFrameLock )
 		if ( bFrameLock && IsFrameLocking() )
 			return FrameLock( handle );
 
-		AUTO_LOCK( m_mutex );
-		DataCacheItem_t *pItem = m_LRU.GetResource_NoLockNoLRUTouch( (memhandle_t)handle );
-		if ( pItem )
-		{
-			return const_cast<void *>( pItem->pItemData );
-		}
+		return const_cast<void *>( m_LRU.GetResourceData( (memhandle_t)handle, false ) );
 	}
 
 	return NULL;
@@ -627,41 +944,18 @@ unsigned CDataCacheSection::Flush( bool bUnlockedOnly, bool bNotify )
 
 	DataCacheNotificationType_t notificationType = ( bNotify )? DC_FLUSH_DISCARD : DC_NONE;
 
-	memhandle_t hCurrent;
-	memhandle_t hNext;
-
-	unsigned nBytesFlushed = 0;
-	unsigned nBytesCurrent = 0;
-
-	hCurrent = GetFirstUnlockedItem();
+	CUtlVector<memhandle_t> items;
+	m_LRU.GetHandleList( items, this, false );
 
-	while ( hCurrent != INVALID_MEMHANDLE )
-	{
-		hNext = GetNextItem( hCurrent );
-		nBytesCurrent = AccessItem( hCurrent )->size;
-
-		if ( DiscardItem( hCurrent, notificationType ) )
-		{
-			nBytesFlushed += nBytesCurrent;
-		}
-		hCurrent = hNext;
-	}
+	unsigned nBytesFlushed = DiscardItems( items, notificationType, false );
 
 	if ( !bUnlockedOnly )
 	{
-		hCurrent = GetFirstLockedItem();
+		// Includes anything locked since the first list was taken
+		items.RemoveAll();
+		m_LRU.GetHandleList( items, this, true );
 
-		while ( hCurrent != INVALID_MEMHANDLE )
-		{
-			hNext = GetNextItem( hCurrent );
-			nBytesCurrent = AccessItem( hCurrent )->size;
-
-			if ( DiscardItem( hCurrent, notificationType ) )
-			{
-				nBytesFlushed += nBytesCurrent;
-			}
-			hCurrent = hNext;
-		}
+		nBytesFlushed += DiscardItems( items, notificationType, true );
 	}
 
 	return nBytesFlushed;
@@ -675,28 +969,7 @@ unsigned CDataCacheSection::Purge( unsigned nBytes )
 {
 	VPROF( "CDataCacheSection::Purge" );
 
-	AUTO_LOCK( m_mutex );
-
-	unsigned nBytesPurged = 0;
-	unsigned nBytesCurrent = 0;
-
-	memhandle_t hCurrent = GetFirstUnlockedItem();
-	memhandle_t hNext;
-
-	while ( hCurrent != INVALID_MEMHANDLE && nBytes > 0 )
-	{
-		hNext = GetNextItem( hCurrent );
-		nBytesCurrent = AccessItem( hCurrent )->size;
-
-		if ( DiscardItem( hCurrent, DC_FLUSH_DISCARD  ) )
-		{
-			nBytesPurged += nBytesCurrent;
-			nBytes -= min( nBytesCurrent, nBytes );
-		}
-		hCurrent = hNext;
-	}
-
-	return nBytesPurged;
+	return m_pSharedCache->PurgeShards( nBytes, 0, this, DC_FLUSH_DISCARD );
 }
 
 //-----------------------------------------------------------------------------
@@ -704,25 +977,8 @@ unsigned CDataCacheSection::Purge( unsigned nBytes )
 //-----------------------------------------------------------------------------
 unsigned CDataCacheSection::PurgeItems( unsigned nItems )
 {
-	AUTO_LOCK( m_mutex );
-
 	unsigned nPurged = 0;
-
-	memhandle_t hCurrent = GetFirstUnlockedItem();
-	memhandle_t hNext;
-
-	while ( hCurrent != INVALID_MEMHANDLE && nItems )
-	{
-		hNext = GetNextItem( hCurrent );
-
-		if ( DiscardItem( hCurrent, DC_FLUSH_DISCARD ) )
-		{
-			nItems--;
-			nPurged++;
-		}
-		hCurrent = hNext;
-	}
-
+	m_pSharedCache->PurgeShards( 0, nItems, this, DC_FLUSH_DISCARD, &nPurged );
 	return nPurged;
 }
 
@@ -763,7 +1019,6 @@ void CDataCacheSection::UpdateSize( DataCacheHandle_t handle, unsigned int nNewS
 			m_pSharedCache->EnsureCapacity( bytesAdded );
 		}
 		
-		m_LRU.NotifySizeChanged( (memhandle_t)handle, oldSize, nNewSize );
 		NoteSizeChanged( oldSize, nNewSize );
 	}
 
@@ -771,113 +1026,93 @@ void CDataCacheSection::UpdateSize( DataCacheHandle_t handle, unsigned int nNewS
 }
 
 //-----------------------------------------------------------------------------
-// 
+// Purpose: Discards an item, notifying the client as type says. Fails if the
+//			item is gone, or is locked and bBreakLock isn't set
 //-----------------------------------------------------------------------------
-memhandle_t CDataCacheSection::GetFirstUnlockedItem()
+bool CDataCacheSection::DiscardItem( memhandle_t hItem, DataCacheNotificationType_t type, bool bBreakLock )
 {
-	memhandle_t hCurrent;
-
-	hCurrent = m_LRU.GetFirstUnlocked();
+	AUTO_LOCK( m_mutex );
 
-	while ( hCurrent != INVALID_MEMHANDLE )
+	// Once detached the handle no longer resolves, so no other thread can lock or evict it
+	int nLockCount = 0;
+	DataCacheItem_t *pItem = m_LRU.DetachResource( hItem, bBreakLock, &nLockCount );
+	if ( !pItem )
 	{
-		if ( AccessItem( hCurrent )->pSection == this )
-		{
-			return hCurrent;
-		}
-		hCurrent = m_LRU.GetNext( hCurrent );
+		return false;
 	}
-	return INVALID_MEMHANDLE;
-}
-
 
-memhandle_t CDataCacheSection::GetFirstLockedItem()
-{
-	memhandle_t hCurrent;
-
-	hCurrent = m_LRU.GetFirstLocked();
+	// Refusing a drop isn't implemented, DiscardItemData asserts on it
+	DiscardItemData( pItem, type );
 
-	while ( hCurrent != INVALID_MEMHANDLE )
+	if ( nLockCount )
 	{
-		if ( AccessItem( hCurrent )->pSection == this )
-		{
-			return hCurrent;
-		}
-		hCurrent = m_LRU.GetNext( hCurrent );
+		NoteUnlock( pItem->size );
 	}
-	return INVALID_MEMHANDLE;
-}
 
-
-memhandle_t CDataCacheSection::GetNextItem( memhandle_t hCurrent )
-{
-	hCurrent = m_LRU.GetNext( hCurrent );
-
-	while ( hCurrent != INVALID_MEMHANDLE )
-	{
-		if ( AccessItem( hCurrent )->pSection == this )
-		{
-			return hCurrent;
-		}
-		hCurrent = m_LRU.GetNext( hCurrent );
-	}
-	return INVALID_MEMHANDLE;
-}
-
-bool CDataCacheSection::DiscardItem( memhandle_t hItem, DataCacheNotificationType_t type )
-{
-	DataCacheItem_t *pItem = AccessItem( hItem );
-	if ( DiscardItemData( pItem, type ) )
+	FrameLock_t *pFrameLock = m_ThreadFrameLock.Get();
+	if ( pFrameLock )
 	{
-		if ( m_LRU.LockCount( hItem ) )
-		{
-			m_LRU.BreakLock( hItem );
-			NoteUnlock( pItem->size );
-		}
-
-		FrameLock_t *pFrameLock = m_ThreadFrameLock.Get();
-		if ( pFrameLock )
+		int iThread = pFrameLock->m_iThread;
+		if ( pItem->pNextFrameLocked[iThread] != DC_NO_NEXT_LOCKED )
 		{
-			int iThread = pFrameLock->m_iThread;
-			if ( pItem->pNextFrameLocked[iThread] != DC_NO_NEXT_LOCKED )
+			if ( pFrameLock->m_pFirst == pItem )
 			{
-				if ( pFrameLock->m_pFirst == pItem )
-				{
-					pFrameLock->m_pFirst = pItem->pNextFrameLocked[iThread];
-				}
-				else
+				pFrameLock->m_pFirst = pItem->pNextFrameLocked[iThread];
+			}
+			else
+			{
+				DataCacheItem_t *pCurrent = pFrameLock->m_pFirst;
+				while ( pCurrent )
 				{
-					DataCacheItem_t *pCurrent = pFrameLock->m_pFirst;
-					while ( pCurrent )
+					if ( pCurrent->pNextFrameLocked[iThread] == pItem )
 					{
-						if ( pCurrent->pNextFrameLocked[iThread] == pItem )
-						{
-							pCurrent->pNextFrameLocked[iThread] = pItem->pNextFrameLocked[iThread];
-							break;
-						}
-						pCurrent = pCurrent->pNextFrameLocked[iThread];
+						pCurrent->pNextFrameLocked[iThread] = pItem->pNextFrameLocked[iThread];
+						break;
 					}
+					pCurrent = pCurrent->pNextFrameLocked[iThread];
 				}
-				pItem->pNextFrameLocked[iThread] = DC_NO_NEXT_LOCKED;
 			}
-
+			pItem->pNextFrameLocked[iThread] = DC_NO_NEXT_LOCKED;
 		}
 
+	}
+
 #ifdef _DEBUG
-		for ( int i = 0; i < DC_MAX_THREADS_FRAMELOCKED; i++ )
+	for ( int i = 0; i < DC_MAX_THREADS_FRAMELOCKED; i++ )
+	{
+		if ( pItem->pNextFrameLocked[i] != DC_NO_NEXT_LOCKED )
 		{
-			if ( pItem->pNextFrameLocked[i] != DC_NO_NEXT_LOCKED )
-			{
-				DebuggerBreak(); // higher level code needs to handle better
-			}
+			DebuggerBreak(); // higher level code needs to handle better
 		}
+	}
 #endif
 
-		pItem->pSection = NULL; // inhibit callbacks from lower level resource system
-		m_LRU.DestroyResource( hItem );
-		return true;
+	delete pItem;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Discards a list of items, returns the bytes released
+//-----------------------------------------------------------------------------
+unsigned CDataCacheSection::DiscardItems( const CUtlVector<memhandle_t> &items, DataCacheNotificationType_t type, bool bBreakLock )
+{
+	AUTO_LOCK( m_mutex );
+
+	unsigned nBytesDiscarded = 0;
+	for ( int i = 0; i < items.Count(); i++ )
+	{
+		DataCacheItem_t *pItem = AccessItem( items[i] );
+		if ( !pItem )
+			continue;
+
+		unsigned nBytesCurrent = pItem->size;
+		if ( DiscardItem( items[i], type, bBreakLock ) )
+		{
+			nBytesDiscarded += nBytesCurrent;
+		}
 	}
-	return false;
+
+	return nBytesDiscarded;
 }
 
 bool CDataCacheSection::DiscardItemData( DataCacheItem_t *pItem, DataCacheNotificationType_t type )
@@ -930,7 +1165,7 @@ bool CDataCacheSection::DiscardItemData( DataCacheItem_t *pItem, DataCacheNotifi
 //-----------------------------------------------------------------------------
 DataCacheHandle_t CDataCacheSectionFastFind::DoFind( DataCacheClientID_t clientId ) 
 { 
-	AUTO_LOCK( m_mutex );
+	AUTO_LOCK( m_HandlesMutex );
 	UtlHashFastHandle_t hHash = m_Handles.Find( Hash4( &clientId ) );
 	if( hHash != m_Handles.InvalidHandle() )
 		return m_Handles[hHash];
@@ -940,7 +1175,7 @@ DataCacheHandle_t CDataCacheSectionFastFind::DoFind( DataCacheClientID_t clientI
 
 void CDataCacheSectionFastFind::OnAdd( DataCacheClientID_t clientId, DataCacheHandle_t hCacheItem ) 
 {
-	AUTO_LOCK( m_mutex );
+	AUTO_LOCK( m_HandlesMutex );
 	Assert( m_Handles.Find( Hash4( &clientId ) ) == m_Handles.InvalidHandle());
 	m_Handles.FastInsert( Hash4( &clientId ), hCacheItem );
 }
@@ -948,7 +1183,7 @@ void CDataCacheSectionFastFind::OnAdd( DataCacheClientID_t clientId, DataCacheHa
 
 void CDataCacheSectionFastFind::OnRemove( DataCacheClientID_t clientId ) 
 {
-	AUTO_LOCK( m_mutex );
+	AUTO_LOCK( m_HandlesMutex );
 	UtlHashFastHandle_t hHash = m_Handles.Find( Hash4( &clientId ) );
 	Assert( hHash != m_Handles.InvalidHandle());
 	if( hHash != m_Handles.InvalidHandle() )
@@ -1026,9 +1261,10 @@ void *CDataCache::QueryInterface( const char *pInterfaceName )
 // 
 //-----------------------------------------------------------------------------
 CDataCache::CDataCache()
-	: m_mutex( m_LRU.AccessMutex() )
 {
 	memset( &m_status, 0, sizeof(m_status) );
+	m_nTargetBytes = (unsigned)-1;
+	m_iNextShard = 0;
 	m_bInFlush = false;
 }
 
@@ -1037,8 +1273,8 @@ CDataCache::CDataCache()
 //-----------------------------------------------------------------------------
 void CDataCache::SetSize( int nMaxBytes )
 {
-	m_LRU.SetTargetSize( nMaxBytes );
-	m_LRU.FlushToTargetSize();
+	m_nTargetBytes = nMaxBytes;
+	EnsureCapacity( 0 );
 
 	nMaxBytes /= 1024 * 1024;
 
@@ -1091,7 +1327,7 @@ void CDataCache::GetStatus( DataCacheStatus_t *pStatus, DataCacheLimits_t *pLimi
 	if ( pLimits )
 	{
 		Construct( pLimits );
-		pLimits->nMaxBytes = m_LRU.TargetSize();
+		pLimits->nMaxBytes = m_nTargetBytes;
 	}
 }
 
@@ -1164,7 +1400,61 @@ void CDataCache::EnsureCapacity( unsigned nBytes )
 {
 	VPROF( "CDataCache::EnsureCapacity" );
 
-	m_LRU.EnsureCapacity( nBytes );
+	// Checked without a lock; racing adds can leave the cache over target until the next check
+	unsigned nNewBytes = GetNumBytes() + nBytes;
+	if ( nNewBytes > m_nTargetBytes )
+	{
+		PurgeShards( nNewBytes - m_nTargetBytes, 0, NULL, DC_AGE_DISCARD );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Evicts unlocked items, optionally only one section's, working round
+//			the LRU shards until nBytes and nItems are freed or no shard has
+//			anything left to evict. Returns bytes freed
+//-----------------------------------------------------------------------------
+unsigned CDataCache::PurgeShards( unsigned nBytes, unsigned nItems, CDataCacheSection *pSection, DataCacheNotificationType_t type, unsigned *pnItemsPurged )
+{
+	unsigned nBytesPurged = 0;
+	unsigned nItemsPurged = 0;
+	int nEmptyShards = 0;
+
+	while ( ( nBytes || nItems ) && nEmptyShards < DC_LRU_SHARDS )
+	{
+		int iShard = ( m_iNextShard++ ) & ( DC_LRU_SHARDS - 1 );
+
+		CDataCacheSection *pOwner = NULL;
+		memhandle_t hItem = m_LRU.FindVictim( iShard, pSection, &pOwner );
+		if ( hItem == INVALID_MEMHANDLE || !pOwner )
+		{
+			nEmptyShards++;
+			continue;
+		}
+		nEmptyShards = 0;
+
+		AUTO_LOCK( m_mutex );
+
+		// Another thread may have locked or discarded it since
+		DataCacheItem_t *pItem = AccessItem( hItem );
+		unsigned nBytesCurrent = ( pItem ) ? pItem->size : 0;
+		if ( pItem && pOwner->DiscardItem( hItem, type, false ) )
+		{
+			nBytesPurged += nBytesCurrent;
+			nBytes -= min( nBytesCurrent, nBytes );
+			nItemsPurged++;
+			if ( nItems )
+			{
+				nItems--;
+			}
+		}
+	}
+
+	if ( pnItemsPurged )
+	{
+		*pnItemsPurged = nItemsPurged;
+	}
+	return nBytesPurged;
 }
 
 
@@ -1175,7 +1465,7 @@ unsigned CDataCache::Purge( unsigned nBytes )
 {
 	VPROF( "CDataCache::Purge" );
 
-	return m_LRU.Purge( nBytes );
+	return PurgeShards( nBytes, 0, NULL, DC_AGE_DISCARD );
 }
 
 
@@ -1186,7 +1476,7 @@ unsigned CDataCache::Flush( bool bUnlockedOnly, bool bNotify )
 {
 	VPROF( "CDataCache::Flush" );
 
-	unsigned result;
+	unsigned result = 0;
 
 	if ( m_bInFlush )
 	{
@@ -1195,13 +1485,10 @@ unsigned CDataCache::Flush( bool bUnlockedOnly, bool bNotify )
 
 	m_bInFlush = true;
 
-	if ( bUnlockedOnly )
-	{
-		result =  m_LRU.FlushAllUnlocked();
-	}
-	else
+	// Clients are always told, as they were when the shared LRU destroyed the items itself
+	for ( int i = 0; i < m_Sections.Count(); i++ )
 	{
-		result = m_LRU.FlushAll();
+		result += m_Sections[i]->Flush( bUnlockedOnly, true );
 	}
 
 	m_bInFlush = false;
@@ -1217,15 +1504,15 @@ void CDataCache::OutputReport( DataCacheReportType_t reportType, const char *psz
 	int i;
 
 	AUTO_LOCK( m_mutex );
-	int bytesUsed = m_LRU.UsedSize();
-	int bytesTotal = m_LRU.TargetSize();
+	int bytesUsed = GetNumBytes();
+	int bytesTotal = m_nTargetBytes;
 
 	float percent = 100.0f * (float)bytesUsed / (float)bytesTotal;
 
 	CUtlVector<memhandle_t> lruList, lockedlist;
 
-	m_LRU.GetLockHandleList( lockedlist );
-	m_LRU.GetLRUHandleList( lruList );
+	m_LRU.GetHandleList( lockedlist, NULL, true );
+	m_LRU.GetHandleList( lruList, NULL, false );
 
 	CDataCacheSection *pSection = NULL;
 	if ( pszSection )
@@ -1287,6 +1574,7 @@ void CDataCache::OutputReport( DataCacheReportType_t reportType, const char *psz
 				}
 			}
 			Msg( "Summary: %i resources total %s, %.2f %% of capacity\n", lockedlist.Count() + lruList.Count(), Q_pretifymem( bytesUsed, 2, true ), percent );
+			OutputShardReport();
 		}
 		else
 		{
@@ -1298,7 +1586,7 @@ void CDataCache::OutputReport( DataCacheReportType_t reportType, const char *psz
 			{
 				if ( AccessItem( lockedlist[ i ] )->pSection == pSection )
 				{
-					pItem = g_DataCache.m_LRU.GetResource_NoLockNoLRUTouch( lockedlist[i] );
+					pItem = AccessItem( lockedlist[i] );
 					sectionBytes += pItem->size;
 					sectionCount++;
 				}
@@ -1307,7 +1595,7 @@ void CDataCache::OutputReport( DataCacheReportType_t reportType, const char *psz
 			{
 				if ( AccessItem( lruList[ i ] )->pSection == pSection )
 				{
-					pItem = g_DataCache.m_LRU.GetResource_NoLockNoLRUTouch( lruList[i] );
+					pItem = AccessItem( lruList[i] );
 					sectionBytes += pItem->size;
 					sectionCount++;
 				}
@@ -1334,7 +1622,7 @@ void CDataCache::OutputReport( DataCacheReportType_t reportType, const char *psz
 void CDataCache::OutputItemReport( memhandle_t hItem )
 {
 	AUTO_LOCK( m_mutex );
-	DataCacheItem_t *pItem = m_LRU.GetResource_NoLockNoLRUTouch( hItem );
+	DataCacheItem_t *pItem = AccessItem( hItem );
 	if ( !pItem )
 		return;
 
@@ -1353,6 +1641,36 @@ void CDataCache::OutputItemReport( memhandle_t hItem )
 		( m_LRU.LockCount( hItem ) ) ? CFmtStr( "Locked %d", m_LRU.LockCount( hItem ) ).operator const char*() : "" );
 }
 
+//-------------------------------------
+
+void CDataCache::OutputShardReport()
+{
+	DataCacheShardStats_t total;
+	memset( &total, 0, sizeof(total) );
+
+	for ( int i = 0; i < DC_LRU_SHARDS; i++ )
+	{
+		DataCacheShardStats_t stats;
+		m_LRU.GetShardStats( i, &stats );
+
+		Msg( "\tShard %2d: %6u items, %10u locks, %8u contended (%.2f %%), %8u evicted, %10u swept\n",
+			i, stats.nItems, stats.nAcquires, stats.nContended,
+			( stats.nAcquires ) ? 100.0f * (float)stats.nContended / (float)stats.nAcquires : 0.0f,
+			stats.nEvictions, stats.nSwept );
+
+		total.nItems += stats.nItems;
+		total.nAcquires += stats.nAcquires;
+		total.nContended += stats.nContended;
+		total.nEvictions += stats.nEvictions;
+		total.nSwept += stats.nSwept;
+	}
+
+	Msg( "LRU shards: %u locks, %u contended (%.2f %%), %u evicted, %u swept\n",
+		total.nAcquires, total.nContended,
+		( total.nAcquires ) ? 100.0f * (float)total.nContended / (float)total.nAcquires : 0.0f,
+		total.nEvictions, total.nSwept );
+}
+
 
 //-----------------------------------------------------------------------------
 // 
@@ -1373,8 +1691,8 @@ int CDataCache::FindSectionIndex( const char *pszSection )
 //-----------------------------------------------------------------------------
 bool CDataCache::SortMemhandlesBySizeLessFunc( const memhandle_t& lhs, const memhandle_t& rhs )
 {
-	DataCacheItem_t *pItem1 = g_DataCache.m_LRU.GetResource_NoLockNoLRUTouch( lhs );
-	DataCacheItem_t *pItem2 = g_DataCache.m_LRU.GetResource_NoLockNoLRUTouch( rhs );
+	DataCacheItem_t *pItem1 = g_DataCache.AccessItem( lhs );
+	DataCacheItem_t *pItem2 = g_DataCache.AccessItem( rhs );
 
 	Assert( pItem1 );
 	Assert( pItem2 );
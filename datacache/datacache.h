@@ -46,26 +46,117 @@ struct DataCacheItem_t : DataCacheItemData_t
 {
 	DataCacheItem_t( const DataCacheItemData_t &data ) 
 	  : DataCacheItemData_t( data ),
-		hLRU( INVALID_MEMHANDLE )
+		hLRU( INVALID_MEMHANDLE ),
+		nLockCount( 0 ),
+		bReferenced( true )
 	{
 		memset( pNextFrameLocked, 0xff, sizeof(pNextFrameLocked) );
 	}
 
-	static DataCacheItem_t *CreateResource( const DataCacheItemData_t &data )	{ return new DataCacheItem_t(data); }
-	static unsigned int EstimatedSize( const DataCacheItemData_t &data )		{ return data.size; }
-	void DestroyResource();
-	DataCacheItem_t *GetData()													{ return this; }
-	unsigned int Size()															{ return size; }
-
 	memhandle_t		 hLRU;
 	DataCacheItem_t *pNextFrameLocked[DC_MAX_THREADS_FRAMELOCKED];
 
+	// Owned by the item's LRU shard
+	unsigned short	 nLockCount;
+	bool			 bReferenced;
+
 	DECLARE_FIXEDSIZE_ALLOCATOR_MT(DataCacheItem_t);
 };
 
-//-------------------------------------
+//-----------------------------------------------------------------------------
+// CDataCacheLRU
+//
+// Purpose: Tracks every item in the cache. Items are spread over shards by a
+//			hash of their client id, each shard behind its own mutex, so
+//			threads working on different items rarely meet. Recency is
+//			approximated CLOCK style: a hit only sets the item's reference
+//			bit, and eviction sweeps a shard's slots clearing bits until it
+//			reaches an unlocked item whose bit was already clear.
+//
+//			The LRU never discards anything itself. Evictions go through the
+//			owning section, which holds the cache mutex while the client is
+//			notified, so an item can't be freed while that mutex is held.
+//-----------------------------------------------------------------------------
+#define DC_LRU_SHARD_BITS	4
+#define DC_LRU_SHARDS		( 1 << DC_LRU_SHARD_BITS )
+
+struct DataCacheShardStats_t
+{
+	unsigned nItems;
+	unsigned nAcquires;
+	unsigned nContended;
+	unsigned nEvictions;
+	unsigned nSwept;
+};
+
+class CDataCacheLRU
+{
+public:
+	CDataCacheLRU();
+
+	// Returns INVALID_MEMHANDLE if every shard is full
+	memhandle_t CreateResource( const DataCacheItemData_t &data, bool bCreateLocked );
+
+	// Unlinks the item so its handle no longer resolves and hands it to the caller.
+	// Fails on a locked item unless bBreakLock.
+	DataCacheItem_t *DetachResource( memhandle_t handle, bool bBreakLock, int *pnLockCount );
+
+	// Lock counts returned are the count after the call
+	DataCacheItem_t *LockResource( memhandle_t handle, int *pnLockCount = NULL );
+	int UnlockResource( memhandle_t handle, unsigned *pnSize = NULL );
+	int LockCount( memhandle_t handle );
+	int BreakLock( memhandle_t handle );
+
+	// The item is only safe to use while it's locked or the cache mutex is held
+	DataCacheItem_t *GetResource( memhandle_t handle, bool bTouch );
+	const void *GetResourceData( memhandle_t handle, bool bTouch );
+	bool TouchResource( memhandle_t handle );
+	bool MarkAsStale( memhandle_t handle );
 
-typedef CDataManager<DataCacheItem_t, DataCacheItemData_t, DataCacheItem_t *, CThreadFastMutex> CDataCacheLRU;
+	// Advances the shard's clock hand to the next unlocked item not referenced
+	// since the hand last passed it. pSection restricts the sweep to that
+	// section's items. The owner returned stays valid once the shard is unlocked.
+	memhandle_t FindVictim( int iShard, CDataCacheSection *pSection, CDataCacheSection **ppOwner );
+
+	// Snapshot of the locked or unlocked items, optionally of one section
+	void GetHandleList( CUtlVector<memhandle_t> &list, CDataCacheSection *pSection, bool bLocked );
+	memhandle_t FindClientId( CDataCacheSection *pSection, DataCacheClientID_t clientId );
+
+	void GetShardStats( int iShard, DataCacheShardStats_t *pStats );
+
+private:
+	struct Shard_t
+	{
+		CThreadFastMutex				mutex;
+		CUtlVector<DataCacheItem_t *>	items;
+		CUtlVector<unsigned short>		serials;
+		CUtlVector<unsigned short>		freeSlots;
+		int								iHand;
+		int								nUnlocked;
+		DataCacheShardStats_t			stats;
+	};
+
+	// Keeps shards off each other's cache lines
+	struct PaddedShard_t : Shard_t
+	{
+		byte pad[128 - ( sizeof( Shard_t ) % 128 )];
+	};
+
+	// Locks a shard for its scope, counting the times another thread held it
+	class CAutoShardLock
+	{
+	public:
+		CAutoShardLock( Shard_t &shard );
+		~CAutoShardLock()	{ m_shard.mutex.Unlock(); }
+	private:
+		Shard_t &m_shard;
+	};
+
+	DataCacheItem_t *FromHandle( Shard_t &shard, memhandle_t handle, int *piSlot = NULL );
+	Shard_t &ShardFromHandle( memhandle_t handle )	{ return m_Shards[( (uintp)handle >> 16 ) & ( DC_LRU_SHARDS - 1 )]; }
+
+	PaddedShard_t m_Shards[DC_LRU_SHARDS];
+};
 
 //-----------------------------------------------------------------------------
 // CDataCacheSection
@@ -155,17 +246,15 @@ public:
 	virtual void UpdateSize( DataCacheHandle_t handle, unsigned int nNewSize );
 
 private:
-	friend void DataCacheItem_t::DestroyResource();
+	friend class CDataCache;
 
 	virtual void OnAdd( DataCacheClientID_t clientId, DataCacheHandle_t hCacheItem ) {}
 	virtual DataCacheHandle_t DoFind( DataCacheClientID_t clientId );
 	virtual void OnRemove( DataCacheClientID_t clientId ) {}
 
-	memhandle_t GetFirstUnlockedItem();
-	memhandle_t GetFirstLockedItem();
-	memhandle_t GetNextItem( memhandle_t );
 	DataCacheItem_t *AccessItem( memhandle_t hCurrent );
-	bool DiscardItem( memhandle_t hItem, DataCacheNotificationType_t type );
+	bool DiscardItem( memhandle_t hItem, DataCacheNotificationType_t type, bool bBreakLock );
+	unsigned DiscardItems( const CUtlVector<memhandle_t> &items, DataCacheNotificationType_t type, bool bBreakLock );
 	bool DiscardItemData( DataCacheItem_t *pItem, DataCacheNotificationType_t type );
 	void NoteAdd( int size );
 	void NoteRemove( int size );
@@ -218,6 +307,7 @@ private:
 	virtual void OnRemove( DataCacheClientID_t clientId );
 
 	CUtlHashFast<DataCacheHandle_t> m_Handles;
+	CThreadFastMutex				m_HandlesMutex;
 };
 
 
@@ -261,6 +351,7 @@ public:
 	//--------------------------------------------------------
 
 	void EnsureCapacity( unsigned nBytes );
+	unsigned PurgeShards( unsigned nBytes, unsigned nItems, CDataCacheSection *pSection, DataCacheNotificationType_t type, unsigned *pnItemsPurged = NULL );
 	virtual unsigned Purge( unsigned nBytes );
 	virtual unsigned Flush( bool bUnlockedOnly = true, bool bNotify = true );
 
@@ -293,15 +384,20 @@ private:
 
 	// Utilities used by the data cache report
 	void OutputItemReport( memhandle_t hItem );
+	void OutputShardReport();
 	static bool SortMemhandlesBySizeLessFunc( const memhandle_t& lhs, const memhandle_t& rhs );
 
 	//-----------------------------------------------------
 
 	CDataCacheLRU					m_LRU;
 	DataCacheStatus_t				m_status;
+	unsigned						m_nTargetBytes;
+	CInterlockedUInt				m_iNextShard;
 	CUtlVector<CDataCacheSection *>	m_Sections;
 	bool							m_bInFlush;
-	CThreadFastMutex &				m_mutex;
+
+	// Held while items are discarded and by IDataCacheSection::LockMutex(), never to find or lock an item
+	CThreadFastMutex				m_mutex;
 };
 
 //---------------------------------------------------------
@@ -312,7 +408,7 @@ extern CDataCache g_DataCache;
 
 inline DataCacheItem_t *CDataCache::AccessItem( memhandle_t hCurrent ) 
 { 
-	return m_LRU.GetResource_NoLockNoLRUTouch( hCurrent ); 
+	return m_LRU.GetResource( hCurrent, false ); 
 }
 
 //-----------------------------------------------------------------------------
@@ -327,22 +423,22 @@ inline DataCacheItem_t *CDataCacheSection::AccessItem( memhandle_t hCurrent )
 	return m_pSharedCache->AccessItem( hCurrent ); 
 }
 
-// Note: if status updates are moved out of a mutexed section, will need to change these to use interlocked instructions
+// Section budgets are checked against these without a lock, so they're interlocked too
 
 inline void CDataCacheSection::NoteSizeChanged( int oldSize, int newSize )
 {
 	int nBytes = ( newSize - oldSize );
 
-	m_status.nBytes += nBytes;
-	m_status.nBytesLocked += nBytes;
+	ThreadInterlockedExchangeAdd( &m_status.nBytes, nBytes );
+	ThreadInterlockedExchangeAdd( &m_status.nBytesLocked, nBytes );
 	ThreadInterlockedExchangeAdd( &m_pSharedCache->m_status.nBytes, nBytes );
 	ThreadInterlockedExchangeAdd( &m_pSharedCache->m_status.nBytesLocked, nBytes );
 }
 
 inline void CDataCacheSection::NoteAdd( int size )
 {
-	m_status.nBytes += size;
-	m_status.nItems++;
+	ThreadInterlockedExchangeAdd( &m_status.nBytes, size );
+	ThreadInterlockedIncrement( &m_status.nItems );
 
 	ThreadInterlockedExchangeAdd( &m_pSharedCache->m_status.nBytes, size );
 	ThreadInterlockedIncrement( &m_pSharedCache->m_status.nItems );
@@ -350,8 +446,8 @@ inline void CDataCacheSection::NoteAdd( int size )
 
 inline void CDataCacheSection::NoteRemove( int size )
 {
-	m_status.nBytes -= size;
-	m_status.nItems--;
+	ThreadInterlockedExchangeAdd( &m_status.nBytes, -size );
+	ThreadInterlockedDecrement( &m_status.nItems );
 
 	ThreadInterlockedExchangeAdd( &m_pSharedCache->m_status.nBytes, -size );
 	ThreadInterlockedDecrement( &m_pSharedCache->m_status.nItems );
@@ -359,8 +455,8 @@ inline void CDataCacheSection::NoteRemove( int size )
 
 inline void CDataCacheSection::NoteLock( int size )
 {
-	m_status.nBytesLocked += size;
-	m_status.nItemsLocked++;
+	ThreadInterlockedExchangeAdd( &m_status.nBytesLocked, size );
+	ThreadInterlockedIncrement( &m_status.nItemsLocked );
 
 	ThreadInterlockedExchangeAdd( &m_pSharedCache->m_status.nBytesLocked, size );
 	ThreadInterlockedIncrement( &m_pSharedCache->m_status.nItemsLocked );
@@ -368,8 +464,8 @@ inline void CDataCacheSection::NoteLock( int size )
 
 inline void CDataCacheSection::NoteUnlock( int size )
 {
-	m_status.nBytesLocked -= size;
-	m_status.nItemsLocked--;
+	ThreadInterlockedExchangeAdd( &m_status.nBytesLocked, -size );
+	ThreadInterlockedDecrement( &m_status.nItemsLocked );
 
 	ThreadInterlockedExchangeAdd( &m_pSharedCache->m_status.nBytesLocked, -size );
 	ThreadInterlockedDecrement( &m_pSharedCache->m_status.nItemsLocked );
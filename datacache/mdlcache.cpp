@@ -12,6 +12,7 @@
 #include <memory.h>
 #include "tier0/vprof.h"
 #include "tier0/icommandline.h"
+#include "tier0/sharedassets.h"
 #include "tier1/utllinkedlist.h"
 #include "tier1/utlmap.h"
 #include "datacache/imdlcache.h"
@@ -34,6 +35,7 @@
 #include "filesystem/IQueuedLoader.h"
 #include "tier1/lzmaDecoder.h"
 #include "functors.h"
+#include "generichash.h"
 
 // XXX remove this later. (henryg)
 #if 0 && defined(_DEBUG) && defined(_WIN32) && !defined(_X360)
@@ -410,6 +412,7 @@ public:
 	}
 
 	void *AllocData( MDLCacheDataType_t type, int size );
+	void *ShareData( MDLCacheDataType_t type, const void *pData, int size );
 	void FreeData( MDLCacheDataType_t type, void *pData );
 	void CacheData( DataCacheHandle_t *c, void *pData, int size, const char *name, MDLCacheDataType_t type, DataCacheClientID_t id = (DataCacheClientID_t)-1 );
 	void *CheckData( DataCacheHandle_t c, MDLCacheDataType_t type );
@@ -1994,18 +1997,38 @@ studiohdr_t *CMDLCache::UnserializeMDL( MDLHandle_t handle, void *pData, int nDa
 		Studio_SetRootLOD( pStudioHdrIn, r_rootlod.GetInt() );
 	}
 
-	// critical! store a back link to our data
-	// this is fetched when re-establishing dependent cached data (vtx/vvd)
-	pStudioHdrIn->SetVirtualModel( MDLHandleToVirtual( handle ) );
+	// On first load, convert the flex deltas from fp16 to 16-bit fixed-point
+	if ( (pStudioHdrIn->flags & STUDIOHDR_FLAGS_FLEXES_CONVERTED) == 0 )
+	{
+		ConvertFlexData( pStudioHdrIn );
+
+		// Mark as converted so it only happens once
+		pStudioHdrIn->flags |= STUDIOHDR_FLAGS_FLEXES_CONVERTED;
+	}
 
 	MdlCacheMsg( "MDLCache: Alloc studiohdr %s\n", GetModelName( handle ) );
 
-	// allocate cache space
-	MemAlloc_PushAllocDbgInfo( "Models:StudioHdr", 0);
-	studiohdr_t *pHdr = (studiohdr_t *)AllocData( MDLCACHE_STUDIOHDR, pStudioHdrIn->length );
-	MemAlloc_PopAllocDbgInfo();
+	// The back link differs between processes, keep it out of a shared copy's contents
+	pStudioHdrIn->SetVirtualModel( NULL );
+	studiohdr_t *pHdr = (studiohdr_t *)ShareData( MDLCACHE_STUDIOHDR, pStudioHdrIn, pStudioHdrIn->length );
 	if ( !pHdr )
-		return NULL;
+	{
+		// allocate cache space
+		MemAlloc_PushAllocDbgInfo( "Models:StudioHdr", 0);
+		pHdr = (studiohdr_t *)AllocData( MDLCACHE_STUDIOHDR, pStudioHdrIn->length );
+		MemAlloc_PopAllocDbgInfo();
+		if ( !pHdr )
+			return NULL;
+
+		// FIXME: Is there any way we can compute the size to load *before* loading in
+		// and read directly into cache memory? It would be nice to reduce cache overhead here.
+		// move the complete, relocatable model to the cache
+		memcpy( pHdr, pStudioHdrIn, pStudioHdrIn->length );
+	}
+
+	// critical! store a back link to our data
+	// this is fetched when re-establishing dependent cached data (vtx/vvd)
+	pHdr->SetVirtualModel( MDLHandleToVirtual( handle ) );
 
 	CacheData( &m_MDLDict[handle]->m_MDLCache, pHdr, pStudioHdrIn->length, GetModelName( handle ), MDLCACHE_STUDIOHDR, MakeCacheID( handle, MDLCACHE_STUDIOHDR) );
 
@@ -2015,20 +2038,6 @@ studiohdr_t *CMDLCache::UnserializeMDL( MDLHandle_t handle, void *pData, int nDa
 		m_MDLDict[handle]->m_nFlags |= STUDIODATA_FLAGS_LOCKED_MDL;
 	}
 
-	// FIXME: Is there any way we can compute the size to load *before* loading in
-	// and read directly into cache memory? It would be nice to reduce cache overhead here.
-	// move the complete, relocatable model to the cache
-	memcpy( pHdr, pStudioHdrIn, pStudioHdrIn->length );
-
-	// On first load, convert the flex deltas from fp16 to 16-bit fixed-point
-	if ( (pHdr->flags & STUDIOHDR_FLAGS_FLEXES_CONVERTED) == 0 )
-	{
-		ConvertFlexData( pHdr );
-
-		// Mark as converted so it only happens once
-		pHdr->flags |= STUDIOHDR_FLAGS_FLEXES_CONVERTED;
-	}
-
 	if ( m_pCacheNotify )
 	{
 		m_pCacheNotify->OnDataLoaded( MDLCACHE_STUDIOHDR, handle );
@@ -2993,6 +3002,13 @@ bool CMDLCache::ProcessDataIntoCache( MDLHandle_t handle, MDLCacheDataType_t typ
 					}
 				}
 
+				void *pSharedData = ShareData( MDLCACHE_ANIMBLOCK, pData, nDataSize );
+				if ( pSharedData )
+				{
+					g_pFullFileSystem->FreeOptimalReadBuffer( pData );
+					pData = pSharedData;
+				}
+
 				CacheData( &pStudioDataCurrent->m_pAnimBlock[iAnimBlock], pData, nDataSize, pCacheName, MDLCACHE_ANIMBLOCK, MakeCacheID( handle, MDLCACHE_ANIMBLOCK) );
 			}
 			else
@@ -3446,6 +3462,19 @@ void *CMDLCache::AllocData( MDLCacheDataType_t type, int size )
 }
 
 
+//-----------------------------------------------------------------------------
+// Returns a copy of the data shared with the other processes on this host,
+// NULL when asset sharing is off. Free it with FreeData like any other.
+//-----------------------------------------------------------------------------
+void *CMDLCache::ShareData( MDLCacheDataType_t type, const void *pData, int size )
+{
+	if ( !SharedAssets_Enabled() || size <= 0 )
+		return NULL;
+
+	return SharedAssets_Map( MurmurHash64( pData, size, type ), pData, size );
+}
+
+
 //-----------------------------------------------------------------------------
 // Caches an item
 //-----------------------------------------------------------------------------
@@ -3508,7 +3537,11 @@ void CMDLCache::UncacheData( DataCacheHandle_t c, MDLCacheDataType_t type, bool
 //-----------------------------------------------------------------------------
 void CMDLCache::FreeData( MDLCacheDataType_t type, void *pData )
 {
-	if ( type != MDLCACHE_ANIMBLOCK )
+	if ( SharedAssets_Owns( pData ) )
+	{
+		SharedAssets_Release( pData );
+	}
+	else if ( type != MDLCACHE_ANIMBLOCK )
 	{
 		_aligned_free( (void *)pData );
 	}
@@ -390,8 +390,8 @@ void CModelInfo::OnLevelChange()
 	// Network string table has reset
 	m_NetworkedDynamicModels.Purge();
 
-	// Force-unload any server-side models
-	modelloader->ForceUnloadNonClientDynamicModels();
+	// Release any server-side models
+	modelloader->ReleaseNonClientDynamicModels();
 }
 
 const char *CModelInfo::GetModelName( const model_t *pModel ) const
@@ -7,6 +7,7 @@
 
 #include "client_pch.h"
 #include "tier0/etwprof.h"
+#include "tier0/framearena.h"
 #include "eiface.h"
 #include "baseclient.h"
 #include "server.h"
@@ -675,7 +676,8 @@ bool CBaseClient::SendServerInfo( void )
 	COM_TimestampedLog( " CBaseClient::SendServerInfo" );
 
 	// supporting smaller stack
-	byte *buffer = (byte *)MemAllocScratch( NET_MAX_PAYLOAD );
+	CFrameArenaScope arenaScope;
+	byte *buffer = (byte *)FrameArena_Alloc( NET_MAX_PAYLOAD );
 
 	bf_write msg( "SV_SendServerinfo->msg", buffer, NET_MAX_PAYLOAD );
 
@@ -742,15 +744,12 @@ bool CBaseClient::SendServerInfo( void )
 	// send server info as one data block
 	if ( !m_NetChannel->SendData( msg ) )
 	{
-		MemFreeScratch();
 		Disconnect("Server info data overflow");
 		return false;
 	}
 		
 	COM_TimestampedLog( " CBaseClient::SendServerInfo(finished)" );
 
-	MemFreeScratch();
-
 	return true;
 }
 
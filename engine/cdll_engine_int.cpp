@@ -939,7 +939,7 @@ int	CEngineClient::IsBoxInViewCluster( const Vector& mins, const Vector& maxs )
 		return false;
 
 	byte pvs[MAX_MAP_LEAFS/8];
-	const byte *ppvs = CM_Vis( pvs, sizeof(pvs), curCluster, DVIS_PVS );
+	const byte *ppvs = CM_VisRow( pvs, sizeof(pvs), curCluster, DVIS_PVS );
 	return CM_BoxVisible(mins, maxs, ppvs, sizeof(pvs) );
 }
 
@@ -347,12 +347,18 @@ cmodel_t *CM_LoadMap( const char *name, bool allowReusePrevious, unsigned *check
 
 	// read in the collision model data
 	CMapLoadHelper::Init( 0, name );
+	last_checksum = CM_MapChecksum();
+	*checksum = last_checksum;
+	CM_OpenMapCache( name, last_checksum );
 	CollisionBSPData_Load( name, pBSPData );
 	CMapLoadHelper::Shutdown( );
 
     // Push the displacement bounding boxes down the tree and set leaf data.
     CM_DispTreeLeafnum( pBSPData );
 
+	// Save whatever had to be rebuilt for the next load of this map
+	CM_SaveMapCache( pBSPData );
+
 	CM_InitPortalOpenState( pBSPData );
 	FloodAreaConnections(pBSPData);
 
@@ -1460,6 +1466,55 @@ static void FASTCALL CM_TestBoxInBrush( TraceInfo_t *pTraceInfo, const cbrush_t
 #else
 #define PREFETCH_ELEMENT(a,b)
 #endif
+//-----------------------------------------------------------------------------
+// Returns true if a swept trace with these contents should clip against the brush
+//-----------------------------------------------------------------------------
+static FORCEINLINE bool CM_ShouldTraceBrush( TraceInfo_t * RESTRICT pTraceInfo, const cbrush_t * RESTRICT pBrush )
+{
+	const int traceContents = pTraceInfo->m_contents;
+	const int releventContents = ( pBrush->contents & traceContents );
+
+	// only collide with objects you are interested in
+	if( !releventContents )
+		return false;
+
+	// Many traces rely on CONTENTS_OPAQUE always being hit, even if it is nodraw.  AI blocklos brushes
+	// need this, for instance.  CS and Terror visibility checks don't want this behavior, since
+	// blocklight brushes also are CONTENTS_OPAQUE and SURF_NODRAW, and are actually in the playable
+	// area in several maps.
+	// NOTE: This is no longer true - no traces should rely on hitting CONTENTS_OPAQUE unless they
+	// actually want to hit blocklight brushes.  No other brushes are marked with those bits
+	// so it should be renamed CONTENTS_BLOCKLIGHT.  CONTENTS_BLOCKLOS has its own field now
+	// so there is no reason to ignore nodraw opaques since you can merely remove CONTENTS_OPAQUE to
+	// get that behavior
+	if ( releventContents == CONTENTS_OPAQUE && (traceContents & CONTENTS_IGNORE_NODRAW_OPAQUE) )
+	{
+		// if the only reason we hit this brush is because it is opaque, make sure it isn't nodraw
+		if ( pBrush->IsBox())
+		{
+			cboxbrush_t *pBox = &pTraceInfo->m_pBSPData->map_boxbrushes[pBrush->GetBox()];
+			for (int i=0 ; i<6 ;i++)
+			{
+				csurface_t *surface = pTraceInfo->m_pBSPData->GetSurfaceAtIndex( pBox->surfaceIndex[i] );
+				if ( surface->flags & SURF_NODRAW )
+					return false;
+			}
+		}
+		else
+		{
+			cbrushside_t *side = &pTraceInfo->m_pBSPData->map_brushsides[pBrush->firstbrushside];
+			for (int i=0 ; i<pBrush->numsides ;i++, side++)
+			{
+				csurface_t *surface = pTraceInfo->m_pBSPData->GetSurfaceAtIndex( side->surfaceIndex );
+				if ( surface->flags & SURF_NODRAW )
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
 /*
 ================
 CM_TraceToLeaf
@@ -1493,60 +1548,10 @@ void FASTCALL CM_TraceToLeaf( TraceInfo_t * RESTRICT pTraceInfo, int ndxLeaf, fl
 		if ( !pTraceInfo->Visit( pBrush, ndxBrush, count, pCounters ) )
 			continue;
 
-		const int traceContents = pTraceInfo->m_contents;
-		const int releventContents = ( pBrush->contents & traceContents );
-
 		// only collide with objects you are interested in
-		if( !releventContents )
+		if ( !CM_ShouldTraceBrush( pTraceInfo, pBrush ) )
 			continue;
 
-		// Many traces rely on CONTENTS_OPAQUE always being hit, even if it is nodraw.  AI blocklos brushes
-		// need this, for instance.  CS and Terror visibility checks don't want this behavior, since
-		// blocklight brushes also are CONTENTS_OPAQUE and SURF_NODRAW, and are actually in the playable
-		// area in several maps.
-		// NOTE: This is no longer true - no traces should rely on hitting CONTENTS_OPAQUE unless they
-		// actually want to hit blocklight brushes.  No other brushes are marked with those bits
-		// so it should be renamed CONTENTS_BLOCKLIGHT.  CONTENTS_BLOCKLOS has its own field now
-		// so there is no reason to ignore nodraw opaques since you can merely remove CONTENTS_OPAQUE to
-		// get that behavior
-		if ( releventContents == CONTENTS_OPAQUE && (traceContents & CONTENTS_IGNORE_NODRAW_OPAQUE) )
-		{
-			// if the only reason we hit this brush is because it is opaque, make sure it isn't nodraw
-			bool isNoDraw = false;
-
-			if ( pBrush->IsBox())
-			{
-				cboxbrush_t *pBox = &pTraceInfo->m_pBSPData->map_boxbrushes[pBrush->GetBox()];
-				for (int i=0 ; i<6 && !isNoDraw ;i++)
-				{
-					csurface_t *surface = pTraceInfo->m_pBSPData->GetSurfaceAtIndex( pBox->surfaceIndex[i] );
-					if ( surface->flags & SURF_NODRAW )
-					{
-						isNoDraw = true;
-						break;
-					}
-				}
-			}
-			else
-			{
-				cbrushside_t *side = &pTraceInfo->m_pBSPData->map_brushsides[pBrush->firstbrushside];
-				for (int i=0 ; i<pBrush->numsides && !isNoDraw ;i++, side++)
-				{
-					csurface_t *surface = pTraceInfo->m_pBSPData->GetSurfaceAtIndex( side->surfaceIndex );
-					if ( surface->flags & SURF_NODRAW )
-					{
-						isNoDraw = true;
-						break;
-					}
-				}
-			}
-
-			if ( isNoDraw )
-			{
-				continue;
-			}
-		}
-
 		// trace against the brush and find impact point -- if any?
 		// NOTE: pTraceInfo->m_trace.fraction == 0.0f only when trace starts inside of a brush!
 		CM_ClipBoxToBrush<IS_POINT>( pTraceInfo, pBrush );
@@ -1665,6 +1670,147 @@ void FASTCALL CM_TraceToLeaf( TraceInfo_t * RESTRICT pTraceInfo, int ndxLeaf, fl
 }
 
 
+//-----------------------------------------------------------------------------
+// Slab test of a swept box against a world BVH node. flNear gets the entry fraction.
+//-----------------------------------------------------------------------------
+static FORCEINLINE bool CM_IntersectBVHNode( const cbvhnode_t &node, const fltx4 &f4Start, const fltx4 &f4InvDelta,
+											const fltx4 &f4Pad, float flMaxFrac, float &flNear )
+{
+	fltx4 f4Mins = SubSIMD( LoadAlignedSIMD( node.mins.Base() ), f4Pad );
+	fltx4 f4Maxs = AddSIMD( LoadAlignedSIMD( node.maxs.Base() ), f4Pad );
+	fltx4 f4T1 = MulSIMD( SubSIMD( f4Mins, f4Start ), f4InvDelta );
+	fltx4 f4T2 = MulSIMD( SubSIMD( f4Maxs, f4Start ), f4InvDelta );
+
+	flNear = SubFloat( FindHighestSIMD3( MinSIMD( f4T1, f4T2 ) ), 0 );
+	float flFar = SubFloat( FindLowestSIMD3( MaxSIMD( f4T1, f4T2 ) ), 0 );
+	return ( flNear <= flFar ) && ( flFar >= 0.0f ) && ( flNear <= flMaxFrac );
+}
+
+//-----------------------------------------------------------------------------
+// Sweeps the trace through the world BVH front to back, clipping against each
+// brush and displacement it reaches. Takes the place of CM_RecursiveHullCheck
+// on the world headnode.
+//-----------------------------------------------------------------------------
+template <bool IS_POINT>
+static void FASTCALL CM_TraceToWorldBVH( TraceInfo_t * RESTRICT pTraceInfo )
+{
+	VPROF("CM_TraceToWorldBVH");
+
+	struct StackEntry_t
+	{
+		int		node;
+		float	flNear;
+	};
+	StackEntry_t stack[128];
+	int nStackCount = 0;
+
+	// Boxes are padded by the trace extents plus a margin over the DIST_EPSILON the brush tests use
+	Vector vecPad( 1.0f, 1.0f, 1.0f );
+	if ( !IS_POINT )
+	{
+		vecPad += pTraceInfo->m_extents;
+	}
+	fltx4 f4Pad = LoadUnaligned3SIMD( vecPad.Base() );
+	fltx4 f4Start = LoadUnaligned3SIMD( pTraceInfo->m_start.Base() );
+	fltx4 f4InvDelta = LoadUnaligned3SIMD( pTraceInfo->m_invDelta.Base() );
+
+	const cbvhnode_t *pNodes = g_WorldBVH.nodes.Base();
+	const int *pPrims = g_WorldBVH.prims.Base();
+	CRangeValidatedArray<cbrush_t> &map_brushes = pTraceInfo->m_pBSPData->map_brushes;
+	trace_t *pTrace = &pTraceInfo->m_trace;
+	bool bTestedDisp = false;
+
+	float flNear;
+	if ( !CM_IntersectBVHNode( pNodes[0], f4Start, f4InvDelta, f4Pad, 1.0f, flNear ) )
+		return;
+
+	stack[nStackCount].node = 0;
+	stack[nStackCount].flNear = flNear;
+	++nStackCount;
+
+	while ( nStackCount )
+	{
+		--nStackCount;
+
+		// already hit something nearer
+		if ( stack[nStackCount].flNear > pTrace->fraction )
+			continue;
+
+		const cbvhnode_t &node = pNodes[ stack[nStackCount].node ];
+		if ( node.primCount == 0 )
+		{
+			float flNear0, flNear1;
+			bool bHit0 = CM_IntersectBVHNode( pNodes[node.firstChild], f4Start, f4InvDelta, f4Pad, pTrace->fraction, flNear0 );
+			bool bHit1 = CM_IntersectBVHNode( pNodes[node.firstChild + 1], f4Start, f4InvDelta, f4Pad, pTrace->fraction, flNear1 );
+			Assert( nStackCount + 2 <= ARRAYSIZE( stack ) );
+
+			// Push the far child first so the near one is visited first
+			if ( bHit0 && bHit1 && flNear1 < flNear0 )
+			{
+				stack[nStackCount].node = node.firstChild;
+				stack[nStackCount].flNear = flNear0;
+				++nStackCount;
+				stack[nStackCount].node = node.firstChild + 1;
+				stack[nStackCount].flNear = flNear1;
+				++nStackCount;
+				continue;
+			}
+
+			if ( bHit1 )
+			{
+				stack[nStackCount].node = node.firstChild + 1;
+				stack[nStackCount].flNear = flNear1;
+				++nStackCount;
+			}
+			if ( bHit0 )
+			{
+				stack[nStackCount].node = node.firstChild;
+				stack[nStackCount].flNear = flNear0;
+				++nStackCount;
+			}
+			continue;
+		}
+
+		for ( int i = node.firstChild; i < node.firstChild + node.primCount; i++ )
+		{
+			int prim = pPrims[i];
+			if ( prim >= 0 )
+			{
+				cbrush_t * RESTRICT pBrush = &map_brushes[prim];
+				if ( !CM_ShouldTraceBrush( pTraceInfo, pBrush ) )
+					continue;
+
+				CM_ClipBoxToBrush<IS_POINT>( pTraceInfo, pBrush );
+			}
+			else
+			{
+				// Same as CM_TraceToLeaf, displacements are skipped once the trace starts solid
+				if ( pTrace->startsolid )
+					continue;
+
+				int dispIndex = ~prim;
+				if( !( g_pDispBounds[dispIndex].GetContents() & pTraceInfo->m_contents ) )
+					continue;
+
+				CM_TraceToDispTree<IS_POINT>( pTraceInfo, &g_pDispCollTrees[dispIndex], 0.0f, 1.0f );
+				bTestedDisp = true;
+			}
+
+			// NOTE: fraction == 0.0f only when trace starts inside of a brush!
+			if ( !pTrace->fraction )
+			{
+				nStackCount = 0;
+				break;
+			}
+		}
+	}
+
+	if ( bTestedDisp )
+	{
+		CM_PostTraceToDispTree( pTraceInfo );
+	}
+}
+
 /*
 ================
 CM_TestInLeaf
@@ -2223,6 +2369,34 @@ void CM_BoxTrace( const Ray_t& ray, int headnode, int brushmask, bool computeEnd
 		// check for position test special case
 		CM_UnsweptBoxTrace( pTraceInfo, ray, headnode, brushmask );
 	}
+	else if ( g_WorldBVH.IsValid() && headnode == g_WorldBVH.headnode && pTraceInfo->m_pBSPData->map_rootnode == pTraceInfo->m_pBSPData->map_nodes.Base() )
+	{
+		// sweep through the world BVH instead of the BSP
+		if ( pTraceInfo->m_ispoint )
+		{
+			CM_TraceToWorldBVH<true>( pTraceInfo );
+		}
+		else
+		{
+			CM_TraceToWorldBVH<false>( pTraceInfo );
+		}
+
+		if ( CM_WorldBVHCompareEnabled() )
+		{
+			// Redo the trace through the BSP and keep that result
+			trace_t bvhTrace;
+			bvhTrace = pTraceInfo->m_trace;
+			CM_ClearTrace( &pTraceInfo->m_trace );
+			pTraceInfo->m_bDispHit = false;
+			CM_RecursiveHullCheck( pTraceInfo, headnode, 0, 1 );
+
+			if ( computeEndpt )
+			{
+				CM_ComputeTraceEndpoints( ray, bvhTrace );
+			}
+			CM_CompareWorldBVHTrace( ray, bvhTrace, pTraceInfo->m_trace );
+		}
+	}
 	else
 	{
 		// general sweeping through world
@@ -2410,7 +2584,7 @@ const byte *CM_Vis( byte *dest, int destlen, int cluster, int visType )
 		}
 		memset( dest, 0, (pBSPData->numclusters+7)>>3 );
 	}
-	else
+	else if ( !CM_CopyCachedVis( cluster, visType, dest ) )
 	{
 		CM_DecompressVis( pBSPData, cluster, visType, dest );
 	}
@@ -2427,7 +2601,7 @@ int CM_ClusterPVSSize()
 
 const byte	*CM_ClusterPVS (int cluster)
 {
-	return CM_Vis( pvsrow, CM_ClusterPVSSize(), cluster, DVIS_PVS );
+	return CM_VisRow( pvsrow, CM_ClusterPVSSize(), cluster, DVIS_PVS );
 }
 
 /*
@@ -12,6 +12,7 @@
 #include "modelloader.h"
 #include "common.h"
 #include "zone.h"
+#include "maploadgraph.h"
 
 // UNDONE: Abstract the texture/material lookup stuff and all of this goes away
 #include "materialsystem/imaterialsystem.h"
@@ -28,6 +29,8 @@ extern IMaterialSystem *materials;
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
+static ConVar cm_disp_simd( "cm_disp_simd", "1", 0, "Pack displacement triangles four to a packet at map load so traces can reject them with SIMD tests. Takes effect on the next map." );
+
 extern int g_iServerGameDLLVersion;
 IPhysicsSurfaceProps *physprop = NULL;
 IPhysicsCollision	 *physcollision = NULL;
@@ -50,6 +53,11 @@ void CollisionBSPData_LoadVisibility( CCollisionBSPData *pBSPData );
 void CollisionBSPData_LoadEntityString( CCollisionBSPData *pBSPData );
 void CollisionBSPData_LoadPhysics( CCollisionBSPData *pBSPData );
 void CollisionBSPData_LoadDispInfo( CCollisionBSPData *pBSPData );
+void CollisionBSPData_LoadDispPhysCollide( CCollisionBSPData *pBSPData );
+
+// $surfaceprop2 of each texdata's material, or -1, looked up with the textures so
+// the displacements don't need the material system
+static CUtlVector<short> s_TexdataSurfaceProp2;
 
 
 //=============================================================================
@@ -82,6 +90,12 @@ void CollisionBSPData_Destroy( CCollisionBSPData *pBSPData )
 		physcollision->VCollideUnload( &pBSPData->map_cmodels[i].vcollisionData );
 	}
 
+	CM_FreeWorldBVH();
+	CM_FreeVisCache();
+
+	// The vis rows may have been in it
+	CM_CloseMapCache();
+
 	// free displacement data
 	DispCollTrees_FreeLeafList( pBSPData );
 	CM_DestroyDispPhysCollide();
@@ -231,6 +245,20 @@ void CollisionBSPData_PreLoad( CCollisionBSPData *pBSPData )
 }
 
 
+//-----------------------------------------------------------------------------
+// Functors copy their arguments, so the loaders sharing the texinfo table get it by pointer
+//-----------------------------------------------------------------------------
+static void CollisionBSPData_LoadTexinfoTask( CCollisionBSPData *pBSPData, CUtlVector<unsigned short> *pMapTexinfo )
+{
+	CollisionBSPData_LoadTexinfo( pBSPData, *pMapTexinfo );
+}
+
+static void CollisionBSPData_LoadBrushSidesTask( CCollisionBSPData *pBSPData, CUtlVector<unsigned short> *pMapTexinfo )
+{
+	CollisionBSPData_LoadBrushSides( pBSPData, *pMapTexinfo );
+}
+
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 bool CollisionBSPData_Load( const char *pName, CCollisionBSPData *pBSPData )
@@ -245,50 +273,31 @@ bool CollisionBSPData_Load( const char *pName, CCollisionBSPData *pBSPData )
 	//
 	// load bsp file data
 	//
-	COM_TimestampedLog( "  CollisionBSPData_LoadTextures" );
-	CollisionBSPData_LoadTextures( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadTexinfo" );
-	CollisionBSPData_LoadTexinfo( pBSPData, map_texinfo );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadLeafs" );
-	CollisionBSPData_LoadLeafs( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadLeafBrushes" );
-	CollisionBSPData_LoadLeafBrushes( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadPlanes" );
-	CollisionBSPData_LoadPlanes( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadBrushes" );
-	CollisionBSPData_LoadBrushes( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadBrushSides" );
-	CollisionBSPData_LoadBrushSides( pBSPData, map_texinfo );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadSubmodels" );
-	CollisionBSPData_LoadSubmodels( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadPlanes" );
-	CollisionBSPData_LoadNodes( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadAreas" );
-	CollisionBSPData_LoadAreas( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadAreaPortals" );
-	CollisionBSPData_LoadAreaPortals( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadVisibility" );
-	CollisionBSPData_LoadVisibility( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadEntityString" );
-	CollisionBSPData_LoadEntityString( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadPhysics" );
-	CollisionBSPData_LoadPhysics( pBSPData );
-
-	COM_TimestampedLog( "  CollisionBSPData_LoadDispInfo" );
-	CollisionBSPData_LoadDispInfo( pBSPData );
+	CMapLoadGraph graph( "CollisionBSPData_Load" );
+	int nTextures = graph.AddTask( "CollisionBSPData_LoadTextures", CreateFunctor( CollisionBSPData_LoadTextures, pBSPData ), true );
+	int nTexinfo = graph.AddTask( "CollisionBSPData_LoadTexinfo", CreateFunctor( CollisionBSPData_LoadTexinfoTask, pBSPData, &map_texinfo ), false, nTextures );
+	int nLeafs = graph.AddTask( "CollisionBSPData_LoadLeafs", CreateFunctor( CollisionBSPData_LoadLeafs, pBSPData ), false );
+	int nLeafBrushes = graph.AddTask( "CollisionBSPData_LoadLeafBrushes", CreateFunctor( CollisionBSPData_LoadLeafBrushes, pBSPData ), false );
+	int nPlanes = graph.AddTask( "CollisionBSPData_LoadPlanes", CreateFunctor( CollisionBSPData_LoadPlanes, pBSPData ), false );
+	int nBrushes = graph.AddTask( "CollisionBSPData_LoadBrushes", CreateFunctor( CollisionBSPData_LoadBrushes, pBSPData ), false );
+	int nBrushSides = graph.AddTask( "CollisionBSPData_LoadBrushSides", CreateFunctor( CollisionBSPData_LoadBrushSidesTask, pBSPData, &map_texinfo ), false, nBrushes, nPlanes, nTexinfo );
+	int nSubmodels = graph.AddTask( "CollisionBSPData_LoadSubmodels", CreateFunctor( CollisionBSPData_LoadSubmodels, pBSPData ), false );
+	int nNodes = graph.AddTask( "CollisionBSPData_LoadNodes", CreateFunctor( CollisionBSPData_LoadNodes, pBSPData ), false, nPlanes );
+	graph.AddTask( "CollisionBSPData_LoadAreas", CreateFunctor( CollisionBSPData_LoadAreas, pBSPData ), false );
+	graph.AddTask( "CollisionBSPData_LoadAreaPortals", CreateFunctor( CollisionBSPData_LoadAreaPortals, pBSPData ), false );
+	int nVisibility = graph.AddTask( "CollisionBSPData_LoadVisibility", CreateFunctor( CollisionBSPData_LoadVisibility, pBSPData ), false );
+	graph.AddTask( "CollisionBSPData_LoadEntityString", CreateFunctor( CollisionBSPData_LoadEntityString, pBSPData ), false );
+	graph.AddTask( "CollisionBSPData_LoadPhysics", CreateFunctor( CollisionBSPData_LoadPhysics, pBSPData ), true, nSubmodels );
+	int nDispInfo = graph.AddTask( "CollisionBSPData_LoadDispInfo", CreateFunctor( CollisionBSPData_LoadDispInfo, pBSPData ), false, nTextures );
+	graph.AddTask( "CollisionBSPData_LoadDispPhysCollide", CreateFunctor( CollisionBSPData_LoadDispPhysCollide, pBSPData ), true, nDispInfo );
+
+	int nWorldBVH = graph.AddTask( "CM_BuildWorldBVH", CreateFunctor( CM_BuildWorldBVH, pBSPData ), false, nLeafs, nLeafBrushes, nBrushSides, nNodes );
+	graph.AddDependency( nWorldBVH, nSubmodels );
+	graph.AddDependency( nWorldBVH, nDispInfo );
+
+	graph.AddTask( "CM_BuildVisCache", CreateFunctor( CM_BuildVisCache, pBSPData ), false, nVisibility, nLeafs );
+
+	graph.Run();
 
 	return true;
 }
@@ -334,6 +343,8 @@ void CollisionBSPData_LoadTextures( CCollisionBSPData *pBSPData )
 
 	pBSPData->map_texturenames = (char *)Hunk_Alloc( lhStringData.LumpSize() * sizeof(char), false );
 	memcpy( pBSPData->map_texturenames, pStringData, lhStringData.LumpSize() );
+
+	s_TexdataSurfaceProp2.SetCount( count );
  
 	for ( i=0 ; i<count ; i++, in++ )
 	{
@@ -347,6 +358,7 @@ void CollisionBSPData_LoadTextures( CCollisionBSPData *pBSPData )
 		out->name = &pBSPData->map_texturenames[index];
 		out->surfaceProps = 0;
 		out->flags = 0;
+		s_TexdataSurfaceProp2[i] = -1;
 
 		material = materials->FindMaterial( pBSPData->map_surfaces[i].name, TEXTURE_GROUP_WORLD, true );
 		if ( !IsErrorMaterial( material ) )
@@ -359,6 +371,12 @@ void CollisionBSPData_LoadTextures( CCollisionBSPData *pBSPData )
 				const char *pProps = var->GetStringValue();
 				pBSPData->map_surfaces[i].surfaceProps = physprop->GetSurfaceIndex( pProps );
 			}
+
+			var = material->FindVar( "$surfaceprop2", &varFound, false );
+			if ( varFound )
+			{
+				s_TexdataSurfaceProp2[i] = physprop->GetSurfaceIndex( var->GetStringValue() );
+			}
 		}
 	}
 }
@@ -1248,6 +1266,10 @@ void CollisionBSPData_LoadDispInfo( CCollisionBSPData *pBSPData )
 
 		// new collision
 		pDispTree->Create( &coreDisp );
+		if ( cm_disp_simd.GetBool() )
+		{
+			pDispTree->AABBTree_CreateTriPackets();
+		}
 		g_pDispBounds[i].Init(pDispTree->m_mins, pDispTree->m_maxs, pDispTree->m_iCounter, pDispTree->GetContents());
 		nSize += pDispTree->GetMemorySize();
 		nCacheSize += pDispTree->GetCacheMemorySize();
@@ -1255,30 +1277,25 @@ void CollisionBSPData_LoadDispInfo( CCollisionBSPData *pBSPData )
 
 		// Surface props.
 		texinfo_t *pTex = &pTexinfoList[pFaces->texinfo];
-		if ( pTex->texdata >= 0 )
+		if ( pTex->texdata >= 0 && pTex->texdata < s_TexdataSurfaceProp2.Count() )
 		{
-			IMaterial *pMaterial = materials->FindMaterial( pBSPData->map_surfaces[pTex->texdata].name, TEXTURE_GROUP_WORLD, true );
-			if ( !IsErrorMaterial( pMaterial ) )
-			{
-				IMaterialVar *pVar;
-				bool bVarFound;
-				pVar = pMaterial->FindVar( "$surfaceprop", &bVarFound, false );
-				if ( bVarFound )
-				{
-					const char *pProps = pVar->GetStringValue();
-					pDispTree->SetSurfaceProps( 0, physprop->GetSurfaceIndex( pProps ) );
-					pDispTree->SetSurfaceProps( 1, physprop->GetSurfaceIndex( pProps ) );
-				}
-
-				pVar = pMaterial->FindVar( "$surfaceprop2", &bVarFound, false );
-				if ( bVarFound )
-				{
-					const char *pProps = pVar->GetStringValue();
-					pDispTree->SetSurfaceProps( 1, physprop->GetSurfaceIndex( pProps ) );
-				}
-			}
+			int nSurfaceProp = pBSPData->map_surfaces[pTex->texdata].surfaceProps;
+			int nSurfaceProp2 = s_TexdataSurfaceProp2[pTex->texdata];
+			pDispTree->SetSurfaceProps( 0, nSurfaceProp );
+			pDispTree->SetSurfaceProps( 1, ( nSurfaceProp2 >= 0 ) ? nSurfaceProp2 : nSurfaceProp );
 		}
 	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Runs on the main thread for vphysics, once the collision trees are built
+//-----------------------------------------------------------------------------
+void CollisionBSPData_LoadDispPhysCollide( CCollisionBSPData *pBSPData )
+{
+	// CollisionBSPData_LoadDispInfo bailed out before allocating the trees
+	if ( CMapLoadHelper::LumpSize( LUMP_DISPINFO ) < (int)sizeof( ddispinfo_t ) || !g_pDispCollTrees )
+		return;
 
 	CMapLoadHelper lhDispPhys( LUMP_PHYSDISP );
 	dphysdisp_t *pDispPhys = (dphysdisp_t *)lhDispPhys.LumpBase();
@@ -0,0 +1,378 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Bounding volume hierarchy over world brushes and displacements
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cmodel_engine.h"
+#include "cmodel_private.h"
+#include "dispcoll_common.h"
+#include "coordsize.h"
+#include "convar.h"
+#include "tier0/dbg.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static ConVar cm_world_bvh( "cm_world_bvh", "0", 0, "Build a bounding volume hierarchy over world brushes and displacements at map load and run swept world traces against it. Takes effect on the next map." );
+static ConVar cm_world_bvh_compare( "cm_world_bvh_compare", "0", 0, "Also run every BVH world trace through the BSP, keep the BSP result and report traces that differ." );
+
+cworldbvh_t g_WorldBVH;
+
+// Primitives per leaf before a node is split
+#define WORLD_BVH_LEAF_PRIMS	4
+
+// Only this many differing traces are printed per map; the rest are just counted
+#define WORLD_BVH_MAX_REPORTED_MISMATCHES	16
+
+// Deepest tree the traversal stack in CM_TraceToWorldBVH can hold
+#define WORLD_BVH_MAX_DEPTH		100
+
+// Leads the nodes and prims in a map cache section
+struct bvhcacheheader_t
+{
+	int		nodeCount;
+	int		primCount;
+	int		headnode;
+	int		maxDepth;
+	int		leafPrims;
+	int		unused[3];
+};
+
+struct bvhbuildprim_t
+{
+	Vector	mins;
+	Vector	maxs;
+	Vector	center;
+	int		prim;
+};
+
+static int s_nBVHSortAxis;
+
+static int __cdecl BVHPrimCompare( const bvhbuildprim_t *pLeft, const bvhbuildprim_t *pRight )
+{
+	float flLeft = pLeft->center[s_nBVHSortAxis];
+	float flRight = pRight->center[s_nBVHSortAxis];
+	if ( flLeft != flRight )
+		return ( flLeft < flRight ) ? -1 : 1;
+
+	// Keep the order stable so the same map always builds the same tree
+	return pLeft->prim - pRight->prim;
+}
+
+//-----------------------------------------------------------------------------
+// Brush bounds come from the axial bevel planes every compiled brush carries.
+// A brush missing one is left unbounded on that axis so it is never culled.
+//-----------------------------------------------------------------------------
+static void CM_BrushBounds( CCollisionBSPData *pBSPData, const cbrush_t *pBrush, Vector &mins, Vector &maxs )
+{
+	if ( pBrush->IsBox() )
+	{
+		const cboxbrush_t *pBox = &pBSPData->map_boxbrushes[pBrush->GetBox()];
+		mins = pBox->mins;
+		maxs = pBox->maxs;
+		return;
+	}
+
+	mins.Init( MIN_COORD_FLOAT, MIN_COORD_FLOAT, MIN_COORD_FLOAT );
+	maxs.Init( MAX_COORD_FLOAT, MAX_COORD_FLOAT, MAX_COORD_FLOAT );
+
+	for ( int i = 0; i < pBrush->numsides; i++ )
+	{
+		const cbrushside_t *pSide = &pBSPData->map_brushsides[pBrush->firstbrushside + i];
+		const cplane_t *pPlane = pSide->plane;
+		if ( pPlane->type >= 3 )
+			continue;
+
+		if ( pPlane->normal[pPlane->type] > 0.0f )
+		{
+			maxs[pPlane->type] = pPlane->dist;
+		}
+		else
+		{
+			mins[pPlane->type] = -pPlane->dist;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Builds the subtree for prims [nFirst, nFirst + nCount) into an allocated node
+//-----------------------------------------------------------------------------
+static void CM_BuildBVHNode( CUtlVector< bvhbuildprim_t > &buildPrims, int nNode, int nFirst, int nCount, int nDepth )
+{
+	g_WorldBVH.maxDepth = MAX( g_WorldBVH.maxDepth, nDepth );
+
+	cbvhnode_t node;
+	node.mins.Init( FLT_MAX, FLT_MAX, FLT_MAX );
+	node.maxs.Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+
+	Vector vecCenterMins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecCenterMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = nFirst; i < nFirst + nCount; i++ )
+	{
+		const bvhbuildprim_t &prim = buildPrims[i];
+		VectorMin( node.mins, prim.mins, node.mins );
+		VectorMax( node.maxs, prim.maxs, node.maxs );
+		VectorMin( vecCenterMins, prim.center, vecCenterMins );
+		VectorMax( vecCenterMaxs, prim.center, vecCenterMaxs );
+	}
+
+	if ( nCount <= WORLD_BVH_LEAF_PRIMS )
+	{
+		node.firstChild = g_WorldBVH.prims.Count();
+		node.primCount = nCount;
+		for ( int i = nFirst; i < nFirst + nCount; i++ )
+		{
+			g_WorldBVH.prims.AddToTail( buildPrims[i].prim );
+		}
+		g_WorldBVH.nodes[nNode] = node;
+		return;
+	}
+
+	// Median split on the axis where the centers are spread the most
+	Vector vecSpread = vecCenterMaxs - vecCenterMins;
+	s_nBVHSortAxis = ( vecSpread.x > vecSpread.y ) ? ( ( vecSpread.x > vecSpread.z ) ? 0 : 2 ) : ( ( vecSpread.y > vecSpread.z ) ? 1 : 2 );
+	qsort( buildPrims.Base() + nFirst, nCount, sizeof( bvhbuildprim_t ), ( int (__cdecl *)( const void *, const void * ) )BVHPrimCompare );
+
+	int nChildren = g_WorldBVH.nodes.AddMultipleToTail( 2 );
+	node.firstChild = nChildren;
+	node.primCount = 0;
+	g_WorldBVH.nodes[nNode] = node;
+
+	int nHalf = nCount / 2;
+	CM_BuildBVHNode( buildPrims, nChildren, nFirst, nHalf, nDepth + 1 );
+	CM_BuildBVHNode( buildPrims, nChildren + 1, nFirst + nHalf, nCount - nHalf, nDepth + 1 );
+}
+
+//-----------------------------------------------------------------------------
+// A cached tree is only as good as the disk it sat on. Children always come
+// after their parent, so checking that also rules out cycles, and every node
+// and prim index has to be in bounds before a trace follows it.
+//-----------------------------------------------------------------------------
+static bool CM_ValidateCachedBVH( CCollisionBSPData *pBSPData, const byte *pCached, int nCachedSize )
+{
+	const bvhcacheheader_t *pHeader = (const bvhcacheheader_t *)pCached;
+	if ( nCachedSize < (int)sizeof( bvhcacheheader_t ) || pHeader->nodeCount < 0 || pHeader->primCount < 0 ||
+		nCachedSize != (int)( sizeof( bvhcacheheader_t ) + pHeader->nodeCount * sizeof( cbvhnode_t ) + pHeader->primCount * sizeof( int ) ) ||
+		( pHeader->nodeCount && pHeader->headnode != pBSPData->map_cmodels[0].headnode ) || pHeader->leafPrims != WORLD_BVH_LEAF_PRIMS )
+		return false;
+
+	const cbvhnode_t *pNodes = (const cbvhnode_t *)( pHeader + 1 );
+	CUtlVector< int > depth;
+	depth.SetCount( pHeader->nodeCount );
+	FOR_EACH_VEC( depth, i )
+	{
+		depth[i] = ( i == 0 ) ? 1 : 0;
+	}
+
+	for ( int i = 0; i < pHeader->nodeCount; i++ )
+	{
+		const cbvhnode_t &node = pNodes[i];
+		if ( node.primCount == 0 )
+		{
+			if ( node.firstChild <= i || node.firstChild >= pHeader->nodeCount - 1 || depth[i] >= WORLD_BVH_MAX_DEPTH )
+				return false;
+
+			depth[node.firstChild] = MAX( depth[node.firstChild], depth[i] + 1 );
+			depth[node.firstChild + 1] = MAX( depth[node.firstChild + 1], depth[i] + 1 );
+		}
+		else if ( node.primCount < 0 || node.primCount > WORLD_BVH_LEAF_PRIMS || node.firstChild < 0 || node.firstChild > pHeader->primCount - node.primCount )
+		{
+			return false;
+		}
+	}
+
+	const int *pPrims = (const int *)( pNodes + pHeader->nodeCount );
+	for ( int i = 0; i < pHeader->primCount; i++ )
+	{
+		int prim = pPrims[i];
+		if ( prim >= pBSPData->numbrushes || ~prim >= g_DispCollTreeCount )
+			return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the tree over every brush reachable from the world headnode plus all
+// displacements. Does nothing unless cm_world_bvh is set.
+//-----------------------------------------------------------------------------
+void CM_BuildWorldBVH( CCollisionBSPData *pBSPData )
+{
+	CM_FreeWorldBVH();
+
+	if ( !cm_world_bvh.GetBool() || !pBSPData->numcmodels || !pBSPData->numnodes )
+		return;
+
+	double flStartTime = Plat_FloatTime();
+
+	int nCachedSize;
+	const byte *pCached = CM_FindMapCacheSection( MAP_CACHE_WORLD_BVH, &nCachedSize );
+	if ( pCached )
+	{
+		if ( CM_ValidateCachedBVH( pBSPData, pCached, nCachedSize ) )
+		{
+			const bvhcacheheader_t *pHeader = (const bvhcacheheader_t *)pCached;
+			const cbvhnode_t *pNodes = (const cbvhnode_t *)( pHeader + 1 );
+			g_WorldBVH.nodes.CopyArray( pNodes, pHeader->nodeCount );
+			g_WorldBVH.prims.CopyArray( (const int *)( pNodes + pHeader->nodeCount ), pHeader->primCount );
+			g_WorldBVH.headnode = pHeader->headnode;
+			g_WorldBVH.maxDepth = pHeader->maxDepth;
+
+			DevMsg( "World BVH: %d nodes, depth %d, loaded from the map cache in %.2f ms\n",
+				g_WorldBVH.nodes.Count(), g_WorldBVH.maxDepth, ( Plat_FloatTime() - flStartTime ) * 1000.0f );
+			return;
+		}
+
+		CM_RejectMapCacheSection( MAP_CACHE_WORLD_BVH );
+	}
+
+	CUtlVector< bvhbuildprim_t > buildPrims;
+	buildPrims.EnsureCapacity( pBSPData->numbrushes + g_DispCollTreeCount );
+
+	// Gather the world brushes; brush models have their own headnodes and are left alone
+	CVarBitVec brushesAdded( pBSPData->numbrushes );
+	CUtlVector< int > nodeStack;
+	nodeStack.AddToTail( pBSPData->map_cmodels[0].headnode );
+	while ( nodeStack.Count() )
+	{
+		int num = nodeStack.Tail();
+		nodeStack.RemoveMultipleFromTail( 1 );
+
+		if ( num >= 0 )
+		{
+			const cnode_t *pNode = &pBSPData->map_nodes[num];
+			nodeStack.AddToTail( pNode->children[0] );
+			nodeStack.AddToTail( pNode->children[1] );
+			continue;
+		}
+
+		const cleaf_t *pLeaf = &pBSPData->map_leafs[-1 - num];
+		for ( int i = 0; i < pLeaf->numleafbrushes; i++ )
+		{
+			int ndxBrush = pBSPData->map_leafbrushes[pLeaf->firstleafbrush + i];
+			if ( brushesAdded.IsBitSet( ndxBrush ) )
+				continue;
+			brushesAdded.Set( ndxBrush );
+
+			bvhbuildprim_t &prim = buildPrims[ buildPrims.AddToTail() ];
+			CM_BrushBounds( pBSPData, &pBSPData->map_brushes[ndxBrush], prim.mins, prim.maxs );
+			prim.prim = ndxBrush;
+		}
+	}
+
+	int nBrushes = buildPrims.Count();
+	for ( int i = 0; i < g_DispCollTreeCount; i++ )
+	{
+		bvhbuildprim_t &prim = buildPrims[ buildPrims.AddToTail() ];
+		prim.mins = g_pDispBounds[i].mins;
+		prim.maxs = g_pDispBounds[i].maxs;
+		prim.prim = ~i;
+	}
+
+	if ( !buildPrims.Count() )
+		return;
+
+	for ( int i = 0; i < buildPrims.Count(); i++ )
+	{
+		bvhbuildprim_t &prim = buildPrims[i];
+		VectorLerp( prim.mins, prim.maxs, 0.5f, prim.center );
+	}
+
+	// A binary tree with at most WORLD_BVH_LEAF_PRIMS per leaf never needs more than this
+	g_WorldBVH.nodes.EnsureCapacity( 2 * ( buildPrims.Count() / ( WORLD_BVH_LEAF_PRIMS / 2 ) + 1 ) );
+	g_WorldBVH.prims.EnsureCapacity( buildPrims.Count() );
+	g_WorldBVH.headnode = pBSPData->map_cmodels[0].headnode;
+	g_WorldBVH.maxDepth = 0;
+
+	CM_BuildBVHNode( buildPrims, g_WorldBVH.nodes.AddToTail(), 0, buildPrims.Count(), 1 );
+
+	DevMsg( "World BVH: %d brushes, %d displacements, %d nodes, depth %d, %.1f KB, built in %.2f ms\n",
+		nBrushes, g_DispCollTreeCount, g_WorldBVH.nodes.Count(), g_WorldBVH.maxDepth,
+		( g_WorldBVH.nodes.Count() * sizeof( cbvhnode_t ) + g_WorldBVH.prims.Count() * sizeof( int ) ) / 1024.0f,
+		( Plat_FloatTime() - flStartTime ) * 1000.0f );
+}
+
+//-----------------------------------------------------------------------------
+// Saved even when empty, so a map without prims doesn't rebuild its cache
+//-----------------------------------------------------------------------------
+bool CM_SaveWorldBVH( CUtlBuffer &buf )
+{
+	if ( !cm_world_bvh.GetBool() )
+		return false;
+
+	bvhcacheheader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.nodeCount = g_WorldBVH.nodes.Count();
+	header.primCount = g_WorldBVH.prims.Count();
+	header.headnode = g_WorldBVH.headnode;
+	header.maxDepth = g_WorldBVH.maxDepth;
+	header.leafPrims = WORLD_BVH_LEAF_PRIMS;
+	buf.Put( &header, sizeof( header ) );
+	buf.Put( g_WorldBVH.nodes.Base(), header.nodeCount * sizeof( cbvhnode_t ) );
+	buf.Put( g_WorldBVH.prims.Base(), header.primCount * sizeof( int ) );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+void CM_FreeWorldBVH( void )
+{
+	if ( g_WorldBVH.numCompared > 0 )
+	{
+		Msg( "World BVH compare: %d traces, %d differed from the BSP\n", (int)g_WorldBVH.numCompared, (int)g_WorldBVH.numMismatched );
+	}
+
+	g_WorldBVH.nodes.Purge();
+	g_WorldBVH.prims.Purge();
+	g_WorldBVH.headnode = -1;
+	g_WorldBVH.maxDepth = 0;
+	g_WorldBVH.numCompared = 0;
+	g_WorldBVH.numMismatched = 0;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+bool CM_WorldBVHCompareEnabled( void )
+{
+	return cm_world_bvh_compare.GetBool();
+}
+
+//-----------------------------------------------------------------------------
+// Compares every field a caller can see, bit for bit
+//-----------------------------------------------------------------------------
+static bool CM_TracesIdentical( const trace_t &a, const trace_t &b )
+{
+	return !memcmp( &a.fraction, &b.fraction, sizeof( a.fraction ) ) &&
+		!memcmp( &a.fractionleftsolid, &b.fractionleftsolid, sizeof( a.fractionleftsolid ) ) &&
+		!memcmp( &a.plane.normal, &b.plane.normal, sizeof( a.plane.normal ) ) &&
+		!memcmp( &a.plane.dist, &b.plane.dist, sizeof( a.plane.dist ) ) &&
+		a.startsolid == b.startsolid &&
+		a.allsolid == b.allsolid &&
+		a.contents == b.contents &&
+		a.dispFlags == b.dispFlags &&
+		a.surface.name == b.surface.name &&
+		a.surface.surfaceProps == b.surface.surfaceProps &&
+		a.surface.flags == b.surface.flags;
+}
+
+void CM_CompareWorldBVHTrace( const Ray_t &ray, const trace_t &bvhTrace, const trace_t &bspTrace )
+{
+	++g_WorldBVH.numCompared;
+	if ( CM_TracesIdentical( bvhTrace, bspTrace ) )
+		return;
+
+	int nMismatch = ++g_WorldBVH.numMismatched;
+	if ( nMismatch > WORLD_BVH_MAX_REPORTED_MISMATCHES )
+		return;
+
+	Warning( "World BVH trace differs: start (%.3f %.3f %.3f) delta (%.3f %.3f %.3f) extents (%.3f %.3f %.3f)\n",
+		ray.m_Start.x, ray.m_Start.y, ray.m_Start.z, ray.m_Delta.x, ray.m_Delta.y, ray.m_Delta.z,
+		ray.m_Extents.x, ray.m_Extents.y, ray.m_Extents.z );
+	Warning( "    bvh: frac %f left %f solid %d/%d contents 0x%x normal (%.3f %.3f %.3f) surf %s\n",
+		bvhTrace.fraction, bvhTrace.fractionleftsolid, bvhTrace.startsolid, bvhTrace.allsolid, bvhTrace.contents,
+		bvhTrace.plane.normal.x, bvhTrace.plane.normal.y, bvhTrace.plane.normal.z, bvhTrace.surface.name );
+	Warning( "    bsp: frac %f left %f solid %d/%d contents 0x%x normal (%.3f %.3f %.3f) surf %s\n",
+		bspTrace.fraction, bspTrace.fractionleftsolid, bspTrace.startsolid, bspTrace.allsolid, bspTrace.contents,
+		bspTrace.plane.normal.x, bspTrace.plane.normal.y, bspTrace.plane.normal.z, bspTrace.surface.name );
+}
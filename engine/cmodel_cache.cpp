@@ -0,0 +1,394 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Sidecar file caching structures derived from a map's collision data
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cmodel_engine.h"
+#include "cmodel_private.h"
+#include "modelloader.h"
+#include "filesystem_engine.h"
+#include "host.h"
+#include "server.h"
+#include "client.h"
+#include "zone.h"
+#include "convar.h"
+#include "bspfile.h"
+#include "tier0/dbg.h"
+#include "tier0/threadtools.h"
+#include "tier1/generichash.h"
+#include "tier1/utlbuffer.h"
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static ConVar cm_map_cache( "cm_map_cache", "0", 0, "Save the vis rows, world BVH and displacement leaf lists built at map load next to the map, and load them from there while the map and engine build are unchanged. Servers sharing a game directory may all write the cache." );
+
+#define MAP_CACHE_MAGIC			0x43444d42	// 'BMDC'
+#define MAP_CACHE_VERSION		2
+#define MAP_CACHE_EXTENSION		".bspcache"
+
+// Sections start on a cache line so they can be used in place
+#define MAP_CACHE_SECTION_ALIGN	64
+
+struct MapCacheHeader_t
+{
+	uint32	m_nMagic;
+	uint32	m_nVersion;
+	int32	m_nBuildNumber;
+	uint32	m_nMapChecksum;
+	uint32	m_nFileSize;
+	uint32	m_nSections;
+};
+
+struct MapCacheSection_t
+{
+	uint32	m_nId;
+	uint32	m_nOffset;
+	uint32	m_nSize;
+	uint32	m_nHash;		// MurmurHash2 of the section's data
+};
+
+// Lumps the cached structures are derived from. Anything else in the BSP can change freely.
+static const int s_MapCacheLumps[] =
+{
+	LUMP_PLANES, LUMP_NODES, LUMP_LEAFS, LUMP_LEAFBRUSHES, LUMP_BRUSHES, LUMP_BRUSHSIDES,
+	LUMP_MODELS, LUMP_VISIBILITY, LUMP_VERTEXES, LUMP_EDGES, LUMP_SURFEDGES, LUMP_FACES,
+	LUMP_FACES_HDR, LUMP_TEXINFO, LUMP_DISPINFO, LUMP_DISP_VERTS, LUMP_DISP_TRIS,
+};
+
+static char				s_szMapCacheName[MAX_PATH];
+static unsigned int		s_nMapCacheChecksum = 0;
+static byte				*s_pMapCacheData = NULL;
+static FileViewHandle_t	s_hMapCacheView = NULL;
+static const MapCacheSection_t	*s_pMapCacheSections = NULL;
+static int				s_nMapCacheSections = 0;
+static CInterlockedInt	s_nMapCacheMisses;
+
+
+//-----------------------------------------------------------------------------
+// Hashes the lumps the cache is built from, through the same lump helper the
+// loaders use so lump patch files count. Needs CMapLoadHelper::Init.
+//-----------------------------------------------------------------------------
+unsigned int CM_MapChecksum( void )
+{
+	uint32 nHash = MAP_CACHE_VERSION;
+	for ( size_t i = 0; i < ARRAYSIZE( s_MapCacheLumps ); ++i )
+	{
+		int nLumpSize = CMapLoadHelper::LumpSize( s_MapCacheLumps[i] );
+		nHash = MurmurHash2( &nLumpSize, sizeof( nLumpSize ), nHash );
+		if ( nLumpSize <= 0 )
+			continue;
+
+		CMapLoadHelper lh( s_MapCacheLumps[i] );
+		int nVersion = lh.LumpVersion();
+		nHash = MurmurHash2( &nVersion, sizeof( nVersion ), nHash );
+		nHash = MurmurHash2( lh.LumpBase(), lh.LumpSize(), nHash );
+	}
+	return nHash;
+}
+
+static void CM_MapCacheFileName( const char *pszMapName, char *pszOut, int nOutSize )
+{
+	V_StripExtension( pszMapName, pszOut, nOutSize );
+	V_strncat( pszOut, MAP_CACHE_EXTENSION, nOutSize );
+	V_FixSlashes( pszOut );
+}
+
+static bool CM_ValidateMapCache( const byte *pData, int nSize, unsigned int nMapChecksum )
+{
+	if ( nSize < (int)sizeof( MapCacheHeader_t ) )
+		return false;
+
+	const MapCacheHeader_t *pHeader = (const MapCacheHeader_t *)pData;
+	if ( pHeader->m_nMagic != MAP_CACHE_MAGIC || pHeader->m_nVersion != MAP_CACHE_VERSION ||
+		pHeader->m_nBuildNumber != build_number() || pHeader->m_nMapChecksum != nMapChecksum ||
+		pHeader->m_nFileSize != (uint32)nSize )
+		return false;
+
+	// A file cut short by a crash while writing fails the size check above; this catches the rest
+	if ( sizeof( MapCacheHeader_t ) + (uint64)pHeader->m_nSections * sizeof( MapCacheSection_t ) > (uint64)nSize )
+		return false;
+
+	const MapCacheSection_t *pSections = (const MapCacheSection_t *)( pHeader + 1 );
+	for ( uint32 i = 0; i < pHeader->m_nSections; ++i )
+	{
+		if ( ( pSections[i].m_nOffset % MAP_CACHE_SECTION_ALIGN ) ||
+			(uint64)pSections[i].m_nOffset + pSections[i].m_nSize > (uint64)nSize )
+			return false;
+
+		// The sections are used as they are, a damaged vis row or node would go unnoticed otherwise
+		if ( MurmurHash2( pData + pSections[i].m_nOffset, pSections[i].m_nSize, MAP_CACHE_MAGIC ) != pSections[i].m_nHash )
+			return false;
+	}
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Maps the map's cache file if it was built from the same lumps by this build
+//-----------------------------------------------------------------------------
+void CM_OpenMapCache( const char *pszMapName, unsigned int nMapChecksum )
+{
+	// The vis rows may still point into the cache being replaced
+	CM_FreeVisCache();
+	CM_CloseMapCache();
+
+	CM_MapCacheFileName( pszMapName, s_szMapCacheName, sizeof( s_szMapCacheName ) );
+	s_nMapCacheChecksum = nMapChecksum;
+	s_nMapCacheMisses = 0;
+
+	if ( !cm_map_cache.GetBool() )
+		return;
+
+	FileHandle_t hFile = g_pFileSystem->Open( s_szMapCacheName, "rb", "GAME" );
+	if ( !hFile )
+		return;
+
+	int nSize = g_pFileSystem->Size( hFile );
+	if ( nSize >= (int)sizeof( MapCacheHeader_t ) )
+	{
+		s_pMapCacheData = (byte *)g_pFileSystem->MapFileView( hFile, 0, nSize, &s_hMapCacheView );
+		if ( !s_pMapCacheData )
+		{
+			s_pMapCacheData = (byte *)MemAlloc_AllocAligned( nSize, MAP_CACHE_SECTION_ALIGN );
+			if ( g_pFileSystem->Read( s_pMapCacheData, nSize, hFile ) != nSize )
+			{
+				nSize = 0;
+			}
+		}
+	}
+	g_pFileSystem->Close( hFile );
+
+	if ( !s_pMapCacheData || !CM_ValidateMapCache( s_pMapCacheData, nSize, nMapChecksum ) )
+	{
+		DevMsg( "Map cache: %s is stale, rebuilding\n", s_szMapCacheName );
+		CM_CloseMapCache();
+		return;
+	}
+
+	const MapCacheHeader_t *pHeader = (const MapCacheHeader_t *)s_pMapCacheData;
+	s_pMapCacheSections = (const MapCacheSection_t *)( pHeader + 1 );
+	s_nMapCacheSections = pHeader->m_nSections;
+}
+
+void CM_CloseMapCache( void )
+{
+	if ( s_hMapCacheView )
+	{
+		g_pFileSystem->ReleaseFileView( s_hMapCacheView );
+		s_hMapCacheView = NULL;
+	}
+	else if ( s_pMapCacheData )
+	{
+		MemAlloc_FreeAligned( s_pMapCacheData );
+	}
+
+	s_pMapCacheData = NULL;
+	s_pMapCacheSections = NULL;
+	s_nMapCacheSections = 0;
+}
+
+//-----------------------------------------------------------------------------
+// The section's data, or NULL when the cache doesn't have it. Only ask for a
+// section when it would be saved, a miss gets the cache rewritten.
+//-----------------------------------------------------------------------------
+const byte *CM_FindMapCacheSection( int nSection, int *pnSize )
+{
+	for ( int i = 0; i < s_nMapCacheSections; ++i )
+	{
+		if ( s_pMapCacheSections[i].m_nId == (uint32)nSection )
+		{
+			*pnSize = s_pMapCacheSections[i].m_nSize;
+			return s_pMapCacheData + s_pMapCacheSections[i].m_nOffset;
+		}
+	}
+
+	++s_nMapCacheMisses;
+	*pnSize = 0;
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// For a section that doesn't match what the map needs now, so it's saved again
+//-----------------------------------------------------------------------------
+void CM_RejectMapCacheSection( int nSection )
+{
+	DevMsg( "Map cache: section %d of %s doesn't match, rebuilding it\n", nSection, s_szMapCacheName );
+	++s_nMapCacheMisses;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the cache out again if any section was missing from it
+//-----------------------------------------------------------------------------
+void CM_SaveMapCache( CCollisionBSPData *pBSPData )
+{
+	if ( !cm_map_cache.GetBool() || !s_nMapCacheMisses || !s_szMapCacheName[0] )
+		return;
+
+	CUtlBuffer sections[MAP_CACHE_NUM_SECTIONS];
+	bool bSaved[MAP_CACHE_NUM_SECTIONS];
+	bSaved[MAP_CACHE_VIS] = CM_SaveVisCache( sections[MAP_CACHE_VIS] );
+	bSaved[MAP_CACHE_WORLD_BVH] = CM_SaveWorldBVH( sections[MAP_CACHE_WORLD_BVH] );
+	bSaved[MAP_CACHE_DISP_LEAVES] = CM_SaveDispLeafLists( pBSPData, sections[MAP_CACHE_DISP_LEAVES] );
+
+	MapCacheSection_t table[MAP_CACHE_NUM_SECTIONS];
+	int nSections = 0;
+	uint32 nOffset = AlignValue( sizeof( MapCacheHeader_t ) + sizeof( table ), MAP_CACHE_SECTION_ALIGN );
+	for ( int i = 0; i < MAP_CACHE_NUM_SECTIONS; ++i )
+	{
+		if ( !bSaved[i] )
+			continue;
+
+		table[nSections].m_nId = i;
+		table[nSections].m_nOffset = nOffset;
+		table[nSections].m_nSize = sections[i].TellPut();
+		table[nSections].m_nHash = MurmurHash2( sections[i].Base(), table[nSections].m_nSize, MAP_CACHE_MAGIC );
+		nOffset = AlignValue( nOffset + table[nSections].m_nSize, MAP_CACHE_SECTION_ALIGN );
+		++nSections;
+	}
+
+	if ( !nSections )
+		return;
+
+	MapCacheHeader_t header;
+	header.m_nMagic = MAP_CACHE_MAGIC;
+	header.m_nVersion = MAP_CACHE_VERSION;
+	header.m_nBuildNumber = build_number();
+	header.m_nMapChecksum = s_nMapCacheChecksum;
+	header.m_nFileSize = nOffset;
+	header.m_nSections = nSections;
+
+	CUtlBuffer buf;
+	buf.EnsureCapacity( nOffset );
+	buf.Put( &header, sizeof( header ) );
+	buf.Put( table, nSections * sizeof( MapCacheSection_t ) );
+	for ( int i = 0; i < nSections; ++i )
+	{
+		while ( (uint32)buf.TellPut() < table[i].m_nOffset )
+		{
+			buf.PutChar( 0 );
+		}
+		buf.Put( sections[table[i].m_nId].Base(), table[i].m_nSize );
+	}
+	while ( (uint32)buf.TellPut() < nOffset )
+	{
+		buf.PutChar( 0 );
+	}
+
+	// Write beside the old file and swap it in, so a reader never sees half a file. The temp
+	// name is per process since servers sharing a game directory can save the same map at once.
+	char szDir[MAX_PATH];
+	V_ExtractFilePath( s_szMapCacheName, szDir, sizeof( szDir ) );
+	g_pFileSystem->CreateDirHierarchy( szDir, "DEFAULT_WRITE_PATH" );
+
+	char szTempName[MAX_PATH];
+	V_snprintf( szTempName, sizeof( szTempName ), "%s.%d.tmp", s_szMapCacheName, (int)getpid() );
+	if ( !g_pFileSystem->WriteFile( szTempName, "DEFAULT_WRITE_PATH", buf ) )
+	{
+		Warning( "Map cache: couldn't write %s\n", szTempName );
+		return;
+	}
+
+#ifdef _WIN32
+	// Windows won't rename over a file; elsewhere the rename replaces it in one step
+	g_pFileSystem->RemoveFile( s_szMapCacheName, "DEFAULT_WRITE_PATH" );
+#endif
+	if ( !g_pFileSystem->RenameFile( szTempName, s_szMapCacheName, "DEFAULT_WRITE_PATH" ) )
+	{
+		Warning( "Map cache: couldn't replace %s\n", s_szMapCacheName );
+		g_pFileSystem->RemoveFile( szTempName, "DEFAULT_WRITE_PATH" );
+		return;
+	}
+
+	DevMsg( "Map cache: wrote %s (%d sections, %.1f KB)\n", s_szMapCacheName, nSections, nOffset / 1024.0f );
+}
+
+//-----------------------------------------------------------------------------
+// True when the last CM_LoadMap took everything it asked for from the cache
+//-----------------------------------------------------------------------------
+bool CM_MapCacheWasComplete( void )
+{
+	return !s_nMapCacheMisses;
+}
+
+
+//-----------------------------------------------------------------------------
+// Loads the collision model of every map in a map cycle so their caches are
+// built before a server gets to them
+//-----------------------------------------------------------------------------
+CON_COMMAND( cm_map_cache_warm, "Builds the map cache of every map in a map cycle file (cfg/mapcycle.txt by default)" )
+{
+	if ( !cm_map_cache.GetBool() )
+	{
+		Warning( "cm_map_cache_warm: cm_map_cache is 0\n" );
+		return;
+	}
+
+	bool bInUse = sv.IsActive();
+#ifndef SWDS
+	bInUse = bInUse || cl.IsConnected();
+#endif
+	if ( bInUse )
+	{
+		Warning( "cm_map_cache_warm: the collision model is in use, disconnect first\n" );
+		return;
+	}
+
+	const char *pszCycleFile = ( args.ArgC() > 1 ) ? args[1] : "cfg/mapcycle.txt";
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( !g_pFileSystem->ReadFile( pszCycleFile, "GAME", buf ) &&
+		( args.ArgC() > 1 || !g_pFileSystem->ReadFile( "mapcycle.txt", "GAME", buf ) ) )
+	{
+		Warning( "cm_map_cache_warm: couldn't read %s\n", pszCycleFile );
+		return;
+	}
+
+	int nMaps = 0, nBuilt = 0;
+	double flStartTime = Plat_FloatTime();
+	char szLine[MAX_PATH];
+	while ( buf.IsValid() )
+	{
+		buf.GetLine( szLine, sizeof( szLine ) );
+		char *pszComment = V_strstr( szLine, "//" );
+		if ( pszComment )
+		{
+			*pszComment = 0;
+		}
+
+		char szMapName[MAX_PATH];
+		if ( sscanf( szLine, "%259s", szMapName ) != 1 )
+			continue;
+
+		char szMapPath[MAX_PATH];
+		V_snprintf( szMapPath, sizeof( szMapPath ), "maps/%s.bsp", szMapName );
+		if ( !g_pFileSystem->FileExists( szMapPath, "GAME" ) )
+		{
+			Warning( "cm_map_cache_warm: %s not found\n", szMapPath );
+			continue;
+		}
+
+		++nMaps;
+		double flMapStart = Plat_FloatTime();
+		int nHunkMark = Hunk_LowMark();
+		unsigned int nChecksum;
+		CM_LoadMap( szMapPath, false, &nChecksum );
+		bool bWasCached = CM_MapCacheWasComplete();
+		CM_FreeMap();
+		Hunk_FreeToLowMark( nHunkMark );
+
+		if ( !bWasCached )
+		{
+			++nBuilt;
+		}
+		Msg( "  %-32s %s in %.0f ms\n", szMapName, bWasCached ? "up to date" : "built", ( Plat_FloatTime() - flMapStart ) * 1000.0f );
+	}
+
+	Msg( "cm_map_cache_warm: %d maps, %d built, %.1f s\n", nMaps, nBuilt, Plat_FloatTime() - flStartTime );
+}
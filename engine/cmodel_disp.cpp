@@ -182,12 +182,86 @@ private:
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
+// Leads a map cache section holding each leaf's range, then the leaf lists
+struct displeafcacheheader_t
+{
+	int		leafCount;
+	int		dispCount;
+	int		dispListCount;
+	int		unused;
+};
+
+static bool CM_LoadDispLeafLists( CCollisionBSPData *pBSPData, const byte *pCached, int nCachedSize )
+{
+	const displeafcacheheader_t *pHeader = (const displeafcacheheader_t *)pCached;
+	if ( nCachedSize < (int)sizeof( displeafcacheheader_t ) || pHeader->leafCount != pBSPData->numleafs || pHeader->dispCount != g_DispCollTreeCount ||
+		pHeader->dispListCount < 0 ||
+		nCachedSize != (int)( sizeof( displeafcacheheader_t ) + pHeader->leafCount * 2 * sizeof( unsigned short ) + pHeader->dispListCount * sizeof( unsigned short ) ) )
+		return false;
+
+	// The file is only as good as the disk it sat on, every range and index has to be in bounds
+	const unsigned short *pRanges = (const unsigned short *)( pHeader + 1 );
+	const unsigned short *pDispList = pRanges + pHeader->leafCount * 2;
+	for ( int i = 0; i < pBSPData->numleafs; i++ )
+	{
+		if ( pRanges[i * 2] + pRanges[i * 2 + 1] > pHeader->dispListCount )
+			return false;
+	}
+	for ( int i = 0; i < pHeader->dispListCount; i++ )
+	{
+		if ( pDispList[i] >= g_DispCollTreeCount )
+			return false;
+	}
+
+	for ( int i = 0; i < pBSPData->numleafs; i++ )
+	{
+		pBSPData->map_leafs[i].dispListStart = pRanges[i * 2];
+		pBSPData->map_leafs[i].dispCount = pRanges[i * 2 + 1];
+	}
+
+	int count = pHeader->dispListCount;
+	pBSPData->map_dispList.Attach( count, (unsigned short*)Hunk_Alloc( sizeof(unsigned short) * count, false ) );
+	memcpy( pBSPData->map_dispList.Base(), pDispList, sizeof(unsigned short) * count );
+	pBSPData->numdisplist = count;
+	return true;
+}
+
+bool CM_SaveDispLeafLists( CCollisionBSPData *pBSPData, CUtlBuffer &buf )
+{
+	if ( g_DispCollTreeCount == 0 || !pBSPData->map_dispList.Base() )
+		return false;
+
+	displeafcacheheader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.leafCount = pBSPData->numleafs;
+	header.dispCount = g_DispCollTreeCount;
+	header.dispListCount = pBSPData->numdisplist;
+	buf.Put( &header, sizeof( header ) );
+	for ( int i = 0; i < pBSPData->numleafs; i++ )
+	{
+		buf.PutUnsignedShort( pBSPData->map_leafs[i].dispListStart );
+		buf.PutUnsignedShort( pBSPData->map_leafs[i].dispCount );
+	}
+	buf.Put( pBSPData->map_dispList.Base(), pBSPData->numdisplist * sizeof( unsigned short ) );
+	return true;
+}
+
 void CM_DispTreeLeafnum( CCollisionBSPData *pBSPData )
 {
 	// check to see if there are any displacement trees to push down the bsp tree??
 	if( g_DispCollTreeCount == 0 )
 		return;
 
+	int nCachedSize;
+	const byte *pCached = CM_FindMapCacheSection( MAP_CACHE_DISP_LEAVES, &nCachedSize );
+	if ( pCached )
+	{
+		if ( CM_LoadDispLeafLists( pBSPData, pCached, nCachedSize ) )
+			return;
+
+		CM_RejectMapCacheSection( MAP_CACHE_DISP_LEAVES );
+	}
+
 	for ( int i = 0; i < pBSPData->numleafs; i++ )
 	{
 		pBSPData->map_leafs[i].dispCount = 0;
@@ -204,6 +278,7 @@ void CM_DispTreeLeafnum( CCollisionBSPData *pBSPData )
 	int count = leafBuilder.GetDispListCount();
 	pBSPData->map_dispList.Attach( count, (unsigned short*)Hunk_Alloc( sizeof(unsigned short) * count, false ) );
 	leafBuilder.WriteLeafList( pBSPData->map_dispList.Base() );
+	pBSPData->numdisplist = count;
 }
 
 //-----------------------------------------------------------------------------
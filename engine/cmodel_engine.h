@@ -41,6 +41,13 @@ const byte	*CM_ClusterPVS( int cluster );
 int			CM_ClusterPVSSize();
 
 const byte	*CM_Vis( byte *dest, int destlen, int cluster, int visType );
+// Like CM_Vis, but returns the cached row itself when there is one instead of copying it into dest
+const byte	*CM_VisRow( byte *dest, int destlen, int cluster, int visType );
+// ORs the PVS or PAS of a cluster into dest
+void		CM_AddVis( byte *dest, int destlen, int cluster, int visType );
+// dest |= src and dest &= src over nBytes of vis bits
+void		CM_VisUnion( byte *dest, const byte *src, int nBytes );
+void		CM_VisIntersect( byte *dest, const byte *src, int nBytes );
 
 int			CM_PointLeafnum( const Vector& p );
 void		CM_SnapPointToReferenceLeaf(const Vector &referenceLeafPoint, float tolerance, Vector *pSnapPoint);
@@ -477,6 +477,89 @@ template <bool IS_POINT>
 void FASTCALL CM_TraceToDispTree( TraceInfo_t *pTraceInfo, CDispCollTree *pDispTree, float startFrac, float endFrac );
 void CM_PostTraceToDispTree( TraceInfo_t *pTraceInfo );
 
+//=============================================================================
+//
+// World Bounding Volume Hierarchy (cmodel_bvh.cpp)
+//
+// Optional flat tree over every world brush and displacement, built at map load
+// when cm_world_bvh is set. Swept world traces walk it instead of the BSP.
+//
+
+// 32 bytes, two to a cache line; mins and maxs are 16-byte aligned for SIMD loads
+struct cbvhnode_t
+{
+	Vector			mins;
+	int				firstChild;		// interior: children are firstChild and firstChild + 1; leaf: first entry in prims
+	Vector			maxs;
+	int				primCount;		// 0 for interior nodes
+};
+
+struct cworldbvh_t
+{
+	CUtlVector< cbvhnode_t, CUtlMemoryAligned< cbvhnode_t, 64 > > nodes;
+	CUtlVector< int >	prims;			// brush index, or ~dispIndex for displacements
+	int					headnode;		// the BSP node this tree stands in for
+	int					maxDepth;
+
+	CInterlockedInt		numCompared;
+	CInterlockedInt		numMismatched;
+
+	bool IsValid() const { return nodes.Count() > 0; }
+};
+
+extern cworldbvh_t g_WorldBVH;
+
+void CM_BuildWorldBVH( CCollisionBSPData *pBSPData );
+void CM_FreeWorldBVH( void );
+bool CM_WorldBVHCompareEnabled( void );
+void CM_CompareWorldBVHTrace( const Ray_t &ray, const trace_t &bvhTrace, const trace_t &bspTrace );
+
+//=============================================================================
+//
+// Vis cache (cmodel_vis.cpp)
+//
+// Decompressed PVS and PAS rows for every cluster, built at map load. Maps that
+// don't fit under cm_vis_cache_mb keep the most recently used rows instead.
+//
+
+void CM_DecompressVis( CCollisionBSPData *pBSPData, int cluster, int visType, byte *out );
+void CM_BuildVisCache( CCollisionBSPData *pBSPData );
+void CM_FreeVisCache( void );
+
+// Copies a cached row into dest. False when the cache can't provide that cluster.
+bool CM_CopyCachedVis( int cluster, int visType, byte *dest );
+
+//=============================================================================
+//
+// Map cache (cmodel_cache.cpp)
+//
+// Structures derived from the collision data at map load are saved to a file
+// beside the map, keyed by a hash of the lumps they come from and the engine
+// build, and loaded from it on later loads of the same map.
+//
+
+enum MapCacheSectionId_t
+{
+	MAP_CACHE_VIS = 0,
+	MAP_CACHE_WORLD_BVH,
+	MAP_CACHE_DISP_LEAVES,
+
+	MAP_CACHE_NUM_SECTIONS
+};
+
+unsigned int CM_MapChecksum( void );
+void CM_OpenMapCache( const char *pszMapName, unsigned int nMapChecksum );
+void CM_CloseMapCache( void );
+const byte *CM_FindMapCacheSection( int nSection, int *pnSize );
+void CM_RejectMapCacheSection( int nSection );
+void CM_SaveMapCache( CCollisionBSPData *pBSPData );
+bool CM_MapCacheWasComplete( void );
+
+// Section writers, false when there's nothing to save
+bool CM_SaveVisCache( CUtlBuffer &buf );
+bool CM_SaveWorldBVH( CUtlBuffer &buf );
+bool CM_SaveDispLeafLists( CCollisionBSPData *pBSPData, CUtlBuffer &buf );
+
 //=============================================================================
 //
 // profiling purposes only -- remove when done!!!
@@ -0,0 +1,370 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Decompressed PVS/PAS cache and vis bitset operations
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cmodel_engine.h"
+#include "cmodel_private.h"
+#include "convar.h"
+#include "mathlib/ssemath.h"
+#include "tier0/dbg.h"
+#include "tier0/fasttimer.h"
+#include "tier0/threadtools.h"
+#include "tier1/utllinkedlist.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static ConVar cm_vis_cache( "cm_vis_cache", "1", 0, "Decompress the PVS and PAS of every cluster at map load so vis lookups are a copy or a pointer. Takes effect on the next map." );
+static ConVar cm_vis_cache_mb( "cm_vis_cache_mb", "32", 0, "Memory the vis cache may use. Maps needing more keep only the most recently used rows. Takes effect on the next map." );
+
+// Rows start on a SIMD boundary
+#define VIS_CACHE_ROW_ALIGN		16
+
+// Fewest rows worth keeping when the map doesn't fit
+#define VIS_CACHE_MIN_SLOTS		64
+
+//-----------------------------------------------------------------------------
+// Every cluster gets a PVS row and a PAS row. When they all fit under the
+// memory cap they are decompressed once at map load and never change, so
+// they can be read without a lock. Otherwise a fixed set of slots holds the
+// most recently used rows.
+//-----------------------------------------------------------------------------
+class CVisCache
+{
+public:
+	CVisCache();
+
+	void Build( CCollisionBSPData *pBSPData );
+	void Free();
+
+	bool IsBuilt() const		{ return m_pRows != NULL; }
+	bool IsComplete() const		{ return m_bComplete; }
+	int RowBytes() const		{ return m_nRowBytes; }
+
+	// NULL unless every row is resident
+	const byte *Row( int cluster, int visType ) const;
+
+	// Copies the row into dest, decompressing it into the LRU first if needed. False if the cluster isn't cached.
+	bool Copy( int cluster, int visType, byte *dest );
+
+	void ReportStats() const;
+
+	// Complete caches only
+	bool Save( CUtlBuffer &buf ) const;
+
+private:
+	int RowIndex( int cluster, int visType ) const	{ return cluster * 2 + visType; }
+	byte *Slot( int nSlot ) const					{ return m_pRows + nSlot * m_nRowStride; }
+
+	CCollisionBSPData	*m_pBSPData;
+	byte				*m_pRows;
+	bool				m_bRowsInMapCache;	// m_pRows points into the map cache, not at an allocation
+	int					m_nRowBytes;
+	int					m_nRowStride;
+	int					m_nClusters;
+	int					m_nSlots;
+	bool				m_bComplete;
+
+	// LRU mode only
+	CThreadFastMutex			m_Mutex;
+	CUtlVector<int>				m_SlotForRow;		// -1 when the row isn't resident
+	CUtlVector<int>				m_RowForSlot;		// -1 when the slot is empty
+	CUtlLinkedList<int, int>	m_LRU;				// Slots, most recently used first
+	CUtlVector<int>				m_LRUElement;		// Where each slot is in m_LRU
+
+	CInterlockedInt		m_nHits;
+	CInterlockedInt		m_nMisses;
+	float				m_flBuildTime;
+};
+
+static CVisCache s_VisCache;
+
+CVisCache::CVisCache()
+{
+	m_pBSPData = NULL;
+	m_pRows = NULL;
+	m_bRowsInMapCache = false;
+	m_nRowBytes = 0;
+	m_nRowStride = 0;
+	m_nClusters = 0;
+	m_nSlots = 0;
+	m_bComplete = false;
+	m_flBuildTime = 0.0f;
+}
+
+// Leads the rows in a map cache section, padded so the rows stay aligned
+struct VisCacheSectionHeader_t
+{
+	int		m_nClusters;
+	int		m_nRowBytes;
+	int		m_nRowStride;
+	int		m_nUnused;
+};
+
+void CVisCache::Build( CCollisionBSPData *pBSPData )
+{
+	Free();
+
+	// Maps without vis see everything, CM_NullVis already handles them
+	if ( !cm_vis_cache.GetBool() || !pBSPData->numvisibility || !pBSPData->map_vis || pBSPData->numclusters <= 0 )
+		return;
+
+	CFastTimer timer;
+	timer.Start();
+
+	m_pBSPData = pBSPData;
+	m_nClusters = pBSPData->numclusters;
+	m_nRowBytes = ( m_nClusters + 7 ) >> 3;
+	m_nRowStride = AlignValue( m_nRowBytes, VIS_CACHE_ROW_ALIGN );
+
+	int nRows = m_nClusters * 2;
+	int64 nMaxBytes = (int64)MAX( cm_vis_cache_mb.GetInt(), 1 ) * 1024 * 1024;
+	m_bComplete = ( (int64)nRows * m_nRowStride <= nMaxBytes );
+	m_nSlots = m_bComplete ? nRows : clamp( (int)( nMaxBytes / m_nRowStride ), VIS_CACHE_MIN_SLOTS, nRows );
+
+	if ( m_bComplete )
+	{
+		// Rows saved by an earlier load of this map are used in place, they never change
+		int nCachedSize;
+		const byte *pCached = CM_FindMapCacheSection( MAP_CACHE_VIS, &nCachedSize );
+		if ( pCached )
+		{
+			const VisCacheSectionHeader_t *pHeader = (const VisCacheSectionHeader_t *)pCached;
+			if ( nCachedSize == (int)sizeof( VisCacheSectionHeader_t ) + nRows * m_nRowStride &&
+				pHeader->m_nClusters == m_nClusters && pHeader->m_nRowBytes == m_nRowBytes && pHeader->m_nRowStride == m_nRowStride )
+			{
+				m_pRows = const_cast<byte *>( pCached ) + sizeof( VisCacheSectionHeader_t );
+				m_bRowsInMapCache = true;
+			}
+			else
+			{
+				CM_RejectMapCacheSection( MAP_CACHE_VIS );
+			}
+		}
+	}
+
+	if ( !m_bRowsInMapCache )
+	{
+		m_pRows = (byte *)MemAlloc_AllocAligned( m_nSlots * m_nRowStride, VIS_CACHE_ROW_ALIGN );
+		memset( m_pRows, 0, m_nSlots * m_nRowStride );
+	}
+
+	if ( !m_bComplete )
+	{
+		m_SlotForRow.SetCount( nRows );
+		m_SlotForRow.FillWithValue( -1 );
+		m_RowForSlot.SetCount( m_nSlots );
+		m_RowForSlot.FillWithValue( -1 );
+		m_LRUElement.SetCount( m_nSlots );
+		m_LRU.EnsureCapacity( m_nSlots );
+		for ( int i = 0; i < m_nSlots; ++i )
+		{
+			m_LRUElement[i] = m_LRU.AddToTail( i );
+		}
+	}
+	else if ( !m_bRowsInMapCache )
+	{
+		for ( int cluster = 0; cluster < m_nClusters; ++cluster )
+		{
+			CM_DecompressVis( pBSPData, cluster, DVIS_PVS, Slot( RowIndex( cluster, DVIS_PVS ) ) );
+			CM_DecompressVis( pBSPData, cluster, DVIS_PAS, Slot( RowIndex( cluster, DVIS_PAS ) ) );
+		}
+	}
+
+	timer.End();
+	m_flBuildTime = timer.GetDuration().GetMillisecondsF();
+
+	DevMsg( "Vis cache: %d clusters, %s, %.1f KB, %.2f ms\n", m_nClusters, m_bRowsInMapCache ? "all rows from the map cache" : ( m_bComplete ? "all rows" : "LRU" ),
+		( m_nSlots * m_nRowStride ) / 1024.0f, m_flBuildTime );
+}
+
+bool CVisCache::Save( CUtlBuffer &buf ) const
+{
+	if ( !m_pRows || !m_bComplete )
+		return false;
+
+	VisCacheSectionHeader_t header;
+	header.m_nClusters = m_nClusters;
+	header.m_nRowBytes = m_nRowBytes;
+	header.m_nRowStride = m_nRowStride;
+	header.m_nUnused = 0;
+	buf.Put( &header, sizeof( header ) );
+	buf.Put( m_pRows, m_nSlots * m_nRowStride );
+	return true;
+}
+
+void CVisCache::Free()
+{
+	AUTO_LOCK( m_Mutex );
+	if ( m_pRows && !m_bRowsInMapCache )
+	{
+		MemAlloc_FreeAligned( m_pRows );
+	}
+	m_pRows = NULL;
+	m_bRowsInMapCache = false;
+
+	m_pBSPData = NULL;
+	m_nRowBytes = 0;
+	m_nRowStride = 0;
+	m_nClusters = 0;
+	m_nSlots = 0;
+	m_bComplete = false;
+	m_SlotForRow.Purge();
+	m_RowForSlot.Purge();
+	m_LRU.Purge();
+	m_LRUElement.Purge();
+	m_nHits = 0;
+	m_nMisses = 0;
+}
+
+const byte *CVisCache::Row( int cluster, int visType ) const
+{
+	if ( !m_bComplete || cluster < 0 || cluster >= m_nClusters || ( visType != DVIS_PVS && visType != DVIS_PAS ) )
+		return NULL;
+
+	return Slot( RowIndex( cluster, visType ) );
+}
+
+bool CVisCache::Copy( int cluster, int visType, byte *dest )
+{
+	if ( !m_pRows || cluster < 0 || cluster >= m_nClusters || ( visType != DVIS_PVS && visType != DVIS_PAS ) )
+		return false;
+
+	if ( m_bComplete )
+	{
+		memcpy( dest, Slot( RowIndex( cluster, visType ) ), m_nRowBytes );
+		return true;
+	}
+
+	// A slot can be reused as soon as the lock is dropped, so copy while holding it
+	AUTO_LOCK( m_Mutex );
+	int nRow = RowIndex( cluster, visType );
+	int nSlot = m_SlotForRow[nRow];
+	if ( nSlot >= 0 )
+	{
+		++m_nHits;
+	}
+	else
+	{
+		++m_nMisses;
+		nSlot = m_LRU[ m_LRU.Tail() ];
+		if ( m_RowForSlot[nSlot] >= 0 )
+		{
+			m_SlotForRow[ m_RowForSlot[nSlot] ] = -1;
+		}
+		m_RowForSlot[nSlot] = nRow;
+		m_SlotForRow[nRow] = nSlot;
+		CM_DecompressVis( m_pBSPData, cluster, visType, Slot( nSlot ) );
+	}
+
+	m_LRU.Unlink( m_LRUElement[nSlot] );
+	m_LRU.LinkToHead( m_LRUElement[nSlot] );
+
+	memcpy( dest, Slot( nSlot ), m_nRowBytes );
+	return true;
+}
+
+void CVisCache::ReportStats() const
+{
+	if ( !m_pRows )
+	{
+		Msg( "Vis cache: not built (%s)\n", cm_vis_cache.GetBool() ? "the map has no vis" : "cm_vis_cache is 0" );
+		return;
+	}
+
+	Msg( "Vis cache: %d clusters, %d byte rows, %d of %d rows resident (%.1f KB), built in %.2f ms\n",
+		m_nClusters, m_nRowBytes, m_nSlots, m_nClusters * 2, ( m_nSlots * m_nRowStride ) / 1024.0f, m_flBuildTime );
+	if ( !m_bComplete )
+	{
+		Msg( "\tLRU: %d hits, %d misses\n", (int)m_nHits, (int)m_nMisses );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Entry points
+//-----------------------------------------------------------------------------
+void CM_BuildVisCache( CCollisionBSPData *pBSPData )
+{
+	s_VisCache.Build( pBSPData );
+}
+
+void CM_FreeVisCache( void )
+{
+	s_VisCache.Free();
+}
+
+bool CM_SaveVisCache( CUtlBuffer &buf )
+{
+	return s_VisCache.Save( buf );
+}
+
+bool CM_CopyCachedVis( int cluster, int visType, byte *dest )
+{
+	return s_VisCache.Copy( cluster, visType, dest );
+}
+
+const byte *CM_VisRow( byte *dest, int destlen, int cluster, int visType )
+{
+	const byte *pRow = s_VisCache.Row( cluster, visType );
+	if ( pRow )
+		return pRow;
+
+	return CM_Vis( dest, destlen, cluster, visType );
+}
+
+void CM_AddVis( byte *dest, int destlen, int cluster, int visType )
+{
+	// No cluster sees nothing
+	if ( cluster == -1 )
+		return;
+
+	const byte *pRow = s_VisCache.Row( cluster, visType );
+	if ( pRow )
+	{
+		CM_VisUnion( dest, pRow, MIN( destlen, s_VisCache.RowBytes() ) );
+		return;
+	}
+
+	byte vis[MAX_MAP_LEAFS/8];
+	CM_Vis( vis, sizeof( vis ), cluster, visType );
+	CM_VisUnion( dest, vis, MIN( destlen, ( CM_NumClusters() + 7 ) >> 3 ) );
+}
+
+void CM_VisUnion( byte *dest, const byte *src, int nBytes )
+{
+	int i = 0;
+	for ( ; i + 16 <= nBytes; i += 16 )
+	{
+		fltx4 result = OrSIMD( LoadUnalignedSIMD( dest + i ), LoadUnalignedSIMD( src + i ) );
+		StoreUnalignedSIMD( (float *)( dest + i ), result );
+	}
+
+	for ( ; i < nBytes; ++i )
+	{
+		dest[i] |= src[i];
+	}
+}
+
+void CM_VisIntersect( byte *dest, const byte *src, int nBytes )
+{
+	int i = 0;
+	for ( ; i + 16 <= nBytes; i += 16 )
+	{
+		fltx4 result = AndSIMD( LoadUnalignedSIMD( dest + i ), LoadUnalignedSIMD( src + i ) );
+		StoreUnalignedSIMD( (float *)( dest + i ), result );
+	}
+
+	for ( ; i < nBytes; ++i )
+	{
+		dest[i] &= src[i];
+	}
+}
+
+CON_COMMAND( cm_vis_cache_stats, "Reports the decompressed PVS/PAS cache" )
+{
+	s_VisCache.ReportStats();
+}
@@ -28,6 +28,8 @@
 #include "mathlib/polyhedron.h"
 #include "sys_dll.h"
 #include "vphysics/virtualmesh.h"
+#include "tracecapture.h"
+#include "vstdlib/random.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -58,6 +60,17 @@ static CUtlVector<Ray_t> s_FrameRays;
 
 #define BENCHMARK_RAY_TEST 0
 
+static ConVar trace_batch( "trace_batch", "1", 0, "Share the entity query across rays passed to TraceRayBatch. 0 traces each ray on its own." );
+
+// Rays handled by one shared entity query; bigger batches are split
+#define TRACE_BATCH_MAX_RAYS	32
+
+// Rays are treated as a box this many units fatter when checking whether a batch is coherent
+#define TRACE_BATCH_COHERENCE_PAD	64.0f
+
+// A batch whose combined bounds are more than this many times the summed bounds of its rays is traced ray by ray
+#define TRACE_BATCH_COHERENCE_RATIO	4.0f
+
 #if BENCHMARK_RAY_TEST
 static CUtlVector<Ray_t> s_BenchmarkRays;
 #endif
@@ -70,7 +83,7 @@ static CUtlVector<Ray_t> s_BenchmarkRays;
 abstract_class CEngineTrace : public IEngineTrace
 {
 public:
-	CEngineTrace() { m_pRootMoveParent = NULL; }
+	CEngineTrace() { SetRootMoveParent( NULL ); }
 	// Returns the contents mask at a particular world-space position
 	virtual int		GetPointContents( const Vector &vecAbsPosition, IHandleEntity** ppEntity );
 
@@ -125,6 +138,13 @@ public:
 	// Walks bsp to find the leaf containing the specified point
 	virtual int GetLeafContainingPoint( const Vector &ptTest );
 
+	// Traces a set of rays sharing one mask and filter
+	virtual void TraceRayBatch( const Ray_t *pRays, int nRayCount, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTraces );
+
+	// Read only phase during which traces may come from any thread
+	virtual void BeginConcurrentTracePhase();
+	virtual void EndConcurrentTracePhase();
+
 private:
 	// FIXME: Different versions for client + server. Eventually we need to make these go away
 	virtual void SetTraceEntity( ICollideable *pCollideable, trace_t *pTrace ) = 0;
@@ -158,9 +178,19 @@ private:
 
 	// Clips a trace to another trace
 	bool ClipTraceToTrace( trace_t &clipTrace, trace_t *pFinalTrace );
+
+	// Clips a trace that has already been run against the world to the entities along the ray
+	void ClipRayToEntities( const Ray_t &entityRay, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace );
+
+	// Traces up to TRACE_BATCH_MAX_RAYS coherent rays against one shared entity list
+	void TraceRayBatchCoherent( const Ray_t *pRays, int nRayCount, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTraces );
 private:
-	int m_traceStatCounters[NUM_TRACE_STAT_COUNTER];
-	const matrix3x4_t *m_pRootMoveParent;
+	// The root parent is set by SweepCollideable for the duration of one trace, so each thread needs its own
+	const matrix3x4_t *GetRootMoveParent()					{ return m_pRootMoveParent; }
+	void SetRootMoveParent( const matrix3x4_t *pRoot )	{ m_pRootMoveParent = const_cast<matrix3x4_t *>( pRoot ); }
+
+	CInterlockedInt m_traceStatCounters[NUM_TRACE_STAT_COUNTER];
+	CTHREADLOCALPTR( matrix3x4_t ) m_pRootMoveParent;
 	friend void RayBench( const CCommand &args );
 
 };
@@ -387,6 +417,11 @@ int	CEngineTrace::GetPointContents( const Vector &vecAbsPosition, IHandleEntity*
 	m_traceStatCounters[TRACE_STAT_COUNTER_POINTCONTENTS]++;
 	// First check the collision model
 	int nContents = CM_PointContents( vecAbsPosition, 0 );
+	if ( TraceCapture_IsActive() )
+	{
+		TraceCapture_RecordPointContents( vecAbsPosition, nContents );
+	}
+
 	if ( nContents & MASK_CURRENT )
 	{
 		nContents = CONTENTS_WATER;
@@ -794,6 +829,22 @@ int CEngineTrace::GetLeafContainingPoint( const Vector &vPos )
 }
 
 
+//-----------------------------------------------------------------------------
+// Concurrent trace phase. The world collision data is read only once a map is
+// loaded and traces get their scratch state from the TraceInfo pool, so the
+// only shared state left to freeze is the spatial partition.
+//-----------------------------------------------------------------------------
+void CEngineTrace::BeginConcurrentTracePhase()
+{
+	SpatialPartition()->BeginConcurrentQueries();
+}
+
+void CEngineTrace::EndConcurrentTracePhase()
+{
+	SpatialPartition()->EndConcurrentQueries();
+}
+
+
 
 //-----------------------------------------------------------------------------
 // Convex info for studio + brush models
@@ -933,20 +984,21 @@ bool CEngineTrace::ClipRayToBBox( const Ray_t &ray, unsigned int fMask, ICollide
 
 	VectorAligned vecAbsMins, vecAbsMaxs;
 	VectorAligned vecInvDelta;
-	// NOTE: If m_pRootMoveParent is set, then the boxes should be rotated into the root parent's space
-	if ( !ray.m_IsRay && m_pRootMoveParent )
+	// NOTE: If the root move parent is set, then the boxes should be rotated into the root parent's space
+	const matrix3x4_t *pRootMoveParent = GetRootMoveParent();
+	if ( !ray.m_IsRay && pRootMoveParent )
 	{
 		Ray_t ray_l;
 
 		ray_l.m_Extents = ray.m_Extents;
 
-		VectorIRotate( ray.m_Delta, *m_pRootMoveParent, ray_l.m_Delta );
+		VectorIRotate( ray.m_Delta, *pRootMoveParent, ray_l.m_Delta );
 		ray_l.m_StartOffset.Init();
-		VectorITransform( ray.m_Start, *m_pRootMoveParent, ray_l.m_Start );
+		VectorITransform( ray.m_Start, *pRootMoveParent, ray_l.m_Start );
 
 		vecInvDelta = ray_l.InvDelta();
 		Vector localEntityOrigin;
-		VectorITransform( pEntity->GetCollisionOrigin(), *m_pRootMoveParent, localEntityOrigin );
+		VectorITransform( pEntity->GetCollisionOrigin(), *pRootMoveParent, localEntityOrigin );
 		ray_l.m_IsRay = ray.m_IsRay;
 		ray_l.m_IsSwept = ray.m_IsSwept;
 
@@ -958,7 +1010,7 @@ bool CEngineTrace::ClipRayToBBox( const Ray_t &ray, unsigned int fMask, ICollide
 		{
 			Vector temp;
 			VectorCopy (pTrace->plane.normal, temp);
-			VectorRotate( temp, *m_pRootMoveParent, pTrace->plane.normal );
+			VectorRotate( temp, *pRootMoveParent, pTrace->plane.normal );
 			VectorAdd( ray.m_Start, ray.m_StartOffset, pTrace->startpos );
 
 			if (pTrace->fraction == 1)
@@ -1077,10 +1129,10 @@ void CEngineTrace::ClipRayToCollideable( const Ray_t &ray, unsigned int fMask, I
 		}
 	}
 
-	const matrix3x4_t *pOldRoot = m_pRootMoveParent;
+	const matrix3x4_t *pOldRoot = GetRootMoveParent();
 	if ( pEntity->GetSolidFlags() & FSOLID_ROOT_PARENT_ALIGNED )
 	{
-		m_pRootMoveParent = pEntity->GetRootParentToWorldTransform();
+		SetRootMoveParent( pEntity->GetRootParentToWorldTransform() );
 	}
 	bool bTraced = false;
 	bool bCustomPerformed = false;
@@ -1150,7 +1202,7 @@ void CEngineTrace::ClipRayToCollideable( const Ray_t &ray, unsigned int fMask, I
 	VectorMA( vecOffset, pTrace->fraction, ray.m_Delta, vecEndTest );
 	Assert( VectorsAreEqual( vecEndTest, pTrace->endpos, 0.1f ) );
 #endif
-	m_pRootMoveParent = pOldRoot;
+	SetRootMoveParent( pOldRoot );
 }
 
 
@@ -1647,6 +1699,28 @@ CON_COMMAND_EXTERN( ray_bench, RayBench, "Time the rays" )
 		}
 		Msg("RAY TEST: %d hits, %d misses, %.2fms   (%d rays, %d sweeps) (%d ray/prop, %d box/prop)\n", hit, miss, ms, point, swept, rayVsProp, boxVsProp );
 	}
+	{
+		// Full traces through the interface, one ray at a time and then in batches of eight
+		const int nBatchSize = 8;
+		trace_t traces[nBatchSize];
+		int nRays = s_BenchmarkRays.Count();
+
+		double tStart = Plat_FloatTime();
+		for ( int i = 0; i < nRays; i++ )
+		{
+			s_EngineTraceServer.TraceRay( s_BenchmarkRays[i], MASK_SOLID, NULL, &traces[0] );
+		}
+		double tSingle = Plat_FloatTime() - tStart;
+
+		tStart = Plat_FloatTime();
+		for ( int i = 0; i < nRays; i += nBatchSize )
+		{
+			s_EngineTraceServer.TraceRayBatch( &s_BenchmarkRays[i], MIN( nBatchSize, nRays - i ), MASK_SOLID, NULL, traces );
+		}
+		double tBatch = Plat_FloatTime() - tStart;
+
+		Msg("RAY BATCH TEST: TraceRay %.2fms, TraceRayBatch(%d) %.2fms\n", tSingle * 1000.0f, nBatchSize, tBatch * 1000.0f );
+	}
 #if VPROF_LEVEL > 0 
 	g_VProfCurrentProfile.MarkFrame();
 	g_VProfCurrentProfile.Stop();
@@ -1661,14 +1735,14 @@ CON_COMMAND_EXTERN( ray_bench, RayBench, "Time the rays" )
 void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace )
 {	
 #if defined _DEBUG && !defined SWDS
-	if( debugrayenable.GetBool() )
+	if( debugrayenable.GetBool() && ThreadInMainThread() )
 	{
 		s_FrameRays.AddToTail( ray );
 	}
 #endif
 
 #if BENCHMARK_RAY_TEST
-	if( s_BenchmarkRays.Count() < 15000 )
+	if( s_BenchmarkRays.Count() < 15000 && ThreadInMainThread() )
 	{
 		s_BenchmarkRays.EnsureCapacity(15000);
 		s_BenchmarkRays.AddToTail( ray );
@@ -1704,6 +1778,11 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 		CM_BoxTrace( ray, 0, fMask, true, *pTrace );
 		SetTraceEntity( pCollide, pTrace );
 
+		if ( TraceCapture_IsActive() )
+		{
+			TraceCapture_RecordRay( ray, fMask, pTraceFilter, pTrace );
+		}
+
 		// inside world, no need to check being inside anything else
 		if ( pTrace->startsolid )
 			return;
@@ -1714,6 +1793,11 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 	}
 	else
 	{
+		if ( TraceCapture_IsActive() )
+		{
+			TraceCapture_RecordRay( ray, fMask, pTraceFilter, NULL );
+		}
+
 		// Set initial start + endpos, necessary if the world isn't traced against 
 		// because we may not trace against *anything* below.
 		VectorAdd( ray.m_Start, ray.m_StartOffset, pTrace->startpos );
@@ -1751,6 +1835,42 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 	}
 
 	// Collide with entities along the ray
+	ClipRayToEntities( entityRay, fMask, pTraceFilter, pTrace );
+
+	// Fix up the fractions so they are appropriate given the original
+	// unclipped-to-world ray
+	pTrace->fraction *= flWorldFraction;
+	pTrace->fractionleftsolid *= flWorldFractionLeftSolidScale;
+
+#ifdef _DEBUG
+	Vector vecOffset, vecEndTest;
+	VectorAdd( ray.m_Start, ray.m_StartOffset, vecOffset );
+	VectorMA( vecOffset, pTrace->fractionleftsolid, ray.m_Delta, vecEndTest );
+	Assert( VectorsAreEqual( vecEndTest, pTrace->startpos, 0.1f ) );
+	VectorMA( vecOffset, pTrace->fraction, ray.m_Delta, vecEndTest );
+	Assert( VectorsAreEqual( vecEndTest, pTrace->endpos, 0.1f ) );
+//	Assert( !ray.m_IsRay || pTrace->allsolid || pTrace->fraction >= pTrace->fractionleftsolid );
+#endif
+
+	if ( !ray.m_IsRay )
+	{
+		// Make sure no fractionleftsolid can be used with box sweeps
+		VectorAdd( ray.m_Start, ray.m_StartOffset, pTrace->startpos );
+		pTrace->fractionleftsolid = 0;
+
+#ifdef _DEBUG
+		pTrace->fractionleftsolid = VEC_T_NAN;
+#endif
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Clips a trace that has already been run against the world to the entities
+// along the world-clipped ray
+//-----------------------------------------------------------------------------
+void CEngineTrace::ClipRayToEntities( const Ray_t &entityRay, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace )
+{
 	// FIXME: Hitbox code causes this to be re-entrant for the IK stuff.
 	// If we could eliminate that, this could be static and therefore
 	// not have to reallocate memory all the time
@@ -1808,34 +1928,485 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 		if (pTrace->allsolid)
 			break;
 	}
+}
 
-	// Fix up the fractions so they are appropriate given the original
-	// unclipped-to-world ray
-	pTrace->fraction *= flWorldFraction;
-	pTrace->fractionleftsolid *= flWorldFractionLeftSolidScale;
 
-#ifdef _DEBUG
-	Vector vecOffset, vecEndTest;
-	VectorAdd( ray.m_Start, ray.m_StartOffset, vecOffset );
-	VectorMA( vecOffset, pTrace->fractionleftsolid, ray.m_Delta, vecEndTest );
-	Assert( VectorsAreEqual( vecEndTest, pTrace->startpos, 0.1f ) );
-	VectorMA( vecOffset, pTrace->fraction, ray.m_Delta, vecEndTest );
-	Assert( VectorsAreEqual( vecEndTest, pTrace->endpos, 0.1f ) );
-//	Assert( !ray.m_IsRay || pTrace->allsolid || pTrace->fraction >= pTrace->fractionleftsolid );
+//-----------------------------------------------------------------------------
+// Computes the bounds swept by a ray, padded by flPad on every side
+//-----------------------------------------------------------------------------
+static void TraceBatch_RayBounds( const Ray_t &ray, float flPad, Vector &vecMins, Vector &vecMaxs )
+{
+	Vector vecEnd;
+	VectorAdd( ray.m_Start, ray.m_Delta, vecEnd );
+	VectorMin( ray.m_Start, vecEnd, vecMins );
+	VectorMax( ray.m_Start, vecEnd, vecMaxs );
+
+	Vector vecPad( flPad, flPad, flPad );
+	vecPad += ray.m_Extents;
+	vecMins -= vecPad;
+	vecMaxs += vecPad;
+}
+
+static inline float TraceBatch_BoxVolume( const Vector &vecMins, const Vector &vecMaxs )
+{
+	Vector vecSize;
+	VectorSubtract( vecMaxs, vecMins, vecSize );
+	return vecSize.x * vecSize.y * vecSize.z;
+}
+
+//-----------------------------------------------------------------------------
+// Four rays in SoA form, used to cull entity bounds against all of them at once
+//-----------------------------------------------------------------------------
+struct TraceBatchPacket_t
+{
+	FourVectors	m_vecStart;
+	FourVectors	m_vecInvDelta;
+	FourVectors	m_vecExtents;
+	int			m_nFirstRay;
+	int			m_nActiveMask;		// bit n set if lane n is a ray that still needs entity clipping
+};
+
+//-----------------------------------------------------------------------------
+// Returns a bit per lane for the rays whose swept box touches the box
+//-----------------------------------------------------------------------------
+static FORCEINLINE int TraceBatch_IntersectBox( const TraceBatchPacket_t &packet, const FourVectors &vecBoxMin, const FourVectors &vecBoxMax )
+{
+	fltx4 fl4Near = Four_Zeros;
+	fltx4 fl4Far = Four_Ones;
+	for ( int i = 0; i < 3; ++i )
+	{
+		fltx4 fl4Lo = MulSIMD( SubSIMD( SubSIMD( vecBoxMin[i], packet.m_vecExtents[i] ), packet.m_vecStart[i] ), packet.m_vecInvDelta[i] );
+		fltx4 fl4Hi = MulSIMD( SubSIMD( AddSIMD( vecBoxMax[i], packet.m_vecExtents[i] ), packet.m_vecStart[i] ), packet.m_vecInvDelta[i] );
+		fl4Near = MaxSIMD( fl4Near, MinSIMD( fl4Lo, fl4Hi ) );
+		fl4Far = MinSIMD( fl4Far, MaxSIMD( fl4Lo, fl4Hi ) );
+	}
+
+	return TestSignSIMD( CmpLeSIMD( fl4Near, fl4Far ) ) & packet.m_nActiveMask;
+}
+
+//-----------------------------------------------------------------------------
+// Traces a batch of rays that share a mask and filter
+//-----------------------------------------------------------------------------
+void CEngineTrace::TraceRayBatch( const Ray_t *pRays, int nRayCount, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTraces )
+{
+	VPROF( "CEngineTrace::TraceRayBatch" );
+
+	CTraceFilterHitAll traceFilter;
+	if ( !pTraceFilter )
+	{
+		pTraceFilter = &traceFilter;
+	}
+
+	// Nothing to share when there are no entities to test against
+	bool bShareEntities = trace_batch.GetBool() && ( pTraceFilter->GetTraceType() != TRACE_WORLD_ONLY );
+
+	int nFirst = 0;
+	while ( nFirst < nRayCount )
+	{
+		int nCount = MIN( nRayCount - nFirst, TRACE_BATCH_MAX_RAYS );
+
+		bool bCoherent = bShareEntities && ( nCount > 1 );
+		if ( bCoherent )
+		{
+			// Rays that fan out widely would pull in far more entities through one
+			// shared box than they would each find along their own path
+			Vector vecUnionMins( FLT_MAX, FLT_MAX, FLT_MAX );
+			Vector vecUnionMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+			float flRayVolume = 0.0f;
+			for ( int i = nFirst; i < nFirst + nCount; ++i )
+			{
+				Vector vecMins, vecMaxs;
+				TraceBatch_RayBounds( pRays[i], TRACE_BATCH_COHERENCE_PAD, vecMins, vecMaxs );
+				VectorMin( vecUnionMins, vecMins, vecUnionMins );
+				VectorMax( vecUnionMaxs, vecMaxs, vecUnionMaxs );
+				flRayVolume += TraceBatch_BoxVolume( vecMins, vecMaxs );
+			}
+
+			bCoherent = TraceBatch_BoxVolume( vecUnionMins, vecUnionMaxs ) <= flRayVolume * TRACE_BATCH_COHERENCE_RATIO;
+		}
+
+		if ( bCoherent )
+		{
+			TraceRayBatchCoherent( pRays + nFirst, nCount, fMask, pTraceFilter, pTraces + nFirst );
+		}
+		else
+		{
+			for ( int i = nFirst; i < nFirst + nCount; ++i )
+			{
+				TraceRay( pRays[i], fMask, pTraceFilter, &pTraces[i] );
+			}
+		}
+
+		nFirst += nCount;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Traces each ray against the world, then enumerates the spatial partition once
+// for all of them and clips every ray against the entities in its path. Mirrors
+// TraceRay step for step so the traces come out the same.
+//-----------------------------------------------------------------------------
+void CEngineTrace::TraceRayBatchCoherent( const Ray_t *pRays, int nRayCount, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTraces )
+{
+	Assert( nRayCount <= TRACE_BATCH_MAX_RAYS );
+
+	Ray_t entityRays[TRACE_BATCH_MAX_RAYS];
+	float flWorldFraction[TRACE_BATCH_MAX_RAYS];
+	float flWorldFractionLeftSolidScale[TRACE_BATCH_MAX_RAYS];
+	bool bClipToEntities[TRACE_BATCH_MAX_RAYS];
+
+	Vector vecUnionMins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecUnionMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	int nEntityRays = 0;
+
+	bool bTraceWorld = pTraceFilter->GetTraceType() != TRACE_ENTITIES_ONLY;
+	ICollideable *pWorldCollide = bTraceWorld ? GetWorldCollideable() : NULL;
+
+	for ( int i = 0; i < nRayCount; ++i )
+	{
+		const Ray_t &ray = pRays[i];
+		trace_t *pTrace = &pTraces[i];
+
+#if defined _DEBUG && !defined SWDS
+		if( debugrayenable.GetBool() && ThreadInMainThread() )
+		{
+			s_FrameRays.AddToTail( ray );
+		}
 #endif
+		VPROF_INCREMENT_COUNTER( "TraceRay", 1 );
+		m_traceStatCounters[TRACE_STAT_COUNTER_TRACERAY]++;
 
-	if ( !ray.m_IsRay )
+		CM_ClearTrace( pTrace );
+		bClipToEntities[i] = false;
+
+		if ( bTraceWorld )
+		{
+			Assert( pWorldCollide );
+			CM_BoxTrace( ray, 0, fMask, true, *pTrace );
+			SetTraceEntity( pWorldCollide, pTrace );
+
+			if ( TraceCapture_IsActive() )
+			{
+				TraceCapture_RecordRay( ray, fMask, pTraceFilter, pTrace );
+			}
+
+			// inside world, no need to check being inside anything else
+			if ( pTrace->startsolid )
+				continue;
+		}
+		else
+		{
+			if ( TraceCapture_IsActive() )
+			{
+				TraceCapture_RecordRay( ray, fMask, pTraceFilter, NULL );
+			}
+
+			VectorAdd( ray.m_Start, ray.m_StartOffset, pTrace->startpos );
+			VectorAdd( pTrace->startpos, ray.m_Delta, pTrace->endpos );
+		}
+
+		flWorldFraction[i] = pTrace->fraction;
+		flWorldFractionLeftSolidScale[i] = pTrace->fraction;
+
+		Ray_t &entityRay = entityRays[i];
+		entityRay = ray;
+		if ( pTrace->fraction == 0 )
+		{
+			entityRay.m_Delta.Init();
+			flWorldFractionLeftSolidScale[i] = pTrace->fractionleftsolid;
+			pTrace->fractionleftsolid = 1.0f;
+			pTrace->fraction = 1.0f;
+		}
+		else
+		{
+			// Same quantization as TraceRay, see the comment there
+			Vector end;
+			VectorMA( entityRay.m_Start, pTrace->fraction, entityRay.m_Delta, end );
+			VectorSubtract( end, entityRay.m_Start, entityRay.m_Delta );
+			pTrace->fractionleftsolid /= pTrace->fraction;
+			pTrace->fraction = 1.0;
+		}
+
+		Vector vecMins, vecMaxs;
+		TraceBatch_RayBounds( entityRay, 0.0f, vecMins, vecMaxs );
+		VectorMin( vecUnionMins, vecMins, vecUnionMins );
+		VectorMax( vecUnionMaxs, vecMaxs, vecUnionMaxs );
+
+		bClipToEntities[i] = true;
+		++nEntityRays;
+	}
+
+	if ( nEntityRays )
 	{
-		// Make sure no fractionleftsolid can be used with box sweeps
-		VectorAdd( ray.m_Start, ray.m_StartOffset, pTrace->startpos );
-		pTrace->fractionleftsolid = 0;
+		// One partition query for the whole batch
+		CEntityListAlongRay enumerator;
+		enumerator.Reset();
+		SpatialPartition()->EnumerateElementsInBox( SpatialPartitionMask(), vecUnionMins, vecUnionMaxs, false, &enumerator );
+
+		if ( enumerator.Count() >= CEntityListAlongRay::MAX_ENTITIES_ALONGRAY )
+		{
+			// The shared list got truncated, so it may be missing entities a single ray would have
+			// found. The world traces are already done and captured, so only the entity pass is redone.
+			for ( int i = 0; i < nRayCount; ++i )
+			{
+				if ( bClipToEntities[i] )
+				{
+					ClipRayToEntities( entityRays[i], fMask, pTraceFilter, &pTraces[i] );
+				}
+			}
+			nEntityRays = 0;
+		}
+
+		// Pack the rays four at a time for the bounds test
+		TraceBatchPacket_t packets[TRACE_BATCH_MAX_RAYS / 4];
+		int nPackets = 0;
+		for ( int i = 0; i < nRayCount; i += 4 )
+		{
+			TraceBatchPacket_t &packet = packets[nPackets++];
+			packet.m_nFirstRay = i;
+			packet.m_nActiveMask = 0;
+
+			VectorAligned vecStart[4], vecInvDelta[4], vecExtents[4];
+			for ( int j = 0; j < 4; ++j )
+			{
+				// Lanes past the end repeat the last ray and stay masked off
+				int nRay = MIN( i + j, nRayCount - 1 );
+				const Ray_t &entityRay = entityRays[nRay];
+				if ( ( i + j < nRayCount ) && bClipToEntities[i + j] )
+				{
+					packet.m_nActiveMask |= ( 1 << j );
+				}
+
+				if ( !bClipToEntities[nRay] )
+				{
+					vecStart[j].Init();
+					vecInvDelta[j].Init();
+					vecExtents[j].Init();
+					continue;
+				}
+
+				vecStart[j] = entityRay.m_Start;
+				vecExtents[j] = entityRay.m_Extents;
+				for ( int k = 0; k < 3; ++k )
+				{
+					vecInvDelta[j][k] = ( entityRay.m_Delta[k] != 0.0f ) ? 1.0f / entityRay.m_Delta[k] : FLT_MAX;
+				}
+			}
+
+			packet.m_vecStart.LoadAndSwizzle( vecStart[0], vecStart[1], vecStart[2], vecStart[3] );
+			packet.m_vecInvDelta.LoadAndSwizzle( vecInvDelta[0], vecInvDelta[1], vecInvDelta[2], vecInvDelta[3] );
+			packet.m_vecExtents.LoadAndSwizzle( vecExtents[0], vecExtents[1], vecExtents[2], vecExtents[3] );
+		}
+
+		bool bNoStaticProps = pTraceFilter->GetTraceType() == TRACE_ENTITIES_ONLY;
+		bool bFilterStaticProps = pTraceFilter->GetTraceType() == TRACE_EVERYTHING_FILTER_PROPS;
+
+		// Entity bounds are widened a touch so the packet test can only over-include
+		fltx4 fl4BoundsPad = ReplicateX4( 1.0f );
+
+		trace_t tr;
+		ICollideable *pCollideable;
+		const char *pDebugName;
+		int nCount = enumerator.Count();
+		for ( int iEntity = 0; iEntity < nCount && nEntityRays; ++iEntity )
+		{
+			IHandleEntity *pHandleEntity = enumerator.m_EntityHandles[iEntity];
+			HandleEntityToCollideable( pHandleEntity, &pCollideable, &pDebugName );
+
+			Vector vecEntityMins, vecEntityMaxs;
+			pCollideable->WorldSpaceSurroundingBounds( &vecEntityMins, &vecEntityMaxs );
+
+			FourVectors vecBoxMin, vecBoxMax;
+			vecBoxMin.DuplicateVector( vecEntityMins );
+			vecBoxMax.DuplicateVector( vecEntityMaxs );
+			for ( int k = 0; k < 3; ++k )
+			{
+				vecBoxMin[k] = SubSIMD( vecBoxMin[k], fl4BoundsPad );
+				vecBoxMax[k] = AddSIMD( vecBoxMax[k], fl4BoundsPad );
+			}
+
+			bool bFiltered = false;
+			for ( int iPacket = 0; iPacket < nPackets; ++iPacket )
+			{
+				TraceBatchPacket_t &packet = packets[iPacket];
+				int nHitMask = TraceBatch_IntersectBox( packet, vecBoxMin, vecBoxMax );
+				if ( !nHitMask )
+					continue;
+
+				// The filter only runs once per entity, and only for entities some ray actually reaches
+				if ( !bFiltered )
+				{
+					bFiltered = true;
+
+					if ( IsPC() && IsDebug() && !IsSolid( pCollideable->GetSolid(), pCollideable->GetSolidFlags() ) )
+					{
+						Assert( 0 );
+						Msg( "%s in solid list (not solid)\n", pDebugName );
+						break;
+					}
+
+					if ( !StaticPropMgr()->IsStaticProp( pHandleEntity ) )
+					{
+						if ( !pTraceFilter->ShouldHitEntity( pHandleEntity, fMask ) )
+							break;
+					}
+					else
+					{
+						if ( bNoStaticProps )
+							break;
+
+						if ( bFilterStaticProps )
+						{
+							if ( !pTraceFilter->ShouldHitEntity( pHandleEntity, fMask ) )
+								break;
+						}
+					}
+				}
+
+				for ( int j = 0; j < 4; ++j )
+				{
+					if ( !( nHitMask & ( 1 << j ) ) )
+						continue;
+
+					int nRay = packet.m_nFirstRay + j;
+					ClipRayToCollideable( entityRays[nRay], fMask, pCollideable, &tr );
+
+					// Make sure the ray is always shorter than it currently is
+					ClipTraceToTrace( tr, &pTraces[nRay] );
+
+					// Stop if we're in allsolid
+					if ( pTraces[nRay].allsolid )
+					{
+						packet.m_nActiveMask &= ~( 1 << j );
+						--nEntityRays;
+					}
+				}
+			}
+		}
+	}
+
+	for ( int i = 0; i < nRayCount; ++i )
+	{
+		// Rays that started solid in the world were finished by the world trace
+		if ( !bClipToEntities[i] )
+			continue;
+
+		const Ray_t &ray = pRays[i];
+		trace_t *pTrace = &pTraces[i];
+
+		// Fix up the fractions so they are appropriate given the original
+		// unclipped-to-world ray
+		pTrace->fraction *= flWorldFraction[i];
+		pTrace->fractionleftsolid *= flWorldFractionLeftSolidScale[i];
+
+		if ( !ray.m_IsRay )
+		{
+			// Make sure no fractionleftsolid can be used with box sweeps
+			VectorAdd( ray.m_Start, ray.m_StartOffset, pTrace->startpos );
+			pTrace->fractionleftsolid = 0;
 
 #ifdef _DEBUG
-		pTrace->fractionleftsolid = VEC_T_NAN;
+			pTrace->fractionleftsolid = VEC_T_NAN;
 #endif
+		}
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Times TraceRayBatch against TraceRay on fans of rays fired from random open
+// spots of the current map, and checks that both give the same traces
+//-----------------------------------------------------------------------------
+CON_COMMAND( trace_batch_bench, "Times TraceRay against TraceRayBatch on pellet-like fans of rays across the current map. Arguments: [fans] [rays per fan] [spread in degrees]" )
+{
+	if ( !sv.IsActive() || !host_state.worldmodel )
+	{
+		Msg( "trace_batch_bench: no map is running\n" );
+		return;
+	}
+
+	int nFans = ( args.ArgC() > 1 ) ? clamp( atoi( args[1] ), 1, 100000 ) : 2000;
+	int nRaysPerFan = ( args.ArgC() > 2 ) ? clamp( atoi( args[2] ), 1, TRACE_BATCH_MAX_RAYS ) : 8;
+	float flSpread = ( args.ArgC() > 3 ) ? clamp( (float)atof( args[3] ), 0.0f, 45.0f ) : 5.0f;
+	float flSpreadTan = tanf( DEG2RAD( flSpread ) );
+
+	// Fixed seed so runs before and after a change trace the same rays
+	CUniformRandomStream random;
+	random.SetSeed( 0x2e8 );
+
+	const Vector &vecWorldMins = host_state.worldmodel->mins;
+	const Vector &vecWorldMaxs = host_state.worldmodel->maxs;
+	CUtlVector<Ray_t> rays;
+	rays.EnsureCapacity( nFans * nRaysPerFan );
+	for ( int nAttempts = 0; ( rays.Count() < nFans * nRaysPerFan ) && ( nAttempts < nFans * 100 ); ++nAttempts )
+	{
+		Vector vecStart( random.RandomFloat( vecWorldMins.x, vecWorldMaxs.x ),
+			random.RandomFloat( vecWorldMins.y, vecWorldMaxs.y ),
+			random.RandomFloat( vecWorldMins.z, vecWorldMaxs.z ) );
+		if ( s_EngineTraceServer.GetPointContents( vecStart, NULL ) & MASK_SOLID )
+			continue;
+
+		QAngle angles( random.RandomFloat( -30.0f, 30.0f ), random.RandomFloat( 0.0f, 360.0f ), 0.0f );
+		Vector vecForward, vecRight, vecUp;
+		AngleVectors( angles, &vecForward, &vecRight, &vecUp );
+		for ( int i = 0; i < nRaysPerFan; ++i )
+		{
+			Vector vecDir = vecForward + vecRight * ( flSpreadTan * random.RandomFloat( -1.0f, 1.0f ) ) + vecUp * ( flSpreadTan * random.RandomFloat( -1.0f, 1.0f ) );
+			VectorNormalize( vecDir );
+
+			// Every other ray is a small hull, like FireBullets pellets
+			Ray_t &ray = rays[ rays.AddToTail() ];
+			if ( i % 2 )
+			{
+				ray.Init( vecStart, vecStart + vecDir * MAX_TRACE_LENGTH, Vector( -3, -3, -3 ), Vector( 3, 3, 3 ) );
+			}
+			else
+			{
+				ray.Init( vecStart, vecStart + vecDir * MAX_TRACE_LENGTH );
+			}
+		}
+	}
+
+	nFans = rays.Count() / nRaysPerFan;
+	if ( !nFans )
+	{
+		Msg( "trace_batch_bench: couldn't find any open space to trace from\n" );
+		return;
+	}
+
+	CUtlVector<trace_t> singleTraces, batchTraces;
+	singleTraces.SetCount( rays.Count() );
+	batchTraces.SetCount( rays.Count() );
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < rays.Count(); ++i )
+	{
+		s_EngineTraceServer.TraceRay( rays[i], MASK_SHOT, NULL, &singleTraces[i] );
+	}
+	double flSingle = Plat_FloatTime() - flStart;
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nFans; ++i )
+	{
+		s_EngineTraceServer.TraceRayBatch( &rays[i * nRaysPerFan], nRaysPerFan, MASK_SHOT, NULL, &batchTraces[i * nRaysPerFan] );
+	}
+	double flBatch = Plat_FloatTime() - flStart;
+
+	int nMismatches = 0;
+	for ( int i = 0; i < rays.Count(); ++i )
+	{
+		const trace_t &single = singleTraces[i];
+		const trace_t &batch = batchTraces[i];
+		if ( single.fraction != batch.fraction || single.startsolid != batch.startsolid || single.allsolid != batch.allsolid ||
+			single.m_pEnt != batch.m_pEnt || single.endpos != batch.endpos )
+		{
+			++nMismatches;
+		}
+	}
+
+	Msg( "trace_batch_bench: %d fans of %d rays, %.1f degree spread\n", nFans, nRaysPerFan, flSpread );
+	Msg( "  TraceRay %.2fms, TraceRayBatch %.2fms (%.2fx), %d mismatched traces\n",
+		flSingle * 1000.0, flBatch * 1000.0, ( flBatch > 0.0 ) ? flSingle / flBatch : 0.0, nMismatches );
+}
 
 //-----------------------------------------------------------------------------
 // A version that sweeps a collideable through the world
@@ -1844,16 +2415,28 @@ void CEngineTrace::SweepCollideable( ICollideable *pCollide,
 		const Vector &vecAbsStart, const Vector &vecAbsEnd, const QAngle &vecAngles,
 		unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace )
 {
-	const matrix3x4_t *pOldRoot = m_pRootMoveParent;
+	const matrix3x4_t *pOldRoot = GetRootMoveParent();
 	Ray_t ray;
 	Assert( vecAngles == vec3_angle );
 	if ( pCollide->GetSolidFlags() & FSOLID_ROOT_PARENT_ALIGNED )
 	{
-		m_pRootMoveParent = pCollide->GetRootParentToWorldTransform();
+		SetRootMoveParent( pCollide->GetRootParentToWorldTransform() );
 	}
 	ray.Init( vecAbsStart, vecAbsEnd, pCollide->OBBMins(), pCollide->OBBMaxs() );
+
+	bool bCaptureSweep = TraceCapture_IsActive();
+	if ( bCaptureSweep )
+	{
+		TraceCapture_BeginSweep();
+	}
+
 	TraceRay( ray, fMask, pTraceFilter, pTrace );
-	m_pRootMoveParent = pOldRoot;
+
+	if ( bCaptureSweep )
+	{
+		TraceCapture_EndSweep();
+	}
+	SetRootMoveParent( pOldRoot );
 }
 
 
@@ -68,6 +68,7 @@
 #include "tier0/vcrmode.h"
 #include "traceinit.h"
 #include "host_saverestore.h"
+#include "maploadgraph.h"
 #include "l_studio.h"
 #include "cl_demo.h"
 #include "cdll_engine_int.h"
@@ -83,6 +84,8 @@
 #include "testscriptmgr.h"
 #include "tmessage.h"
 #include "tier0/vprof.h"
+#include "tier0/framearena.h"
+#include "host_hitch.h"
 #include "tier0/icommandline.h"
 #include "materialsystem/imaterialsystemhardwareconfig.h"
 #include "MapReslistGenerator.h"
@@ -906,6 +909,14 @@ void Host_Error (const char *error, ...)
 	char		string[1024];
 	static	bool inerror = false;
 
+	va_start (argptr,error);
+	Q_vsnprintf(string,sizeof(string),error,argptr);
+	va_end (argptr);
+
+	// A lump loader in a threaded map load, which returns and leaves the main thread to raise it
+	if ( MapLoadGraph_DeferHostError( string ) )
+		return;
+
 	DebuggerBreakIfDebugging_StagingOnly();
 
 	g_HostErrorCount++;
@@ -920,10 +931,6 @@ void Host_Error (const char *error, ...)
 	//	CL_WriteMessageHistory();	TODO must be done by network layer
 #endif
 
-	va_start (argptr,error);
-	Q_vsnprintf(string,sizeof(string),error,argptr);
-	va_end (argptr);
-
 	if ( sv.IsDedicated() )
 	{
 		// dedicated servers just exit
@@ -2664,6 +2671,9 @@ void _Host_RunFrame_Server( bool finaltick )
 	VPROF_INCREMENT_COUNTER( "ticks", 1 );
 	tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "%s", __FUNCTION__ );
 
+	// Temporaries of the previous tick on this thread are done with
+	FrameArena_Reset();
+
 	// Run the Server frame ( read, run physics, respond )
 	g_HostTimes.StartFrameSegment( FRAME_SEGMENT_SERVER );
 	SV_Frame ( finaltick );
@@ -3052,6 +3062,8 @@ void _Host_RunFrame (float time)
 	double prevremainder;
 	bool shouldrender;
 
+	Host_HitchBeginFrame();
+
 #if defined( RAD_TELEMETRY_ENABLED )
 	if( g_Telemetry.DemoTickEnd == ( uint32 )-1 )
 	{
@@ -3582,6 +3594,8 @@ void _Host_RunFrame (float time)
 	} // Profile scope, protect from setjmp() problems
 
 	Host_ShowIPCCallCount();
+
+	Host_HitchEndFrame( numticks );
 }
 /*
 ==============================
@@ -4792,6 +4806,8 @@ void Host_FreeStateAndWorld( bool server )
 	}
 #endif
 
+	modelloader->BeginLevelChange();
+
 	// The world model relies on the low hunk, so we need to force it to unload
 	if ( host_state.worldmodel )
 	{
@@ -40,6 +40,7 @@
 #include "sys_dll.h"
 #include "cmd.h"
 #include "tier0/icommandline.h"
+#include "tier0/sharedassets.h"
 #include "filesystem.h"
 #include "filesystem_engine.h"
 #include "icliententitylist.h"
@@ -2283,6 +2284,22 @@ CON_COMMAND( cache_print_summary, "cache_print_summary [section]\nPrint out a su
 	g_pDataCache->OutputReport( DC_SUMMARY_REPORT, pszSection );
 }
 
+CON_COMMAND( cache_print_shared, "Print how much model data this process shares with other processes on the host." )
+{
+	if ( !SharedAssets_Enabled() )
+	{
+		ConMsg( "Asset sharing is off, run with -sharedassets to share model data between servers on a host.\n" );
+		return;
+	}
+
+	SharedAssetStats_t stats;
+	SharedAssets_GetStats( &stats );
+	ConMsg( "Shared assets: %d mapped (%d published here), %.2f MB\n", stats.nMapped, stats.nPublished, stats.nMappedBytes / ( 1024.0f * 1024.0f ) );
+	ConMsg( "   resident shared  %.2f MB\n", stats.nSharedBytes / ( 1024.0f * 1024.0f ) );
+	ConMsg( "   resident private %.2f MB\n", stats.nPrivateBytes / ( 1024.0f * 1024.0f ) );
+	ConMsg( "   kept private     %d, %.2f MB\n", stats.nFallbacks, stats.nFallbackBytes / ( 1024.0f * 1024.0f ) );
+}
+
 CON_COMMAND( sv_dump_edicts, "Display a list of edicts allocated on the server." )
 {
 	if ( !sv.IsActive() )
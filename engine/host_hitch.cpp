@@ -0,0 +1,288 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Automatic capture of slow host frames
+//
+// With host_hitch_capture on the VProf trace runs all the time, and every host
+// frame leaves a record of how long it took and what the server looked like
+// in a ring. When a frame takes longer than host_hitch_threshold tick
+// intervals, the frames around it are written to hitches/ as Chrome trace
+// JSON: the VProf scopes and jobs of every thread, plus a track of host frames
+// and counters for entities, clients, thinking entities and network traffic.
+// chrome://tracing and Perfetto open the files.
+//
+// Writing happens on the thread pool, and no more often than
+// host_hitch_min_interval allows, so a server that keeps hitching doesn't
+// spend its time writing about it.
+//
+//=============================================================================//
+
+#include "host_hitch.h"
+#include "host.h"
+#include "server.h"
+#include "convar.h"
+#include "filesystem_engine.h"
+#include "inetchannel.h"
+#include "tier0/vprof.h"
+#include "tier0/vproftrace.h"
+#include "tier1/utlbuffer.h"
+#include "vstdlib/jobthread.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define HITCH_HISTORY_FRAMES	128
+#define HITCH_MAX_FRAMES_AFTER	16
+
+static void HitchCaptureChanged( IConVar *pConVar, const char *pOldValue, float flOldValue );
+
+static ConVar host_hitch_capture( "host_hitch_capture", "0", 0, "Keep a trace of recent host frames and write it to hitches/ when a frame is slow", HitchCaptureChanged );
+static ConVar host_hitch_threshold( "host_hitch_threshold", "4", 0, "Host frames longer than this many tick intervals are written out by host_hitch_capture", true, 1.0f, false, 0.0f );
+static ConVar host_hitch_frames_before( "host_hitch_frames_before", "32", 0, "Frames before a hitch that get written out with it", true, 1.0f, true, HITCH_HISTORY_FRAMES - HITCH_MAX_FRAMES_AFTER - 1 );
+static ConVar host_hitch_frames_after( "host_hitch_frames_after", "8", 0, "Frames after a hitch that get written out with it", true, 0.0f, true, HITCH_MAX_FRAMES_AFTER );
+static ConVar host_hitch_min_interval( "host_hitch_min_interval", "60", 0, "Seconds after writing out a hitch before another one is written", true, 0.0f, false, 0.0f );
+static ConVar host_hitch_max_dumps( "host_hitch_max_dumps", "20", 0, "Most hitches written out in one run, 0 for no limit", true, 0.0f, false, 0.0f );
+
+struct HitchFrame_t
+{
+	uint64	m_nStartStamp;
+	uint64	m_nEndStamp;
+	float	m_flDuration;		// Seconds
+	int		m_nTicks;
+	int		m_nTickCount;
+	int		m_nEntities;
+	int		m_nClients;
+	int		m_nThinkers;
+	float	m_flNetIn;			// Bytes per second, all clients
+	float	m_flNetOut;
+	float	m_flMaxLatency;		// Seconds, worst client
+	float	m_flMaxLoss;		// 0..1, worst client
+};
+
+// Everything the write job needs, the ring keeps moving while it runs
+struct HitchDump_t
+{
+	HitchFrame_t	m_Frames[HITCH_HISTORY_FRAMES];
+	int				m_nFrames;
+	int				m_iHitch;
+	float			m_flTickInterval;
+	float			m_flThreshold;
+	char			m_szMapName[64];
+	char			m_szFilename[MAX_PATH];
+};
+
+static HitchFrame_t s_Frames[HITCH_HISTORY_FRAMES];
+static int s_nFrames;					// Recorded since capture started
+static int s_nHitchFrame = -1;			// Waiting for its frames after
+static int s_nDumps;
+static double s_flLastDumpTime = -1.0;
+static CInterlockedInt s_nDumpsInFlight;
+
+static uint64 s_nFrameStartStamp;
+static double s_flFrameStartTime;
+static int s_nFrameSpawnCount;
+
+// The game adds to this counter as it runs think functions
+static int *s_pThinkCounter;
+
+static void HitchCaptureChanged( IConVar *pConVar, const char *pOldValue, float flOldValue )
+{
+	// The trace counts its users, vprof_trace can have it on as well
+	static bool s_bTracing;
+	if ( s_bTracing != host_hitch_capture.GetBool() )
+	{
+		s_bTracing = host_hitch_capture.GetBool();
+		VProfTrace_Enable( s_bTracing );
+	}
+	s_nFrames = 0;
+	s_nHitchFrame = -1;
+	s_nFrameStartStamp = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Chrome trace events for the host frames, timed like the VProf trace
+//-----------------------------------------------------------------------------
+static void HitchWriteToBuffer( const char *pData, int nLength, void *pContext )
+{
+	( (CUtlBuffer *)pContext )->Put( pData, nLength );
+}
+
+// Quoted and escaped the way the trace writer does scope names
+static void HitchPutJSONString( CUtlBuffer &buf, const char *pszString )
+{
+	buf.PutChar( '"' );
+	for ( const char *p = pszString; *p; ++p )
+	{
+		if ( *p == '"' || *p == '\\' )
+		{
+			buf.PutChar( '\\' );
+			buf.PutChar( *p );
+		}
+		else if ( (uint8)*p < ' ' )
+		{
+			buf.Printf( "\\u%04x", (uint8)*p );
+		}
+		else
+		{
+			buf.PutChar( *p );
+		}
+	}
+	buf.PutChar( '"' );
+}
+
+static void HitchWriteDump( HitchDump_t *pDump )
+{
+	uint64 nStartStamp = pDump->m_Frames[0].m_nStartStamp;
+	double flMicrosecondsPerTick = 1000000.0 / VProfTrace_GetTicksPerSecond();
+	const HitchFrame_t &hitch = pDump->m_Frames[pDump->m_iHitch];
+
+	CUtlBuffer otherData( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	otherData.PutString( "\"map\":" );
+	HitchPutJSONString( otherData, pDump->m_szMapName );
+	otherData.Printf( ",\"tick_interval_ms\":%.3f,\"threshold_ticks\":%.2f,\"hitch_ms\":%.3f,\"hitch_tick\":%d,\"frames\":%d",
+		pDump->m_flTickInterval * 1000.0f, pDump->m_flThreshold, hitch.m_flDuration * 1000.0f, hitch.m_nTickCount, pDump->m_nFrames );
+	otherData.PutChar( 0 );
+
+	CUtlBuffer events( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	events.Printf( "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"Host frames\"}}" );
+	for ( int i = 0; i < pDump->m_nFrames; i++ )
+	{
+		const HitchFrame_t &frame = pDump->m_Frames[i];
+		double flStart = ( frame.m_nStartStamp - nStartStamp ) * flMicrosecondsPerTick;
+		double flDuration = ( frame.m_nEndStamp - frame.m_nStartStamp ) * flMicrosecondsPerTick;
+
+		events.Printf( ",\n{\"name\":\"Frame\",\"cat\":\"host\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"tick\":%d,\"ticks\":%d}}",
+			flStart, flDuration, frame.m_nTickCount, frame.m_nTicks );
+		events.Printf( ",\n{\"name\":\"Frame ms\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,\"args\":{\"ms\":%.3f}}",
+			flStart, frame.m_flDuration * 1000.0f );
+		events.Printf( ",\n{\"name\":\"Server\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,\"args\":{\"entities\":%d,\"clients\":%d,\"thinking entities\":%d}}",
+			flStart, frame.m_nEntities, frame.m_nClients, frame.m_nThinkers );
+		events.Printf( ",\n{\"name\":\"Network kB/s\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,\"args\":{\"in\":%.2f,\"out\":%.2f}}",
+			flStart, frame.m_flNetIn / 1024.0f, frame.m_flNetOut / 1024.0f );
+		events.Printf( ",\n{\"name\":\"Worst client\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,\"args\":{\"latency ms\":%.1f,\"loss %%\":%.1f}}",
+			flStart, frame.m_flMaxLatency * 1000.0f, frame.m_flMaxLoss * 100.0f );
+	}
+	events.Printf( ",\n{\"name\":\"Hitch\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":0,\"ts\":%.3f}",
+		( hitch.m_nStartStamp - nStartStamp ) * flMicrosecondsPerTick );
+	events.PutChar( 0 );
+
+	CUtlBuffer buf;
+	VProfTrace_WriteChromeTraceFrom( nStartStamp, (const char *)events.Base(), (const char *)otherData.Base(), HitchWriteToBuffer, &buf );
+
+	g_pFileSystem->CreateDirHierarchy( "hitches", "DEFAULT_WRITE_PATH" );
+	if ( !g_pFileSystem->WriteFile( pDump->m_szFilename, "DEFAULT_WRITE_PATH", buf ) )
+	{
+		Warning( "Couldn't write hitch capture %s\n", pDump->m_szFilename );
+	}
+
+	delete pDump;
+	--s_nDumpsInFlight;
+}
+
+static bool HitchCanDump()
+{
+	if ( s_nDumpsInFlight > 0 )
+		return false;
+
+	if ( host_hitch_max_dumps.GetInt() && s_nDumps >= host_hitch_max_dumps.GetInt() )
+		return false;
+
+	return ( s_flLastDumpTime < 0.0 || Plat_FloatTime() - s_flLastDumpTime >= host_hitch_min_interval.GetFloat() );
+}
+
+static void HitchStartDump()
+{
+	const HitchFrame_t &hitch = s_Frames[s_nHitchFrame % HITCH_HISTORY_FRAMES];
+
+	HitchDump_t *pDump = new HitchDump_t;
+	int nFirst = MAX( s_nHitchFrame - host_hitch_frames_before.GetInt(), MAX( s_nFrames - HITCH_HISTORY_FRAMES, 0 ) );
+	pDump->m_nFrames = s_nFrames - nFirst;
+	pDump->m_iHitch = s_nHitchFrame - nFirst;
+	for ( int i = 0; i < pDump->m_nFrames; i++ )
+	{
+		pDump->m_Frames[i] = s_Frames[( nFirst + i ) % HITCH_HISTORY_FRAMES];
+	}
+	pDump->m_flTickInterval = host_state.interval_per_tick;
+	pDump->m_flThreshold = host_hitch_threshold.GetFloat();
+	V_strcpy_safe( pDump->m_szMapName, sv.GetMapName() );
+	V_sprintf_safe( pDump->m_szFilename, "hitches/hitch_%s_%d.json", sv.GetMapName()[0] ? sv.GetMapName() : "nomap", hitch.m_nTickCount );
+
+	ConMsg( "Hitch of %.1f ms at tick %d, writing %s\n", hitch.m_flDuration * 1000.0f, hitch.m_nTickCount, pDump->m_szFilename );
+
+	s_nHitchFrame = -1;
+	s_nDumps++;
+	s_flLastDumpTime = Plat_FloatTime();
+	++s_nDumpsInFlight;
+	g_pThreadPool->QueueCall( &HitchWriteDump, pDump )->Release();
+}
+
+//-----------------------------------------------------------------------------
+// Frame records
+//-----------------------------------------------------------------------------
+void Host_HitchBeginFrame()
+{
+	if ( !host_hitch_capture.GetBool() )
+		return;
+
+	if ( !s_pThinkCounter )
+	{
+		s_pThinkCounter = g_VProfCurrentProfile.FindOrCreateCounter( "thinking entities", COUNTER_GROUP_NO_RESET );
+	}
+	*s_pThinkCounter = 0;
+
+	s_nFrameStartStamp = Plat_Rdtsc();
+	s_flFrameStartTime = Plat_FloatTime();
+	s_nFrameSpawnCount = sv.GetSpawnCount();
+}
+
+void Host_HitchEndFrame( int nTicks )
+{
+	if ( !host_hitch_capture.GetBool() || !s_nFrameStartStamp )
+		return;
+
+	HitchFrame_t &frame = s_Frames[s_nFrames % HITCH_HISTORY_FRAMES];
+	frame.m_nStartStamp = s_nFrameStartStamp;
+	frame.m_nEndStamp = Plat_Rdtsc();
+	frame.m_flDuration = Plat_FloatTime() - s_flFrameStartTime;
+	frame.m_nTicks = nTicks;
+	frame.m_nTickCount = sv.m_nTickCount;
+	frame.m_nEntities = sv.num_edicts - sv.free_edicts;
+	frame.m_nClients = sv.GetNumClients();
+	frame.m_nThinkers = *s_pThinkCounter;
+	frame.m_flNetIn = frame.m_flNetOut = 0.0f;
+	frame.m_flMaxLatency = frame.m_flMaxLoss = 0.0f;
+	for ( int i = 0; i < sv.GetClientCount(); i++ )
+	{
+		IClient *pClient = sv.GetClient( i );
+		INetChannel *pNetChannel = ( pClient->IsConnected() && !pClient->IsFakeClient() ) ? pClient->GetNetChannel() : NULL;
+		if ( !pNetChannel )
+			continue;
+
+		frame.m_flNetIn += pNetChannel->GetAvgData( FLOW_INCOMING );
+		frame.m_flNetOut += pNetChannel->GetAvgData( FLOW_OUTGOING );
+		frame.m_flMaxLatency = MAX( frame.m_flMaxLatency, pNetChannel->GetAvgLatency( FLOW_OUTGOING ) );
+		frame.m_flMaxLoss = MAX( frame.m_flMaxLoss, pNetChannel->GetAvgLoss( FLOW_INCOMING ) );
+	}
+	s_nFrames++;
+
+	if ( s_nHitchFrame >= 0 )
+	{
+		if ( s_nFrames - 1 - s_nHitchFrame >= host_hitch_frames_after.GetInt() )
+		{
+			HitchStartDump();
+		}
+		return;
+	}
+
+	// Loading a map is slow on purpose
+	if ( !sv.IsActive() || sv.GetSpawnCount() != s_nFrameSpawnCount )
+		return;
+
+	if ( frame.m_flDuration > host_hitch_threshold.GetFloat() * host_state.interval_per_tick && HitchCanDump() )
+	{
+		s_nHitchFrame = s_nFrames - 1;
+		if ( !host_hitch_frames_after.GetInt() )
+		{
+			HitchStartDump();
+		}
+	}
+}
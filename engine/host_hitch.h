@@ -0,0 +1,17 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Automatic capture of slow host frames
+//
+//=============================================================================//
+
+#ifndef HOST_HITCH_H
+#define HOST_HITCH_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+// Bracket every host frame, they do nothing unless host_hitch_capture is on
+void Host_HitchBeginFrame();
+void Host_HitchEndFrame( int nTicks );
+
+#endif // HOST_HITCH_H
@@ -23,6 +23,13 @@ public:
 	virtual void Init( const Vector& worldmin, const Vector& worldmax ) = 0;
 
 	virtual void DrawDebugOverlays() = 0;
+
+	// Between these calls nothing may be inserted, removed or moved, and queries
+	// can be made from any thread. Query callbacks run once in Begin instead of
+	// around every query. Both must be called from the main thread; they nest.
+	virtual void BeginConcurrentQueries() = 0;
+	virtual void EndConcurrentQueries() = 0;
+	virtual bool IsInConcurrentQueries() const = 0;
 };
 
 
@@ -0,0 +1,375 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs the lump loaders of a map load as a dependency graph
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "maploadgraph.h"
+#include "convar.h"
+#include "host.h"
+#include "tier0/dbg.h"
+#include "tier0/platform.h"
+#include "vstdlib/jobthread.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static ConVar map_load_threads( "map_load_threads", "-1", 0, "Thread pool threads running lump loaders during a map load. -1 uses every pool thread, 0 loads one lump after another on the main thread." );
+static ConVar map_load_timings( "map_load_timings", "0", 0, "Print how long each lump loader took, and on which thread, after a map load." );
+
+// Set while a graph is running on more than one thread
+static CMapLoadGraph	*s_pRunningGraph = NULL;
+
+// Set on whichever thread is running one of its tasks
+static CTHREADLOCALINT	s_nInGraphTask;
+
+static CThreadFastMutex	s_DeferredErrorMutex;
+static char				s_szDeferredError[1024];
+static bool				s_bDeferredError = false;
+
+static bool MapLoadGraph_HasDeferredError()
+{
+	AUTO_LOCK( s_DeferredErrorMutex );
+	return s_bDeferredError;
+}
+
+bool MapLoadGraph_DeferHostError( const char *pszError )
+{
+	if ( !s_nInGraphTask )
+		return false;
+
+	// Only the first error is raised, as it would have been by a serial load
+	AUTO_LOCK( s_DeferredErrorMutex );
+	if ( !s_bDeferredError )
+	{
+		V_strncpy( s_szDeferredError, pszError, sizeof( s_szDeferredError ) );
+		s_bDeferredError = true;
+	}
+	return true;
+}
+
+CMapLoadGraph::CMapLoadGraph( const char *pszName )
+	: m_MainWake( true ), m_WorkerWake( true )
+{
+	m_pszName = pszName;
+	m_flStartTime = 0.0;
+	m_nRemaining = 0;
+}
+
+CMapLoadGraph::~CMapLoadGraph()
+{
+	FOR_EACH_VEC( m_Tasks, i )
+	{
+		if ( m_Tasks[i].m_pFunctor )
+		{
+			m_Tasks[i].m_pFunctor->Release();
+		}
+	}
+}
+
+int CMapLoadGraph::AddTask( const char *pszName, CFunctor *pFunctor, bool bMainThread, int nDep0, int nDep1, int nDep2, int nDep3 )
+{
+	int nTask = m_Tasks.AddToTail();
+	Task_t &task = m_Tasks[nTask];
+	task.m_pszName = pszName;
+	task.m_pFunctor = pFunctor;
+	task.m_bMainThread = bMainThread;
+	task.m_nDependencies = 0;
+	task.m_nWaitingOn = 0;
+	task.m_flStart = task.m_flEnd = 0.0f;
+	task.m_bRanOnWorker = false;
+
+	int deps[] = { nDep0, nDep1, nDep2, nDep3 };
+	for ( size_t i = 0; i < ARRAYSIZE( deps ); ++i )
+	{
+		if ( deps[i] != -1 )
+		{
+			AddDependency( nTask, deps[i] );
+		}
+	}
+	return nTask;
+}
+
+void CMapLoadGraph::AddDependency( int nTask, int nDependsOn )
+{
+	// Serial order is insertion order, so it must already satisfy every dependency
+	if ( nDependsOn < 0 || nDependsOn >= nTask )
+	{
+		AssertMsg( 0, "Map load task %s depends on a task added after it", m_Tasks[nTask].m_pszName );
+		return;
+	}
+
+	if ( m_Tasks[nDependsOn].m_Dependents.Find( nTask ) != -1 )
+		return;
+
+	m_Tasks[nDependsOn].m_Dependents.AddToTail( nTask );
+	++m_Tasks[nTask].m_nDependencies;
+}
+
+void CMapLoadGraph::DependOnAll( int nTask )
+{
+	for ( int i = 0; i < nTask; ++i )
+	{
+		AddDependency( nTask, i );
+	}
+}
+
+void CMapLoadGraph::Run()
+{
+	int nWorkerTasks = 0;
+	FOR_EACH_VEC( m_Tasks, i )
+	{
+		if ( !m_Tasks[i].m_bMainThread )
+		{
+			++nWorkerTasks;
+		}
+	}
+
+	int nWorkers = 0;
+	if ( g_pThreadPool && !s_pRunningGraph )
+	{
+		nWorkers = map_load_threads.GetInt();
+		if ( nWorkers < 0 || nWorkers > g_pThreadPool->NumThreads() )
+		{
+			nWorkers = g_pThreadPool->NumThreads();
+		}
+
+		// The main thread takes worker tasks too
+		nWorkers = MIN( nWorkers, nWorkerTasks - 1 );
+	}
+
+	m_flStartTime = Plat_FloatTime();
+	if ( nWorkers > 0 )
+	{
+		RunParallel( nWorkers );
+	}
+	else
+	{
+		RunSerial();
+	}
+
+	float flWallTime = ( Plat_FloatTime() - m_flStartTime ) * 1000.0f;
+	if ( map_load_timings.GetBool() )
+	{
+		ReportTimings( flWallTime, MAX( nWorkers, 0 ) );
+	}
+}
+
+void CMapLoadGraph::RunSerial()
+{
+	FOR_EACH_VEC( m_Tasks, i )
+	{
+		COM_TimestampedLog( "  %s", m_Tasks[i].m_pszName );
+
+		Task_t &task = m_Tasks[i];
+		task.m_flStart = ( Plat_FloatTime() - m_flStartTime ) * 1000.0f;
+		( *task.m_pFunctor )();
+		task.m_flEnd = ( Plat_FloatTime() - m_flStartTime ) * 1000.0f;
+	}
+}
+
+void CMapLoadGraph::RunParallel( int nWorkers )
+{
+	m_nRemaining = m_Tasks.Count();
+	m_ReadyMain.RemoveAll();
+	m_ReadyWorker.RemoveAll();
+	FOR_EACH_VEC( m_Tasks, i )
+	{
+		Task_t &task = m_Tasks[i];
+		task.m_nWaitingOn = task.m_nDependencies;
+		if ( !task.m_nWaitingOn )
+		{
+			( task.m_bMainThread ? m_ReadyMain : m_ReadyWorker ).AddToTail( i );
+		}
+	}
+
+	s_bDeferredError = false;
+	s_pRunningGraph = this;
+
+	m_Mutex.Lock();
+	UpdateEventsLocked();
+	m_Mutex.Unlock();
+
+	CUtlVector<CJob *> workers;
+	for ( int i = 0; i < nWorkers; ++i )
+	{
+		CJob *pJob = new CFunctorJob( CreateFunctor( this, &CMapLoadGraph::WorkerLoop ), "MapLoadGraph" );
+		g_pThreadPool->AddJob( pJob );
+		workers.AddToTail( pJob );
+	}
+
+	for ( ;; )
+	{
+		m_MainWake.Wait();
+
+		m_Mutex.Lock();
+		if ( !m_nRemaining )
+		{
+			m_Mutex.Unlock();
+			break;
+		}
+		int nTask = PopReadyTask( true );
+		if ( nTask != -1 && m_Tasks[nTask].m_bMainThread )
+		{
+			COM_TimestampedLog( "  %s", m_Tasks[nTask].m_pszName );
+		}
+		UpdateEventsLocked();
+		m_Mutex.Unlock();
+
+		if ( nTask != -1 )
+		{
+			ExecuteTask( nTask );
+		}
+	}
+
+	FOR_EACH_VEC( workers, i )
+	{
+		workers[i]->WaitForFinishAndRelease();
+	}
+
+	s_pRunningGraph = NULL;
+
+	if ( s_bDeferredError )
+	{
+		s_bDeferredError = false;
+		Host_Error( "%s", s_szDeferredError );
+	}
+}
+
+void CMapLoadGraph::WorkerLoop()
+{
+	for ( ;; )
+	{
+		m_WorkerWake.Wait();
+
+		m_Mutex.Lock();
+		if ( !m_nRemaining )
+		{
+			m_Mutex.Unlock();
+			return;
+		}
+		int nTask = PopReadyTask( false );
+		UpdateEventsLocked();
+		m_Mutex.Unlock();
+
+		if ( nTask != -1 )
+		{
+			m_Tasks[nTask].m_bRanOnWorker = true;
+			ExecuteTask( nTask );
+		}
+	}
+}
+
+void CMapLoadGraph::ExecuteTask( int nTask )
+{
+	Task_t &task = m_Tasks[nTask];
+	task.m_flStart = ( Plat_FloatTime() - m_flStartTime ) * 1000.0f;
+	// After a loader has failed, what depends on it would read what it didn't load
+	if ( !MapLoadGraph_HasDeferredError() )
+	{
+		s_nInGraphTask = 1;
+		( *task.m_pFunctor )();
+		s_nInGraphTask = 0;
+	}
+	task.m_flEnd = ( Plat_FloatTime() - m_flStartTime ) * 1000.0f;
+
+	AUTO_LOCK( m_Mutex );
+	FOR_EACH_VEC( task.m_Dependents, i )
+	{
+		int nDependent = task.m_Dependents[i];
+		if ( !--m_Tasks[nDependent].m_nWaitingOn )
+		{
+			( m_Tasks[nDependent].m_bMainThread ? m_ReadyMain : m_ReadyWorker ).AddToTail( nDependent );
+		}
+	}
+	--m_nRemaining;
+	UpdateEventsLocked();
+}
+
+//-----------------------------------------------------------------------------
+// The earliest added ready task goes first, which keeps the load close to
+// the serial order. The main thread prefers the tasks only it can run.
+//-----------------------------------------------------------------------------
+int CMapLoadGraph::PopReadyTask( bool bMainThread )
+{
+	CUtlVector<int> *pLists[2] = { bMainThread ? &m_ReadyMain : NULL, &m_ReadyWorker };
+	for ( size_t l = 0; l < ARRAYSIZE( pLists ); ++l )
+	{
+		CUtlVector<int> *pList = pLists[l];
+		if ( !pList || !pList->Count() )
+			continue;
+
+		int nBest = 0;
+		for ( int i = 1; i < pList->Count(); ++i )
+		{
+			if ( pList->Element( i ) < pList->Element( nBest ) )
+			{
+				nBest = i;
+			}
+		}
+		int nTask = pList->Element( nBest );
+		pList->FastRemove( nBest );
+		return nTask;
+	}
+	return -1;
+}
+
+void CMapLoadGraph::UpdateEventsLocked()
+{
+	bool bDone = ( m_nRemaining == 0 );
+	if ( bDone || m_ReadyMain.Count() || m_ReadyWorker.Count() )
+	{
+		m_MainWake.Set();
+	}
+	else
+	{
+		m_MainWake.Reset();
+	}
+
+	if ( bDone || m_ReadyWorker.Count() )
+	{
+		m_WorkerWake.Set();
+	}
+	else
+	{
+		m_WorkerWake.Reset();
+	}
+}
+
+void CMapLoadGraph::ReportTimings( float flWallTime, int nWorkers )
+{
+	// The critical path is the longest chain of dependent tasks, the least the load can take
+	CUtlVector<float> pathEnd;
+	pathEnd.SetCount( m_Tasks.Count() );
+	FOR_EACH_VEC( pathEnd, i )
+	{
+		pathEnd[i] = 0.0f;
+	}
+
+	float flWork = 0.0f;
+	float flCriticalPath = 0.0f;
+	FOR_EACH_VEC( m_Tasks, i )
+	{
+		const Task_t &task = m_Tasks[i];
+		float flTime = task.m_flEnd - task.m_flStart;
+		flWork += flTime;
+		pathEnd[i] += flTime;
+		flCriticalPath = MAX( flCriticalPath, pathEnd[i] );
+		FOR_EACH_VEC( task.m_Dependents, j )
+		{
+			int nDependent = task.m_Dependents[j];
+			pathEnd[nDependent] = MAX( pathEnd[nDependent], pathEnd[i] );
+		}
+	}
+
+	Msg( "%s: %d lump loaders on %d thread%s in %.2f ms (%.2f ms of work, %.2f ms critical path)\n",
+		m_pszName, m_Tasks.Count(), nWorkers + 1, nWorkers ? "s" : "", flWallTime, flWork, flCriticalPath );
+	Msg( "   start      ms  thread  loader\n" );
+	FOR_EACH_VEC( m_Tasks, i )
+	{
+		const Task_t &task = m_Tasks[i];
+		Msg( "%8.2f %7.2f  %-6s  %s\n", task.m_flStart, task.m_flEnd - task.m_flStart,
+			task.m_bRanOnWorker ? "worker" : "main", task.m_pszName );
+	}
+}
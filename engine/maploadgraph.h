@@ -0,0 +1,87 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs the lump loaders of a map load as a dependency graph
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef MAPLOADGRAPH_H
+#define MAPLOADGRAPH_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/threadtools.h"
+#include "tier1/functors.h"
+#include "tier1/utlvector.h"
+
+//-----------------------------------------------------------------------------
+// Tasks are added in the order a serial load runs them and may only depend
+// on tasks added before them, so running the graph without threads is the
+// old load exactly. Each task must write only what no task it doesn't depend
+// on reads or writes; that is what keeps the result the same however the
+// tasks are scheduled. Tasks touching the material system, vphysics or VGUI
+// are main thread tasks and run on the thread calling Run(), interleaved with
+// the worker tasks running on g_pThreadPool.
+//-----------------------------------------------------------------------------
+class CMapLoadGraph
+{
+public:
+	CMapLoadGraph( const char *pszName );
+	~CMapLoadGraph();
+
+	// Takes the functor's reference. Returns the task's handle for dependencies.
+	int AddTask( const char *pszName, CFunctor *pFunctor, bool bMainThread, int nDep0 = -1, int nDep1 = -1, int nDep2 = -1, int nDep3 = -1 );
+	void AddDependency( int nTask, int nDependsOn );
+
+	// Makes the task wait for every task added before it
+	void DependOnAll( int nTask );
+
+	void Run();
+
+private:
+	struct Task_t
+	{
+		const char			*m_pszName;
+		CFunctor			*m_pFunctor;
+		bool				m_bMainThread;
+		CUtlVector<int>		m_Dependents;
+		int					m_nDependencies;
+		int					m_nWaitingOn;
+		float				m_flStart;
+		float				m_flEnd;
+		bool				m_bRanOnWorker;
+	};
+
+	void RunSerial();
+	void RunParallel( int nWorkers );
+	void WorkerLoop();
+
+	// Runs a task and queues whatever it was the last dependency of
+	void ExecuteTask( int nTask );
+
+	// Under m_Mutex
+	int PopReadyTask( bool bMainThread );
+	void UpdateEventsLocked();
+
+	void ReportTimings( float flWallTime, int nWorkers );
+
+	const char			*m_pszName;
+	CUtlVector<Task_t>	m_Tasks;
+	double				m_flStartTime;
+
+	CThreadFastMutex	m_Mutex;
+	CUtlVector<int>		m_ReadyWorker;
+	CUtlVector<int>		m_ReadyMain;
+	int					m_nRemaining;
+	CThreadEvent		m_MainWake;
+	CThreadEvent		m_WorkerWake;
+};
+
+// Host_Error in a task of a graph running on several threads hands the message here
+// and returns, so loaders must return straight after calling it. Tasks not yet started
+// are skipped and the main thread raises the error once the graph has finished.
+// False outside the tasks of a threaded graph, where Host_Error doesn't return.
+bool MapLoadGraph_DeferHostError( const char *pszError );
+
+#endif // MAPLOADGRAPH_H
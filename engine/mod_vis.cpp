@@ -300,21 +300,10 @@ void Map_VisMark( bool forcenovis, model_t *worldmodel )
 
 	CM_Vis( vis.rgCurrentVis, sizeof( vis.rgCurrentVis ), vis.rgVisClusters[ 0 ].viewcluster, DVIS_PVS );
 
-	// Get cluster count
-	c = ( CM_NumClusters() + 31 ) / 32 ;
-
 	// Merge in any extra clusters
 	for ( i = 1; i < vis.nClusters; i++ )
 	{
-		byte	mapVis[ MAX_MAP_CLUSTERS/8 ];
-		
-		CM_Vis( mapVis, sizeof( mapVis ), vis.rgVisClusters[ i ].viewcluster, DVIS_PVS );
-				
-		// Copy one dword at a time ( could use memcpy )
-		for ( int j = 0 ; j < c ; j++ )
-		{
-			((int *)vis.rgCurrentVis)[ j ] |= ((int *)mapVis)[ j ];
-		}
+		CM_AddVis( vis.rgCurrentVis, sizeof( vis.rgCurrentVis ), vis.rgVisClusters[ i ].viewcluster, DVIS_PVS );
 	}
 	
 
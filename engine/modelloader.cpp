@@ -56,6 +56,7 @@
 #include "optimize.h"
 #include "networkstringtable.h"
 #include "tier1/callqueue.h"
+#include "maploadgraph.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -88,6 +89,8 @@ static ConVar mod_dynamicunloadtextures( "mod_dynamicunloadtex", "1", FCVAR_HIDD
 static ConVar mod_dynamicloadpause( "mod_dynamicloadpause", "0", FCVAR_CHEAT | FCVAR_HIDDEN | FCVAR_DONTRECORD );
 static ConVar mod_dynamicloadthrottle( "mod_dynamicloadthrottle", "0", FCVAR_CHEAT | FCVAR_HIDDEN | FCVAR_DONTRECORD );
 static ConVar mod_dynamicloadspew( "mod_dynamicloadspew", "0", FCVAR_HIDDEN | FCVAR_DONTRECORD );
+static ConVar mod_incremental_changelevel( "mod_incremental_changelevel", "0", 0, "Keep dynamic models resident across a level change and unload only the ones the new level doesn't use once it has loaded." );
+static ConVar mod_changelevel_report( "mod_changelevel_report", "1", 0, "After a level change, report how many of the previous level's models were reused. 2 also lists the models." );
 
 #define DynamicModelDebugMsg(...) ( mod_dynamicloadspew.GetBool() ? Msg(__VA_ARGS__) : (void)0 )
 
@@ -257,6 +260,9 @@ public:
 	// Called by server and client to force-unload dynamic models regardless of refcount!
 	virtual void	ForceUnloadNonClientDynamicModels();
 
+	virtual void	ReleaseNonClientDynamicModels();
+	virtual void	BeginLevelChange();
+
 	// Called by client code to load dynamic models, instead of GetModelForName.
 	virtual model_t *GetDynamicModel( const char *name, bool bClientOnly );
 	
@@ -299,6 +305,7 @@ private:
 	void		Map_LoadModel( model_t *mod );
 	void		Map_UnloadModel( model_t *mod );
 	void		Map_UnloadCubemapSamples( model_t *mod );
+	void		Map_LoadAreaPortals( model_t *mod );
 
 	// World loading helper
 	void		SetWorldModel( model_t *mod );
@@ -327,6 +334,8 @@ private:
 
 	void		InternalUpdateDynamicModels( bool bIgnoreUpdateTime );
 
+	void		ReportLevelChange();
+
 	// Internal data
 private:
 	enum 
@@ -378,6 +387,11 @@ private:
 	// Dynamic model load queue
 	CUtlVector< model_t* > m_DynamicModelLoadQueue;
 	bool m_bDynamicLoadQueueHeadActive;
+
+	// Models loaded when the level change began, for ReportLevelChange
+	CUtlHashtable< model_t * > m_LevelChangeModels;
+	bool m_bLevelChangePending;
+	double m_flLevelChangeStart;
 };
 
 // Expose interface
@@ -394,6 +408,10 @@ static char				s_szMapName[128];
 static worldbrushdata_t	*s_pMap = NULL;
 static int				s_nMapLoadRecursion = 0;
 static CUtlBuffer		s_MapBuffer;
+static byte				*s_pMapView = NULL;				// The whole bsp, when the filesystem can map it
+static int				s_nMapViewSize = 0;
+static FileViewHandle_t	s_hMapView = NULL;
+static CThreadFastMutex	s_MapReadMutex;
 
 // Lump files are patches for a shipped map
 // List of lump files found when map was loaded. Each entry is the lump file index for that lump id.
@@ -470,6 +488,10 @@ void CMapLoadHelper::Init( model_t *pMapModel, const char *loadname )
 
 	V_strcpy_safe( s_szLoadName, loadname );
 
+	// Lumps are used in place from a mapped view of the file, if there can be one
+	s_nMapViewSize = g_pFileSystem->Size( s_MapFileHandle );
+	s_pMapView = (byte *)g_pFileSystem->MapFileView( s_MapFileHandle, 0, s_nMapViewSize, &s_hMapView );
+
 	// Store map version, but only do it once so that the communication between the engine and Hammer isn't broken. The map version
 	// is incremented whenever a Hammer to Engine session is established so resetting the global map version each time causes a problem.
 	if ( 0 == g_ServerGlobalVariables.mapversion )
@@ -597,6 +619,14 @@ void CMapLoadHelper::Shutdown( void )
 		s_MapFileHandle = FILESYSTEM_INVALID_HANDLE;
 	}
 
+	if ( s_hMapView )
+	{
+		g_pFileSystem->ReleaseFileView( s_hMapView );
+		s_hMapView = NULL;
+	}
+	s_pMapView = NULL;
+	s_nMapViewSize = 0;
+
 	if ( IsPC() )
 	{
 		// Close our open lump files
@@ -797,6 +827,12 @@ CMapLoadHelper::CMapLoadHelper( int lumpToLoad )
 		// bsp is in memory
 		m_pData = (unsigned char*)s_MapBuffer.Base() + m_nLumpOffset;
 	}
+	else if ( s_pMapView && fileToUse == s_MapFileHandle && ( m_nLumpOffset % 4 == 0 ) &&
+			  m_nLumpOffset >= 0 && m_nLumpOffset + m_nLumpSize <= s_nMapViewSize )
+	{
+		// bsp is mapped, the view is copy on write so loaders may still modify the lump in place
+		m_pData = s_pMapView + m_nLumpOffset;
+	}
 	else
 	{
 		if ( s_MapFileHandle == FILESYSTEM_INVALID_HANDLE )
@@ -825,6 +861,8 @@ CMapLoadHelper::CMapLoadHelper( int lumpToLoad )
 
 		if ( m_nLumpSize )
 		{
+			// Lumps load on several threads, which share the file handles
+			AUTO_LOCK( s_MapReadMutex );
 			g_pFileSystem->Seek( fileToUse, alignedOffset, FILESYSTEM_SEEK_HEAD );
 			g_pFileSystem->ReadEx( m_pRawData, alignedBytesToRead, alignedBytesToRead, fileToUse );
 			m_pData = m_pRawData + ( m_nLumpOffset - alignedOffset );
@@ -1207,6 +1245,7 @@ void Mod_LoadVertices( void )
 	if ( lh.LumpSize() % sizeof(*in) )
 	{
 		Host_Error( "Mod_LoadVertices: funny lump size in %s", lh.GetMapName() );
+		return;
 	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (mvertex_t *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "vertexes" ) );
@@ -1289,7 +1328,10 @@ medge_t *Mod_LoadEdges ( void )
 
 	in = (dedge_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadEdges: funny lump size in %s",lh.GetMapName());
+		return NULL;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	medge_t *pedges = new medge_t[count];
 
@@ -1398,7 +1440,7 @@ void Mod_LoadOcclusion( void )
 
 	default:
 		Host_Error("Invalid occlusion lump version!\n");
-		break;
+		return;
 	}
 }
 
@@ -1434,7 +1476,10 @@ void Mod_LoadTexinfo( void )
 
 	in = (texinfo_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadTexinfo: funny lump size in %s",lh.GetMapName());
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (mtexinfo_t *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "texinfo" ) );
 
@@ -1638,7 +1683,10 @@ void Mod_LoadVertNormals( void )
     // verify vertnormals data size
     //
     if( lh.LumpSize() % sizeof( *pVertNormals ) )
+    {
         Host_Error( "Mod_LoadVertNormals: funny lump size in %s!\n", lh.GetMapName() );
+        return;
+    }
 
 	int count = lh.LumpSize() / sizeof(*pVertNormals);
 	Vector *out = (Vector *)Hunk_AllocName( lh.LumpSize(), va( "%s [%s]", lh.GetLoadName(), "vertnormals" ) );
@@ -1692,7 +1740,10 @@ void Mod_LoadPrimitives( void )
 
 	in = (dprimitive_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadPrimitives: funny lump size in %s",lh.GetMapName());
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (mprimitive_t *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "primitives" ) );
 	memset( out, 0, count * sizeof( mprimitive_t ) );
@@ -1725,7 +1776,10 @@ void Mod_LoadPrimVerts( void )
 
 	in = (dprimvert_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadPrimVerts: funny lump size in %s",lh.GetMapName());
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (mprimvert_t *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "primverts" ) );
 	memset( out, 0, count * sizeof( mprimvert_t ) );
@@ -1754,7 +1808,10 @@ void Mod_LoadPrimIndices( void )
 
 	in = (unsigned short *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadPrimIndices: funny lump size in %s",lh.GetMapName());
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (unsigned short *)Hunk_AllocName( count*sizeof(*out), va("%s [%s]", lh.GetLoadName(), "primindices" ) );
 	memset( out, 0, count * sizeof( unsigned short ) );
@@ -1864,7 +1921,10 @@ void Mod_LoadFaces( void )
 	
 	in = (dface_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadFaces: funny lump size in %s",lh.GetMapName());
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 
 	// align these allocations
@@ -1920,6 +1980,7 @@ void Mod_LoadFaces( void )
 		if (ti < 0 || ti >= lh.GetMap()->numtexinfo)
 		{
 			Host_Error( "Mod_LoadFaces: bad texinfo number" );
+			return;
 		}
 		surfID->texinfo = ti;
 		surfID->m_bDynamicShadowsEnabled = in->AreDynamicShadowsEnabled();
@@ -2057,7 +2118,10 @@ void Mod_LoadNodes( void )
 
 	in = (dnode_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadNodes: funny lump size in %s",lh.GetMapName());
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (mnode_t *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "nodes" ) );
 
@@ -2124,7 +2188,7 @@ void Mod_LoadNodes( void )
 //			*l - 
 //			*loadname - 
 //-----------------------------------------------------------------------------
-void Mod_LoadLeafs_Version_0( CMapLoadHelper &lh )
+bool Mod_LoadLeafs_Version_0( CMapLoadHelper &lh )
 {
 	Vector mins( 0, 0, 0 ), maxs( 0, 0, 0 );
 	dleaf_version_0_t 	*in;
@@ -2133,7 +2197,10 @@ void Mod_LoadLeafs_Version_0( CMapLoadHelper &lh )
 
 	in = (dleaf_version_0_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadLeafs: funny lump size in %s",lh.GetMapName());
+		return false;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (mleaf_t *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "leafs" ) );
 
@@ -2182,6 +2249,7 @@ void Mod_LoadLeafs_Version_0( CMapLoadHelper &lh )
 
 		out->leafWaterDataID = in->leafWaterDataID;
 	}	
+	return true;
 }
 
 //-----------------------------------------------------------------------------
@@ -2190,7 +2258,7 @@ void Mod_LoadLeafs_Version_0( CMapLoadHelper &lh )
 //			*l - 
 //			*loadname - 
 //-----------------------------------------------------------------------------
-void Mod_LoadLeafs_Version_1( CMapLoadHelper &lh, CMapLoadHelper &ambientLightingLump, CMapLoadHelper &ambientLightingTable )
+bool Mod_LoadLeafs_Version_1( CMapLoadHelper &lh, CMapLoadHelper &ambientLightingLump, CMapLoadHelper &ambientLightingTable )
 {
 	Vector mins( 0, 0, 0 ), maxs( 0, 0, 0 );
 	dleaf_t 	*in;
@@ -2199,7 +2267,10 @@ void Mod_LoadLeafs_Version_1( CMapLoadHelper &lh, CMapLoadHelper &ambientLightin
 
 	in = (dleaf_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadLeafs: funny lump size in %s",lh.GetMapName());
+		return false;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (mleaf_t *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "leafs" ) );
 
@@ -2283,29 +2354,31 @@ void Mod_LoadLeafs_Version_1( CMapLoadHelper &lh, CMapLoadHelper &ambientLightin
 
 		out->leafWaterDataID = in->leafWaterDataID;
 	}	
+	return true;
 }
 
 void Mod_LoadLeafs( void )
 {
 	CMapLoadHelper lh( LUMP_LEAFS );
 
+	bool bLoaded = false;
 	switch( lh.LumpVersion() )
 	{
 	case 0:
-		Mod_LoadLeafs_Version_0( lh );
+		bLoaded = Mod_LoadLeafs_Version_0( lh );
 		break;
 	case 1:
 		if( g_pMaterialSystemHardwareConfig->GetHDREnabled() && CMapLoadHelper::LumpSize( LUMP_LEAF_AMBIENT_LIGHTING_HDR ) > 0 )
 		{
 			CMapLoadHelper mlh( LUMP_LEAF_AMBIENT_LIGHTING_HDR );
 			CMapLoadHelper mlhTable( LUMP_LEAF_AMBIENT_INDEX_HDR );
-			Mod_LoadLeafs_Version_1( lh, mlh, mlhTable );
+			bLoaded = Mod_LoadLeafs_Version_1( lh, mlh, mlhTable );
 		}
 		else
 		{
 			CMapLoadHelper mlh( LUMP_LEAF_AMBIENT_LIGHTING );
 			CMapLoadHelper mlhTable( LUMP_LEAF_AMBIENT_INDEX );
-			Mod_LoadLeafs_Version_1( lh, mlh, mlhTable ); 
+			bLoaded = Mod_LoadLeafs_Version_1( lh, mlh, mlhTable ); 
 		}
 		break;
 	default:
@@ -2314,6 +2387,9 @@ void Mod_LoadLeafs( void )
 		break;
 	}
 
+	if ( !bLoaded )
+		return;
+
 	worldbrushdata_t *pMap = lh.GetMap();
 	cleaf_t *pCLeaf = GetCollisionBSPData()->map_leafs.Base();
 	for ( int i = 0; i < pMap->numleafs; i++ )
@@ -2339,7 +2415,10 @@ void Mod_LoadLeafWaterData( void )
 
 	in = (dleafwaterdata_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadLeafs: funny lump size in %s",lh.GetMapName());
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (mleafwaterdata_t *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "leafwaterdata" ) );
 
@@ -2383,7 +2462,10 @@ void Mod_LoadCubemapSamples( void )
 
 	in = (dcubemapsample_t *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadCubemapSamples: funny lump size in %s",lh.GetMapName());
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	out = (mcubemapsample_t *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "cubemapsample" ) );
 
@@ -2494,7 +2576,10 @@ void Mod_LoadLeafMinDistToWater( void )
 
 		in = (unsigned short *)lh.LumpBase();
 		if (lh.LumpSize() % sizeof(*in))
+		{
 			Host_Error ("Mod_LoadLeafMinDistToWater: funny lump size in %s",lh.GetMapName());
+			return;
+		}
 		count = lh.LumpSize() / sizeof(*in);
 		out = (unsigned short *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "leafmindisttowater" ) );
 
@@ -2515,7 +2600,10 @@ void Mod_LoadMarksurfaces( void )
 	
 	in = (unsigned short *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadMarksurfaces: funny lump size in %s",lh.GetMapName());
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	SurfaceHandle_t	*tempDiskData = new SurfaceHandle_t[count];
 
@@ -2529,7 +2617,13 @@ void Mod_LoadMarksurfaces( void )
 	{
 		j = in[i];
 		if (j >= lh.GetMap()->numsurfaces)
+		{
 			Host_Error ("Mod_LoadMarksurfaces: bad surface number");
+			pBrushData->marksurfaces = NULL;
+			pBrushData->nummarksurfaces = 0;
+			delete[] tempDiskData;
+			return;
+		}
 		SurfaceHandle_t surfID = SurfaceHandleFromIndex( j, pBrushData );
 		tempDiskData[i] = surfID;
 		if ( !SurfaceHasDispInfo( surfID ) && !(MSurf_Flags(surfID) & SURFDRAW_NODRAW) )
@@ -2603,11 +2697,19 @@ void Mod_LoadSurfedges( medge_t *pedges )
 
 	in = (int *)lh.LumpBase();
 	if (lh.LumpSize() % sizeof(*in))
+	{
 		Host_Error ("Mod_LoadSurfedges: funny lump size in %s",lh.GetMapName());
+		delete[] pedges;
+		return;
+	}
 	count = lh.LumpSize() / sizeof(*in);
 	if (count < 1 || count >= MAX_MAP_SURFEDGES)
+	{
 		Host_Error ("Mod_LoadSurfedges: bad surfedges count in %s: %i",
 		lh.GetMapName(), count);
+		delete[] pedges;
+		return;
+	}
 	out = (unsigned short *)Hunk_AllocName( count*sizeof(*out), va( "%s [%s]", lh.GetLoadName(), "surfedges" ) );
 
 	lh.GetMap()->vertindices = out;
@@ -3925,6 +4027,94 @@ void CModelLoader::PurgeUnusedModels( void )
 
 	// now purge unreferenced materials
 	materials->UncacheUnusedMaterials( true );
+
+	ReportLevelChange();
+}
+
+//-----------------------------------------------------------------------------
+// Remembers the models the outgoing level had loaded
+//-----------------------------------------------------------------------------
+void CModelLoader::BeginLevelChange()
+{
+	if ( m_bLevelChangePending )
+		return;
+
+	m_LevelChangeModels.RemoveAll();
+	FOR_EACH_MAP_FAST( m_Models, i )
+	{
+		model_t *pModel = m_Models[i].modelpointer;
+		if ( pModel->type == mod_studio && ( pModel->nLoadFlags & FMODELLOADER_LOADED ) )
+		{
+			m_LevelChangeModels.Insert( pModel );
+		}
+	}
+
+	// Nothing to reuse on the first level
+	m_bLevelChangePending = ( m_LevelChangeModels.Count() != 0 );
+	m_flLevelChangeStart = Plat_FloatTime();
+}
+
+//-----------------------------------------------------------------------------
+// Called once the incoming level's unused models are purged. Models still
+// loaded from the outgoing level were reused rather than reloaded.
+//-----------------------------------------------------------------------------
+void CModelLoader::ReportLevelChange()
+{
+	if ( !m_bLevelChangePending )
+		return;
+	m_bLevelChangePending = false;
+
+	int nReport = mod_changelevel_report.GetInt();
+	if ( nReport <= 0 )
+	{
+		m_LevelChangeModels.Purge();
+		return;
+	}
+
+	int nReused = 0, nReusedDynamic = 0, nLoaded = 0;
+	FOR_EACH_MAP_FAST( m_Models, i )
+	{
+		model_t *pModel = m_Models[i].modelpointer;
+		if ( pModel->type != mod_studio || !( pModel->nLoadFlags & FMODELLOADER_LOADED ) )
+			continue;
+
+		bool bReused = ( m_LevelChangeModels.Find( pModel ) != m_LevelChangeModels.InvalidHandle() );
+		if ( bReused )
+		{
+			++nReused;
+			if ( pModel->nLoadFlags & FMODELLOADER_DYNAMIC )
+			{
+				++nReusedDynamic;
+			}
+		}
+		else
+		{
+			++nLoaded;
+		}
+
+		if ( nReport >= 2 )
+		{
+			Msg( "  %s %s%s\n", bReused ? "reused" : "loaded", pModel->strName.String(), ( pModel->nLoadFlags & FMODELLOADER_DYNAMIC ) ? " (dynamic)" : "" );
+		}
+	}
+
+	int nUnloaded = m_LevelChangeModels.Count() - nReused;
+	if ( nReport >= 2 )
+	{
+		for ( UtlHashHandle_t h = m_LevelChangeModels.FirstHandle(); h != m_LevelChangeModels.InvalidHandle(); h = m_LevelChangeModels.NextHandle( h ) )
+		{
+			model_t *pModel = m_LevelChangeModels.Key( h );
+			if ( !( pModel->nLoadFlags & FMODELLOADER_LOADED ) )
+			{
+				Msg( "  unloaded %s\n", pModel->strName.String() );
+			}
+		}
+	}
+
+	Msg( "Level change: %d models reused (%d dynamic), %d loaded, %d unloaded in %.2f seconds\n",
+		nReused, nReusedDynamic, nLoaded, nUnloaded, Plat_FloatTime() - m_flLevelChangeStart );
+
+	m_LevelChangeModels.Purge();
 }
 
 //-----------------------------------------------------------------------------
@@ -4384,6 +4574,70 @@ static void MarkBrushModelWaterSurfaces( model_t* world,
 	host_state.SetWorldModel( pTemp );
 }
 
+//-----------------------------------------------------------------------------
+// Map load tasks for loaders that pick their lump, or hand data to another
+//-----------------------------------------------------------------------------
+static void Mod_LoadEdgesAndSurfedges( void )
+{
+	medge_t *pedges = Mod_LoadEdges();
+	if ( pedges )
+	{
+		Mod_LoadSurfedges( pedges );
+	}
+}
+
+static void Mod_LoadLightingLump( void )
+{
+	if ( g_pMaterialSystemHardwareConfig->GetHDREnabled() && CMapLoadHelper::LumpSize( LUMP_LIGHTING_HDR ) > 0 )
+	{
+		CMapLoadHelper mlh( LUMP_LIGHTING_HDR );
+		Mod_LoadLighting( mlh );
+	}
+	else
+	{
+		CMapLoadHelper mlh( LUMP_LIGHTING );
+		Mod_LoadLighting( mlh );
+	}
+}
+
+static void Mod_LoadWorldlightsLump( void )
+{
+	if ( g_pMaterialSystemHardwareConfig->GetHDREnabled() && CMapLoadHelper::LumpSize( LUMP_WORLDLIGHTS_HDR ) > 0 )
+	{
+		CMapLoadHelper mlh( LUMP_WORLDLIGHTS_HDR );
+		Mod_LoadWorldlights( mlh, true );
+	}
+	else
+	{
+		CMapLoadHelper mlh( LUMP_WORLDLIGHTS );
+		Mod_LoadWorldlights( mlh, false );
+	}
+}
+
+void CModelLoader::Map_LoadAreaPortals( model_t *mod )
+{
+	Mod_LoadLump( mod, 
+		LUMP_CLIPPORTALVERTS, 
+		va( "%s [%s]", m_szLoadName, "clipportalverts" ),
+		sizeof(m_worldBrushData.m_pClipPortalVerts[0]), 
+		(void**)&m_worldBrushData.m_pClipPortalVerts,
+		&m_worldBrushData.m_nClipPortalVerts );
+
+	Mod_LoadLump( mod, 
+		LUMP_AREAPORTALS, 
+		va( "%s [%s]", m_szLoadName, "areaportals" ),
+		sizeof(m_worldBrushData.m_pAreaPortals[0]), 
+		(void**)&m_worldBrushData.m_pAreaPortals,
+		&m_worldBrushData.m_nAreaPortals );
+	
+	Mod_LoadLump( mod, 
+		LUMP_AREAS, 
+		va( "%s [%s]", m_szLoadName, "areas" ),
+		sizeof(m_worldBrushData.m_pAreas[0]), 
+		(void**)&m_worldBrushData.m_pAreas,
+		&m_worldBrushData.m_nAreas );
+}
+
 int g_nMapLoadCount = 0;
 //-----------------------------------------------------------------------------
 // Purpose: 
@@ -4430,140 +4684,60 @@ void CModelLoader::Map_LoadModel( model_t *mod )
 	mod->nLoadFlags |= FMODELLOADER_LOADED;
 	CMapLoadHelper::Init( mod, m_szLoadName );
 
-	COM_TimestampedLog( "  Mod_LoadVertices" );
-	Mod_LoadVertices();
-	
-	COM_TimestampedLog( "  Mod_LoadEdges" );
-	medge_t *pedges = Mod_LoadEdges();
-
-	COM_TimestampedLog( "  Mod_LoadSurfedges" );
-	Mod_LoadSurfedges( pedges );
-
-	COM_TimestampedLog( "  Mod_LoadPlanes" );
-	Mod_LoadPlanes();
-
-	COM_TimestampedLog( "  Mod_LoadOcclusion" );
-	Mod_LoadOcclusion();
-
-	// texdata needs to load before texinfo
-	COM_TimestampedLog( "  Mod_LoadTexdata" );
-	Mod_LoadTexdata();
-
-	COM_TimestampedLog( "  Mod_LoadTexinfo" );
-	Mod_LoadTexinfo();
-
 #ifndef SWDS
 	EngineVGui()->UpdateProgressBar(PROGRESS_LOADWORLDMODEL);
 #endif
 
-	// Until BSP version 19, this must occur after loading texinfo
-	COM_TimestampedLog( "  Mod_LoadLighting" );
-	if ( g_pMaterialSystemHardwareConfig->GetHDREnabled() && CMapLoadHelper::LumpSize( LUMP_LIGHTING_HDR ) > 0 )
-	{
-		CMapLoadHelper mlh( LUMP_LIGHTING_HDR );
-		Mod_LoadLighting( mlh );
-	}
-	else
-	{
-		CMapLoadHelper mlh( LUMP_LIGHTING );
-		Mod_LoadLighting( mlh );
-	}
-
-	COM_TimestampedLog( "  Mod_LoadPrimitives" );
-	Mod_LoadPrimitives();
+	// Each loader fills in its own part of the world brush data; the collision
+	// data they share is already loaded. Loaders going through the material
+	// system run on this thread.
+	CMapLoadGraph graph( "Map_LoadModel" );
+	int hVertices = graph.AddTask( "Mod_LoadVertices", CreateFunctor( Mod_LoadVertices ), false );
+	int hSurfedges = graph.AddTask( "Mod_LoadSurfedges", CreateFunctor( Mod_LoadEdgesAndSurfedges ), false );
+	int hPlanes = graph.AddTask( "Mod_LoadPlanes", CreateFunctor( Mod_LoadPlanes ), false );
+	graph.AddTask( "Mod_LoadOcclusion", CreateFunctor( Mod_LoadOcclusion ), false );
 
-	COM_TimestampedLog( "  Mod_LoadPrimVerts" );
-	Mod_LoadPrimVerts();
+	// texdata needs to load before texinfo
+	int hTexdata = graph.AddTask( "Mod_LoadTexdata", CreateFunctor( Mod_LoadTexdata ), false );
+	int hTexinfo = graph.AddTask( "Mod_LoadTexinfo", CreateFunctor( Mod_LoadTexinfo ), true, hTexdata );
 
-	COM_TimestampedLog( "  Mod_LoadPrimIndices" );
-	Mod_LoadPrimIndices();
+	// Until BSP version 19, this must occur after loading texinfo
+	int hLighting = graph.AddTask( "Mod_LoadLighting", CreateFunctor( Mod_LoadLightingLump ), false, hTexinfo );
 
-#ifndef SWDS
-	EngineVGui()->UpdateProgressBar(PROGRESS_LOADWORLDMODEL);
-#endif
+	int hPrimitives = graph.AddTask( "Mod_LoadPrimitives", CreateFunctor( Mod_LoadPrimitives ), false );
+	graph.AddTask( "Mod_LoadPrimVerts", CreateFunctor( Mod_LoadPrimVerts ), false );
+	graph.AddTask( "Mod_LoadPrimIndices", CreateFunctor( Mod_LoadPrimIndices ), false );
 
 	// faces need to be loaded before vertnormals
-	COM_TimestampedLog( "  Mod_LoadFaces" );
-	Mod_LoadFaces();
-
-	COM_TimestampedLog( "  Mod_LoadVertNormals" );
-	Mod_LoadVertNormals();
-
-	COM_TimestampedLog( "  Mod_LoadVertNormalIndices" );
-	Mod_LoadVertNormalIndices();
-
-#ifndef SWDS
-	EngineVGui()->UpdateProgressBar(PROGRESS_LOADWORLDMODEL);
-#endif
+	int hFaces = graph.AddTask( "Mod_LoadFaces", CreateFunctor( Mod_LoadFaces ), false, hVertices, hSurfedges, hPlanes, hTexinfo );
+	graph.AddDependency( hFaces, hLighting );
+	graph.AddDependency( hFaces, hPrimitives );
+	graph.AddTask( "Mod_LoadVertNormals", CreateFunctor( Mod_LoadVertNormals ), false );
+	graph.AddTask( "Mod_LoadVertNormalIndices", CreateFunctor( Mod_LoadVertNormalIndices ), false, hFaces );
 
 	// note leafs must load befor marksurfaces
-	COM_TimestampedLog( "  Mod_LoadLeafs" );
-	Mod_LoadLeafs();
-
-	COM_TimestampedLog( "  Mod_LoadMarksurfaces" );
-    Mod_LoadMarksurfaces();
-
-	COM_TimestampedLog( "  Mod_LoadNodes" );
-	Mod_LoadNodes();
-
-	COM_TimestampedLog( "  Mod_LoadLeafWaterData" );
-	Mod_LoadLeafWaterData();
-
-	COM_TimestampedLog( "  Mod_LoadCubemapSamples" );
-	Mod_LoadCubemapSamples();
+	int hLeafs = graph.AddTask( "Mod_LoadLeafs", CreateFunctor( Mod_LoadLeafs ), false );
+	graph.AddTask( "Mod_LoadMarksurfaces", CreateFunctor( Mod_LoadMarksurfaces ), false, hLeafs, hFaces );
+	graph.AddTask( "Mod_LoadNodes", CreateFunctor( Mod_LoadNodes ), false, hLeafs, hPlanes );
+	graph.AddTask( "Mod_LoadLeafWaterData", CreateFunctor( Mod_LoadLeafWaterData ), false, hLeafs );
+	graph.AddTask( "Mod_LoadCubemapSamples", CreateFunctor( Mod_LoadCubemapSamples ), true );
 
 #ifndef SWDS
 	// UNDONE: Does the cmodel need worldlights?
-	COM_TimestampedLog( "  OverlayMgr()->LoadOverlays" );
-	OverlayMgr()->LoadOverlays();	
+	int hOverlays = graph.AddTask( "OverlayMgr()->LoadOverlays", CreateFunctor( OverlayMgr(), &IOverlayMgr::LoadOverlays ), true );
+	graph.DependOnAll( hOverlays );
 #endif
 
-	COM_TimestampedLog( "  Mod_LoadLeafMinDistToWater" );
-	Mod_LoadLeafMinDistToWater();
+	graph.AddTask( "Mod_LoadLeafMinDistToWater", CreateFunctor( Mod_LoadLeafMinDistToWater ), false );
+	graph.AddTask( "Mod_LoadAreaPortals", CreateFunctor( this, &CModelLoader::Map_LoadAreaPortals, mod ), false );
+	graph.AddTask( "Mod_LoadWorldlights", CreateFunctor( Mod_LoadWorldlightsLump ), false );
+	graph.AddTask( "Mod_LoadGameLumpDict", CreateFunctor( Mod_LoadGameLumpDict ), false );
+	graph.Run();
 
 #ifndef SWDS
 	EngineVGui()->UpdateProgressBar(PROGRESS_LOADWORLDMODEL);
 #endif
 
-	COM_TimestampedLog( "  LUMP_CLIPPORTALVERTS" );
-	Mod_LoadLump( mod, 
-		LUMP_CLIPPORTALVERTS, 
-		va( "%s [%s]", m_szLoadName, "clipportalverts" ),
-		sizeof(m_worldBrushData.m_pClipPortalVerts[0]), 
-		(void**)&m_worldBrushData.m_pClipPortalVerts,
-		&m_worldBrushData.m_nClipPortalVerts );
-
-	COM_TimestampedLog( "  LUMP_AREAPORTALS" );
-	Mod_LoadLump( mod, 
-		LUMP_AREAPORTALS, 
-		va( "%s [%s]", m_szLoadName, "areaportals" ),
-		sizeof(m_worldBrushData.m_pAreaPortals[0]), 
-		(void**)&m_worldBrushData.m_pAreaPortals,
-		&m_worldBrushData.m_nAreaPortals );
-	
-	COM_TimestampedLog( "  LUMP_AREAS" );
-	Mod_LoadLump( mod, 
-		LUMP_AREAS, 
-		va( "%s [%s]", m_szLoadName, "areas" ),
-		sizeof(m_worldBrushData.m_pAreas[0]), 
-		(void**)&m_worldBrushData.m_pAreas,
-		&m_worldBrushData.m_nAreas );
-
-	COM_TimestampedLog( "  Mod_LoadWorldlights" );
-	if ( g_pMaterialSystemHardwareConfig->GetHDREnabled() && CMapLoadHelper::LumpSize( LUMP_WORLDLIGHTS_HDR ) > 0 )
-	{
-		CMapLoadHelper mlh( LUMP_WORLDLIGHTS_HDR );
-		Mod_LoadWorldlights( mlh, true );
-	}
-	else
-	{
-		CMapLoadHelper mlh( LUMP_WORLDLIGHTS );
-		Mod_LoadWorldlights( mlh, false );
-	}
-
-	COM_TimestampedLog( "  Mod_LoadGameLumpDict" );
-	Mod_LoadGameLumpDict();
-
 	// load the portal information
 	// JAY: Disabled until we need this information.
 #if 0
@@ -5564,6 +5738,18 @@ model_t *CModelLoader::GetDynamicModel( const char *name, bool bClientOnly )
 	}
 	dyn.m_uLastTouchedMS_Div256 = Plat_MSTime() >> 8;
 
+	// A model kept resident across a level change is registered with the new
+	// level's table as not loaded, and no load will come along to correct it
+	if ( !bClientOnly && ( dyn.m_nLoadFlags & CDynamicModelInfo::ALLREADY ) && sv.GetDynamicModelsTable() )
+	{
+		int netidx = sv.GetDynamicModelsTable()->FindStringIndex( pModel->strName );
+		if ( netidx != INVALID_STRING_INDEX )
+		{
+			char nIsLoaded = 1;
+			sv.GetDynamicModelsTable()->SetStringUserData( netidx, 1, &nIsLoaded );
+		}
+	}
+
 	return pModel;
 }
 
@@ -6018,6 +6204,27 @@ void CModelLoader::ForceUnloadNonClientDynamicModels()
 	InternalUpdateDynamicModels( true );
 }
 
+void CModelLoader::ReleaseNonClientDynamicModels()
+{
+	if ( !mod_incremental_changelevel.GetBool() )
+	{
+		ForceUnloadNonClientDynamicModels();
+		return;
+	}
+
+	// Drop the server's references but leave the models resident. The next level
+	// re-references the ones it uses as it spawns, and PurgeUnusedModels flushes
+	// the rest once it has loaded. Touch them so a timed update in between
+	// doesn't unload them first.
+	const uint32 uNow = Plat_MSTime() >> 8;
+	for ( UtlHashHandle_t i = m_DynamicModels.FirstHandle(); i != m_DynamicModels.InvalidHandle(); i = m_DynamicModels.NextHandle( i ) )
+	{
+		CDynamicModelInfo &dyn = m_DynamicModels[i];
+		dyn.m_iRefCount = dyn.m_iClientRefCount;
+		dyn.m_uLastTouchedMS_Div256 = uNow;
+	}
+}
+
 
 // reconstruct the ambient lighting for a leaf at the given position in worldspace
 void Mod_LeafAmbientColorAtPos( Vector *pOut, const Vector &pos, int leafIndex )
@@ -135,6 +135,14 @@ public:
 	// Called by server and client engine code to flush unreferenced dynamic models
 	virtual void		ForceUnloadNonClientDynamicModels() = 0;
 
+	// Called on a level change to drop the server's dynamic model references. With
+	// mod_incremental_changelevel the models stay resident until PurgeUnusedModels.
+	virtual void		ReleaseNonClientDynamicModels() = 0;
+
+	// Called before the outgoing level's models are released, so PurgeUnusedModels
+	// can report which of them the incoming level reused
+	virtual void		BeginLevelChange() = 0;
+
 	// Called by client code to load dynamic models, instead of GetModelForName.
 	virtual model_t		*GetDynamicModel( const char *name, bool bClientOnly ) = 0;
 
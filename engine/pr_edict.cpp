@@ -26,9 +26,6 @@
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
-// Edicts won't get reallocated for this many seconds after being freed.
-#define EDICT_FREETIME	1.0
-
 
 
 #ifdef _DEBUG
@@ -41,6 +38,7 @@
 
 static ConVar		sv_useexplicitdelete( "sv_useexplicitdelete", "1", FCVAR_DEVELOPMENTONLY, "Explicitly delete dormant client entities caused by AllowImmediateReuse()." );
 static ConVar		sv_lowedict_threshold( "sv_lowedict_threshold", "8", FCVAR_NONE, "When only this many edicts are free, take the action specified by sv_lowedict_action.", true, 0, true, MAX_EDICTS );
+static ConVar		sv_edict_freetime( "sv_edict_freetime", "1.0", FCVAR_NONE, "Edicts won't get reallocated for this many seconds after being freed. Lower values recycle edicts faster on servers that churn short-lived entities.", true, 0.1f, true, 5.0f );
 static ConVar		sv_lowedict_action( "sv_lowedict_action", "0", FCVAR_NONE, "0 - no action, 1 - warn to log file, 2 - attempt to restart the game, if applicable, 3 - restart the map, 4 - go to the next map in the map cycle, 5 - spew all edicts.", true, 0, true, 5 );
 
 // Bitmask of free edicts.
@@ -177,6 +175,7 @@ edict_t *ED_Alloc( int iForceEdictIndex )
 	}
 
 	// Check the free list first.
+	const float flFreeTime = sv_edict_freetime.GetFloat();
 	int iBit = -1;
 	for ( ;; )
 	{
@@ -189,7 +188,7 @@ edict_t *ED_Alloc( int iForceEdictIndex )
 		// If this assert goes off, someone most likely called pedict->ClearFree() and not ED_ClearFreeFlag()?
 		Assert( pEdict->IsFree() );
 		Assert( iBit == pEdict->m_EdictIndex );
-		if ( ( pEdict->freetime < 2 ) || ( sv.GetTime() - pEdict->freetime >= EDICT_FREETIME ) )
+		if ( ( pEdict->freetime < 2 ) || ( sv.GetTime() - pEdict->freetime >= flFreeTime ) )
 		{
 			// If we have no freetime, we've had AllowImmediateReuse() called. We need
 			// to explicitly delete this old entity.
@@ -32,6 +32,8 @@
 #include "bitvec.h"
 #include "host.h"
 #include "tier1/mempool.h"
+#include "tier1/utlhashtable.h"
+#include "tier0/icommandline.h"
 
 #ifdef _PS3
 #include "tls_ps3.h"
@@ -320,6 +322,219 @@ private:
 	CThreadSpinRWLock					m_lock;
 };
 
+//-----------------------------------------------------------------------------
+// Bounding volume hierarchy over the engine trigger list, walked by queries
+// from moving solids instead of the voxel hash. A trigger that moves is
+// updated in place and the bounds above it refit; new triggers are tested
+// linearly and removed ones left as empty slots until enough of either, or
+// enough refits, have piled up to make a rebuild on the next query worth it.
+//-----------------------------------------------------------------------------
+class CTriggerPartitionIndex
+{
+public:
+	CTriggerPartitionIndex();
+
+	void Init( CSpatialPartition *pOwner );
+	void Shutdown();
+
+	// Called after an element was inserted, moved, removed or changed lists
+	void ElementChanged( SpatialPartitionHandle_t hPartition );
+
+	// Brings the hierarchy up to date and lets queries skip the mutex until it is turned back off
+	void SetReadOnly( bool bReadOnly );
+
+	// Returns false if the index couldn't be used and the caller should fall back to the voxel tree
+	bool EnumerateElementsInBox( SpatialPartitionListMask_t listMask, const Vector& mins, const Vector& maxs, IPartitionEnumerator* pIterator );
+	bool EnumerateElementsAlongRay( SpatialPartitionListMask_t listMask, const Ray_t& ray, IPartitionEnumerator* pIterator );
+
+	void ReportStats();
+
+private:
+	enum
+	{
+		MAX_LEAF_ELEMENTS = 4,
+		MAX_DEPTH = 64,
+		MIN_REBUILD_CHANGES = 8,
+		NOT_INDEXED = -1,
+	};
+
+	struct Element_t
+	{
+		Vector						m_vecMin;
+		SpatialPartitionHandle_t	m_hPartition;	// PARTITION_INVALID_HANDLE once removed
+		Vector						m_vecMax;
+		int							m_nLeaf;		// -1 until the next rebuild puts it in the hierarchy
+		float						m_flCenter[3];
+	};
+
+	// Leaves reference m_nCount elements starting at m_nFirst, interior nodes have m_nCount == 0
+	// and their children are m_nFirst and m_nFirst + 1
+	struct Node_t
+	{
+		Vector	m_vecMin;
+		int		m_nFirst;
+		Vector	m_vecMax;
+		int		m_nCount;
+		int		m_nParent;
+	};
+
+	typedef CUtlVectorFixedGrowable< IHandleEntity *, 64 > HitList_t;
+
+	bool BeginQuery();
+	void EndQuery();
+	void Rebuild();
+	void BuildNode( int nNode, int nParent, int nFirst, int nCount );
+	void Refit( int nNode );
+	void RemoveElement( int nElement );
+	void UpdateDirty();
+
+	template <class T> void Enumerate( const T &intersectTest, SpatialPartitionListMask_t listMask, HitList_t &hits );
+	void CallEnumerator( const HitList_t &hits, IPartitionEnumerator* pIterator );
+
+	CSpatialPartition		*m_pOwner;
+	CUtlVector<Element_t>	m_Elements;		// The first m_nTreeElements are in the hierarchy
+	CUtlVector<Node_t>		m_Nodes;
+	CUtlVector<int>			m_ElementIndex;	// Element of each partition handle, or NOT_INDEXED
+	CThreadFastMutex		m_Mutex;
+	int						m_nTreeElements;
+	int						m_nRemoved;
+	int						m_nRefits;
+	bool					m_bDirty;
+	bool					m_bReadOnly;
+
+	// Stats
+	int						m_nRebuilds;
+	CInterlockedInt			m_nQueries;
+	int						m_nUpdates;
+	float					m_flRebuildTime;
+};
+
+//-----------------------------------------------------------------------------
+// Loose multi-level grid, an alternative to the voxel tree. Every element lives
+// in exactly one cell: the one holding its center, on the finest level whose
+// cells are at least as big as the element. Cells are loosened by half their
+// size so an element never straddles them and queries need no visit bits.
+// Moves are queued and applied as one sorted batch by the first query that
+// follows them, and queries run without taking a lock.
+//-----------------------------------------------------------------------------
+class CLooseGridTree
+{
+public:
+	CLooseGridTree();
+
+	void Init( CSpatialPartition *pOwner, int iTree );
+	void Shutdown();
+
+	// Changes are queued until the next query. Removals and list changes are
+	// visible right away so a query nested in an enumeration never sees stale lists.
+	void ElementMoved( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs );
+	void RemoveFromTree( SpatialPartitionHandle_t hPartition );
+	void UpdateListMask( SpatialPartitionHandle_t hPartition );
+
+	// Applies the queued changes once queries running on other threads have finished
+	void FlushPendingChanges();
+
+	void EnumerateElementsInBox( SpatialPartitionListMask_t listMask, const Vector& mins, const Vector& maxs, IPartitionEnumerator* pIterator );
+	void EnumerateElementsInSphere( SpatialPartitionListMask_t listMask, const Vector& origin, float radius, IPartitionEnumerator* pIterator );
+	void EnumerateElementsAlongRay( SpatialPartitionListMask_t listMask, const Ray_t& ray, IPartitionEnumerator* pIterator );
+	void EnumerateElementsAtPoint( SpatialPartitionListMask_t listMask, const Vector& pt, IPartitionEnumerator* pIterator );
+
+	void ReportStats();
+
+private:
+	enum
+	{
+		NUM_LEVELS = 5,
+		HUGE_LEVEL = NUM_LEVELS - 1,	// a single cell for anything too big for the other levels
+		BASE_CELL_SHIFT = 7,			// level 0 cells are 128 units
+		LEVEL_SHIFT = 2,				// and every level up is 4 times as big
+		COORD_BITS = 9,
+		LEVEL_KEY_SHIFT = 3 * COORD_BITS,
+	};
+
+	struct Entry_t
+	{
+		Vector						m_vecMin;
+		SpatialPartitionHandle_t	m_hPartition;
+		uint16						m_nListMask;
+		Vector						m_vecMax;
+		IHandleEntity				*m_pHandleEntity;
+	};
+
+	struct Cell_t
+	{
+		Vector				m_vecLooseMin;
+		Vector				m_vecLooseMax;
+		CUtlVector<Entry_t>	m_Entries;
+	};
+
+	// Where a handle is in the grid and where it is going once the queue is flushed
+	struct Element_t
+	{
+		Vector		m_vecMin;
+		Vector		m_vecMax;
+		int			m_nCell;		// -1 when it isn't in the grid
+		int			m_nSlot;
+		uint8		m_nLevel;
+		bool		m_bInTree;
+		bool		m_bPending;
+	};
+
+	struct PendingChange_t
+	{
+		uint32						m_nKey;
+		SpatialPartitionHandle_t	m_hPartition;
+	};
+
+	static float CellSize( int nLevel )		{ return (float)( 1 << ( BASE_CELL_SHIFT + LEVEL_SHIFT * nLevel ) ); }
+	static int CellCount( int nLevel );
+	static int CellCoord( int nLevel, float flCoord, int nAxis );
+	static uint32 MakeKey( int nLevel, int x, int y, int z )	{ return ( nLevel << LEVEL_KEY_SHIFT ) | ( z << ( 2 * COORD_BITS ) ) | ( y << COORD_BITS ) | x; }
+	static uint32 ComputeKey( const Vector &vecMin, const Vector &vecMax );
+	static int SortPendingChanges( const PendingChange_t *pLeft, const PendingChange_t *pRight );
+
+	Element_t &FindOrAddElement( SpatialPartitionHandle_t hPartition );
+	Entry_t &ElementEntry( const Element_t &elem )	{ return m_Cells[elem.m_nLevel][elem.m_nCell].m_Entries[elem.m_nSlot]; }
+	void QueueChange( SpatialPartitionHandle_t hPartition, Element_t &elem );
+	int FindOrAddCell( uint32 nKey );
+	void ApplyChange( SpatialPartitionHandle_t hPartition, uint32 nKey );
+	void RemoveEntry( Element_t &elem );
+
+	bool BeginQuery();
+	void EndQuery();
+
+	template <class T> bool EnumerateCell( const Cell_t &cell, const T &intersectTest, SpatialPartitionListMask_t listMask, IPartitionEnumerator* pIterator );
+	template <class T> void Enumerate( const Vector &vecQueryMin, const Vector &vecQueryMax, const T &intersectTest, SpatialPartitionListMask_t listMask, IPartitionEnumerator* pIterator );
+
+	CSpatialPartition			*m_pOwner;
+	int							m_TreeId;
+	CUtlVector<Cell_t>			m_Cells[NUM_LEVELS];
+	int							m_nLevelElements[NUM_LEVELS];
+	CUtlHashtable<uint32, int>	m_CellIndex;
+	CUtlVector<Element_t>		m_Elements;
+	CUtlVector<SpatialPartitionHandle_t> m_PendingHandles;
+
+	// Writers take the write mutex; queries only bump the reader count. A flush
+	// holds new queries off and waits for the count to drain before it takes the
+	// write mutex, so enumerators of the queries it waits for can still queue
+	// moves and removals. The flush mutex keeps flushes from overlapping.
+	CThreadFastMutex			m_WriteMutex;
+	CThreadFastMutex			m_FlushMutex;
+	volatile int				m_nPendingCount;
+	volatile bool				m_bFlushing;
+	CInterlockedInt				m_nActiveQueries;
+	int							m_nQueryDepth[MAX_THREADS_SUPPORTED];
+
+	// Stats
+	int							m_nQueuedChanges;
+	int							m_nFlushes;
+	int							m_nAppliedChanges;
+	int							m_nCellChanges;
+	float						m_flFlushTime;
+	CInterlockedInt				m_nQueries;
+	CInterlockedInt				m_nStaleQueries;
+};
+
 //-----------------------------------------------------------------------------
 // The spatial partition
 //-----------------------------------------------------------------------------
@@ -382,6 +597,10 @@ public:
 	virtual void ReportStats( const char *pFileName );
 	virtual void DrawDebugOverlays();
 
+	virtual void BeginConcurrentQueries();
+	virtual void EndConcurrentQueries();
+	virtual bool IsInConcurrentQueries() const	{ return m_nConcurrentQueryDepth > 0; }
+
 	// Gets entity info (for enumerations).
 	EntityInfo_t &EntityInfo( SpatialPartitionHandle_t hPartition );
 
@@ -390,22 +609,41 @@ public:
 
 	CVoxelTree * VoxelTree( SpatialPartitionListMask_t listMask );
 	CVoxelTree * VoxelTreeForHandle( SpatialPartitionHandle_t handle );
+	CLooseGridTree * LooseGrid( SpatialPartitionListMask_t listMask );
+
+	typedef CUtlLinkedList<EntityInfo_t, SpatialPartitionHandle_t, false, SpatialPartitionHandle_t, CUtlMemoryStack<UtlLinkedListElem_t< EntityInfo_t, SpatialPartitionHandle_t >, SpatialPartitionHandle_t, 0xffff, 1024> > CHandleList;
+	CHandleList &Handles()	{ return m_aHandles; }
 
 protected:
 	void UpdateListMask( SpatialPartitionHandle_t hPartition, uint16 nListMask );
 	// Invokes the pre-query callbacks.
 	void InvokeQueryCallbacks( SpatialPartitionListMask_t listMask, bool = false );
+	// Runs the same box queries against the voxel trees and the loose grids
+	void CompareImplementations();
 
-	typedef CUtlLinkedList<EntityInfo_t, SpatialPartitionHandle_t, false, SpatialPartitionHandle_t, CUtlMemoryStack<UtlLinkedListElem_t< EntityInfo_t, SpatialPartitionHandle_t >, SpatialPartitionHandle_t, 0xffff, 1024> > CHandleList;
+	// Forward element changes to whichever implementations are active
+	void TreeElementMoved( int iTree, SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs, bool bInsert );
+	void TreeRemove( int iTree, SpatialPartitionHandle_t hPartition );
+	void TreeUpdateListMask( int iTree, SpatialPartitionHandle_t hPartition );
 
 private:
 	CHandleList												m_aHandles;  								// Stores all unique elements (1 per entity in tree).
 	CThreadFastMutex										m_HandlesMutex;
 
 	CVoxelTree												m_VoxelTrees[NUM_TREES];
+	CLooseGridTree											m_LooseGrids[NUM_TREES];
+	CTriggerPartitionIndex									m_TriggerIndex;
+
+	// Picked at Init from the command line. With -partition_compare both are kept up to date
+	bool													m_bUseLooseGrid;		// Queries are answered by the loose grids.
+	bool													m_bKeepVoxelTrees;		// The voxel trees are maintained.
+	double													m_flVoxelUpdateTime;	// Time spent updating each implementation, compare mode only.
+	double													m_flGridUpdateTime;
+	int														m_nComparedUpdates;
 
 	IPartitionQueryCallback									*m_pQueryCallback[MAX_QUERY_CALLBACK];		// Query callbacks.
 	int														m_nQueryCallbackCount;						// Number of query callbacks.
+	int														m_nConcurrentQueryDepth;					// Nesting of BeginConcurrentQueries, main thread only.
 
 	// Debug!
 	SpatialPartitionListMask_t								m_nSuppressedListMask;
@@ -471,6 +709,12 @@ inline CVoxelTree *CSpatialPartition::VoxelTree( SpatialPartitionListMask_t list
 	return &m_VoxelTrees[iTree];
 }
 
+inline CLooseGridTree *CSpatialPartition::LooseGrid( SpatialPartitionListMask_t listMask )
+{
+	int iTree = ( ( listMask & PARTITION_ALL_CLIENT_EDICTS ) == 0 ) ? SERVER_TREE : CLIENT_TREE;
+	return &m_LooseGrids[iTree];
+}
+
 inline CVoxelTree *CSpatialPartition::VoxelTreeForHandle( SpatialPartitionHandle_t handle )
 {
 	return VoxelTree( m_aHandles[handle].m_fList );
@@ -2707,6 +2951,12 @@ ISpatialPartitionInternal *SpatialPartition()
 CSpatialPartition::CSpatialPartition()
 {
 	m_nQueryCallbackCount = 0;
+	m_nConcurrentQueryDepth = 0;
+	m_bUseLooseGrid = false;
+	m_bKeepVoxelTrees = true;
+	m_flVoxelUpdateTime = 0.0;
+	m_flGridUpdateTime = 0.0;
+	m_nComparedUpdates = 0;
 }
 
 
@@ -2727,10 +2977,20 @@ void CSpatialPartition::Init( const Vector &worldmin, const Vector &worldmax )
 	m_aHandles.Purge();
 	m_aHandles.EnsureCapacity( SPHASH_HANDLELIST_BLOCK );
 
+	bool bCompare = ( CommandLine()->FindParm( "-partition_compare" ) != 0 );
+	m_bUseLooseGrid = bCompare || ( CommandLine()->FindParm( "-partition_loosegrid" ) != 0 );
+	m_bKeepVoxelTrees = bCompare || !m_bUseLooseGrid;
+	m_flVoxelUpdateTime = 0.0;
+	m_flGridUpdateTime = 0.0;
+	m_nComparedUpdates = 0;
+
 	for ( int i = 0; i < NUM_TREES; i++ )
 	{
 		m_VoxelTrees[i].Init( this, i, worldmin, worldmax );
+		m_LooseGrids[i].Init( this, i );
 	}
+
+	m_TriggerIndex.Init( this );
 }
 
 //-----------------------------------------------------------------------------
@@ -2741,7 +3001,9 @@ void CSpatialPartition::Shutdown( void )
 	for ( int i = 0; i < NUM_TREES; i++ )
 	{
 		m_VoxelTrees[i].Shutdown();
+		m_LooseGrids[i].Shutdown();
 	}
+	m_TriggerIndex.Shutdown();
 	m_aHandles.Purge();
 }
 
@@ -2790,6 +3052,11 @@ void CSpatialPartition::RemoveQueryCallback( IPartitionQueryCallback *pCallback
 //-----------------------------------------------------------------------------
 void CSpatialPartition::InvokeQueryCallbacks( SpatialPartitionListMask_t listMask, bool bDone )
 {
+	// The callbacks were flushed when the concurrent phase began, and since nothing may move
+	// until it ends there is nothing for them to do. They also aren't safe off the main thread.
+	if ( m_nConcurrentQueryDepth > 0 )
+		return;
+
 	for ( int iQuery = 0; iQuery < m_nQueryCallbackCount; ++iQuery )
 	{
 		if ( !bDone )
@@ -2803,6 +3070,46 @@ void CSpatialPartition::InvokeQueryCallbacks( SpatialPartitionListMask_t listMas
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Starts a phase in which the partition is read only and can be
+//          queried from any thread. Must be called on the main thread.
+//-----------------------------------------------------------------------------
+void CSpatialPartition::BeginConcurrentQueries()
+{
+	Assert( ThreadInMainThread() );
+	if ( m_nConcurrentQueryDepth == 0 )
+	{
+		// Let the game bring every dirty element up to date now, since the callbacks are skipped until the phase ends
+		SpatialPartitionListMask_t listMask = PARTITION_ALL_CLIENT_EDICTS | PARTITION_SERVER_GAME_EDICTS;
+		InvokeQueryCallbacks( listMask );
+		InvokeQueryCallbacks( listMask, true );
+
+		m_TriggerIndex.SetReadOnly( true );
+		if ( m_bUseLooseGrid )
+		{
+			for ( int i = 0; i < NUM_TREES; i++ )
+			{
+				m_LooseGrids[i].FlushPendingChanges();
+			}
+		}
+	}
+
+	++m_nConcurrentQueryDepth;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Ends the phase started by BeginConcurrentQueries. All queries
+//          issued from other threads must have completed.
+//-----------------------------------------------------------------------------
+void CSpatialPartition::EndConcurrentQueries()
+{
+	Assert( ThreadInMainThread() && m_nConcurrentQueryDepth > 0 );
+	if ( --m_nConcurrentQueryDepth > 0 )
+		return;
+
+	m_TriggerIndex.SetReadOnly( false );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Create spatial partition object handle.
 //   Input: pHandleEntity - entity handle of the object to create a spatial partition handle for
@@ -2871,19 +3178,94 @@ void CSpatialPartition::UpdateListMask( SpatialPartitionHandle_t hPartition, uin
 	EntityInfo_t &entityInfo = EntityInfo( hPartition );
 	if ( entityInfo.m_fList != nListMask )
 	{
+		AssertMsg( m_nConcurrentQueryDepth == 0, "Spatial partition list changed during a concurrent query phase\n" );
+
+		uint16 nChangedLists = entityInfo.m_fList ^ nListMask;
 		entityInfo.m_fList = nListMask;
 
 		if ( entityInfo.m_flags & IN_CLIENT_TREE )
 		{
-			m_VoxelTrees[CLIENT_TREE].UpdateListMask( hPartition ); 
+			TreeUpdateListMask( CLIENT_TREE, hPartition ); 
 		}
 
 		if ( entityInfo.m_flags & IN_SERVER_TREE )
 		{
-			m_VoxelTrees[SERVER_TREE].UpdateListMask( hPartition ); 
+			TreeUpdateListMask( SERVER_TREE, hPartition ); 
+		}
+
+		if ( nChangedLists & PARTITION_ENGINE_TRIGGER_EDICTS )
+		{
+			m_TriggerIndex.ElementChanged( hPartition );
+		}
+	}
+}
+//-----------------------------------------------------------------------------
+// Purpose: Forwards element changes to the voxel tree and/or loose grid
+//-----------------------------------------------------------------------------
+void CSpatialPartition::TreeElementMoved( int iTree, SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs, bool bInsert )
+{
+	if ( !m_bUseLooseGrid || !m_bKeepVoxelTrees )
+	{
+		if ( m_bUseLooseGrid )
+		{
+			m_LooseGrids[iTree].ElementMoved( hPartition, mins, maxs );
+		}
+		else if ( bInsert )
+		{
+			m_VoxelTrees[iTree].InsertIntoTree( hPartition, mins, maxs, false );
+		}
+		else
+		{
+			m_VoxelTrees[iTree].ElementMoved( hPartition, mins, maxs );
 		}
+		return;
+	}
+
+	// Both are kept up to date, time them for ReportStats
+	double flStartTime = Plat_FloatTime();
+	if ( bInsert )
+	{
+		m_VoxelTrees[iTree].InsertIntoTree( hPartition, mins, maxs, false );
+	}
+	else
+	{
+		m_VoxelTrees[iTree].ElementMoved( hPartition, mins, maxs );
+	}
+	double flVoxelTime = Plat_FloatTime();
+	m_LooseGrids[iTree].ElementMoved( hPartition, mins, maxs );
+	double flEndTime = Plat_FloatTime();
+
+	m_flVoxelUpdateTime += flVoxelTime - flStartTime;
+	m_flGridUpdateTime += flEndTime - flVoxelTime;
+	++m_nComparedUpdates;
+}
+
+void CSpatialPartition::TreeRemove( int iTree, SpatialPartitionHandle_t hPartition )
+{
+	if ( m_bKeepVoxelTrees )
+	{
+		m_VoxelTrees[iTree].RemoveFromTree( hPartition );
+	}
+
+	if ( m_bUseLooseGrid )
+	{
+		m_LooseGrids[iTree].RemoveFromTree( hPartition );
+	}
+}
+
+void CSpatialPartition::TreeUpdateListMask( int iTree, SpatialPartitionHandle_t hPartition )
+{
+	if ( m_bKeepVoxelTrees )
+	{
+		m_VoxelTrees[iTree].UpdateListMask( hPartition );
+	}
+
+	if ( m_bUseLooseGrid )
+	{
+		m_LooseGrids[iTree].UpdateListMask( hPartition );
 	}
 }
+
 //-----------------------------------------------------------------------------
 // Purpose: Insert object handle into group(s).
 //   Input: listId - list(s) to insert the object handle into
@@ -2992,29 +3374,35 @@ SpatialPartitionListMask_t CSpatialPartition::GetSuppressedLists( void )
 //-----------------------------------------------------------------------------
 void CSpatialPartition::ElementMoved( SpatialPartitionHandle_t handle, const Vector& mins, const Vector& maxs )
 {
+	AssertMsg( m_nConcurrentQueryDepth == 0, "Spatial partition element moved during a concurrent query phase\n" );
+
 	EntityInfo_t &entityInfo = EntityInfo( handle );
 	SpatialPartitionListMask_t listMask = entityInfo.m_fList;
 
-
 	if ( CLIENT_TREE != SERVER_TREE )
 	{
 		if ( listMask & PARTITION_ALL_CLIENT_EDICTS )
 		{
-			m_VoxelTrees[CLIENT_TREE].ElementMoved( handle, mins, maxs );
+			TreeElementMoved( CLIENT_TREE, handle, mins, maxs, false );
 			entityInfo.m_flags |= IN_CLIENT_TREE;
 		}
 
 		if ( listMask & ~PARTITION_ALL_CLIENT_EDICTS )
 		{
-			m_VoxelTrees[SERVER_TREE].ElementMoved( handle, mins, maxs );
+			TreeElementMoved( SERVER_TREE, handle, mins, maxs, false );
 			entityInfo.m_flags |= IN_SERVER_TREE;
 		}
 	}
 	else
 	{
-		m_VoxelTrees[CLIENT_TREE].ElementMoved( handle, mins, maxs );
+		TreeElementMoved( CLIENT_TREE, handle, mins, maxs, false );
 		entityInfo.m_flags |= IN_CLIENT_TREE;
 	}
+
+	if ( listMask & PARTITION_ENGINE_TRIGGER_EDICTS )
+	{
+		m_TriggerIndex.ElementChanged( handle );
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -3025,7 +3413,17 @@ void CSpatialPartition::EnumerateElementsInBox( SpatialPartitionListMask_t listM
 	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
 	CVoxelTree *pTree = VoxelTree( listMask );
 	InvokeQueryCallbacks( listMask );
-	pTree->EnumerateElementsInBox( listMask, mins, maxs, coarseTest, pIterator );
+	if ( listMask != PARTITION_ENGINE_TRIGGER_EDICTS || !m_TriggerIndex.EnumerateElementsInBox( listMask, mins, maxs, pIterator ) )
+	{
+		if ( m_bUseLooseGrid )
+		{
+			LooseGrid( listMask )->EnumerateElementsInBox( listMask, mins, maxs, pIterator );
+		}
+		else
+		{
+			pTree->EnumerateElementsInBox( listMask, mins, maxs, coarseTest, pIterator );
+		}
+	}
 	InvokeQueryCallbacks( listMask, true );
 }
 
@@ -3037,7 +3435,14 @@ void CSpatialPartition::EnumerateElementsInSphere( SpatialPartitionListMask_t li
 	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
 	CVoxelTree *pTree = VoxelTree( listMask );
 	InvokeQueryCallbacks( listMask );
-	pTree->EnumerateElementsInSphere( listMask, origin, radius, coarseTest, pIterator );
+	if ( m_bUseLooseGrid )
+	{
+		LooseGrid( listMask )->EnumerateElementsInSphere( listMask, origin, radius, pIterator );
+	}
+	else
+	{
+		pTree->EnumerateElementsInSphere( listMask, origin, radius, coarseTest, pIterator );
+	}
 	InvokeQueryCallbacks( listMask, true );
 }
 
@@ -3049,7 +3454,17 @@ void CSpatialPartition::EnumerateElementsAlongRay( SpatialPartitionListMask_t li
 	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
 	CVoxelTree *pTree = VoxelTree( listMask );
 	InvokeQueryCallbacks( listMask );
-	pTree->EnumerateElementsAlongRay( listMask, ray, coarseTest, pIterator );
+	if ( listMask != PARTITION_ENGINE_TRIGGER_EDICTS || !m_TriggerIndex.EnumerateElementsAlongRay( listMask, ray, pIterator ) )
+	{
+		if ( m_bUseLooseGrid )
+		{
+			LooseGrid( listMask )->EnumerateElementsAlongRay( listMask, ray, pIterator );
+		}
+		else
+		{
+			pTree->EnumerateElementsAlongRay( listMask, ray, coarseTest, pIterator );
+		}
+	}
 	InvokeQueryCallbacks( listMask, true );
 }
 
@@ -3061,7 +3476,14 @@ void CSpatialPartition::EnumerateElementsAtPoint( SpatialPartitionListMask_t lis
 	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
 	CVoxelTree *pTree = VoxelTree( listMask );
 	InvokeQueryCallbacks( listMask );
-	pTree->EnumerateElementsAtPoint( listMask, pt, coarseTest, pIterator );
+	if ( m_bUseLooseGrid )
+	{
+		LooseGrid( listMask )->EnumerateElementsAtPoint( listMask, pt, pIterator );
+	}
+	else
+	{
+		pTree->EnumerateElementsAtPoint( listMask, pt, coarseTest, pIterator );
+	}
 	InvokeQueryCallbacks( listMask, true );
 }
 
@@ -3071,6 +3493,8 @@ void CSpatialPartition::EnumerateElementsAtPoint( SpatialPartitionListMask_t lis
 //-----------------------------------------------------------------------------
 void CSpatialPartition::InsertIntoTree( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs ) 
 {
+	AssertMsg( m_nConcurrentQueryDepth == 0, "Spatial partition element inserted during a concurrent query phase\n" );
+
 	EntityInfo_t &entityInfo = EntityInfo( hPartition );
 	SpatialPartitionListMask_t listMask = entityInfo.m_fList;
 
@@ -3078,21 +3502,26 @@ void CSpatialPartition::InsertIntoTree( SpatialPartitionHandle_t hPartition, con
 	{
 		if ( ( listMask & PARTITION_ALL_CLIENT_EDICTS ) && !( entityInfo.m_flags & IN_CLIENT_TREE ) )
 		{
-			m_VoxelTrees[CLIENT_TREE].InsertIntoTree( hPartition, mins, maxs, false );
+			TreeElementMoved( CLIENT_TREE, hPartition, mins, maxs, true );
 			entityInfo.m_flags |= IN_CLIENT_TREE;
 		}
 
 		if ( ( listMask & ~PARTITION_ALL_CLIENT_EDICTS ) && !( entityInfo.m_flags & IN_SERVER_TREE ) )
 		{
-			m_VoxelTrees[SERVER_TREE].InsertIntoTree( hPartition, mins, maxs, false );
+			TreeElementMoved( SERVER_TREE, hPartition, mins, maxs, true );
 			entityInfo.m_flags |= IN_SERVER_TREE;
 		}
 	}
 	else if ( !( entityInfo.m_flags & IN_CLIENT_TREE ) )
 	{
-		m_VoxelTrees[CLIENT_TREE].InsertIntoTree( hPartition, mins, maxs, false );
+		TreeElementMoved( CLIENT_TREE, hPartition, mins, maxs, true );
 		entityInfo.m_flags |= IN_CLIENT_TREE;
 	}
+
+	if ( listMask & PARTITION_ENGINE_TRIGGER_EDICTS )
+	{
+		m_TriggerIndex.ElementChanged( hPartition );
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -3100,79 +3529,1200 @@ void CSpatialPartition::InsertIntoTree( SpatialPartitionHandle_t hPartition, con
 //-----------------------------------------------------------------------------
 void CSpatialPartition::RemoveFromTree( SpatialPartitionHandle_t hPartition ) 
 { 
+	AssertMsg( m_nConcurrentQueryDepth == 0, "Spatial partition element removed during a concurrent query phase\n" );
+
 	EntityInfo_t &entityInfo = EntityInfo( hPartition );
 
 	if ( entityInfo.m_flags & IN_CLIENT_TREE )
 	{
-		m_VoxelTrees[CLIENT_TREE].RemoveFromTree( hPartition ); 
+		TreeRemove( CLIENT_TREE, hPartition ); 
 		entityInfo.m_flags &= ~IN_CLIENT_TREE;
 	}
 
 	if ( entityInfo.m_flags & IN_SERVER_TREE )
 	{
-		m_VoxelTrees[SERVER_TREE].RemoveFromTree( hPartition ); 
+		TreeRemove( SERVER_TREE, hPartition ); 
 		entityInfo.m_flags &= ~IN_SERVER_TREE;
 	}
+
+	if ( entityInfo.m_fList & PARTITION_ENGINE_TRIGGER_EDICTS )
+	{
+		m_TriggerIndex.ElementChanged( hPartition );
+	}
 }
 
 //-----------------------------------------------------------------------------
-// Purpose:
+// Trigger index
 //-----------------------------------------------------------------------------
-void CSpatialPartition::RenderObjectsInBox( const Vector &vecMin, const Vector &vecMax, float flTime )
+static ConVar partition_trigger_index( "partition_trigger_index", "1", 0, "Use a bounding volume hierarchy for trigger list queries instead of the voxel hash." );
+
+CTriggerPartitionIndex::CTriggerPartitionIndex()
+{
+	m_pOwner = NULL;
+	m_nTreeElements = 0;
+	m_nRemoved = 0;
+	m_nRefits = 0;
+	m_bDirty = true;
+	m_bReadOnly = false;
+	m_nRebuilds = 0;
+	m_nQueries = 0;
+	m_nUpdates = 0;
+	m_flRebuildTime = 0.0f;
+}
+
+void CTriggerPartitionIndex::Init( CSpatialPartition *pOwner )
 {
+	m_pOwner = pOwner;
+	m_Elements.Purge();
+	m_Nodes.Purge();
+	m_ElementIndex.Purge();
+	m_nTreeElements = 0;
+	m_nRemoved = 0;
+	m_nRefits = 0;
+	m_bDirty = true;
+	m_bReadOnly = false;
+	m_nRebuilds = 0;
+	m_nQueries = 0;
+	m_nUpdates = 0;
+	m_flRebuildTime = 0.0f;
 }
 
+void CTriggerPartitionIndex::Shutdown()
+{
+	m_Elements.Purge();
+	m_Nodes.Purge();
+	m_ElementIndex.Purge();
+	m_nTreeElements = 0;
+	m_bDirty = true;
+}
 
 //-----------------------------------------------------------------------------
-// Purpose:
+// Sorts elements by their center along one axis
 //-----------------------------------------------------------------------------
-void CSpatialPartition::RenderObjectsInSphere( const Vector &vecCenter, float flRadius, float flTime )
+static int s_nTriggerIndexSortAxis;
+
+template <class T>
+static int __cdecl TriggerIndexCenterCompare( const T *pLeft, const T *pRight )
 {
+	float flLeft = pLeft->m_flCenter[s_nTriggerIndexSortAxis];
+	float flRight = pRight->m_flCenter[s_nTriggerIndexSortAxis];
+	return ( flLeft < flRight ) ? -1 : ( ( flLeft > flRight ) ? 1 : 0 );
 }
 
+//-----------------------------------------------------------------------------
+// Builds the subtree for a range of elements into an already allocated node
+//-----------------------------------------------------------------------------
+void CTriggerPartitionIndex::BuildNode( int nNode, int nParent, int nFirst, int nCount )
+{
+	Node_t node;
+	node.m_vecMin.Init( FLT_MAX, FLT_MAX, FLT_MAX );
+	node.m_vecMax.Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	node.m_nParent = nParent;
+
+	Vector vecCenterMin( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecCenterMax( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = nFirst; i < nFirst + nCount; ++i )
+	{
+		const Element_t &elem = m_Elements[i];
+		VectorMin( node.m_vecMin, elem.m_vecMin, node.m_vecMin );
+		VectorMax( node.m_vecMax, elem.m_vecMax, node.m_vecMax );
+		for ( int j = 0; j < 3; ++j )
+		{
+			vecCenterMin[j] = MIN( vecCenterMin[j], elem.m_flCenter[j] );
+			vecCenterMax[j] = MAX( vecCenterMax[j], elem.m_flCenter[j] );
+		}
+	}
+
+	if ( nCount <= MAX_LEAF_ELEMENTS )
+	{
+		node.m_nFirst = nFirst;
+		node.m_nCount = nCount;
+		m_Nodes[nNode] = node;
+		for ( int i = nFirst; i < nFirst + nCount; ++i )
+		{
+			m_Elements[i].m_nLeaf = nNode;
+		}
+		return;
+	}
 
-void CSpatialPartition::RenderObjectsAlongRay( const Ray_t& ray, float flTime )
+	// Median split along the axis where the element centers are spread the most
+	Vector vecSpread = vecCenterMax - vecCenterMin;
+	s_nTriggerIndexSortAxis = ( vecSpread.x > vecSpread.y ) ? ( ( vecSpread.x > vecSpread.z ) ? 0 : 2 ) : ( ( vecSpread.y > vecSpread.z ) ? 1 : 2 );
+	qsort( m_Elements.Base() + nFirst, nCount, sizeof( Element_t ), ( int (__cdecl *)( const void *, const void * ) )TriggerIndexCenterCompare<Element_t> );
+
+	// Children are allocated as a pair so the second one is always m_nFirst + 1
+	int nHalf = nCount / 2;
+	int nChildren = m_Nodes.AddMultipleToTail( 2 );
+	node.m_nFirst = nChildren;
+	node.m_nCount = 0;
+	m_Nodes[nNode] = node;
+
+	BuildNode( nChildren, nNode, nFirst, nHalf );
+	BuildNode( nChildren + 1, nNode, nFirst + nHalf, nCount - nHalf );
+}
+
+//-----------------------------------------------------------------------------
+// Gathers every trigger from the handle list and rebuilds the hierarchy
+//-----------------------------------------------------------------------------
+void CTriggerPartitionIndex::Rebuild()
 {
+	double flStartTime = Plat_FloatTime();
+
+	m_Elements.RemoveAll();
+	m_Nodes.RemoveAll();
+
+	CSpatialPartition::CHandleList &handles = m_pOwner->Handles();
+	for ( SpatialPartitionHandle_t h = handles.Head(); h != handles.InvalidIndex(); h = handles.Next( h ) )
+	{
+		const EntityInfo_t &info = handles[h];
+		if ( !( info.m_fList & PARTITION_ENGINE_TRIGGER_EDICTS ) || !( info.m_flags & IN_SERVER_TREE ) )
+			continue;
+
+		Element_t &elem = m_Elements[ m_Elements.AddToTail() ];
+		elem.m_vecMin = info.m_vecMin;
+		elem.m_vecMax = info.m_vecMax;
+		elem.m_hPartition = h;
+		for ( int j = 0; j < 3; ++j )
+		{
+			elem.m_flCenter[j] = 0.5f * ( info.m_vecMin[j] + info.m_vecMax[j] );
+		}
+	}
+
+	if ( m_Elements.Count() )
+	{
+		// Node 0 is always the root
+		BuildNode( m_Nodes.AddToTail(), -1, 0, m_Elements.Count() );
+	}
+
+	// Sorting moved the elements around, so map the handles afterwards
+	for ( int i = 0; i < m_ElementIndex.Count(); ++i )
+	{
+		m_ElementIndex[i] = NOT_INDEXED;
+	}
+	for ( int i = 0; i < m_Elements.Count(); ++i )
+	{
+		SpatialPartitionHandle_t h = m_Elements[i].m_hPartition;
+		while ( m_ElementIndex.Count() <= h )
+		{
+			m_ElementIndex.AddToTail( NOT_INDEXED );
+		}
+		m_ElementIndex[h] = i;
+	}
+
+	m_nTreeElements = m_Elements.Count();
+	m_nRemoved = 0;
+	m_nRefits = 0;
+	m_bDirty = false;
+	++m_nRebuilds;
+	m_flRebuildTime += ( float )( Plat_FloatTime() - flStartTime );
 }
 
-	
 //-----------------------------------------------------------------------------
-// Report stats
+// Recomputes the bounds of a leaf and everything above it
 //-----------------------------------------------------------------------------
-void CSpatialPartition::RenderAllObjectsInTree( float flTime )
+void CTriggerPartitionIndex::Refit( int nNode )
 {
-	for ( int i = 0; i < NUM_TREES; i++ )
+	Node_t &leaf = m_Nodes[nNode];
+	Assert( leaf.m_nCount > 0 );
+	leaf.m_vecMin.Init( FLT_MAX, FLT_MAX, FLT_MAX );
+	leaf.m_vecMax.Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = leaf.m_nFirst; i < leaf.m_nFirst + leaf.m_nCount; ++i )
 	{
-		m_VoxelTrees[i].RenderAllObjectsInTree( flTime );
+		VectorMin( leaf.m_vecMin, m_Elements[i].m_vecMin, leaf.m_vecMin );
+		VectorMax( leaf.m_vecMax, m_Elements[i].m_vecMax, leaf.m_vecMax );
+	}
+
+	for ( int nParent = leaf.m_nParent; nParent >= 0; nParent = m_Nodes[nParent].m_nParent )
+	{
+		Node_t &node = m_Nodes[nParent];
+		const Node_t &left = m_Nodes[node.m_nFirst];
+		const Node_t &right = m_Nodes[node.m_nFirst + 1];
+		VectorMin( left.m_vecMin, right.m_vecMin, node.m_vecMin );
+		VectorMax( left.m_vecMax, right.m_vecMax, node.m_vecMax );
 	}
+
+	++m_nRefits;
 }
 
-void CSpatialPartition::RenderObjectsInPlayerLeafs( const Vector &vecPlayerMin, const Vector &vecPlayerMax, float flTime )
+//-----------------------------------------------------------------------------
+// Empties the slot of an element in the hierarchy, or drops an unindexed one
+//-----------------------------------------------------------------------------
+void CTriggerPartitionIndex::RemoveElement( int nElement )
 {
-	for ( int i = 0; i < NUM_TREES; i++ )
+	Element_t &elem = m_Elements[nElement];
+	m_ElementIndex[elem.m_hPartition] = NOT_INDEXED;
+
+	if ( nElement < m_nTreeElements )
 	{
-		m_VoxelTrees[i].RenderObjectsInPlayerLeafs( vecPlayerMin, vecPlayerMax, flTime );
+		// An inverted box keeps the bounds above it from growing
+		elem.m_hPartition = PARTITION_INVALID_HANDLE;
+		elem.m_vecMin.Init( FLT_MAX, FLT_MAX, FLT_MAX );
+		elem.m_vecMax.Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+		Refit( elem.m_nLeaf );
+		++m_nRemoved;
+		return;
+	}
+
+	// Unindexed elements are at the tail, so the one swapped in is unindexed too
+	m_Elements.FastRemove( nElement );
+	if ( nElement < m_Elements.Count() )
+	{
+		m_ElementIndex[ m_Elements[nElement].m_hPartition ] = nElement;
 	}
 }
 
 //-----------------------------------------------------------------------------
-// Report stats
+// Rebuilds on the next query once the updates have made the hierarchy loose
 //-----------------------------------------------------------------------------
-void CVoxelTree::ReportStats( const char *pFileName )
+void CTriggerPartitionIndex::UpdateDirty()
 {
-	Msg( "Histogram : Entities per level\n" );
-	for ( int i = 0; i < m_nLevelCount; ++i )
+	int nUnindexed = m_Elements.Count() - m_nTreeElements;
+	int nChangeLimit = MAX( (int)MIN_REBUILD_CHANGES, m_nTreeElements / 8 );
+	if ( nUnindexed + m_nRemoved > nChangeLimit || m_nRefits > MAX( (int)MIN_REBUILD_CHANGES, m_nTreeElements * 4 ) )
 	{
-		Msg( "\t%d - %d\n", i, m_pVoxelHash[i].EntityCount() );
+		m_bDirty = true;
 	}
 }
 
-void CSpatialPartition::ReportStats( const char *pFileName )
+//-----------------------------------------------------------------------------
+// Applies an insert, move, removal or list change of a single element
+//-----------------------------------------------------------------------------
+void CTriggerPartitionIndex::ElementChanged( SpatialPartitionHandle_t hPartition )
 {
-	Msg( "Handle Count %d (%d bytes)\n", m_aHandles.Count(), m_aHandles.Count() * ( sizeof(EntityInfo_t) + 2 * sizeof(SpatialPartitionHandle_t) ) );
-	for ( int i = 0; i < NUM_TREES; i++ )
+	AUTO_LOCK( m_Mutex );
+
+	// Nothing to update until the first query builds the hierarchy
+	if ( m_bDirty || !m_pOwner )
+		return;
+
+	const EntityInfo_t &info = m_pOwner->Handles()[hPartition];
+	bool bIndexed = ( info.m_fList & PARTITION_ENGINE_TRIGGER_EDICTS ) && ( info.m_flags & IN_SERVER_TREE );
+	int nElement = ( hPartition < m_ElementIndex.Count() ) ? m_ElementIndex[hPartition] : (int)NOT_INDEXED;
+
+	if ( !bIndexed )
+	{
+		if ( nElement != NOT_INDEXED )
+		{
+			RemoveElement( nElement );
+			++m_nUpdates;
+			UpdateDirty();
+		}
+		return;
+	}
+
+	if ( nElement == NOT_INDEXED )
+	{
+		while ( m_ElementIndex.Count() <= hPartition )
+		{
+			m_ElementIndex.AddToTail( NOT_INDEXED );
+		}
+		nElement = m_Elements.AddToTail();
+		m_ElementIndex[hPartition] = nElement;
+		m_Elements[nElement].m_hPartition = hPartition;
+		m_Elements[nElement].m_nLeaf = -1;
+	}
+	else if ( VectorsAreEqual( m_Elements[nElement].m_vecMin, info.m_vecMin ) && VectorsAreEqual( m_Elements[nElement].m_vecMax, info.m_vecMax ) )
+	{
+		return;
+	}
+
+	Element_t &elem = m_Elements[nElement];
+	elem.m_vecMin = info.m_vecMin;
+	elem.m_vecMax = info.m_vecMax;
+	if ( nElement < m_nTreeElements )
+	{
+		Refit( elem.m_nLeaf );
+	}
+
+	++m_nUpdates;
+	UpdateDirty();
+}
+
+//-----------------------------------------------------------------------------
+// Makes sure the hierarchy is current and keeps it locked while it's walked
+//-----------------------------------------------------------------------------
+bool CTriggerPartitionIndex::BeginQuery()
+{
+	if ( !partition_trigger_index.GetBool() || !m_pOwner )
+		return false;
+
+	++m_nQueries;
+
+	// Nothing can change the hierarchy while it's read only, so any number of threads can walk it
+	if ( m_bReadOnly )
+		return true;
+
+	m_Mutex.Lock();
+	if ( m_bDirty )
+	{
+		Rebuild();
+	}
+	return true;
+}
+
+void CTriggerPartitionIndex::EndQuery()
+{
+	if ( m_bReadOnly )
+		return;
+
+	m_Mutex.Unlock();
+}
+
+void CTriggerPartitionIndex::SetReadOnly( bool bReadOnly )
+{
+	AUTO_LOCK( m_Mutex );
+	if ( bReadOnly && m_bDirty && m_pOwner )
+	{
+		Rebuild();
+	}
+	m_bReadOnly = bReadOnly;
+}
+
+class CTriggerIndexIntersectBox
+{
+public:
+	CTriggerIndexIntersectBox( const Vector &vecMins, const Vector &vecMaxs ) : m_vecMins( vecMins ), m_vecMaxs( vecMaxs )
+	{
+	}
+
+	bool Intersects( const Vector &vecMins, const Vector &vecMaxs ) const
+	{
+		return ( vecMins.x <= m_vecMaxs.x ) && ( vecMaxs.x >= m_vecMins.x ) &&
+				( vecMins.y <= m_vecMaxs.y ) && ( vecMaxs.y >= m_vecMins.y ) &&
+				( vecMins.z <= m_vecMaxs.z ) && ( vecMaxs.z >= m_vecMins.z );
+	}
+
+private:
+	const Vector &m_vecMins;
+	const Vector &m_vecMaxs;
+};
+
+class CTriggerIndexIntersectSweptBox
+{
+public:
+	CTriggerIndexIntersectSweptBox( const Ray_t &ray )
+	{
+		Vector vecInvDelta;
+		vecInvDelta[0] = ( ray.m_Delta[0] != 0.0f ) ? 1.0f / ray.m_Delta[0] : FLT_MAX;
+		vecInvDelta[1] = ( ray.m_Delta[1] != 0.0f ) ? 1.0f / ray.m_Delta[1] : FLT_MAX;
+		vecInvDelta[2] = ( ray.m_Delta[2] != 0.0f ) ? 1.0f / ray.m_Delta[2] : FLT_MAX;
+
+		m_f4Start = LoadUnaligned3SIMD( ray.m_Start.Base() );
+		m_f4Delta = LoadUnaligned3SIMD( ray.m_Delta.Base() );
+		m_f4InvDelta = LoadUnaligned3SIMD( vecInvDelta.Base() );
+		m_f4Extents = LoadUnaligned3SIMD( ray.m_Extents.Base() );
+	}
+
+	bool Intersects( const Vector &vecMins, const Vector &vecMaxs ) const
+	{
+		fltx4 f4Mins = LoadUnaligned3SIMD( vecMins.Base() );
+		fltx4 f4Maxs = LoadUnaligned3SIMD( vecMaxs.Base() );
+		return IsBoxIntersectingRay( SubSIMD( f4Mins, m_f4Extents ), AddSIMD( f4Maxs, m_f4Extents ), m_f4Start, m_f4Delta, m_f4InvDelta );
+	}
+
+private:
+	fltx4 m_f4Start;
+	fltx4 m_f4Delta;
+	fltx4 m_f4InvDelta;
+	fltx4 m_f4Extents;
+};
+
+//-----------------------------------------------------------------------------
+// Collects the elements that pass the test, the enumerator is called once
+// the hierarchy is unlocked so it can move or remove triggers
+//-----------------------------------------------------------------------------
+template <class T> 
+void CTriggerPartitionIndex::Enumerate( const T &intersectTest, SpatialPartitionListMask_t listMask, HitList_t &hits )
+{
+	CSpatialPartition::CHandleList &handles = m_pOwner->Handles();
+
+	int pStack[MAX_DEPTH];
+	int nStackCount = 0;
+	if ( m_Nodes.Count() )
+	{
+		pStack[nStackCount++] = 0;
+	}
+
+	while ( nStackCount )
+	{
+		const Node_t &node = m_Nodes[ pStack[--nStackCount] ];
+		if ( !intersectTest.Intersects( node.m_vecMin, node.m_vecMax ) )
+			continue;
+
+		if ( node.m_nCount == 0 )
+		{
+			Assert( nStackCount + 2 <= MAX_DEPTH );
+			pStack[nStackCount++] = node.m_nFirst + 1;
+			pStack[nStackCount++] = node.m_nFirst;
+			continue;
+		}
+
+		for ( int i = node.m_nFirst; i < node.m_nFirst + node.m_nCount; ++i )
+		{
+			// The inverted box of a removed element doesn't stop a swept test
+			const Element_t &elem = m_Elements[i];
+			if ( elem.m_hPartition == PARTITION_INVALID_HANDLE || !intersectTest.Intersects( elem.m_vecMin, elem.m_vecMax ) )
+				continue;
+
+			// List membership and hiding can change without an update
+			const EntityInfo_t &info = handles[elem.m_hPartition];
+			if ( !( info.m_fList & listMask ) || ( info.m_flags & ENTITY_HIDDEN ) )
+				continue;
+
+			hits.AddToTail( info.m_pHandleEntity );
+		}
+	}
+
+	// Triggers added since the last rebuild
+	for ( int i = m_nTreeElements; i < m_Elements.Count(); ++i )
+	{
+		const Element_t &elem = m_Elements[i];
+		if ( !intersectTest.Intersects( elem.m_vecMin, elem.m_vecMax ) )
+			continue;
+
+		const EntityInfo_t &info = handles[elem.m_hPartition];
+		if ( !( info.m_fList & listMask ) || ( info.m_flags & ENTITY_HIDDEN ) )
+			continue;
+
+		hits.AddToTail( info.m_pHandleEntity );
+	}
+}
+
+void CTriggerPartitionIndex::CallEnumerator( const HitList_t &hits, IPartitionEnumerator* pIterator )
+{
+	for ( int i = 0; i < hits.Count(); ++i )
+	{
+		if ( pIterator->EnumElement( hits[i] ) == ITERATION_STOP )
+			return;
+	}
+}
+
+bool CTriggerPartitionIndex::EnumerateElementsInBox( SpatialPartitionListMask_t listMask, const Vector& mins, const Vector& maxs, IPartitionEnumerator* pIterator )
+{
+	if ( !BeginQuery() )
+		return false;
+
+	VPROF( "TriggerIndex BoxTest" );
+	HitList_t hits;
+	CTriggerIndexIntersectBox intersectBox( mins, maxs );
+	Enumerate( intersectBox, listMask, hits );
+	EndQuery();
+
+	CallEnumerator( hits, pIterator );
+	return true;
+}
+
+bool CTriggerPartitionIndex::EnumerateElementsAlongRay( SpatialPartitionListMask_t listMask, const Ray_t& ray, IPartitionEnumerator* pIterator )
+{
+	// Same as the voxel tree, unswept rays are box queries
+	if ( !ray.m_IsSwept )
+	{
+		Vector vecMin, vecMax;
+		VectorSubtract( ray.m_Start, ray.m_Extents, vecMin );
+		VectorAdd( ray.m_Start, ray.m_Extents, vecMax );
+		return EnumerateElementsInBox( listMask, vecMin, vecMax, pIterator );
+	}
+
+	if ( !BeginQuery() )
+		return false;
+
+	VPROF( "TriggerIndex SweptBoxTest" );
+	HitList_t hits;
+	CTriggerIndexIntersectSweptBox intersectSweptBox( ray );
+	Enumerate( intersectSweptBox, listMask, hits );
+	EndQuery();
+
+	CallEnumerator( hits, pIterator );
+	return true;
+}
+
+void CTriggerPartitionIndex::ReportStats()
+{
+	Msg( "Trigger index: %s, %d triggers (%d since the last rebuild), %d nodes\n", partition_trigger_index.GetBool() ? "enabled" : "disabled", m_Elements.Count() - m_nRemoved, m_Elements.Count() - m_nTreeElements, m_Nodes.Count() );
+	Msg( "\t%d queries, %d in place updates, %d rebuilds (%.2f ms total)\n", (int)m_nQueries, m_nUpdates, m_nRebuilds, m_flRebuildTime * 1000.0f );
+}
+
+//-----------------------------------------------------------------------------
+// Loose grid
+//-----------------------------------------------------------------------------
+CLooseGridTree::CLooseGridTree()
+{
+	m_pOwner = NULL;
+	m_TreeId = 0;
+	m_nPendingCount = 0;
+	m_bFlushing = false;
+	memset( m_nQueryDepth, 0, sizeof( m_nQueryDepth ) );
+	memset( m_nLevelElements, 0, sizeof( m_nLevelElements ) );
+	m_nQueuedChanges = 0;
+	m_nFlushes = 0;
+	m_nAppliedChanges = 0;
+	m_nCellChanges = 0;
+	m_flFlushTime = 0.0f;
+}
+
+void CLooseGridTree::Init( CSpatialPartition *pOwner, int iTree )
+{
+	Shutdown();
+	m_pOwner = pOwner;
+	m_TreeId = iTree;
+}
+
+void CLooseGridTree::Shutdown()
+{
+	AUTO_LOCK( m_WriteMutex );
+	Assert( m_nActiveQueries == 0 );
+	for ( int i = 0; i < NUM_LEVELS; ++i )
+	{
+		m_Cells[i].Purge();
+		m_nLevelElements[i] = 0;
+	}
+	m_CellIndex.Purge();
+	m_Elements.Purge();
+	m_PendingHandles.Purge();
+	m_nPendingCount = 0;
+	m_nQueuedChanges = 0;
+	m_nFlushes = 0;
+	m_nAppliedChanges = 0;
+	m_nCellChanges = 0;
+	m_flFlushTime = 0.0f;
+	m_nQueries = 0;
+	m_nStaleQueries = 0;
+}
+
+int CLooseGridTree::CellCount( int nLevel )
+{
+	if ( nLevel == HUGE_LEVEL )
+		return 1;
+
+	int nCount = (int)( ( s_PartitionMax.x - s_PartitionMin.x ) / CellSize( nLevel ) );
+	Assert( nCount < ( 1 << COORD_BITS ) );
+	return MAX( nCount, 1 );
+}
+
+int CLooseGridTree::CellCoord( int nLevel, float flCoord, int nAxis )
+{
+	int nCoord = (int)( ( flCoord - s_PartitionMin[nAxis] ) / CellSize( nLevel ) );
+	return clamp( nCoord, 0, CellCount( nLevel ) - 1 );
+}
+
+//-----------------------------------------------------------------------------
+// The cell an element belongs in: the one holding its center, on the first
+// level whose cells are at least as big as the element
+//-----------------------------------------------------------------------------
+uint32 CLooseGridTree::ComputeKey( const Vector &vecMin, const Vector &vecMax )
+{
+	float flSize = MAX( vecMax.x - vecMin.x, MAX( vecMax.y - vecMin.y, vecMax.z - vecMin.z ) );
+
+	int nLevel = 0;
+	while ( nLevel < HUGE_LEVEL && flSize > CellSize( nLevel ) )
+	{
+		++nLevel;
+	}
+
+	if ( nLevel == HUGE_LEVEL )
+		return MakeKey( nLevel, 0, 0, 0 );
+
+	Vector vecCenter = ( vecMin + vecMax ) * 0.5f;
+	return MakeKey( nLevel, CellCoord( nLevel, vecCenter.x, 0 ), CellCoord( nLevel, vecCenter.y, 1 ), CellCoord( nLevel, vecCenter.z, 2 ) );
+}
+
+CLooseGridTree::Element_t &CLooseGridTree::FindOrAddElement( SpatialPartitionHandle_t hPartition )
+{
+	while ( m_Elements.Count() <= hPartition )
+	{
+		Element_t &elem = m_Elements[ m_Elements.AddToTail() ];
+		elem.m_vecMin.Init();
+		elem.m_vecMax.Init();
+		elem.m_nCell = -1;
+		elem.m_nSlot = -1;
+		elem.m_nLevel = 0;
+		elem.m_bInTree = false;
+		elem.m_bPending = false;
+	}
+	return m_Elements[hPartition];
+}
+
+// Must be called with the write mutex held
+void CLooseGridTree::QueueChange( SpatialPartitionHandle_t hPartition, Element_t &elem )
+{
+	++m_nQueuedChanges;
+	if ( elem.m_bPending )
+		return;
+
+	elem.m_bPending = true;
+	m_PendingHandles.AddToTail( hPartition );
+	m_nPendingCount = m_PendingHandles.Count();
+}
+
+void CLooseGridTree::ElementMoved( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs )
+{
+	Assert( hPartition != PARTITION_INVALID_HANDLE );
+
+	// Same bloat and clamp as the voxel tree so both report identical bounds
+	Vector vecMin( mins.x - SPHASH_EPS, mins.y - SPHASH_EPS, mins.z - SPHASH_EPS );
+	Vector vecMax( maxs.x + SPHASH_EPS, maxs.y + SPHASH_EPS, maxs.z + SPHASH_EPS );
+	ClampVector( vecMin, s_PartitionMin, s_PartitionMax );
+	ClampVector( vecMax, s_PartitionMin, s_PartitionMax );
+
+	EntityInfo_t &info = m_pOwner->EntityInfo( hPartition );
+	info.m_vecMin = vecMin;
+	info.m_vecMax = vecMax;
+
+	AUTO_LOCK( m_WriteMutex );
+	Element_t &elem = FindOrAddElement( hPartition );
+	elem.m_vecMin = vecMin;
+	elem.m_vecMax = vecMax;
+	elem.m_bInTree = true;
+	QueueChange( hPartition, elem );
+}
+
+void CLooseGridTree::RemoveFromTree( SpatialPartitionHandle_t hPartition )
+{
+	AUTO_LOCK( m_WriteMutex );
+	if ( hPartition >= m_Elements.Count() )
+		return;
+
+	Element_t &elem = m_Elements[hPartition];
+	if ( elem.m_nCell >= 0 )
+	{
+		// Hide it right away, the handle may be reused before the queue is flushed
+		ElementEntry( elem ).m_nListMask = 0;
+	}
+	elem.m_bInTree = false;
+	QueueChange( hPartition, elem );
+}
+
+void CLooseGridTree::UpdateListMask( SpatialPartitionHandle_t hPartition )
+{
+	AUTO_LOCK( m_WriteMutex );
+	if ( hPartition >= m_Elements.Count() )
+		return;
+
+	// A pending element picks its list up when it is applied
+	Element_t &elem = m_Elements[hPartition];
+	if ( elem.m_nCell >= 0 && elem.m_bInTree )
+	{
+		ElementEntry( elem ).m_nListMask = m_pOwner->EntityInfo( hPartition ).m_fList;
+	}
+}
+
+int CLooseGridTree::FindOrAddCell( uint32 nKey )
+{
+	UtlHashHandle_t hCell = m_CellIndex.Find( nKey );
+	if ( hCell != m_CellIndex.InvalidHandle() )
+		return m_CellIndex[hCell];
+
+	int nLevel = nKey >> LEVEL_KEY_SHIFT;
+	int nCell = m_Cells[nLevel].AddToTail();
+	Cell_t &cell = m_Cells[nLevel][nCell];
+	if ( nLevel == HUGE_LEVEL )
+	{
+		cell.m_vecLooseMin = s_PartitionMin;
+		cell.m_vecLooseMax = s_PartitionMax;
+	}
+	else
+	{
+		float flSize = CellSize( nLevel );
+		int nMask = ( 1 << COORD_BITS ) - 1;
+		int pCoord[3] = { (int)( nKey & nMask ), (int)( ( nKey >> COORD_BITS ) & nMask ), (int)( ( nKey >> ( 2 * COORD_BITS ) ) & nMask ) };
+		for ( int i = 0; i < 3; ++i )
+		{
+			cell.m_vecLooseMin[i] = s_PartitionMin[i] + ( pCoord[i] - 0.5f ) * flSize;
+			cell.m_vecLooseMax[i] = s_PartitionMin[i] + ( pCoord[i] + 1.5f ) * flSize;
+		}
+	}
+
+	m_CellIndex.Insert( nKey, nCell );
+	return nCell;
+}
+
+void CLooseGridTree::RemoveEntry( Element_t &elem )
+{
+	if ( elem.m_nCell < 0 )
+		return;
+
+	CUtlVector<Entry_t> &entries = m_Cells[elem.m_nLevel][elem.m_nCell].m_Entries;
+	entries.FastRemove( elem.m_nSlot );
+	if ( elem.m_nSlot < entries.Count() )
+	{
+		m_Elements[ entries[elem.m_nSlot].m_hPartition ].m_nSlot = elem.m_nSlot;
+	}
+
+	--m_nLevelElements[elem.m_nLevel];
+	elem.m_nCell = -1;
+	elem.m_nSlot = -1;
+}
+
+void CLooseGridTree::ApplyChange( SpatialPartitionHandle_t hPartition, uint32 nKey )
+{
+	Element_t &elem = m_Elements[hPartition];
+	elem.m_bPending = false;
+	if ( !elem.m_bInTree )
+	{
+		RemoveEntry( elem );
+		return;
+	}
+
+	int nLevel = nKey >> LEVEL_KEY_SHIFT;
+	int nCell = FindOrAddCell( nKey );
+	if ( elem.m_nCell != nCell || elem.m_nLevel != nLevel )
+	{
+		RemoveEntry( elem );
+		elem.m_nLevel = nLevel;
+		elem.m_nCell = nCell;
+		elem.m_nSlot = m_Cells[nLevel][nCell].m_Entries.AddToTail();
+		++m_nLevelElements[nLevel];
+		++m_nCellChanges;
+	}
+
+	const EntityInfo_t &info = m_pOwner->EntityInfo( hPartition );
+	Entry_t &entry = ElementEntry( elem );
+	entry.m_vecMin = elem.m_vecMin;
+	entry.m_vecMax = elem.m_vecMax;
+	entry.m_hPartition = hPartition;
+	entry.m_nListMask = info.m_fList;
+	entry.m_pHandleEntity = info.m_pHandleEntity;
+}
+
+int CLooseGridTree::SortPendingChanges( const PendingChange_t *pLeft, const PendingChange_t *pRight )
+{
+	if ( pLeft->m_nKey != pRight->m_nKey )
+		return ( pLeft->m_nKey < pRight->m_nKey ) ? -1 : 1;
+	return (int)pLeft->m_hPartition - (int)pRight->m_hPartition;
+}
+
+//-----------------------------------------------------------------------------
+// Applies every queued change in one pass, sorted by destination cell
+//-----------------------------------------------------------------------------
+void CLooseGridTree::FlushPendingChanges()
+{
+	if ( !m_nPendingCount )
+		return;
+
+	// Waiting for our own query to finish would never return
+	if ( m_nQueryDepth[g_nThreadID] != 0 )
+	{
+		Assert( 0 );
+		return;
+	}
+
+	AUTO_LOCK( m_FlushMutex );
+	if ( !m_nPendingCount )
+		return;
+
+	double flStartTime = Plat_FloatTime();
+
+	m_bFlushing = true;
+	ThreadMemoryBarrier();
+	while ( m_nActiveQueries != 0 )
+	{
+		ThreadPause();
+	}
+
+	AUTO_LOCK( m_WriteMutex );
+	CUtlVector<PendingChange_t> changes( 0, m_PendingHandles.Count() );
+	for ( int i = 0; i < m_PendingHandles.Count(); ++i )
+	{
+		SpatialPartitionHandle_t hPartition = m_PendingHandles[i];
+		const Element_t &elem = m_Elements[hPartition];
+
+		PendingChange_t &change = changes[ changes.AddToTail() ];
+		change.m_hPartition = hPartition;
+		change.m_nKey = elem.m_bInTree ? ComputeKey( elem.m_vecMin, elem.m_vecMax ) : 0xFFFFFFFF;
+	}
+	changes.Sort( SortPendingChanges );
+
+	for ( int i = 0; i < changes.Count(); ++i )
+	{
+		ApplyChange( changes[i].m_hPartition, changes[i].m_nKey );
+	}
+
+	m_nAppliedChanges += changes.Count();
+	++m_nFlushes;
+	m_PendingHandles.RemoveAll();
+	m_nPendingCount = 0;
+	m_flFlushTime += (float)( Plat_FloatTime() - flStartTime );
+
+	ThreadMemoryBarrier();
+	m_bFlushing = false;
+}
+
+//-----------------------------------------------------------------------------
+// Queries don't lock. The outermost query on a thread flushes the queue and
+// registers itself so a flush on another thread waits for it; nested queries
+// ride on the outer one and see the grid as it was when that one started.
+//-----------------------------------------------------------------------------
+bool CLooseGridTree::BeginQuery()
+{
+	int nThread = g_nThreadID;
+	if ( m_nQueryDepth[nThread]++ > 0 )
+	{
+		if ( m_nPendingCount )
+		{
+			++m_nStaleQueries;
+		}
+		return true;
+	}
+
+	--m_nQueryDepth[nThread];
+	FlushPendingChanges();
+	++m_nQueryDepth[nThread];
+
+	for ( ;; )
+	{
+		++m_nActiveQueries;
+		if ( !m_bFlushing )
+			break;
+
+		--m_nActiveQueries;
+		while ( m_bFlushing )
+		{
+			ThreadPause();
+		}
+	}
+
+	++m_nQueries;
+	return true;
+}
+
+void CLooseGridTree::EndQuery()
+{
+	if ( --m_nQueryDepth[g_nThreadID] == 0 )
+	{
+		--m_nActiveQueries;
+	}
+}
+
+template <class T>
+bool CLooseGridTree::EnumerateCell( const Cell_t &cell, const T &intersectTest, SpatialPartitionListMask_t listMask, IPartitionEnumerator* pIterator )
+{
+	CSpatialPartition::CHandleList &handles = m_pOwner->Handles();
+	for ( int i = 0; i < cell.m_Entries.Count(); ++i )
+	{
+		const Entry_t &entry = cell.m_Entries[i];
+		if ( !( entry.m_nListMask & listMask ) )
+			continue;
+
+		if ( !intersectTest.Intersects( entry.m_vecMin, entry.m_vecMax ) )
+			continue;
+
+		if ( handles[entry.m_hPartition].m_flags & ENTITY_HIDDEN )
+			continue;
+
+		if ( pIterator->EnumElement( entry.m_pHandleEntity ) == ITERATION_STOP )
+			return false;
+	}
+	return true;
+}
+
+template <class T>
+void CLooseGridTree::Enumerate( const Vector &vecQueryMin, const Vector &vecQueryMax, const T &intersectTest, SpatialPartitionListMask_t listMask, IPartitionEnumerator* pIterator )
+{
+	if ( listMask == 0 || !m_pOwner )
+		return;
+
+	BeginQuery();
+	for ( int nLevel = 0; nLevel < NUM_LEVELS; ++nLevel )
+	{
+		if ( !m_nLevelElements[nLevel] )
+			continue;
+
+		const CUtlVector<Cell_t> &cells = m_Cells[nLevel];
+
+		// Elements stick out of their cell by up to half a cell, plus a unit for rounding
+		int nMin[3] = { 0, 0, 0 };
+		int nMax[3] = { 0, 0, 0 };
+		int nRangeCount = 1;
+		if ( nLevel != HUGE_LEVEL )
+		{
+			float flLoose = 0.5f * CellSize( nLevel ) + 1.0f;
+			for ( int i = 0; i < 3; ++i )
+			{
+				nMin[i] = CellCoord( nLevel, vecQueryMin[i] - flLoose, i );
+				nMax[i] = CellCoord( nLevel, vecQueryMax[i] + flLoose, i );
+				nRangeCount *= nMax[i] - nMin[i] + 1;
+			}
+		}
+
+		// Walk the occupied cells instead when there are fewer of them than cells in range
+		if ( nRangeCount >= cells.Count() )
+		{
+			for ( int i = 0; i < cells.Count(); ++i )
+			{
+				const Cell_t &cell = cells[i];
+				if ( !cell.m_Entries.Count() || !intersectTest.Intersects( cell.m_vecLooseMin, cell.m_vecLooseMax ) )
+					continue;
+
+				if ( !EnumerateCell( cell, intersectTest, listMask, pIterator ) )
+				{
+					EndQuery();
+					return;
+				}
+			}
+			continue;
+		}
+
+		for ( int z = nMin[2]; z <= nMax[2]; ++z )
+		{
+			for ( int y = nMin[1]; y <= nMax[1]; ++y )
+			{
+				for ( int x = nMin[0]; x <= nMax[0]; ++x )
+				{
+					UtlHashHandle_t hCell = m_CellIndex.Find( MakeKey( nLevel, x, y, z ) );
+					if ( hCell == m_CellIndex.InvalidHandle() )
+						continue;
+
+					const Cell_t &cell = cells[ m_CellIndex[hCell] ];
+					if ( !cell.m_Entries.Count() || !intersectTest.Intersects( cell.m_vecLooseMin, cell.m_vecLooseMax ) )
+						continue;
+
+					if ( !EnumerateCell( cell, intersectTest, listMask, pIterator ) )
+					{
+						EndQuery();
+						return;
+					}
+				}
+			}
+		}
+	}
+	EndQuery();
+}
+
+void CLooseGridTree::EnumerateElementsInBox( SpatialPartitionListMask_t listMask, const Vector& mins, const Vector& maxs, IPartitionEnumerator* pIterator )
+{
+	VPROF( "LooseGrid BoxTest" );
+	CTriggerIndexIntersectBox intersectBox( mins, maxs );
+	Enumerate( mins, maxs, intersectBox, listMask, pIterator );
+}
+
+void CLooseGridTree::EnumerateElementsInSphere( SpatialPartitionListMask_t listMask, const Vector& origin, float radius, IPartitionEnumerator* pIterator )
+{
+	// Like the voxel tree, spheres are tested as their bounding box
+	Vector vecMin( origin.x - radius, origin.y - radius, origin.z - radius );
+	Vector vecMax( origin.x + radius, origin.y + radius, origin.z + radius );
+	EnumerateElementsInBox( listMask, vecMin, vecMax, pIterator );
+}
+
+void CLooseGridTree::EnumerateElementsAlongRay( SpatialPartitionListMask_t listMask, const Ray_t& ray, IPartitionEnumerator* pIterator )
+{
+	Vector vecMin, vecMax;
+	VectorSubtract( ray.m_Start, ray.m_Extents, vecMin );
+	VectorAdd( ray.m_Start, ray.m_Extents, vecMax );
+	if ( !ray.m_IsSwept )
+	{
+		EnumerateElementsInBox( listMask, vecMin, vecMax, pIterator );
+		return;
+	}
+
+	VPROF( "LooseGrid SweptBoxTest" );
+	Vector vecEnd;
+	VectorAdd( ray.m_Start, ray.m_Delta, vecEnd );
+	Vector vecEndMin, vecEndMax;
+	VectorSubtract( vecEnd, ray.m_Extents, vecEndMin );
+	VectorAdd( vecEnd, ray.m_Extents, vecEndMax );
+	VectorMin( vecMin, vecEndMin, vecMin );
+	VectorMax( vecMax, vecEndMax, vecMax );
+
+	CTriggerIndexIntersectSweptBox intersectSweptBox( ray );
+	Enumerate( vecMin, vecMax, intersectSweptBox, listMask, pIterator );
+}
+
+void CLooseGridTree::EnumerateElementsAtPoint( SpatialPartitionListMask_t listMask, const Vector& pt, IPartitionEnumerator* pIterator )
+{
+	VPROF( "LooseGrid PointTest" );
+	CTriggerIndexIntersectBox intersectPoint( pt, pt );
+	Enumerate( pt, pt, intersectPoint, listMask, pIterator );
+}
+
+void CLooseGridTree::ReportStats()
+{
+	int nCells = 0;
+	int nElements = 0;
+	for ( int i = 0; i < NUM_LEVELS; ++i )
+	{
+		nCells += m_Cells[i].Count();
+		nElements += m_nLevelElements[i];
+	}
+
+	Msg( "Loose grid (%s): %d elements in %d cells\n", ( m_TreeId == CLIENT_TREE ) ? "client" : "server", nElements, nCells );
+	for ( int i = 0; i < NUM_LEVELS; ++i )
+	{
+		if ( i == HUGE_LEVEL )
+		{
+			Msg( "\t%d (huge) - %d\n", i, m_nLevelElements[i] );
+		}
+		else
+		{
+			Msg( "\t%d (%d units) - %d in %d cells\n", i, (int)CellSize( i ), m_nLevelElements[i], m_Cells[i].Count() );
+		}
+	}
+	Msg( "\t%d changes queued, %d flushes applied %d (%d changed cells) in %.2f ms\n", m_nQueuedChanges, m_nFlushes, m_nAppliedChanges, m_nCellChanges, m_flFlushTime * 1000.0f );
+	Msg( "\t%d queries, %d nested queries ran with changes still queued\n", (int)m_nQueries, (int)m_nStaleQueries );
+}
+
+//-----------------------------------------------------------------------------
+// Collects enumerated elements so two implementations can be compared
+//-----------------------------------------------------------------------------
+class CPartitionCompareEnumerator : public IPartitionEnumerator
+{
+public:
+	virtual IterationRetval_t EnumElement( IHandleEntity *pHandleEntity )
+	{
+		m_Elements.AddToTail( pHandleEntity );
+		return ITERATION_CONTINUE;
+	}
+
+	void Sort()
+	{
+		m_Elements.Sort( ComparePointers );
+	}
+
+	static int ComparePointers( IHandleEntity * const *ppLeft, IHandleEntity * const *ppRight )
+	{
+		if ( *ppLeft == *ppRight )
+			return 0;
+		return ( *ppLeft < *ppRight ) ? -1 : 1;
+	}
+
+	CUtlVector<IHandleEntity *> m_Elements;
+};
+
+#define PARTITION_COMPARE_MAX_QUERIES	1024
+#define PARTITION_COMPARE_PAD			64.0f
+
+//-----------------------------------------------------------------------------
+// Queries a padded box around every element in both implementations and checks
+// that they return the same set
+//-----------------------------------------------------------------------------
+void CSpatialPartition::CompareImplementations()
+{
+	int nQueries = 0;
+	int nMismatches = 0;
+	int nVoxelResults = 0;
+	double flVoxelTime = 0.0;
+	double flGridTime = 0.0;
+
+	for ( int iTree = 0; iTree < NUM_TREES; ++iTree )
+	{
+		int nTreeFlag = ( iTree == CLIENT_TREE ) ? IN_CLIENT_TREE : IN_SERVER_TREE;
+		m_LooseGrids[iTree].FlushPendingChanges();
+
+		int nTreeQueries = 0;
+		for ( SpatialPartitionHandle_t h = m_aHandles.Head(); h != m_aHandles.InvalidIndex() && nTreeQueries < PARTITION_COMPARE_MAX_QUERIES; h = m_aHandles.Next( h ) )
+		{
+			const EntityInfo_t &info = m_aHandles[h];
+			if ( !( info.m_flags & nTreeFlag ) || !info.m_fList )
+				continue;
+
+			Vector vecPad( PARTITION_COMPARE_PAD, PARTITION_COMPARE_PAD, PARTITION_COMPARE_PAD );
+			Vector vecMin = info.m_vecMin - vecPad;
+			Vector vecMax = info.m_vecMax + vecPad;
+
+			CPartitionCompareEnumerator voxelResults, gridResults;
+			double flStartTime = Plat_FloatTime();
+			m_VoxelTrees[iTree].EnumerateElementsInBox( info.m_fList, vecMin, vecMax, false, &voxelResults );
+			double flMidTime = Plat_FloatTime();
+			m_LooseGrids[iTree].EnumerateElementsInBox( info.m_fList, vecMin, vecMax, &gridResults );
+			double flEndTime = Plat_FloatTime();
+
+			flVoxelTime += flMidTime - flStartTime;
+			flGridTime += flEndTime - flMidTime;
+			nVoxelResults += voxelResults.m_Elements.Count();
+			++nTreeQueries;
+
+			voxelResults.Sort();
+			gridResults.Sort();
+			if ( voxelResults.m_Elements.Count() != gridResults.m_Elements.Count() ||
+				memcmp( voxelResults.m_Elements.Base(), gridResults.m_Elements.Base(), voxelResults.m_Elements.Count() * sizeof( IHandleEntity * ) ) )
+			{
+				++nMismatches;
+			}
+		}
+		nQueries += nTreeQueries;
+	}
+
+	Msg( "Voxel tree vs loose grid:\n" );
+	Msg( "\tupdates: %d, voxel tree %.2f ms, loose grid %.2f ms to queue (flush time above)\n", m_nComparedUpdates, m_flVoxelUpdateTime * 1000.0, m_flGridUpdateTime * 1000.0 );
+	Msg( "\t%d box queries (%d elements found), voxel tree %.2f ms, loose grid %.2f ms, %d mismatches\n", nQueries, nVoxelResults, flVoxelTime * 1000.0, flGridTime * 1000.0, nMismatches );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CSpatialPartition::RenderObjectsInBox( const Vector &vecMin, const Vector &vecMax, float flTime )
+{
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CSpatialPartition::RenderObjectsInSphere( const Vector &vecCenter, float flRadius, float flTime )
+{
+}
+
+
+void CSpatialPartition::RenderObjectsAlongRay( const Ray_t& ray, float flTime )
+{
+}
+
+	
+//-----------------------------------------------------------------------------
+// Report stats
+//-----------------------------------------------------------------------------
+void CSpatialPartition::RenderAllObjectsInTree( float flTime )
+{
+	for ( int i = 0; i < NUM_TREES; i++ )
+	{
+		m_VoxelTrees[i].RenderAllObjectsInTree( flTime );
+	}
+}
+
+void CSpatialPartition::RenderObjectsInPlayerLeafs( const Vector &vecPlayerMin, const Vector &vecPlayerMax, float flTime )
+{
+	for ( int i = 0; i < NUM_TREES; i++ )
+	{
+		m_VoxelTrees[i].RenderObjectsInPlayerLeafs( vecPlayerMin, vecPlayerMax, flTime );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Report stats
+//-----------------------------------------------------------------------------
+void CVoxelTree::ReportStats( const char *pFileName )
+{
+	Msg( "Histogram : Entities per level\n" );
+	for ( int i = 0; i < m_nLevelCount; ++i )
+	{
+		Msg( "\t%d - %d\n", i, m_pVoxelHash[i].EntityCount() );
+	}
+}
+
+void CSpatialPartition::ReportStats( const char *pFileName )
+{
+	Msg( "Handle Count %d (%d bytes)\n", m_aHandles.Count(), m_aHandles.Count() * ( sizeof(EntityInfo_t) + 2 * sizeof(SpatialPartitionHandle_t) ) );
+	Msg( "Partition implementation: %s\n", !m_bUseLooseGrid ? "voxel tree" : ( m_bKeepVoxelTrees ? "loose grid, voxel tree kept for comparison" : "loose grid" ) );
+	for ( int i = 0; i < NUM_TREES; i++ )
+	{
+		if ( m_bKeepVoxelTrees )
+		{
+			m_VoxelTrees[i].ReportStats( pFileName );
+		}
+
+		if ( m_bUseLooseGrid )
+		{
+			m_LooseGrids[i].ReportStats();
+		}
+	}
+	m_TriggerIndex.ReportStats();
+
+	if ( m_bUseLooseGrid && m_bKeepVoxelTrees )
+	{
+		CompareImplementations();
+	}
+	else
 	{
-		m_VoxelTrees[i].ReportStats( pFileName );
+		Msg( "Run with -partition_compare to compare the voxel tree and loose grid\n" );
 	}
 }
 
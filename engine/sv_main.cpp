@@ -1195,7 +1195,7 @@ void SV_DetermineMulticastRecipients( bool usepas, const Vector& origin, CBitVec
 	int cluster = CM_LeafCluster( CM_PointLeafnum( origin ) );
 	byte pvs[MAX_MAP_LEAFS/8];
 	int visType = usepas ? DVIS_PAS : DVIS_PVS;
-	const byte *pMask = CM_Vis( pvs, sizeof(pvs), cluster, visType );
+	const byte *pMask = CM_VisRow( pvs, sizeof(pvs), cluster, visType );
 
 	playerbits.ClearAll();
 
@@ -1448,14 +1448,7 @@ CUtlVector<int> g_AreasNetworked;
 
 static void SV_AddToFatPVS( const Vector& org )
 {
-	int		i;
-	byte	pvs[MAX_MAP_LEAFS/8];
-
-	CM_Vis( pvs, sizeof(pvs), CM_LeafCluster( CM_PointLeafnum( org ) ), DVIS_PVS );
-	for (i=0 ; i<s_FatBytes ; i++)
-	{
-		s_pFatPVS[i] |= pvs[i];
-	}
+	CM_AddVis( s_pFatPVS, s_FatBytes, CM_LeafCluster( CM_PointLeafnum( org ) ), DVIS_PVS );
 }
 
 //-----------------------------------------------------------------------------
@@ -22,6 +22,7 @@
 #include "dt_instrumentation_server.h"
 #include "LocalNetworkBackdoor.h"
 #include "tier0/vprof.h"
+#include "tier0/framearena.h"
 #include "host.h"
 #include "networkstringtableserver.h"
 #include "networkstringtable.h"
@@ -104,6 +105,9 @@ void SV_EnsureInstanceBaseline( ServerClass *pServerClass, int iEdict, const voi
 
 //-----------------------------------------------------------------------------
 // Pack the entity....
+// NOTE: The caller clears the edict's changed state afterwards. Edicts and their
+// shared change infos are packed several to a cache line, so writing them from
+// the pack workers would bounce those lines between threads.
 //-----------------------------------------------------------------------------
 
 static inline void SV_PackEntity( 
@@ -129,10 +133,7 @@ static inline void SV_PackEntity(
 	}
 		
 	if ( bUsedPrev && !sv_debugmanualmode.GetInt() )
-	{
-		edict->ClearStateChanged();
 		return;
-	}
 	
 	// First encode the entity's data.
 	ALIGN4 char packedData[MAX_PACKEDENTITY_DATA] ALIGN4_POST;
@@ -198,10 +199,7 @@ static inline void SV_PackEntity(
 			if ( pPrevFrame->CompareRecipients( recip ) )
 			{
 				if ( framesnapshotmanager->UsePreviouslySentPacket( pSnapshot, edictIdx, iSerialNum ) )
-				{
-					edict->ClearStateChanged();
 					return;
-				}
 			}
 		}
 		else
@@ -269,8 +267,6 @@ static inline void SV_PackEntity(
 		pPackedEntity->AllocAndCopyPadded( packedData, writeBuf.GetNumBytesWritten() );
 		pPackedEntity->SetRecipients( recip );
 	}
-
-	edict->ClearStateChanged();
 }
 
 // in HLTV mode we ALWAYS have to store position and PVS info, even if entity didnt change
@@ -408,7 +404,8 @@ void PackEntities_Normal(
 	Assert( snapshot->m_nValidEntities >= 0 && snapshot->m_nValidEntities <= MAX_EDICTS );
 	tmZoneFiltered( TELEMETRY_LEVEL0, 50, TMZF_NONE, "%s %d", __FUNCTION__, snapshot->m_nValidEntities );
 
-	CUtlVectorFixed< PackWork_t, MAX_EDICTS > workItems;
+	CFrameArenaScope arenaScope;
+	CUtlVectorFrameArena< PackWork_t > workItems( snapshot->m_nValidEntities );
 
 	// check for all active entities, if they are seen by at least on client, if
 	// so, bit pack them 
@@ -452,6 +449,13 @@ void PackEntities_Normal(
 	if ( sv_parallel_packentities.GetBool() )
 	{
 		ParallelProcess( "PackWork_t::Process", workItems.Base(), workItems.Count(), &PackWork_t::Process );
+
+		// Workers only read edicts; clear the changed state here on the main thread
+		int c = workItems.Count();
+		for ( int i = 0; i < c; ++i )
+		{
+			workItems[ i ].pEdict->ClearStateChanged();
+		}
 	}
 	else
 	{
@@ -460,6 +464,7 @@ void PackEntities_Normal(
 		{
 			PackWork_t &w = workItems[ i ];
 			SV_PackEntity( w.nIdx, w.pEdict, w.pSnapshot->m_pEntities[ w.nIdx ].m_pClass, w.pSnapshot );
+			w.pEdict->ClearStateChanged();
 		}
 	}
 
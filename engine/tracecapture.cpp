@@ -0,0 +1,539 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Capture and replay of world collision queries
+//
+//=============================================================================//
+
+#include "tracecapture.h"
+#include "cmodel_engine.h"
+#include "cmodel_private.h"
+#include "filesystem_engine.h"
+#include "server.h"
+#include "client.h"
+#include "convar.h"
+#include "tier0/threadtools.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/utlhashtable.h"
+#include "tier1/utlstring.h"
+#include <typeinfo>
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+#define TRACE_CAPTURE_MAGIC			0x50435254	// 'TRCP'
+#define TRACE_CAPTURE_VERSION		1
+
+// Records are buffered and written out in blocks of this many
+#define TRACE_CAPTURE_BLOCK_SIZE	4096
+
+// The most threads trace_replay will start
+#define TRACE_REPLAY_MAX_THREADS	32
+
+enum TraceCaptureType_t
+{
+	TRACE_CAPTURE_TRACERAY = 0,
+	TRACE_CAPTURE_SWEEP,
+	TRACE_CAPTURE_POINTCONTENTS,
+
+	NUM_TRACE_CAPTURE_TYPES
+};
+
+enum TraceCaptureFlags_t
+{
+	TRACE_CAPTURE_IS_RAY = 0x1,
+	TRACE_CAPTURE_IS_SWEPT = 0x2,
+	TRACE_CAPTURE_WORLD = 0x4,		// The world was traced; without it there is nothing to replay
+};
+
+static const char *s_pTraceCaptureTypeNames[NUM_TRACE_CAPTURE_TYPES] =
+{
+	"TraceRay",
+	"SweepCollideable",
+	"GetPointContents",
+};
+
+struct TraceCaptureHeader_t
+{
+	uint32	m_nMagic;
+	uint32	m_nVersion;
+	char	m_szMapName[MAX_QPATH];
+	uint32	m_nRecords;
+	uint32	m_nFilterNames;			// Null terminated filter class names, stored after the records
+};
+
+struct TraceCaptureRecord_t
+{
+	uint8	m_nType;				// TraceCaptureType_t
+	uint8	m_nTraceType;			// TraceType_t of the filter
+	uint8	m_nFlags;				// TraceCaptureFlags_t
+	uint8	m_nUnused;
+	uint16	m_nFilter;				// Index into the filter name table, 0 for no filter
+	uint16	m_nUnused2;
+	uint32	m_nMask;
+	uint32	m_nResultHash;			// Hash of the world trace, or the world contents for a point
+	Vector	m_vecStart;				// Ray_t::m_Start, or the point
+	Vector	m_vecDelta;
+	Vector	m_vecExtents;
+	Vector	m_vecStartOffset;
+};
+
+COMPILE_TIME_ASSERT( sizeof( TraceCaptureRecord_t ) == 64 );
+
+
+volatile bool g_bTraceCaptureActive = false;
+
+static CThreadFastMutex s_TraceCaptureMutex;
+static FileHandle_t s_hTraceCaptureFile = FILESYSTEM_INVALID_HANDLE;
+static TraceCaptureHeader_t s_TraceCaptureHeader;
+static CUtlVector<TraceCaptureRecord_t> s_TraceCaptureRecords;
+static CUtlHashtable<uintp, uint16> s_TraceCaptureFilterIndex;
+static CUtlVector<CUtlString> s_TraceCaptureFilterNames;
+static CTHREADLOCALINT s_nTraceCaptureSweepDepth;
+
+
+//-----------------------------------------------------------------------------
+// Hashes the parts of a trace that the world collision code is responsible for
+//-----------------------------------------------------------------------------
+static uint32 TraceCapture_HashTrace( const trace_t &tr )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, &tr.fraction, sizeof( tr.fraction ) );
+	CRC32_ProcessBuffer( &crc, &tr.fractionleftsolid, sizeof( tr.fractionleftsolid ) );
+	CRC32_ProcessBuffer( &crc, &tr.endpos, sizeof( tr.endpos ) );
+	CRC32_ProcessBuffer( &crc, &tr.plane.normal, sizeof( tr.plane.normal ) );
+	CRC32_ProcessBuffer( &crc, &tr.plane.dist, sizeof( tr.plane.dist ) );
+	CRC32_ProcessBuffer( &crc, &tr.contents, sizeof( tr.contents ) );
+	CRC32_ProcessBuffer( &crc, &tr.surface.surfaceProps, sizeof( tr.surface.surfaceProps ) );
+	CRC32_ProcessBuffer( &crc, &tr.surface.flags, sizeof( tr.surface.flags ) );
+
+	byte solid[2] = { tr.allsolid, tr.startsolid };
+	CRC32_ProcessBuffer( &crc, solid, sizeof( solid ) );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+// Must be called with the capture mutex held
+//-----------------------------------------------------------------------------
+static void TraceCapture_FlushRecords()
+{
+	if ( !s_TraceCaptureRecords.Count() )
+		return;
+
+	g_pFileSystem->Write( s_TraceCaptureRecords.Base(), s_TraceCaptureRecords.Count() * sizeof( TraceCaptureRecord_t ), s_hTraceCaptureFile );
+	s_TraceCaptureHeader.m_nRecords += s_TraceCaptureRecords.Count();
+	s_TraceCaptureRecords.RemoveAll();
+}
+
+static void TraceCapture_AddRecord( const TraceCaptureRecord_t &record )
+{
+	AUTO_LOCK( s_TraceCaptureMutex );
+	if ( !g_bTraceCaptureActive )
+		return;
+
+	s_TraceCaptureRecords.AddToTail( record );
+	if ( s_TraceCaptureRecords.Count() >= TRACE_CAPTURE_BLOCK_SIZE )
+	{
+		TraceCapture_FlushRecords();
+	}
+}
+
+static uint16 TraceCapture_FilterIndex( ITraceFilter *pTraceFilter )
+{
+	if ( !pTraceFilter )
+		return 0;
+
+	// type_info names are unique per type, so the pointer can be the key
+	const char *pClassName = typeid( *pTraceFilter ).name();
+
+	AUTO_LOCK( s_TraceCaptureMutex );
+	UtlHashHandle_t hFilter = s_TraceCaptureFilterIndex.Find( (uintp)pClassName );
+	if ( hFilter != s_TraceCaptureFilterIndex.InvalidHandle() )
+		return s_TraceCaptureFilterIndex[hFilter];
+
+	uint16 nIndex = s_TraceCaptureFilterNames.AddToTail( pClassName );
+	s_TraceCaptureFilterIndex.Insert( (uintp)pClassName, nIndex );
+	return nIndex;
+}
+
+void TraceCapture_RecordRay( const Ray_t &ray, unsigned int fMask, ITraceFilter *pTraceFilter, const trace_t *pWorldTrace )
+{
+	TraceCaptureRecord_t record;
+	record.m_nType = ( s_nTraceCaptureSweepDepth > 0 ) ? TRACE_CAPTURE_SWEEP : TRACE_CAPTURE_TRACERAY;
+	record.m_nTraceType = pTraceFilter ? pTraceFilter->GetTraceType() : TRACE_EVERYTHING;
+	record.m_nFlags = ( ray.m_IsRay ? TRACE_CAPTURE_IS_RAY : 0 ) | ( ray.m_IsSwept ? TRACE_CAPTURE_IS_SWEPT : 0 ) | ( pWorldTrace ? TRACE_CAPTURE_WORLD : 0 );
+	record.m_nUnused = 0;
+	record.m_nFilter = TraceCapture_FilterIndex( pTraceFilter );
+	record.m_nUnused2 = 0;
+	record.m_nMask = fMask;
+	record.m_nResultHash = pWorldTrace ? TraceCapture_HashTrace( *pWorldTrace ) : 0;
+	record.m_vecStart = ray.m_Start;
+	record.m_vecDelta = ray.m_Delta;
+	record.m_vecExtents = ray.m_Extents;
+	record.m_vecStartOffset = ray.m_StartOffset;
+	TraceCapture_AddRecord( record );
+}
+
+void TraceCapture_RecordPointContents( const Vector &vecAbsPosition, int nWorldContents )
+{
+	TraceCaptureRecord_t record = TraceCaptureRecord_t();
+	record.m_nType = TRACE_CAPTURE_POINTCONTENTS;
+	record.m_nFlags = TRACE_CAPTURE_WORLD;
+	record.m_nResultHash = nWorldContents;
+	record.m_vecStart = vecAbsPosition;
+	TraceCapture_AddRecord( record );
+}
+
+void TraceCapture_BeginSweep()
+{
+	s_nTraceCaptureSweepDepth = s_nTraceCaptureSweepDepth + 1;
+}
+
+void TraceCapture_EndSweep()
+{
+	Assert( s_nTraceCaptureSweepDepth > 0 );
+	s_nTraceCaptureSweepDepth = s_nTraceCaptureSweepDepth - 1;
+}
+
+//-----------------------------------------------------------------------------
+// Finishes the capture file: the buffered records, the filter names and the final header
+//-----------------------------------------------------------------------------
+static void TraceCapture_Stop()
+{
+	AUTO_LOCK( s_TraceCaptureMutex );
+	if ( s_hTraceCaptureFile == FILESYSTEM_INVALID_HANDLE )
+		return;
+
+	g_bTraceCaptureActive = false;
+	TraceCapture_FlushRecords();
+
+	// Index 0 is the null filter
+	for ( int i = 1; i < s_TraceCaptureFilterNames.Count(); ++i )
+	{
+		g_pFileSystem->Write( s_TraceCaptureFilterNames[i].Get(), s_TraceCaptureFilterNames[i].Length() + 1, s_hTraceCaptureFile );
+	}
+	s_TraceCaptureHeader.m_nFilterNames = s_TraceCaptureFilterNames.Count() - 1;
+
+	g_pFileSystem->Seek( s_hTraceCaptureFile, 0, FILESYSTEM_SEEK_HEAD );
+	g_pFileSystem->Write( &s_TraceCaptureHeader, sizeof( s_TraceCaptureHeader ), s_hTraceCaptureFile );
+	g_pFileSystem->Close( s_hTraceCaptureFile );
+	s_hTraceCaptureFile = FILESYSTEM_INVALID_HANDLE;
+
+	Msg( "Captured %u queries on %s\n", s_TraceCaptureHeader.m_nRecords, s_TraceCaptureHeader.m_szMapName );
+
+	s_TraceCaptureFilterIndex.Purge();
+	s_TraceCaptureFilterNames.Purge();
+	s_TraceCaptureRecords.Purge();
+}
+
+CON_COMMAND( trace_capture_start, "Logs world collision queries to a file for trace_replay. Usage: trace_capture_start [file]" )
+{
+	const char *pFileName = ( args.ArgC() > 1 ) ? args[1] : "traces.trc";
+
+	TraceCapture_Stop();
+
+	const char *pMapName = GetCollisionBSPData()->map_name;
+	if ( !pMapName[0] )
+	{
+		Warning( "trace_capture_start: no map is loaded\n" );
+		return;
+	}
+
+	AUTO_LOCK( s_TraceCaptureMutex );
+	s_hTraceCaptureFile = g_pFileSystem->Open( pFileName, "wb", "MOD" );
+	if ( s_hTraceCaptureFile == FILESYSTEM_INVALID_HANDLE )
+	{
+		Warning( "trace_capture_start: couldn't open %s for writing\n", pFileName );
+		return;
+	}
+
+	memset( &s_TraceCaptureHeader, 0, sizeof( s_TraceCaptureHeader ) );
+	s_TraceCaptureHeader.m_nMagic = TRACE_CAPTURE_MAGIC;
+	s_TraceCaptureHeader.m_nVersion = TRACE_CAPTURE_VERSION;
+	Q_strncpy( s_TraceCaptureHeader.m_szMapName, pMapName, sizeof( s_TraceCaptureHeader.m_szMapName ) );
+
+	// The header is written again with the final counts when the capture stops
+	g_pFileSystem->Write( &s_TraceCaptureHeader, sizeof( s_TraceCaptureHeader ), s_hTraceCaptureFile );
+
+	s_TraceCaptureFilterNames.AddToTail( "(none)" );
+	s_TraceCaptureRecords.EnsureCapacity( TRACE_CAPTURE_BLOCK_SIZE );
+	g_bTraceCaptureActive = true;
+
+	Msg( "Capturing world queries on %s to %s\n", pMapName, pFileName );
+}
+
+CON_COMMAND( trace_capture_stop, "Stops the capture started by trace_capture_start" )
+{
+	TraceCapture_Stop();
+}
+
+
+//-----------------------------------------------------------------------------
+// Replay
+//-----------------------------------------------------------------------------
+struct TraceReplayJob_t
+{
+	const TraceCaptureRecord_t	*m_pRecords;
+	uint32						m_nRecords;
+	uint32						m_nFirst;
+	uint32						m_nStride;
+	int							m_nMismatches[NUM_TRACE_CAPTURE_TYPES];
+	int							m_nReplayed[NUM_TRACE_CAPTURE_TYPES];
+	int							m_nUnknownType;
+};
+
+static bool TraceReplay_Record( const TraceCaptureRecord_t &record )
+{
+	if ( record.m_nType == TRACE_CAPTURE_POINTCONTENTS )
+	{
+		return (uint32)CM_PointContents( record.m_vecStart, 0 ) == record.m_nResultHash;
+	}
+
+	Ray_t ray;
+	ray.m_Start = record.m_vecStart;
+	ray.m_Delta = record.m_vecDelta;
+	ray.m_Extents = record.m_vecExtents;
+	ray.m_StartOffset = record.m_vecStartOffset;
+	ray.m_IsRay = ( record.m_nFlags & TRACE_CAPTURE_IS_RAY ) != 0;
+	ray.m_IsSwept = ( record.m_nFlags & TRACE_CAPTURE_IS_SWEPT ) != 0;
+
+	trace_t tr;
+	CM_ClearTrace( &tr );
+	CM_BoxTrace( ray, 0, record.m_nMask, true, tr );
+	return TraceCapture_HashTrace( tr ) == record.m_nResultHash;
+}
+
+static uintp TraceReplay_Thread( void *pParam )
+{
+	TraceReplayJob_t *pJob = (TraceReplayJob_t *)pParam;
+	for ( uint32 i = pJob->m_nFirst; i < pJob->m_nRecords; i += pJob->m_nStride )
+	{
+		const TraceCaptureRecord_t &record = pJob->m_pRecords[i];
+
+		// Written by a newer build or corrupt
+		if ( record.m_nType >= NUM_TRACE_CAPTURE_TYPES )
+		{
+			++pJob->m_nUnknownType;
+			continue;
+		}
+
+		if ( !( record.m_nFlags & TRACE_CAPTURE_WORLD ) )
+			continue;
+
+		++pJob->m_nReplayed[record.m_nType];
+		if ( !TraceReplay_Record( record ) )
+		{
+			++pJob->m_nMismatches[record.m_nType];
+		}
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Replays every record on nThreads threads, returns the number of mismatches
+//-----------------------------------------------------------------------------
+static int TraceReplay_Run( const TraceCaptureRecord_t *pRecords, uint32 nRecords, int nThreads, int *pReplayed, int *pMismatches, int *pUnknownType )
+{
+	TraceReplayJob_t jobs[TRACE_REPLAY_MAX_THREADS];
+	ThreadHandle_t hThreads[TRACE_REPLAY_MAX_THREADS];
+	for ( int i = 0; i < nThreads; ++i )
+	{
+		memset( &jobs[i], 0, sizeof( jobs[i] ) );
+		jobs[i].m_pRecords = pRecords;
+		jobs[i].m_nRecords = nRecords;
+		jobs[i].m_nFirst = i;
+		jobs[i].m_nStride = nThreads;
+	}
+
+	// The calling thread takes the first share
+	for ( int i = 1; i < nThreads; ++i )
+	{
+		hThreads[i] = CreateSimpleThread( TraceReplay_Thread, &jobs[i] );
+	}
+	TraceReplay_Thread( &jobs[0] );
+	for ( int i = 1; i < nThreads; ++i )
+	{
+		ThreadJoin( hThreads[i] );
+		ReleaseThreadHandle( hThreads[i] );
+	}
+
+	*pUnknownType = 0;
+	for ( int i = 0; i < nThreads; ++i )
+	{
+		*pUnknownType += jobs[i].m_nUnknownType;
+	}
+
+	int nMismatches = 0;
+	for ( int nType = 0; nType < NUM_TRACE_CAPTURE_TYPES; ++nType )
+	{
+		pReplayed[nType] = 0;
+		pMismatches[nType] = 0;
+		for ( int i = 0; i < nThreads; ++i )
+		{
+			pReplayed[nType] += jobs[i].m_nReplayed[nType];
+			pMismatches[nType] += jobs[i].m_nMismatches[nType];
+		}
+		nMismatches += pMismatches[nType];
+	}
+	return nMismatches;
+}
+
+struct TraceReplayFilterCount_t
+{
+	const char	*m_pName;
+	int			m_nCount;
+};
+
+static int TraceReplayFilterSortFunc( const TraceReplayFilterCount_t *pLeft, const TraceReplayFilterCount_t *pRight )
+{
+	return pRight->m_nCount - pLeft->m_nCount;
+}
+
+CON_COMMAND( trace_replay, "Replays a file written by trace_capture_start against the world. Usage: trace_replay <file> [threads]" )
+{
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: trace_replay <file> [threads]\n" );
+		return;
+	}
+
+	CUtlBuffer buf;
+	if ( !g_pFileSystem->ReadFile( args[1], "MOD", buf ) )
+	{
+		Warning( "trace_replay: couldn't read %s\n", args[1] );
+		return;
+	}
+
+	const TraceCaptureHeader_t *pHeader = (const TraceCaptureHeader_t *)buf.Base();
+	if ( buf.TellPut() < (int)sizeof( TraceCaptureHeader_t ) || pHeader->m_nMagic != TRACE_CAPTURE_MAGIC || pHeader->m_nVersion != TRACE_CAPTURE_VERSION )
+	{
+		Warning( "trace_replay: %s is not a trace capture\n", args[1] );
+		return;
+	}
+
+	uint32 nRecords = pHeader->m_nRecords;
+	if ( nRecords > ( buf.TellPut() - sizeof( TraceCaptureHeader_t ) ) / sizeof( TraceCaptureRecord_t ) )
+	{
+		Warning( "trace_replay: %s is truncated\n", args[1] );
+		return;
+	}
+	const TraceCaptureRecord_t *pRecords = (const TraceCaptureRecord_t *)( pHeader + 1 );
+
+	// Filter names follow the records
+	CUtlVector<const char *> filterNames;
+	filterNames.AddToTail( "(none)" );
+	const char *pName = (const char *)( pRecords + nRecords );
+	const char *pEnd = (const char *)buf.Base() + buf.TellPut();
+	for ( uint32 i = 0; i < pHeader->m_nFilterNames && pName < pEnd; ++i )
+	{
+		const char *pTerminator = (const char *)memchr( pName, 0, pEnd - pName );
+		if ( !pTerminator )
+		{
+			Warning( "trace_replay: %s has an unterminated filter name, ignoring it and the ones after it\n", args[1] );
+			break;
+		}
+		filterNames.AddToTail( pName );
+		pName = pTerminator + 1;
+	}
+
+	int nThreads = ( args.ArgC() > 2 ) ? clamp( atoi( args[2] ), 1, TRACE_REPLAY_MAX_THREADS ) : 1;
+
+	// Replay against the captured BSP, loading it if nothing else is using the collision model
+	char szMapName[MAX_QPATH];
+	Q_strncpy( szMapName, pHeader->m_szMapName, sizeof( szMapName ) );
+	bool bLoadedMap = false;
+	if ( Q_stricmp( GetCollisionBSPData()->map_name, szMapName ) )
+	{
+		bool bInUse = sv.IsActive();
+#ifndef SWDS
+		bInUse = bInUse || cl.IsConnected();
+#endif
+		if ( bInUse )
+		{
+			Warning( "trace_replay: %s was captured on %s, disconnect or change to that map first\n", args[1], szMapName );
+			return;
+		}
+
+		unsigned int nChecksum;
+		CM_LoadMap( szMapName, false, &nChecksum );
+		if ( Q_stricmp( GetCollisionBSPData()->map_name, szMapName ) )
+		{
+			Warning( "trace_replay: couldn't load %s\n", szMapName );
+			return;
+		}
+		bLoadedMap = true;
+	}
+
+	int nReplayed[NUM_TRACE_CAPTURE_TYPES];
+	int nMismatches[NUM_TRACE_CAPTURE_TYPES];
+	int nUnknownType;
+
+	double flStart = Plat_FloatTime();
+	int nTotalMismatches = TraceReplay_Run( pRecords, nRecords, 1, nReplayed, nMismatches, &nUnknownType );
+	double flSingleTime = Plat_FloatTime() - flStart;
+
+	int nTotalReplayed = 0;
+	Msg( "Replayed %u records from %s on %s\n", nRecords, args[1], szMapName );
+	for ( int nType = 0; nType < NUM_TRACE_CAPTURE_TYPES; ++nType )
+	{
+		Msg( "\t%-18s %8d replayed, %d mismatches\n", s_pTraceCaptureTypeNames[nType], nReplayed[nType], nMismatches[nType] );
+		nTotalReplayed += nReplayed[nType];
+	}
+	Msg( "\t%u records only traced entities and were skipped\n", nRecords - nTotalReplayed - nUnknownType );
+	if ( nUnknownType )
+	{
+		Warning( "\t%d records have an unknown type and were skipped\n", nUnknownType );
+	}
+	Msg( "\t1 thread: %.2f ms, %.0f queries/s\n", flSingleTime * 1000.0, nTotalReplayed / MAX( flSingleTime, 1e-6 ) );
+
+	if ( nThreads > 1 )
+	{
+		int nThreadedReplayed[NUM_TRACE_CAPTURE_TYPES];
+		int nThreadedMismatches[NUM_TRACE_CAPTURE_TYPES];
+		int nThreadedUnknownType;
+
+		flStart = Plat_FloatTime();
+		int nThreadedTotal = TraceReplay_Run( pRecords, nRecords, nThreads, nThreadedReplayed, nThreadedMismatches, &nThreadedUnknownType );
+		double flThreadedTime = Plat_FloatTime() - flStart;
+
+		Msg( "\t%d threads: %.2f ms, %.0f queries/s (%.2fx), %d mismatches\n", nThreads, flThreadedTime * 1000.0,
+			nTotalReplayed / MAX( flThreadedTime, 1e-6 ), flSingleTime / MAX( flThreadedTime, 1e-6 ), nThreadedTotal );
+		nTotalMismatches += nThreadedTotal;
+	}
+
+	// Which filters the captured queries came from, most used first
+	CUtlVector<TraceReplayFilterCount_t> filterCounts;
+	filterCounts.SetCount( filterNames.Count() );
+	for ( int i = 0; i < filterNames.Count(); ++i )
+	{
+		filterCounts[i].m_pName = filterNames[i];
+		filterCounts[i].m_nCount = 0;
+	}
+	for ( uint32 i = 0; i < nRecords; ++i )
+	{
+		if ( pRecords[i].m_nFilter < filterCounts.Count() )
+		{
+			++filterCounts[pRecords[i].m_nFilter].m_nCount;
+		}
+	}
+	filterCounts.Sort( TraceReplayFilterSortFunc );
+
+	Msg( "\tQueries by filter:\n" );
+	for ( int i = 0; i < MIN( filterCounts.Count(), 10 ) && filterCounts[i].m_nCount; ++i )
+	{
+		Msg( "\t\t%8d %s\n", filterCounts[i].m_nCount, filterCounts[i].m_pName );
+	}
+
+	if ( nTotalMismatches )
+	{
+		Warning( "trace_replay: %d results differ from the capture\n", nTotalMismatches );
+	}
+
+	if ( bLoadedMap )
+	{
+		CM_FreeMap();
+	}
+}
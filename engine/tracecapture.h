@@ -0,0 +1,44 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Captures the world collision queries made through IEngineTrace to
+//			a file so they can be replayed against the same BSP later, to
+//			benchmark and regression test changes to the collision code.
+//
+//			trace_capture_start [file]	- starts logging TraceRay, SweepCollideable
+//										  and GetPointContents calls
+//			trace_capture_stop			- finishes the file
+//			trace_replay <file> [threads] - loads the captured map if needed and
+//										  replays the queries, reporting
+//										  throughput and result mismatches
+//
+//=============================================================================//
+
+#ifndef TRACECAPTURE_H
+#define TRACECAPTURE_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "engine/IEngineTrace.h"
+
+
+extern volatile bool g_bTraceCaptureActive;
+
+inline bool TraceCapture_IsActive()
+{
+	return g_bTraceCaptureActive;
+}
+
+// Logs a ray. pWorldTrace is the result of the world trace, or NULL when the filter skipped the world.
+void TraceCapture_RecordRay( const Ray_t &ray, unsigned int fMask, ITraceFilter *pTraceFilter, const trace_t *pWorldTrace );
+
+// Logs a point contents query along with the contents of the world at that point
+void TraceCapture_RecordPointContents( const Vector &vecAbsPosition, int nWorldContents );
+
+// Rays traced by this thread between these calls are logged as sweeps
+void TraceCapture_BeginSweep();
+void TraceCapture_EndSweep();
+
+
+#endif // TRACECAPTURE_H
@@ -27,6 +27,7 @@
 #include "filesystem_engine.h"
 #include "tier1/utlstring.h"
 #include "tier1/utlvector.h"
+#include "tier1/utlbuffer.h"
 #include "tier0/etwprof.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -380,6 +381,38 @@ DEFERRED_CON_COMMAND( vprof, "Toggle VProf profiler" )
 	}
 }
 
+// host_hitch_capture keeps the trace running too, each holds it on separately
+static bool s_bVProfTraceByCommand;
+
+CON_COMMAND( vprof_trace, "Toggle recording VProf scopes and jobs on every thread for vprof_trace_dump" )
+{
+	s_bVProfTraceByCommand = !s_bVProfTraceByCommand;
+	VProfTrace_Enable( s_bVProfTraceByCommand );
+	Msg( "VProf trace %s%s.\n", s_bVProfTraceByCommand ? "enabled" : "disabled",
+		( !s_bVProfTraceByCommand && g_bVProfTraceEnabled ) ? ", still recording for host_hitch_capture" : "" );
+}
+
+static void VProfTraceWriteToBuffer( const char *pData, int nLength, void *pContext )
+{
+	( (CUtlBuffer *)pContext )->Put( pData, nLength );
+}
+
+CON_COMMAND( vprof_trace_dump, "Write the last seconds of the VProf trace as Chrome trace JSON, for chrome://tracing or Perfetto. Usage: vprof_trace_dump [seconds] [filename]" )
+{
+	float flSeconds = ( args.ArgC() > 1 ) ? atof( args[1] ) : 5.0f;
+	const char *pszFilename = ( args.ArgC() > 2 ) ? args[2] : "vprof_trace.json";
+
+	CUtlBuffer buf;
+	int nEvents = VProfTrace_WriteChromeTrace( flSeconds, VProfTraceWriteToBuffer, &buf );
+	if ( !g_pFileSystem->WriteFile( pszFilename, "DEFAULT_WRITE_PATH", buf ) )
+	{
+		Warning( "vprof_trace_dump: couldn't write %s\n", pszFilename );
+		return;
+	}
+
+	Msg( "Wrote %d trace events from the last %.1f seconds to %s%s\n", nEvents, flSeconds, pszFilename, g_bVProfTraceEnabled ? "" : " (vprof_trace is off)" );
+}
+
 #ifdef	ETW_MARKS_ENABLED
 CON_COMMAND( vprof_vtrace, "Toggle whether vprof data is sent to VTrace" )
 {
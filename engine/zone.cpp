@@ -30,6 +30,9 @@
 #endif
 
 CMemoryStack g_HunkMemoryStack;
+
+// Lump loaders allocate from worker threads during a map load
+static CThreadFastMutex s_HunkAllocMutex;
 #ifdef HUNK_USE_16MB_PAGE
 CMemoryStack g_HunkOverflow;
 static bool g_bWarnedOverflow;
@@ -53,6 +56,7 @@ Hunk_AllocName
 void *Hunk_AllocName (int size, const char *name, bool bClear)
 {
 	MEM_ALLOC_CREDIT();
+	AUTO_LOCK( s_HunkAllocMutex );
 	void * p = g_HunkMemoryStack.Alloc( size, bClear );
 	if ( p )
 		return p;
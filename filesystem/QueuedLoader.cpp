@@ -846,6 +846,11 @@ void CQueuedLoader::SubmitPendingJobs()
 		// loader always takes ownership of buffer
 		asyncRequest.pData = pFileJob->m_pTargetData;
 		asyncRequest.flags = pFileJob->m_pTargetData ? 0 : FSASYNC_FLAGS_ALLOCNOFREE;
+		if ( !pFileJob->m_pTargetData && pFileJob->m_bFreeTargetAfterIO )
+		{
+			// short lived and returned through FreeOptimalReadBuffer(), so it can be read into a registered buffer
+			asyncRequest.flags |= FSASYNC_FLAGS_FIXEDBUFFER;
+		}
 		asyncRequest.nOffset = pFileJob->m_nStartOffset;
 		asyncRequest.nBytes = pFileJob->m_nBytesToRead;
 		asyncRequest.pszFilename = GetFilename( pFileJob->m_hFilename, szFilename, sizeof( szFilename ) );
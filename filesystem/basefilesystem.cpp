@@ -11,6 +11,7 @@
 
 #include "basefilesystem.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
 #include "tier1/characterset.h"
 #include "tier1/utlbuffer.h"
 #include "tier1/convar.h"
@@ -44,6 +45,12 @@
 
 #include <time.h>
 
+#ifdef POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
@@ -53,6 +60,7 @@
 
 ConVar fs_report_sync_opens( "fs_report_sync_opens", "0", 0, "0:Off, 1:Blocking only, 2:All" );
 ConVar fs_warning_mode( "fs_warning_mode", "0", 0, "0:Off, 1:Warn main thread, 2:Warn other threads"  );
+ConVar fs_mmap( "fs_mmap", "1", 0, "Read VPK chunks and pack files through memory mappings, and allow mapped file views. Applies to files opened afterwards." );
 
 #define BSPOUTPUT	0	// bsp output flag -- determines type of fs_log output to generate
 
@@ -124,6 +132,23 @@ CBaseFileSystem *BaseFileSystem()
 
 ConVar filesystem_buffer_size( "filesystem_buffer_size", "0", 0, "Size of per file buffers. 0 for none" );
 
+static void FileIndexChangedCallback( IConVar *pConVar, const char *pOldString, float flOldValue )
+{
+	if ( BaseFileSystem() )
+	{
+		BaseFileSystem()->UpdateFileIndex();
+	}
+}
+
+ConVar fs_file_index( "fs_file_index", "0", 0, "Index the files in every search path as it is mounted, so lookups skip the search paths that don't have the file. "
+	"Files added to loose directories by other programs are not seen until fs_file_index_rebuild.", FileIndexChangedCallback );
+ConVar fs_file_index_max_loose( "fs_file_index_max_loose", "200000", 0, "Loose directories holding more files than this are left out of the file index and always searched." );
+
+CON_COMMAND( fs_file_index_rebuild, "Enumerates every search path into the file index again" )
+{
+	BaseFileSystem()->UpdateFileIndex( true );
+}
+
 #if defined( TRACK_BLOCKING_IO )
 
 // If we hit more than 100 items in a frame, we're probably doing a level load...
@@ -324,6 +349,7 @@ CBaseFileSystem::CBaseFileSystem()
 	m_pPureServerWhitelist = NULL;
 
 	m_pThreadPool = NULL;
+	m_pAsyncRing = NULL;
 #if defined( TRACK_BLOCKING_IO )
 	m_pBlockingItems = new CBlockingFileItemList( this );
 	m_bBlockingFileAccessReportingEnabled = false;
@@ -587,6 +613,11 @@ FILE *CBaseFileSystem::Trace_FOpen( const char *filenameT, const char *options,
 
 	if ( fp )
 	{
+		if ( fs_file_index.GetBool() && strpbrk( options, "wa+" ) )
+		{
+			m_FileIndex.NoteFileWritten( filename );
+		}
+
 		if ( options[0] == 'r' )
 		{
 			FS_setbufsize(fp, filesystem_buffer_size.GetInt() );
@@ -828,6 +859,7 @@ void CBaseFileSystem::AddVPKFile( char const *pPath, const char *pPathID, Search
 			return;
 		}
 		pVPK->RegisterFileTracker( (IThreadedFileMD5Processor *)&m_FileTracker2 );
+		pVPK->SetUseMappedReads( fs_mmap.GetBool() );
 
 		pVPK->m_PackFileID = m_FileTracker2.NotePackFileOpened( pVPK->FullPathName(), pPathID, 0 );
 	}
@@ -888,7 +920,9 @@ bool CBaseFileSystem::AddPackFile( const char *pFileName, const char *pathID )
 	CHECK_DOUBLE_SLASHES( pFileName );
 
 	AsyncFinishAll();
-	return AddPackFileFromPath( "", pFileName, true, pathID );
+	bool bAdded = AddPackFileFromPath( "", pFileName, true, pathID );
+	UpdateFileIndex();
+	return bAdded;
 }
 
 //-----------------------------------------------------------------------------
@@ -1367,7 +1401,25 @@ void CBaseFileSystem::PrintSearchPaths( void )
 			}
 		#endif
 
-		Msg( "\"%s\" \"%s\" %s%s\n", pSearchPath->GetPathString(), (const char *)pSearchPath->GetPathIDString(), pszType, pszPack );
+		char szIndexed[64] = "";
+		if ( fs_file_index.GetBool() )
+		{
+			if ( pSearchPath->m_bInFileIndex )
+			{
+				V_snprintf( szIndexed, sizeof( szIndexed ), " [%d files indexed]", m_FileIndex.StoreFileCount( pSearchPath->m_storeId ) );
+			}
+			else
+			{
+				V_strncpy( szIndexed, " [not indexed]", sizeof( szIndexed ) );
+			}
+		}
+
+		Msg( "\"%s\" \"%s\" %s%s%s\n", pSearchPath->GetPathString(), (const char *)pSearchPath->GetPathIDString(), pszType, pszPack, szIndexed );
+	}
+
+	if ( fs_file_index.GetBool() )
+	{
+		m_FileIndex.PrintStats();
 	}
 
 	if ( IsX360() && m_ExcludePaths.Count() )
@@ -1537,6 +1589,151 @@ CBaseFileSystem::CSearchPath *CBaseFileSystem::FindSearchPathByStoreId( int stor
 	return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Drops the stores that were unmounted from the file index and
+//			enumerates the ones mounted since it was last updated
+//-----------------------------------------------------------------------------
+void CBaseFileSystem::UpdateFileIndex( bool bRebuild )
+{
+	AUTO_LOCK( m_SearchPathsMutex );
+
+	if ( !fs_file_index.GetBool() || bRebuild )
+	{
+		FOR_EACH_VEC( m_SearchPaths, i )
+		{
+			m_SearchPaths[i].m_bInFileIndex = false;
+		}
+		m_FileIndex.Clear();
+
+		if ( !fs_file_index.GetBool() )
+			return;
+	}
+
+	CUtlVector<int> storeIds;
+	m_FileIndex.GetStoreIds( storeIds );
+	FOR_EACH_VEC( storeIds, i )
+	{
+		if ( !FindSearchPathByStoreId( storeIds[i] ) )
+		{
+			m_FileIndex.RemoveStore( storeIds[i] );
+		}
+	}
+
+	FOR_EACH_VEC( m_SearchPaths, i )
+	{
+		CSearchPath &searchPath = m_SearchPaths[i];
+		if ( searchPath.m_bIsRemotePath )
+			continue;
+
+		// A map remounted under the same store ID may be a different pack
+		const void *pSource = searchPath.GetPackFile() ? (const void *)searchPath.GetPackFile() : (const void *)searchPath.GetPackedStore();
+		if ( !m_FileIndex.HasStore( searchPath.m_storeId, pSource ) )
+		{
+			IndexSearchPath( searchPath );
+		}
+		searchPath.m_bInFileIndex = m_FileIndex.IsStoreComplete( searchPath.m_storeId );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds every file in a loose directory, pack file or VPK to the index
+//-----------------------------------------------------------------------------
+void CBaseFileSystem::IndexSearchPath( const CSearchPath &searchPath )
+{
+	CFastTimer timer;
+	timer.Start();
+
+	CUtlVector<unsigned int> nameHashes;
+	const void *pSource = NULL;
+	const char *pszLooseRoot = NULL;
+	bool bComplete = true;
+	unsigned int nHash;
+
+	if ( CPackFile *pPackFile = searchPath.GetPackFile() )
+	{
+		pSource = pPackFile;
+		int nFiles = pPackFile->GetFileCount();
+		nameHashes.EnsureCapacity( nFiles );
+		for ( int i = 0; i < nFiles; ++i )
+		{
+			char szName[MAX_PATH];
+			if ( pPackFile->IndexToFilename( i, szName, sizeof( szName ) ) && CFileIndex::HashName( szName, &nHash ) )
+			{
+				nameHashes.AddToTail( nHash );
+			}
+		}
+	}
+#ifdef SUPPORT_PACKED_STORE
+	else if ( CPackedStore *pVPK = searchPath.GetPackedStore() )
+	{
+		pSource = pVPK;
+		CUtlStringList files;
+		pVPK->GetFileList( files, false, false );
+		nameHashes.EnsureCapacity( files.Count() );
+		FOR_EACH_VEC( files, i )
+		{
+			if ( CFileIndex::HashName( files[i], &nHash ) )
+			{
+				nameHashes.AddToTail( nHash );
+			}
+		}
+	}
+#endif
+	else
+	{
+		pszLooseRoot = searchPath.GetPathString();
+		bComplete = IndexLooseDirectory( pszLooseRoot, "", nameHashes, fs_file_index_max_loose.GetInt() );
+	}
+
+	timer.End();
+	m_FileIndex.AddStore( searchPath.m_storeId, pSource, pszLooseRoot, nameHashes, bComplete, timer.GetDuration().GetMillisecondsF() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Walks a loose directory tree. Returns false if it holds more than
+//			nMaxFiles files or is nested too deep to name.
+//-----------------------------------------------------------------------------
+bool CBaseFileSystem::IndexLooseDirectory( const char *pszRoot, const char *pszRelative, CUtlVector<unsigned int> &nameHashes, int nMaxFiles )
+{
+	char szWildCard[MAX_PATH];
+	if ( V_snprintf( szWildCard, sizeof( szWildCard ), "%s%s*", pszRoot, pszRelative ) >= (int)sizeof( szWildCard ) - 1 )
+		return false;
+	Q_FixSlashes( szWildCard );
+
+	WIN32_FIND_DATA findData;
+	HANDLE hFind = FS_FindFirstFile( szWildCard, &findData );
+	if ( hFind == INVALID_HANDLE_VALUE )
+		return true;
+
+	bool bComplete = true;
+	do
+	{
+		if ( !V_strcmp( findData.cFileName, "." ) || !V_strcmp( findData.cFileName, ".." ) )
+			continue;
+
+		char szName[MAX_PATH];
+		V_snprintf( szName, sizeof( szName ), "%s%s", pszRelative, findData.cFileName );
+
+		if ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+		{
+			V_strncat( szName, "/", sizeof( szName ) );
+			bComplete = IndexLooseDirectory( pszRoot, szName, nameHashes, nMaxFiles );
+		}
+		else
+		{
+			unsigned int nHash;
+			if ( CFileIndex::HashName( szName, &nHash ) )
+			{
+				nameHashes.AddToTail( nHash );
+			}
+			bComplete = ( nameHashes.Count() <= nMaxFiles );
+		}
+	} while ( bComplete && FS_FindNextFile( hFind, &findData ) );
+
+	FS_FindClose( hFind );
+	return bComplete;
+}
+
 //-----------------------------------------------------------------------------
 // Create the search path.
 //-----------------------------------------------------------------------------
@@ -1567,6 +1764,8 @@ void CBaseFileSystem::AddSearchPath( const char *pPath, const char *pathID, Sear
 		}
 	}
 
+	UpdateFileIndex();
+
 	if ( currCount != m_SearchPaths.Count() )
 	{
 #if !defined( DEDICATED )
@@ -1656,7 +1855,9 @@ bool CBaseFileSystem::RemoveSearchPath( const char *pPath, const char *pathID )
 		}
 		else if ( V_stristr( newPath, ".vpk" ) )
 		{
-			return RemoveVPKFile( newPath, pathID );
+			bool bRemoved = RemoveVPKFile( newPath, pathID );
+			UpdateFileIndex();
+			return bRemoved;
 		}
 		else
 		{
@@ -1683,6 +1884,8 @@ bool CBaseFileSystem::RemoveSearchPath( const char *pPath, const char *pathID )
 		m_SearchPaths.Remove( i );
 		bret = true;
 	}
+
+	UpdateFileIndex();
 	return bret;
 }
 
@@ -1703,6 +1906,8 @@ void CBaseFileSystem::RemoveSearchPaths( const char *pathID )
 			m_SearchPaths.FastRemove(i);
 		}
 	}
+
+	UpdateFileIndex();
 }
 
 
@@ -2120,9 +2325,13 @@ bool CBaseFileSystem::UnzipFile( const char *pFileName, const char *pPath, const
 //-----------------------------------------------------------------------------
 void CBaseFileSystem::RemoveAllSearchPaths( void )
 {
-	AUTO_LOCK( m_SearchPathsMutex );
-	m_SearchPaths.Purge();
-	//m_PackFileHandles.Purge();
+	{
+		AUTO_LOCK( m_SearchPathsMutex );
+		m_SearchPaths.Purge();
+		//m_PackFileHandles.Purge();
+	}
+
+	UpdateFileIndex();
 }
 
 
@@ -2520,6 +2729,11 @@ FileHandle_t CBaseFileSystem::OpenForRead( const char *pFileNameT, const char *p
 	}
 
 	CSearchPathsIterator iter( this, &pFileName, pathID, pathFilter );
+	if ( fs_file_index.GetBool() )
+	{
+		iter.UseFileIndex( &m_FileIndex );
+	}
+
 	for ( openInfo.m_pSearchPath = iter.GetFirst(); openInfo.m_pSearchPath != NULL; openInfo.m_pSearchPath = iter.GetNext() )
 	{
 		FileHandle_t filehandle = FindFileInSearchPath( openInfo );
@@ -3332,6 +3546,10 @@ time_t CBaseFileSystem::GetFileTime( const char *pFileName, const char *pPathID
 	CHECK_DOUBLE_SLASHES( pFileName );
 
 	CSearchPathsIterator iter( this, &pFileName, pPathID );
+	if ( fs_file_index.GetBool() )
+	{
+		iter.UseFileIndex( &m_FileIndex );
+	}
 
 	char tempFileName[MAX_PATH];
 	Q_strncpy( tempFileName, pFileName, sizeof(tempFileName) );
@@ -3619,6 +3837,146 @@ void CBaseFileSystem::NotifyFileUnloaded( const char *pszFilename, const char *p
 	m_FileTracker2.NoteFileUnloaded( pszFilename, pPathId );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Finds the OS file holding an open file's bytes from nOffset on,
+//			unchanged, and where they start in it. False for memory files,
+//			compressed pack entries, VPK preload bytes and platforms without
+//			descriptors. When *pbOwnDescriptor is set the caller must hand the
+//			descriptor to CloseFileBacking.
+//-----------------------------------------------------------------------------
+bool CBaseFileSystem::GetFileBacking( FileHandle_t file, int64 nOffset, int *pFd, int64 *pnFileOffset, bool *pbOwnDescriptor )
+{
+	*pFd = -1;
+	*pnFileOffset = nOffset;
+	*pbOwnDescriptor = false;
+
+	CFileHandle *fh = ( CFileHandle *)file;
+	if ( !fh || nOffset < 0 )
+		return false;
+
+#if defined( SUPPORT_PACKED_STORE ) && defined( POSIX )
+	if ( fh->m_VPKHandle )
+	{
+		char szDataFile[MAX_PATH];
+		if ( fh->m_VPKHandle.m_pOwner->GetDataFileLocation( fh->m_VPKHandle, (int)nOffset, szDataFile, sizeof( szDataFile ), *pnFileOffset ) )
+		{
+			*pFd = open( szDataFile, O_RDONLY | O_CLOEXEC );
+			*pbOwnDescriptor = ( *pFd >= 0 );
+		}
+	}
+	else
+#endif
+	if ( fh->m_pFile )
+	{
+		*pFd = FS_fileno( fh->m_pFile );
+	}
+	else if ( fh->m_pPackFileHandle )
+	{
+		FILE *pPackFile;
+		int64 nBase;
+		if ( fh->m_pPackFileHandle->GetBackingFile( &pPackFile, &nBase ) )
+		{
+			*pFd = FS_fileno( pPackFile );
+			*pnFileOffset += nBase;
+		}
+	}
+
+	return ( *pFd >= 0 );
+}
+
+void CBaseFileSystem::CloseFileBacking( int fd )
+{
+#ifdef POSIX
+	if ( fd >= 0 )
+	{
+		close( fd );
+	}
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Memory mapped views
+//-----------------------------------------------------------------------------
+struct FileView_t
+{
+	void	*m_pBase;
+	size_t	m_nMapSize;
+};
+
+void *CBaseFileSystem::MapFileRange( int fd, int64 nOffset, int64 nSize, bool bCopyOnWrite, void **ppBase, size_t *pnMapSize )
+{
+	*ppBase = NULL;
+	*pnMapSize = 0;
+#ifdef POSIX
+	if ( fd < 0 || nOffset < 0 || nSize <= 0 )
+		return NULL;
+
+	int64 nPageSize = sysconf( _SC_PAGESIZE );
+	int64 nMapOffset = nOffset - ( nOffset % nPageSize );
+	size_t nMapSize = (size_t)( nOffset - nMapOffset + nSize );
+
+	void *pBase = mmap( NULL, nMapSize, bCopyOnWrite ? ( PROT_READ | PROT_WRITE ) : PROT_READ, MAP_PRIVATE, fd, nMapOffset );
+	if ( pBase == MAP_FAILED )
+		return NULL;
+
+	*ppBase = pBase;
+	*pnMapSize = nMapSize;
+	return (byte *)pBase + ( nOffset - nMapOffset );
+#else
+	return NULL;
+#endif
+}
+
+void CBaseFileSystem::UnmapFileRange( void *pBase, size_t nMapSize )
+{
+#ifdef POSIX
+	if ( pBase )
+	{
+		munmap( pBase, nMapSize );
+	}
+#endif
+}
+
+void *CBaseFileSystem::MapFileView( FileHandle_t file, int64 nOffset, int64 nSize, FileViewHandle_t *phView )
+{
+	*phView = NULL;
+
+	CFileHandle *fh = ( CFileHandle *)file;
+	if ( !fh || !fs_mmap.GetBool() || nOffset < 0 || nSize <= 0 || nOffset + nSize > fh->Size() )
+		return NULL;
+
+	int fd;
+	int64 nFileOffset;
+	bool bOwnDescriptor;
+	if ( !GetFileBacking( file, nOffset, &fd, &nFileOffset, &bOwnDescriptor ) )
+		return NULL;
+
+	FileView_t view;
+	void *pData = MapFileRange( fd, nFileOffset, nSize, true, &view.m_pBase, &view.m_nMapSize );
+
+	if ( bOwnDescriptor )
+	{
+		// The mapping keeps its own reference to the file
+		CloseFileBacking( fd );
+	}
+
+	if ( !pData )
+		return NULL;
+
+	*phView = new FileView_t( view );
+	return pData;
+}
+
+void CBaseFileSystem::ReleaseFileView( FileViewHandle_t hView )
+{
+	FileView_t *pView = (FileView_t *)hView;
+	if ( !pView )
+		return;
+
+	UnmapFileRange( pView->m_pBase, pView->m_nMapSize );
+	delete pView;
+}
+
 void CBaseFileSystem::SetSearchPathIsTrustedSource( CSearchPath *pSearchPath )
 {
 #if 1
@@ -3957,6 +4315,9 @@ void CBaseFileSystem::CreateDirHierarchy( const char *pRelativePathT, const char
 			_mkdir( szScratchFileName );
 #elif defined( POSIX )
 			mkdir( szScratchFileName, S_IRWXU |  S_IRGRP |  S_IROTH );// owner has rwx, rest have r
+#endif
+#if defined( LINUX )
+			InvalidateCaseInsensitiveDirCache( szScratchFileName );
 #endif
 			*s = CORRECT_PATH_SEPARATOR;
 		}
@@ -3968,6 +4329,9 @@ void CBaseFileSystem::CreateDirHierarchy( const char *pRelativePathT, const char
 #elif defined( POSIX )
 	mkdir( szScratchFileName, S_IRWXU |  S_IRGRP |  S_IROTH );
 #endif
+#if defined( LINUX )
+	InvalidateCaseInsensitiveDirCache( szScratchFileName );
+#endif
 }
 
 
@@ -4659,6 +5023,9 @@ void CBaseFileSystem::RemoveFile( char const* pRelativePath, const char *pathID
 		ComputeFullWritePath( szScratchFileName, sizeof( szScratchFileName ), pRelativePath, pathID );
 	}
 	int fail = unlink( szScratchFileName );
+#if defined( LINUX )
+	InvalidateCaseInsensitiveDirCache( szScratchFileName );
+#endif
 	if ( fail != 0 )
 	{
 		Warning( FILESYSTEM_WARNING, "Unable to remove %s!\n", szScratchFileName );
@@ -4718,12 +5085,21 @@ bool CBaseFileSystem::RenameFile( char const *pOldPath, char const *pNewPath, co
 
 	// Now copy the file over
 	int fail = rename( szScratchFileName, pNewFileName );
+#if defined( LINUX )
+	InvalidateCaseInsensitiveDirCache( szScratchFileName );
+	InvalidateCaseInsensitiveDirCache( pNewFileName );
+#endif
 	if (fail != 0)
 	{
 		Warning( FILESYSTEM_WARNING, "Unable to rename %s to %s!\n", szScratchFileName, pNewFileName );
 		return false;
 	}
 
+	if ( fs_file_index.GetBool() )
+	{
+		m_FileIndex.NoteFileWritten( pNewFileName );
+	}
+
 	return true;
 }
 
@@ -4895,6 +5271,7 @@ CBaseFileSystem::CSearchPath::CSearchPath( void )
 	m_bIsRemotePath = false;
 	m_pPackedStore = NULL;
 	m_bIsTrustedForPureServer = false;
+	m_bInFileIndex = false;
 }
 
 const char *CBaseFileSystem::CSearchPath::GetDebugString() const
@@ -4967,6 +5344,12 @@ CBaseFileSystem::CSearchPath *CBaseFileSystem::CSearchPathsIterator::GetNext()
 		if ( CBaseFileSystem::FilterByPathID( pSearchPath, m_pathID ) )
 			continue;
 
+		if ( m_pFileIndex && pSearchPath->m_bInFileIndex && !m_FileIndexResult.HasStore( pSearchPath->m_storeId ) )
+		{
+			m_pFileIndex->NoteSkippedProbe();
+			continue;
+		}
+
 		// 360 can optionally ignore a local search path in dvddev mode
 		// ignoring a local search path falls through to its cloned remote path
 		// map paths are exempt from this exclusion logic
@@ -5010,6 +5393,22 @@ CBaseFileSystem::CSearchPath *CBaseFileSystem::CSearchPathsIterator::GetNext()
 	return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Looks the file up once so GetNext() can pass over the indexed
+//			search paths that don't have it
+//-----------------------------------------------------------------------------
+void CBaseFileSystem::CSearchPathsIterator::UseFileIndex( CFileIndex *pFileIndex )
+{
+	if ( !m_Filename[0] )
+		return;
+
+	pFileIndex->Lookup( m_Filename, m_FileIndexResult );
+	if ( m_FileIndexResult.IsValid() )
+	{
+		m_pFileIndex = pFileIndex;
+	}
+}
+
 void CBaseFileSystem::CSearchPathsIterator::CopySearchPaths( const CUtlVector<CSearchPath>	&searchPaths )
 {
 	m_SearchPaths = searchPaths;
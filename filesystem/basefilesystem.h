@@ -61,6 +61,7 @@
 #include "byteswap.h"
 #include "threadsaferefcountedobject.h"
 #include "filetracker.h"
+#include "fileindex.h"
 // #include "filesystem_init.h"
 
 #if defined( SUPPORT_PACKED_STORE )
@@ -114,9 +115,23 @@ class CPackFile;
 class IFileList;
 class CFileOpenInfo;
 class CFileAsyncReadJob;
+class CAsyncReadRing;
+struct AsyncOpenedFile_t;
 
 //-----------------------------------------------------------------------------
 
+//-----------------------------------------------------------------------------
+// An async read between opening the file and running the callback
+//-----------------------------------------------------------------------------
+struct AsyncReadState_t
+{
+	AsyncOpenedFile_t	*pHeldFile;
+	FileHandle_t		hFile;
+	void				*pDest;
+	int					nBytesToRead;
+	int					nBytesBuffer;
+};
+
 class CFileHandle
 {
 public:
@@ -279,7 +294,7 @@ public:
 	// Optimal buffer
 	bool						GetOptimalIOConstraints( FileHandle_t hFile, unsigned *pOffsetAlign, unsigned *pSizeAlign, unsigned *pBufferAlign );
 	void						*AllocOptimalReadBuffer( FileHandle_t hFile, unsigned nSize, unsigned nOffset )	{ return malloc( nSize ); }
-	void						FreeOptimalReadBuffer( void *p ) { free( p ); }
+	void						FreeOptimalReadBuffer( void *p ) { if ( !AsyncFreeFixedBuffer( p ) ) free( p ); }
 
 	// Gets the current working directory
 	virtual bool				GetCurrentDirectory( char* pDirectory, int maxlen );
@@ -364,6 +379,12 @@ public:
 	virtual bool				CheckVPKFileHash( int PackFileID, int nPackFileNumber, int nFileFraction, MD5Value_t &md5Value );
 	virtual void				NotifyFileUnloaded( const char *pszFilename, const char *pPathId ) OVERRIDE;
 
+	virtual void				*MapFileView( FileHandle_t file, int64 nOffset, int64 nSize, FileViewHandle_t *phView ) OVERRIDE;
+	virtual void				ReleaseFileView( FileViewHandle_t hView ) OVERRIDE;
+
+	bool						GetFileBacking( FileHandle_t file, int64 nOffset, int *pFd, int64 *pnFileOffset, bool *pbOwnDescriptor );
+	static void					CloseFileBacking( int fd );
+
 	// Returns the file system statistics retreived by the implementation.  Returns NULL if not supported.
 	virtual const FileSystemStatistics *GetFilesystemStatistics();
 	
@@ -404,6 +425,9 @@ public:
 	bool						AddPackFile( const char *pFileName, const char *pathID );
 	bool						AddPackFileFromPath( const char *pPath, const char *pakfile, bool bCheckForAppendedPack, const char *pathID );
 
+	// Brings the file index in line with the mounted search paths, re-enumerating every store if bRebuild
+	void						UpdateFileIndex( bool bRebuild = false );
+
 	// converts a partial path into a full path
 	// can be filtered to restrict path types and can provide info about resolved path
 	virtual const char			*RelativePathToFullPath( const char *pFileName, const char *pPathID, OUT_Z_CAP(maxLenInChars) char *pDest, int maxLenInChars, PathTypeFilter_t pathFilter = FILTER_NONE, PathTypeQuery_t *pPathType = NULL );
@@ -428,6 +452,12 @@ public:
 	virtual bool				FullPathToRelativePathEx( const char *pFullpath, const char *pPathId, OUT_Z_CAP(maxLenInChars) char *pDest, int maxLenInChars );
 
 	FSAsyncStatus_t				SyncRead( const FileAsyncRequest_t &request );
+	// SyncRead in two halves, for reads issued somewhere else in between. Begin reports
+	// failures through the callback itself; otherwise End must follow.
+	FSAsyncStatus_t				BeginAsyncRead( const FileAsyncRequest_t &request, AsyncReadState_t &state, bool bFixedBuffer = false );
+	FSAsyncStatus_t				EndAsyncRead( const FileAsyncRequest_t &request, AsyncReadState_t &state, int nBytesRead );
+	// Returns one of the async ring's registered buffers, false if p isn't one
+	bool						AsyncFreeFixedBuffer( void *p );
 	FSAsyncStatus_t				SyncWrite(const char *pszFilename, const void *pSrc, int nSrcBytes, bool bFreeMemory, bool bAppend );
 	FSAsyncStatus_t				SyncAppendFile(const char *pAppendToFileName, const char *pAppendFromFileName );
 	FSAsyncStatus_t				SyncGetFileSize( const FileAsyncRequest_t &request );
@@ -528,6 +558,9 @@ public:
 
 		bool				m_bIsTrustedForPureServer;
 
+		// Every file in the store is in the file index, so stores it doesn't list can be skipped
+		bool				m_bInFileIndex;
+
 	private:
 		CUtlSymbol			m_Path;
 		const char			*m_pDebugPath;
@@ -563,7 +596,8 @@ public:
 	public:
 		CSearchPathsIterator( CBaseFileSystem *pFileSystem, const char **ppszFilename, const char *pszPathID, PathTypeFilter_t pathTypeFilter = FILTER_NONE )
 		  : m_iCurrent( -1 ),
-			m_PathTypeFilter( pathTypeFilter )
+			m_PathTypeFilter( pathTypeFilter ),
+			m_pFileIndex( NULL )
 		{
 			char tempPathID[MAX_PATH];
 			if ( *ppszFilename && (*ppszFilename)[0] == '/' && (*ppszFilename)[1] == '/' ) // ONLY '//' (and not '\\') for our special format
@@ -603,7 +637,8 @@ public:
 
 		CSearchPathsIterator( CBaseFileSystem *pFileSystem, const char *pszPathID, PathTypeFilter_t pathTypeFilter = FILTER_NONE )
 		  : m_iCurrent( -1 ),
-			m_PathTypeFilter( pathTypeFilter )
+			m_PathTypeFilter( pathTypeFilter ),
+			m_pFileIndex( NULL )
 		{
 			if ( pszPathID ) 
 			{
@@ -623,6 +658,9 @@ public:
 		CSearchPath *GetFirst();
 		CSearchPath *GetNext();
 
+		// Skip the search paths the file index says don't have the file
+		void UseFileIndex( CFileIndex *pFileIndex );
+
 	private:
 		CSearchPathsIterator( const  CSearchPathsIterator & );
 		void operator=(const CSearchPathsIterator &);
@@ -636,6 +674,8 @@ public:
 		CPathIDInfo					m_EmptyPathIDInfo;
 		PathTypeFilter_t			m_PathTypeFilter;
 		char						m_Filename[MAX_PATH];	// set for relative names only
+		CFileIndex					*m_pFileIndex;
+		CFileIndexResult			m_FileIndexResult;
 	};
 
 	friend class CSearchPathsIterator;
@@ -681,6 +721,7 @@ public:
 	bool m_bOutputDebugString;
 
 	IThreadPool *	m_pThreadPool;
+	CAsyncReadRing *m_pAsyncRing;		// io_uring reads, Linux only
 	CThreadFastMutex m_AsyncCallbackMutex;
 
 	// Statistics:
@@ -697,6 +738,9 @@ public:
 
 	CFileTracker2	m_FileTracker2;
 
+	// Which stores hold which files, when fs_file_index is set
+	CFileIndex		m_FileIndex;
+
 protected:
 	//----------------------------------------------------------------------------
 	// Purpose: Functions implementing basic file system behavior.
@@ -721,6 +765,13 @@ protected:
 	virtual bool FS_FindNextFile(HANDLE handle, WIN32_FIND_DATA *dat) = 0;
 	virtual bool FS_FindClose(HANDLE handle) = 0;
 	virtual int FS_GetSectorSize( FILE * ) { return 1; }
+	virtual int FS_fileno( FILE * ) { return -1; }	// OS descriptor, for mapping the file
+
+	// Maps part of a file, read only or copy on write. Returns the address of
+	// nOffset; *ppBase and *pnMapSize describe the page aligned mapping to hand
+	// back to UnmapFileRange. NULL where mapping isn't supported.
+	static void *MapFileRange( int fd, int64 nOffset, int64 nSize, bool bCopyOnWrite, void **ppBase, size_t *pnMapSize );
+	static void UnmapFileRange( void *pBase, size_t nMapSize );
 
 #if defined( TRACK_BLOCKING_IO )
 	void BlockingFileAccess_EnterCriticalSection();
@@ -793,6 +844,9 @@ protected:
 	void						AddVPKFile( const char *pPath, const char *pPathID, SearchPathAdd_t addType );
 	bool						RemoveVPKFile( const char *pPath, const char *pPathID );
 
+	void						IndexSearchPath( const CSearchPath &searchPath );
+	bool						IndexLooseDirectory( const char *pszRoot, const char *pszRelative, CUtlVector<unsigned int> &nameHashes, int nMaxFiles );
+
 	void						HandleOpenRegularFile( CFileOpenInfo &openInfo, bool bIsAbsolutePath );
 
 	FileHandle_t				FindFileInSearchPath( CFileOpenInfo &openInfo );
@@ -0,0 +1,314 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Index of which search path stores hold which files
+//
+//=============================================================================
+
+#include "fileindex.h"
+#include "tier0/dbg.h"
+#include "tier1/generichash.h"
+#include "tier1/strtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+CFileIndex::CFileIndex() : m_Stores( DefLessFunc( int ) )
+{
+	m_nFreeNode = -1;
+}
+
+CFileIndex::~CFileIndex()
+{
+	Clear();
+}
+
+bool CFileIndex::HashName( const char *pFileName, unsigned int *pnHash )
+{
+	char szName[MAX_PATH];
+	if ( !pFileName || !pFileName[0] || V_IsAbsolutePath( pFileName ) )
+		return false;
+
+	V_strncpy( szName, pFileName, sizeof( szName ) );
+	V_FixSlashes( szName, '/' );
+	V_strlower( szName );
+
+	// The stores disagree about how to resolve these, let them
+	if ( szName[0] == '/' || V_strstr( szName, "./" ) || V_strstr( szName, "//" ) || strchr( szName, ':' ) )
+		return false;
+
+	*pnHash = HashString( szName );
+	return true;
+}
+
+bool CFileIndex::IsEmpty() const
+{
+	m_Lock.LockForRead();
+	bool bEmpty = ( m_Stores.Count() == 0 );
+	m_Lock.UnlockRead();
+	return bEmpty;
+}
+
+bool CFileIndex::HasStore( int storeId, const void *pSource ) const
+{
+	m_Lock.LockForRead();
+	unsigned short i = m_Stores.Find( storeId );
+	bool bHas = m_Stores.IsValidIndex( i ) && m_Stores[i]->m_pSource == pSource;
+	m_Lock.UnlockRead();
+	return bHas;
+}
+
+bool CFileIndex::IsStoreComplete( int storeId ) const
+{
+	m_Lock.LockForRead();
+	unsigned short i = m_Stores.Find( storeId );
+	bool bComplete = m_Stores.IsValidIndex( i ) && m_Stores[i]->m_bComplete;
+	m_Lock.UnlockRead();
+	return bComplete;
+}
+
+int CFileIndex::StoreFileCount( int storeId ) const
+{
+	m_Lock.LockForRead();
+	unsigned short i = m_Stores.Find( storeId );
+	int nCount = m_Stores.IsValidIndex( i ) ? m_Stores[i]->m_NameHashes.Count() : 0;
+	m_Lock.UnlockRead();
+	return nCount;
+}
+
+void CFileIndex::GetStoreIds( CUtlVector<int> &storeIds ) const
+{
+	m_Lock.LockForRead();
+	FOR_EACH_MAP_FAST( m_Stores, i )
+	{
+		storeIds.AddToTail( m_Stores.Key( i ) );
+	}
+	m_Lock.UnlockRead();
+}
+
+//-----------------------------------------------------------------------------
+// Links a store into a name's chain unless it's already there, which
+// happens for names that differ only by case on disk
+//-----------------------------------------------------------------------------
+void CFileIndex::AddNameLocked( int storeId, unsigned int nHash, Store_t *pStore )
+{
+	UtlHashHandle_t h = m_Names.Find( nHash );
+	int nHead = ( h != m_Names.InvalidHandle() ) ? m_Names.Element( h ) : -1;
+	for ( int n = nHead; n != -1; n = m_Nodes[n].m_nNext )
+	{
+		if ( m_Nodes[n].m_storeId == storeId )
+			return;
+	}
+
+	int nNode = m_nFreeNode;
+	if ( nNode != -1 )
+	{
+		m_nFreeNode = m_Nodes[nNode].m_nNext;
+	}
+	else
+	{
+		nNode = m_Nodes.AddToTail();
+	}
+
+	m_Nodes[nNode].m_storeId = storeId;
+	m_Nodes[nNode].m_nNext = nHead;
+	if ( h != m_Names.InvalidHandle() )
+	{
+		m_Names.Element( h ) = nNode;
+	}
+	else
+	{
+		m_Names.Insert( nHash, nNode );
+	}
+
+	pStore->m_NameHashes.AddToTail( nHash );
+}
+
+void CFileIndex::FreeNode( int nNode )
+{
+	m_Nodes[nNode].m_storeId = -1;
+	m_Nodes[nNode].m_nNext = m_nFreeNode;
+	m_nFreeNode = nNode;
+}
+
+void CFileIndex::AddStore( int storeId, const void *pSource, const char *pszLooseRoot, const CUtlVector<unsigned int> &nameHashes, bool bComplete, float flBuildTime )
+{
+	RemoveStore( storeId );
+
+	Store_t *pStore = new Store_t;
+	pStore->m_pSource = pSource;
+	pStore->m_bComplete = bComplete;
+	pStore->m_flBuildTime = flBuildTime;
+	if ( pszLooseRoot )
+	{
+		char szRoot[MAX_PATH];
+		V_strncpy( szRoot, pszLooseRoot, sizeof( szRoot ) );
+		V_FixSlashes( szRoot, '/' );
+		pStore->m_LooseRoot = szRoot;
+	}
+
+	m_Lock.LockForWrite();
+	m_Stores.Insert( storeId, pStore );
+	if ( bComplete )
+	{
+		pStore->m_NameHashes.EnsureCapacity( nameHashes.Count() );
+		FOR_EACH_VEC( nameHashes, i )
+		{
+			AddNameLocked( storeId, nameHashes[i], pStore );
+		}
+	}
+	m_Lock.UnlockWrite();
+}
+
+void CFileIndex::RemoveStore( int storeId )
+{
+	m_Lock.LockForWrite();
+	unsigned short iStore = m_Stores.Find( storeId );
+	if ( !m_Stores.IsValidIndex( iStore ) )
+	{
+		m_Lock.UnlockWrite();
+		return;
+	}
+
+	Store_t *pStore = m_Stores[iStore];
+	FOR_EACH_VEC( pStore->m_NameHashes, i )
+	{
+		unsigned int nHash = pStore->m_NameHashes[i];
+		UtlHashHandle_t h = m_Names.Find( nHash );
+		if ( h == m_Names.InvalidHandle() )
+			continue;
+
+		int nPrev = -1;
+		for ( int n = m_Names.Element( h ); n != -1; nPrev = n, n = m_Nodes[n].m_nNext )
+		{
+			if ( m_Nodes[n].m_storeId != storeId )
+				continue;
+
+			int nNext = m_Nodes[n].m_nNext;
+			if ( nPrev != -1 )
+			{
+				m_Nodes[nPrev].m_nNext = nNext;
+			}
+			else if ( nNext != -1 )
+			{
+				m_Names.Element( h ) = nNext;
+			}
+			else
+			{
+				m_Names.Remove( nHash );
+			}
+			FreeNode( n );
+			break;
+		}
+	}
+
+	m_Stores.RemoveAt( iStore );
+	if ( !m_Stores.Count() )
+	{
+		// Start over rather than keep a free list as big as everything that was unmounted
+		m_Names.Purge();
+		m_Nodes.Purge();
+		m_nFreeNode = -1;
+	}
+	m_Lock.UnlockWrite();
+
+	delete pStore;
+}
+
+void CFileIndex::Clear()
+{
+	m_Lock.LockForWrite();
+	FOR_EACH_MAP_FAST( m_Stores, i )
+	{
+		delete m_Stores[i];
+	}
+	m_Stores.Purge();
+	m_Names.Purge();
+	m_Nodes.Purge();
+	m_nFreeNode = -1;
+	m_nLookups = 0;
+	m_nMisses = 0;
+	m_nSkippedProbes = 0;
+	m_Lock.UnlockWrite();
+}
+
+void CFileIndex::NoteFileWritten( const char *pszAbsolutePath )
+{
+	char szPath[MAX_PATH];
+	V_strncpy( szPath, pszAbsolutePath, sizeof( szPath ) );
+	V_FixSlashes( szPath, '/' );
+
+	m_Lock.LockForWrite();
+	FOR_EACH_MAP_FAST( m_Stores, i )
+	{
+		Store_t *pStore = m_Stores[i];
+		int nRootLen = pStore->m_LooseRoot.Length();
+		if ( !pStore->m_bComplete || !nRootLen || V_strnicmp( szPath, pStore->m_LooseRoot.Get(), nRootLen ) )
+			continue;
+
+		unsigned int nHash;
+		if ( HashName( szPath + nRootLen, &nHash ) )
+		{
+			AddNameLocked( m_Stores.Key( i ), nHash, pStore );
+		}
+	}
+	m_Lock.UnlockWrite();
+}
+
+void CFileIndex::Lookup( const char *pFileName, CFileIndexResult &result ) const
+{
+	result.m_bValid = false;
+	result.m_nStores = 0;
+
+	unsigned int nHash;
+	if ( !HashName( pFileName, &nHash ) )
+		return;
+
+	++m_nLookups;
+
+	m_Lock.LockForRead();
+	UtlHashHandle_t h = m_Names.Find( nHash );
+	if ( h == m_Names.InvalidHandle() )
+	{
+		++m_nMisses;
+		result.m_bValid = true;
+	}
+	else
+	{
+		result.m_bValid = true;
+		for ( int n = m_Names.Element( h ); n != -1; n = m_Nodes[n].m_nNext )
+		{
+			if ( result.m_nStores == FILE_INDEX_MAX_RESULT_STORES )
+			{
+				result.m_bValid = false;
+				break;
+			}
+			result.m_StoreIds[result.m_nStores++] = m_Nodes[n].m_storeId;
+		}
+	}
+	m_Lock.UnlockRead();
+}
+
+void CFileIndex::PrintStats() const
+{
+	m_Lock.LockForRead();
+	int nEntries = 0;
+	int nIncomplete = 0;
+	float flBuildTime = 0.0f;
+	FOR_EACH_MAP_FAST( m_Stores, i )
+	{
+		nEntries += m_Stores[i]->m_NameHashes.Count();
+		flBuildTime += m_Stores[i]->m_flBuildTime;
+		if ( !m_Stores[i]->m_bComplete )
+		{
+			++nIncomplete;
+		}
+	}
+
+	int nBytes = m_Names.Count() * ( sizeof( unsigned int ) + sizeof( int ) ) + m_Nodes.Count() * sizeof( Node_t ) + nEntries * sizeof( unsigned int );
+	Msg( "File index: %d names, %d entries in %d stores (%d not indexed), %.1f KB, built in %.2f ms\n",
+		m_Names.Count(), nEntries, m_Stores.Count(), nIncomplete, nBytes / 1024.0f, flBuildTime );
+	m_Lock.UnlockRead();
+
+	Msg( "\t%d lookups, %d not found anywhere, %d search path probes skipped\n", (int)m_nLookups, (int)m_nMisses, (int)m_nSkippedProbes );
+}
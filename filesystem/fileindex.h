@@ -0,0 +1,123 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Index of which search path stores hold which files, so a lookup
+//			can skip every loose directory, VPK and pack file that doesn't
+//			have the file instead of probing each of them in turn.
+//
+//=============================================================================
+
+#ifndef FILEINDEX_H
+#define FILEINDEX_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/threadtools.h"
+#include "tier1/strtools.h"
+#include "tier1/utlhashtable.h"
+#include "tier1/utlmap.h"
+#include "tier1/utlstring.h"
+#include "tier1/utlvector.h"
+
+// Most files live in one or two stores; names in more than this are looked up everywhere
+#define FILE_INDEX_MAX_RESULT_STORES	8
+
+//-----------------------------------------------------------------------------
+// The stores holding a file, copied out of the index so the search path
+// walk doesn't hold its lock
+//-----------------------------------------------------------------------------
+class CFileIndexResult
+{
+public:
+	CFileIndexResult()	{ m_bValid = false; m_nStores = 0; }
+
+	// False when the index couldn't answer and every search path must be tried
+	bool IsValid() const	{ return m_bValid; }
+
+	bool HasStore( int storeId ) const
+	{
+		if ( !m_bValid )
+			return true;
+		for ( int i = 0; i < m_nStores; ++i )
+		{
+			if ( m_StoreIds[i] == storeId )
+				return true;
+		}
+		return false;
+	}
+
+private:
+	friend class CFileIndex;
+
+	bool	m_bValid;
+	int		m_nStores;
+	int		m_StoreIds[FILE_INDEX_MAX_RESULT_STORES];
+};
+
+//-----------------------------------------------------------------------------
+// Names are keyed by a hash of their lowercased, forward slashed relative
+// path. Only the hash is kept: a collision costs a wasted probe, never a
+// missed file. A store is a CSearchPath::m_storeId, which loose directories
+// mounted under several path IDs share.
+//-----------------------------------------------------------------------------
+class CFileIndex
+{
+public:
+	CFileIndex();
+	~CFileIndex();
+
+	// Hashes a relative name. False for names the index can't answer for (absolute, ./ or ../)
+	static bool HashName( const char *pFileName, unsigned int *pnHash );
+
+	bool IsEmpty() const;
+	// True when the store is indexed from the same pack or VPK (NULL for loose directories)
+	bool HasStore( int storeId, const void *pSource ) const;
+	bool IsStoreComplete( int storeId ) const;
+	int StoreFileCount( int storeId ) const;
+	void GetStoreIds( CUtlVector<int> &storeIds ) const;
+
+	// Incomplete stores are remembered so they aren't enumerated again, but never rule out a lookup.
+	// pszLooseRoot is the absolute directory of a loose store, so files written into it can be added.
+	void AddStore( int storeId, const void *pSource, const char *pszLooseRoot, const CUtlVector<unsigned int> &nameHashes, bool bComplete, float flBuildTime );
+	void RemoveStore( int storeId );
+	void Clear();
+
+	// Adds a file created through the filesystem to every loose store under whose root it sits
+	void NoteFileWritten( const char *pszAbsolutePath );
+
+	void Lookup( const char *pFileName, CFileIndexResult &result ) const;
+	void NoteSkippedProbe()		{ ++m_nSkippedProbes; }
+
+	void PrintStats() const;
+
+private:
+	struct Node_t
+	{
+		int		m_storeId;
+		int		m_nNext;
+	};
+
+	struct Store_t
+	{
+		const void					*m_pSource;
+		CUtlString					m_LooseRoot;
+		CUtlVector<unsigned int>	m_NameHashes;
+		bool						m_bComplete;
+		float						m_flBuildTime;
+	};
+
+	void AddNameLocked( int storeId, unsigned int nHash, Store_t *pStore );
+	void FreeNode( int nNode );
+
+	mutable CThreadRWLock					m_Lock;
+	CUtlHashtable< unsigned int, int >		m_Names;		// name hash -> first node
+	CUtlVector< Node_t >					m_Nodes;
+	int										m_nFreeNode;
+	CUtlMap< int, Store_t * >				m_Stores;
+
+	mutable CInterlockedInt					m_nLookups;
+	mutable CInterlockedInt					m_nMisses;
+	CInterlockedInt							m_nSkippedProbes;
+};
+
+#endif // FILEINDEX_H
@@ -25,8 +25,18 @@
 #include "tier1/utlmap.h"
 #include "tier1/utlbuffer.h"
 #include "tier0/icommandline.h"
+#include "tier0/fasttimer.h"
 #include "vstdlib/random.h"
 #include "basefilesystem.h"
+#ifdef LINUX
+#include "linux_iouring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
 
 // VCR mode for now is handled by not running async.  This is primarily for
 // performance reasons. VCR mode would preclude the use of a lock-free job
@@ -270,7 +280,11 @@ public:
 		m_pfnRealCallback( fromRequest.pfnCallback ),
 		m_pCustomFetcher(NULL),
 		m_hCustomFetcherHandle(NULL),
-		m_pOwnerFileSystem(pOwnerFileSystem)
+		m_pOwnerFileSystem(pOwnerFileSystem),
+		m_bInAsyncRing(false),
+		m_RingStage(RING_NONE),
+		m_RingStatus(FSASYNC_OK),
+		m_nRingBytesRead(0)
 	{
 #if defined( TRACK_BLOCKING_IO )
 		m_Timer.Start();
@@ -339,6 +353,12 @@ public:
 				retval = -1; // generic failure code...?
 			}
 		}
+		else if ( m_RingStage != RING_NONE )
+		{
+			// The async ring has done the read, or found it can't, all that's left is the callback
+			retval = ( m_RingStage == RING_READ_DONE ) ? BaseFileSystem()->EndAsyncRead( *this, m_RingRead, m_nRingBytesRead ) : m_RingStatus;
+			m_RingStage = RING_NONE;
+		}
 		else
 		{
 			int iPrevPriority = ThreadGetPriority();
@@ -361,6 +381,17 @@ public:
 		return retval;
 	}
 
+	virtual JobStatus_t DoAbort( bool bDiscard )
+	{
+		if ( m_RingStage == RING_NONE )
+		{
+			return JOB_STATUS_ABORTED;
+		}
+
+		// The ring has already done the read and holds the file and buffer, finish it rather than leak them
+		return DoExecute();
+	}
+
 	virtual JobStatus_t GetResult( void **ppData, int *pSize ) 
 	{ 
 		if ( m_pResultData )
@@ -419,6 +450,19 @@ public:
 	IAsyncFileFetch *		m_pCustomFetcher;
 	IAsyncFileFetch::Handle	m_hCustomFetcherHandle;
 	CBaseFileSystem *		m_pOwnerFileSystem;
+
+	// Serviced by the async ring rather than the thread pool
+	enum RingStage_t
+	{
+		RING_NONE,
+		RING_READ_DONE,		// m_nRingBytesRead are in m_RingRead.pDest
+		RING_FAILED,		// m_RingStatus was already passed to the callback
+	};
+	bool					m_bInAsyncRing;
+	RingStage_t				m_RingStage;
+	FSAsyncStatus_t			m_RingStatus;
+	AsyncReadState_t		m_RingRead;
+	int						m_nRingBytesRead;
 private:
 	void *					m_pResultData;
 	int						m_nResultSize;
@@ -617,6 +661,560 @@ private:
 #endif
 };
 
+#ifdef LINUX
+//-----------------------------------------------------------------------------
+//
+// io_uring backend for reads. One thread keeps up to ASYNC_RING_DEPTH reads
+// in flight, handing each batch to the kernel in the same system call that
+// waits for the next completion. Jobs wait in a queue per priority until
+// there's room, and hold their lock from submission to completion, so
+// AsyncFinish() and AsyncAbort() on a read in flight block until it lands,
+// just as they do on a job the thread pool is executing. Once it lands the
+// job goes to the IOJob pool to run its callback, callbacks may be slow or
+// wait on other reads and mustn't hold up the ring thread.
+//
+//-----------------------------------------------------------------------------
+ConVar fs_async_uring( "fs_async_uring", "1", 0, "Service async reads with io_uring, many in flight from one thread, instead of the IOJob thread pool" );
+
+#define ASYNC_RING_DEPTH				64
+#define ASYNC_RING_WAKE_TAG				0			// completion of the eventfd read that wakes the ring thread
+#define ASYNC_RING_FIXED_BUFFER_SIZE	( 256 * 1024 )
+
+class CAsyncReadRing : public CThread
+{
+public:
+	CAsyncReadRing();
+	~CAsyncReadRing();
+
+	bool Init( CBaseFileSystem *pFileSystem, int nFixedBufferMB );
+	void Shutdown();
+
+	// Queue a read, the ring takes its own reference
+	void AddJob( CFileAsyncReadJob *pJob );
+	void ChangePriority( CFileAsyncReadJob *pJob, JobPriority_t priority );
+	// Run or abort what hasn't been submitted yet, on the calling thread
+	int ExecuteToPriority( JobPriority_t toPriority );
+	int AbortAll();
+	void Suspend();
+	void Resume();
+
+	void *AllocFixedBuffer( int nBytes );
+	bool FreeFixedBuffer( void *p );
+
+	void ResetStats();
+	void PrintStats();
+
+private:
+	struct Read_t
+	{
+		CFileAsyncReadJob	*m_pJob;
+		int					m_fd;
+		bool				m_bOwnDescriptor;
+		int64				m_nFileOffset;
+		int					m_nBytes;
+		int					m_nBytesDone;
+	};
+
+	virtual int Run();
+
+	CFileAsyncReadJob *PopJob();
+	void StartRead( CFileAsyncReadJob *pJob );
+	bool SubmitRead( int iRead );
+	void OnCompletion( int iRead, int nResult );
+	void FinishJob( CFileAsyncReadJob *pJob, FSAsyncStatus_t failure );
+	void Wake();
+
+	CBaseFileSystem		*m_pFileSystem;
+	CIOURing			m_Ring;
+	int					m_fdWake;
+	uint64				m_nWakeValue;
+	bool				m_bWakeArmed;
+	volatile bool		m_bExit;
+	CInterlockedInt		m_nSuspended;
+
+	CThreadFastMutex	m_QueueMutex;
+	CUtlLinkedList< CFileAsyncReadJob * > m_Queue[JP_HIGH + 1];
+
+	// Ring thread only
+	CUtlVector< Read_t > m_Reads;
+	CUtlVector< int >	m_FreeReads;
+	int					m_nInFlight;
+
+	// Registered with the ring as one buffer, handed out in ASYNC_RING_FIXED_BUFFER_SIZE pieces
+	byte				*m_pFixedBuffers;
+	size_t				m_nFixedBufferBytes;
+	CThreadFastMutex	m_FixedMutex;
+	CUtlVector< int >	m_FreeFixedBuffers;
+
+	CInterlockedInt		m_nReads;
+	CInterlockedInt		m_nFixedReads;
+	CInterlockedInt		m_nInlineReads;
+	CInterlockedInt		m_nSubmits;
+	CInterlockedInt		m_nMaxInFlight;
+	int64				m_nBytesRead;
+};
+
+static CAsyncReadRing g_AsyncReadRing;
+
+CAsyncReadRing::CAsyncReadRing()
+{
+	m_pFileSystem = NULL;
+	m_fdWake = -1;
+	m_nWakeValue = 0;
+	m_bWakeArmed = false;
+	m_bExit = false;
+	m_nInFlight = 0;
+	m_pFixedBuffers = NULL;
+	m_nFixedBufferBytes = 0;
+	m_nBytesRead = 0;
+	SetName( "IORing" );
+}
+
+CAsyncReadRing::~CAsyncReadRing()
+{
+	// Buffers may still be out with their owners until the very end
+	if ( m_pFixedBuffers )
+	{
+		munmap( m_pFixedBuffers, m_nFixedBufferBytes );
+	}
+}
+
+bool CAsyncReadRing::Init( CBaseFileSystem *pFileSystem, int nFixedBufferMB )
+{
+	Assert( !IsAlive() );
+	if ( !m_Ring.Init( ASYNC_RING_DEPTH * 2 ) )
+		return false;
+
+	m_fdWake = eventfd( 0, EFD_CLOEXEC );
+	if ( m_fdWake < 0 )
+	{
+		m_Ring.Shutdown();
+		return false;
+	}
+
+	m_pFileSystem = pFileSystem;
+	m_bWakeArmed = false;
+	m_bExit = false;
+	m_nInFlight = 0;
+	m_Reads.Purge();
+	m_FreeReads.Purge();
+
+	// Kept across restarts, its pieces may still be out with their owners
+	if ( !m_pFixedBuffers && nFixedBufferMB > 0 )
+	{
+		size_t nBytes = (size_t)nFixedBufferMB * 1024 * 1024;
+		void *pBuffers = mmap( NULL, nBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if ( pBuffers != MAP_FAILED )
+		{
+			m_pFixedBuffers = (byte *)pBuffers;
+			m_nFixedBufferBytes = nBytes;
+			int nBuffers = nBytes / ASYNC_RING_FIXED_BUFFER_SIZE;
+			m_FreeFixedBuffers.EnsureCapacity( nBuffers );
+			for ( int i = nBuffers - 1; i >= 0; --i )
+			{
+				m_FreeFixedBuffers.AddToTail( i );
+			}
+		}
+	}
+
+	if ( m_pFixedBuffers )
+	{
+		struct iovec buffers;
+		buffers.iov_base = m_pFixedBuffers;
+		buffers.iov_len = m_nFixedBufferBytes;
+		if ( !m_Ring.RegisterBuffers( &buffers, 1 ) )
+		{
+			// Over RLIMIT_MEMLOCK. The pieces still work as plain buffers.
+			DevMsg( "IORing: couldn't register %d MB of read buffers\n", (int)( m_nFixedBufferBytes / ( 1024 * 1024 ) ) );
+		}
+	}
+
+	if ( !Start() )
+	{
+		close( m_fdWake );
+		m_fdWake = -1;
+		m_Ring.Shutdown();
+		return false;
+	}
+
+	return true;
+}
+
+void CAsyncReadRing::Shutdown()
+{
+	if ( !IsAlive() )
+		return;
+
+	AbortAll();
+
+	// The thread drains what's in flight before it exits
+	m_bExit = true;
+	Wake();
+	Join();
+
+	close( m_fdWake );
+	m_fdWake = -1;
+	m_Ring.Shutdown();
+}
+
+void CAsyncReadRing::Wake()
+{
+	uint64 nOne = 1;
+	if ( write( m_fdWake, &nOne, sizeof( nOne ) ) != sizeof( nOne ) )
+	{
+		// The counter is already non-zero, so the ring is being woken anyway
+	}
+}
+
+void CAsyncReadRing::AddJob( CFileAsyncReadJob *pJob )
+{
+	pJob->AddRef();
+	pJob->m_bInAsyncRing = true;
+	pJob->SlamStatus( JOB_STATUS_PENDING );
+	{
+		AUTO_LOCK( m_QueueMutex );
+		m_Queue[pJob->GetPriority()].AddToTail( pJob );
+	}
+	Wake();
+}
+
+void CAsyncReadRing::ChangePriority( CFileAsyncReadJob *pJob, JobPriority_t priority )
+{
+	AUTO_LOCK( m_QueueMutex );
+	CUtlLinkedList< CFileAsyncReadJob * > &queue = m_Queue[pJob->GetPriority()];
+	int i = queue.Find( pJob );
+	if ( i != queue.InvalidIndex() )
+	{
+		queue.Remove( i );
+		m_Queue[priority].AddToTail( pJob );
+	}
+	pJob->SetPriority( priority );
+}
+
+CFileAsyncReadJob *CAsyncReadRing::PopJob()
+{
+	AUTO_LOCK( m_QueueMutex );
+	for ( int iPriority = JP_HIGH; iPriority >= JP_LOW; --iPriority )
+	{
+		CUtlLinkedList< CFileAsyncReadJob * > &queue = m_Queue[iPriority];
+		if ( queue.Count() )
+		{
+			CFileAsyncReadJob *pJob = queue[queue.Head()];
+			queue.Remove( queue.Head() );
+			return pJob;
+		}
+	}
+	return NULL;
+}
+
+int CAsyncReadRing::ExecuteToPriority( JobPriority_t toPriority )
+{
+	int nExecuted = 0;
+	for ( int iPriority = JP_HIGH; iPriority >= toPriority; --iPriority )
+	{
+		for ( ;; )
+		{
+			CFileAsyncReadJob *pJob = NULL;
+			{
+				AUTO_LOCK( m_QueueMutex );
+				CUtlLinkedList< CFileAsyncReadJob * > &queue = m_Queue[iPriority];
+				if ( queue.Count() )
+				{
+					pJob = queue[queue.Head()];
+					queue.Remove( queue.Head() );
+				}
+			}
+
+			if ( !pJob )
+				break;
+
+			pJob->Execute();
+			pJob->Release();
+			++nExecuted;
+		}
+	}
+	return nExecuted;
+}
+
+int CAsyncReadRing::AbortAll()
+{
+	int nAborted = 0;
+	CFileAsyncReadJob *pJob;
+	while ( ( pJob = PopJob() ) != NULL )
+	{
+		pJob->Abort();
+		pJob->Release();
+		++nAborted;
+	}
+	return nAborted;
+}
+
+void CAsyncReadRing::Suspend()
+{
+	++m_nSuspended;
+}
+
+void CAsyncReadRing::Resume()
+{
+	if ( --m_nSuspended == 0 )
+	{
+		Wake();
+	}
+}
+
+void *CAsyncReadRing::AllocFixedBuffer( int nBytes )
+{
+	if ( !m_pFixedBuffers || nBytes <= 0 || nBytes > ASYNC_RING_FIXED_BUFFER_SIZE )
+		return NULL;
+
+	AUTO_LOCK( m_FixedMutex );
+	if ( !m_FreeFixedBuffers.Count() )
+		return NULL;
+
+	int iBuffer = m_FreeFixedBuffers.Tail();
+	m_FreeFixedBuffers.RemoveMultipleFromTail( 1 );
+	return m_pFixedBuffers + (size_t)iBuffer * ASYNC_RING_FIXED_BUFFER_SIZE;
+}
+
+bool CAsyncReadRing::FreeFixedBuffer( void *p )
+{
+	if ( !m_pFixedBuffers || p < m_pFixedBuffers || p >= m_pFixedBuffers + m_nFixedBufferBytes )
+		return false;
+
+	int iBuffer = ( (byte *)p - m_pFixedBuffers ) / ASYNC_RING_FIXED_BUFFER_SIZE;
+	AUTO_LOCK( m_FixedMutex );
+	Assert( m_FreeFixedBuffers.Find( iBuffer ) == m_FreeFixedBuffers.InvalidIndex() );
+	m_FreeFixedBuffers.AddToTail( iBuffer );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Opens the file and issues its read, or finishes the job here when the
+// bytes can't be read straight from a descriptor
+//-----------------------------------------------------------------------------
+void CAsyncReadRing::StartRead( CFileAsyncReadJob *pJob )
+{
+	// Held until the read completes. Jobs run or aborted elsewhere since they were queued are dropped.
+	pJob->Lock();
+	if ( !pJob->CanExecute() )
+	{
+		pJob->Unlock();
+		pJob->Release();
+		return;
+	}
+
+	const FileAsyncRequest_t &request = *pJob->GetRequest();
+	AsyncReadState_t &state = pJob->m_RingRead;
+	FSAsyncStatus_t status = m_pFileSystem->BeginAsyncRead( request, state, true );
+	if ( status != FSASYNC_OK )
+	{
+		// The callback has already been told
+		FinishJob( pJob, status );
+		return;
+	}
+
+	// Never read past the end, the descriptor may be a VPK or pack holding other files after this one
+	int nBytes = MIN( state.nBytesToRead, (int)m_pFileSystem->Size( state.hFile ) - request.nOffset );
+
+	Read_t read;
+	read.m_pJob = pJob;
+	read.m_fd = -1;
+	read.m_bOwnDescriptor = false;
+	read.m_nFileOffset = 0;
+	read.m_nBytes = MAX( nBytes, 0 );
+	read.m_nBytesDone = 0;
+	if ( read.m_nBytes && m_pFileSystem->GetFileBacking( state.hFile, request.nOffset, &read.m_fd, &read.m_nFileOffset, &read.m_bOwnDescriptor ) )
+	{
+		int iRead;
+		if ( m_FreeReads.Count() )
+		{
+			iRead = m_FreeReads.Tail();
+			m_FreeReads.RemoveMultipleFromTail( 1 );
+			m_Reads[iRead] = read;
+		}
+		else
+		{
+			iRead = m_Reads.AddToTail( read );
+		}
+
+		if ( SubmitRead( iRead ) )
+		{
+			pJob->SlamStatus( JOB_STATUS_INPROGRESS );
+			m_nInFlight++;
+			if ( m_nInFlight > m_nMaxInFlight )
+			{
+				m_nMaxInFlight = m_nInFlight;
+			}
+			return;
+		}
+
+		if ( read.m_bOwnDescriptor )
+		{
+			CBaseFileSystem::CloseFileBacking( read.m_fd );
+		}
+		m_FreeReads.AddToTail( iRead );
+	}
+
+	// Memory files, compressed pack entries and VPK preload bytes go through the filesystem
+	if ( read.m_nBytes )
+	{
+		++m_nInlineReads;
+		m_pFileSystem->Seek( state.hFile, request.nOffset, FILESYSTEM_SEEK_HEAD );
+		pJob->m_nRingBytesRead = m_pFileSystem->ReadEx( state.pDest, state.nBytesBuffer, state.nBytesToRead, state.hFile );
+	}
+	else
+	{
+		pJob->m_nRingBytesRead = 0;
+	}
+	FinishJob( pJob, FSASYNC_OK );
+}
+
+bool CAsyncReadRing::SubmitRead( int iRead )
+{
+	Read_t &read = m_Reads[iRead];
+	byte *pDest = (byte *)read.m_pJob->m_RingRead.pDest + read.m_nBytesDone;
+	bool bFixed = ( m_pFixedBuffers && pDest >= m_pFixedBuffers && pDest < m_pFixedBuffers + m_nFixedBufferBytes );
+	if ( !m_Ring.PrepRead( read.m_fd, pDest, read.m_nBytes - read.m_nBytesDone, read.m_nFileOffset + read.m_nBytesDone, iRead + 1, bFixed ? 0 : -1 ) )
+		return false;
+
+	if ( bFixed && !read.m_nBytesDone )
+	{
+		++m_nFixedReads;
+	}
+	return true;
+}
+
+void CAsyncReadRing::OnCompletion( int iRead, int nResult )
+{
+	Read_t &read = m_Reads[iRead];
+	if ( nResult > 0 )
+	{
+		read.m_nBytesDone += nResult;
+
+		// Short reads happen when only part of the range was cached, carry on from there
+		if ( read.m_nBytesDone < read.m_nBytes && SubmitRead( iRead ) )
+			return;
+	}
+	else if ( ( nResult == -EINTR || nResult == -EAGAIN ) && SubmitRead( iRead ) )
+	{
+		return;
+	}
+
+	CFileAsyncReadJob *pJob = read.m_pJob;
+	if ( read.m_bOwnDescriptor )
+	{
+		CBaseFileSystem::CloseFileBacking( read.m_fd );
+	}
+	read.m_pJob = NULL;
+	m_FreeReads.AddToTail( iRead );
+	m_nInFlight--;
+
+	++m_nReads;
+	m_nBytesRead += read.m_nBytesDone;
+	pJob->m_nRingBytesRead = read.m_nBytesDone;
+	FinishJob( pJob, FSASYNC_OK );
+}
+
+//-----------------------------------------------------------------------------
+// Hands the job to the IOJob pool, which completes it through CJob::Execute()
+// so its status, event and cleanup are handled as for any other pool job.
+// AsyncFinish() on it before the pool gets there runs the callback itself.
+//-----------------------------------------------------------------------------
+void CAsyncReadRing::FinishJob( CFileAsyncReadJob *pJob, FSAsyncStatus_t failure )
+{
+	if ( failure != FSASYNC_OK )
+	{
+		pJob->m_RingStage = CFileAsyncReadJob::RING_FAILED;
+		pJob->m_RingStatus = failure;
+	}
+	else
+	{
+		pJob->m_RingStage = CFileAsyncReadJob::RING_READ_DONE;
+	}
+
+	pJob->SlamStatus( JOB_STATUS_PENDING );
+	pJob->Unlock();
+	if ( pJob->CanExecute() )
+	{
+		m_pFileSystem->m_pThreadPool->AddJob( pJob );
+	}
+	pJob->Release();
+}
+
+int CAsyncReadRing::Run()
+{
+	for ( ;; )
+	{
+		if ( !m_bWakeArmed )
+		{
+			m_bWakeArmed = m_Ring.PrepRead( m_fdWake, &m_nWakeValue, sizeof( m_nWakeValue ), 0, ASYNC_RING_WAKE_TAG );
+		}
+
+		// Top up the reads in flight, most important first
+		while ( !m_bExit && m_nSuspended == 0 && m_nInFlight < ASYNC_RING_DEPTH )
+		{
+			CFileAsyncReadJob *pJob = PopJob();
+			if ( !pJob )
+				break;
+
+			StartRead( pJob );
+		}
+
+		if ( m_bExit && !m_nInFlight )
+			break;
+
+		// Hands over the batch and sleeps until a read lands or someone wakes us
+		++m_nSubmits;
+		int nResult = m_Ring.Submit( 1 );
+		if ( nResult < 0 )
+		{
+			ExecuteOnce( Warning( "IORing: io_uring_enter failed (%d)\n", nResult ) );
+			ThreadSleep( 1 );
+		}
+
+		uint64 nUserData;
+		int nReadResult;
+		while ( m_Ring.PopCompletion( &nUserData, &nReadResult ) )
+		{
+			if ( nUserData == ASYNC_RING_WAKE_TAG )
+			{
+				m_bWakeArmed = false;
+			}
+			else
+			{
+				OnCompletion( (int)nUserData - 1, nReadResult );
+			}
+		}
+	}
+
+	return 0;
+}
+
+void CAsyncReadRing::ResetStats()
+{
+	m_nReads = 0;
+	m_nFixedReads = 0;
+	m_nInlineReads = 0;
+	m_nSubmits = 0;
+	m_nMaxInFlight = 0;
+	m_nBytesRead = 0;
+}
+
+void CAsyncReadRing::PrintStats()
+{
+	int nFreeFixed;
+	{
+		AUTO_LOCK( m_FixedMutex );
+		nFreeFixed = m_FreeFixedBuffers.Count();
+	}
+
+	Msg( "IORing: %d reads (%d into registered buffers, %d read inline), %.1f MB, %d system calls, %d most in flight, %d of %d fixed buffers free\n",
+		(int)m_nReads, (int)m_nFixedReads, (int)m_nInlineReads, m_nBytesRead / ( 1024.0f * 1024.0f ), (int)m_nSubmits, (int)m_nMaxInFlight,
+		nFreeFixed, (int)( m_nFixedBufferBytes / ASYNC_RING_FIXED_BUFFER_SIZE ) );
+}
+
+#endif // LINUX
+
 //-----------------------------------------------------------------------------
 // 
 //-----------------------------------------------------------------------------
@@ -690,6 +1288,21 @@ void CBaseFileSystem::InitAsync()
 			SafeRelease( m_pThreadPool );
 		}
 	}
+
+#ifdef LINUX
+	if ( m_pThreadPool && !CommandLine()->FindParm( "-nouring" ) )
+	{
+		// Registered buffers count against RLIMIT_MEMLOCK, which is often 8 MB
+		if ( g_AsyncReadRing.Init( this, CommandLine()->ParmValue( "-uring_fixed_mb", 8 ) ) )
+		{
+			m_pAsyncRing = &g_AsyncReadRing;
+		}
+		else
+		{
+			DevMsg( "io_uring unavailable, async reads use the IOJob thread pool\n" );
+		}
+	}
+#endif
 }
 
 //-----------------------------------------------------------------------------
@@ -700,6 +1313,13 @@ void CBaseFileSystem::ShutdownAsync()
 	if ( m_pThreadPool )
 	{
 		AsyncFlush();
+#ifdef LINUX
+		if ( m_pAsyncRing )
+		{
+			m_pAsyncRing->Shutdown();
+			m_pAsyncRing = NULL;
+		}
+#endif
 		m_pThreadPool->Stop();
 		SafeRelease( m_pThreadPool );
 	}
@@ -875,7 +1495,16 @@ FSAsyncStatus_t CBaseFileSystem::AsyncReadMultipleCreditAlloc( const FileAsyncRe
 		if ( !bSynchronous )
 		{
 			// async mode, queue request
-			m_pThreadPool->AddJob( pJob );
+#ifdef LINUX
+			if ( m_pAsyncRing && fs_async_uring.GetBool() && pRequests[i].nBytes >= 0 )
+			{
+				m_pAsyncRing->AddJob( pJob );
+			}
+			else
+#endif
+			{
+				m_pThreadPool->AddJob( pJob );
+			}
 		}
 		else
 		{
@@ -1015,6 +1644,12 @@ void CBaseFileSystem::AsyncFinishAll( int iToPriority )
 	if ( m_pThreadPool)
 	{
 		AUTO_LOCK( g_AsyncFinishMutex );
+#ifdef LINUX
+		if ( m_pAsyncRing )
+		{
+			m_pAsyncRing->ExecuteToPriority( ConvertPriority( iToPriority ) );
+		}
+#endif
 		m_pThreadPool->ExecuteToPriority( ConvertPriority( iToPriority ) );
 	}
 }
@@ -1048,6 +1683,12 @@ bool CBaseFileSystem::AsyncSuspend()
 	{
 		m_pThreadPool->SuspendExecution();
 	}
+#ifdef LINUX
+	if ( m_pAsyncRing )
+	{
+		m_pAsyncRing->Suspend();
+	}
+#endif
 
 	return true;
 }
@@ -1062,6 +1703,12 @@ bool CBaseFileSystem::AsyncResume()
 	{
 		m_pThreadPool->ResumeExecution();
 	}
+#ifdef LINUX
+	if ( m_pAsyncRing )
+	{
+		m_pAsyncRing->Resume();
+	}
+#endif
 
 	return true;
 }
@@ -1222,6 +1869,12 @@ FSAsyncStatus_t CBaseFileSystem::AsyncFlush()
 	{
 		m_pThreadPool->AbortAll();
 	}
+#ifdef LINUX
+	if ( m_pAsyncRing )
+	{
+		m_pAsyncRing->AbortAll();
+	}
+#endif
 
 	// Abort all custom jobs
 	while ( m_vecAsyncCustomFetchJobs.Count() > 0 )
@@ -1252,7 +1905,18 @@ FSAsyncStatus_t CBaseFileSystem::AsyncSetPriority(FSAsyncControl_t hControl, int
 		JobPriority_t internalPriority = ConvertPriority( newPriority );
 		if ( internalPriority != pJob->GetPriority() )
 		{
-			m_pThreadPool->ChangePriority( pJob, internalPriority );
+#ifdef LINUX
+			// The pool would queue a ring job to run it a second time
+			CFileAsyncReadJob *pReadJob = dynamic_cast<CFileAsyncReadJob *>( pJob );
+			if ( pReadJob && pReadJob->m_bInAsyncRing )
+			{
+				g_AsyncReadRing.ChangePriority( pReadJob, internalPriority );
+			}
+			else
+#endif
+			{
+				m_pThreadPool->ChangePriority( pJob, internalPriority );
+			}
 		}
 
 	}
@@ -1286,14 +1950,57 @@ void CBaseFileSystem::AsyncRelease( FSAsyncControl_t hControl )
 }
 
 
+//-----------------------------------------------------------------------------
+// 
+//-----------------------------------------------------------------------------
+
+bool CBaseFileSystem::AsyncFreeFixedBuffer( void *p )
+{
+#ifdef LINUX
+	return g_AsyncReadRing.FreeFixedBuffer( p );
+#else
+	return false;
+#endif
+}
+
 //-----------------------------------------------------------------------------
 // 
 //-----------------------------------------------------------------------------
 
 FSAsyncStatus_t CBaseFileSystem::SyncRead( const FileAsyncRequest_t &request )
+{
+	AsyncReadState_t state;
+	FSAsyncStatus_t result = BeginAsyncRead( request, state );
+	if ( result != FSASYNC_OK )
+	{
+		return result;
+	}
+
+	if ( request.nOffset > 0 )
+	{
+		Seek( state.hFile, request.nOffset, FILESYSTEM_SEEK_HEAD );
+	}
+
+	// perform the read operation
+	int nBytesRead = ReadEx( state.pDest, state.nBytesBuffer, state.nBytesToRead, state.hFile );
+
+	return EndAsyncRead( request, state, nBytesRead );
+}
+
+//-----------------------------------------------------------------------------
+// Opens the file and finds the destination buffer. bFixedBuffer lets a
+// FSASYNC_FLAGS_FIXEDBUFFER request take one of the async ring's buffers.
+//-----------------------------------------------------------------------------
+FSAsyncStatus_t CBaseFileSystem::BeginAsyncRead( const FileAsyncRequest_t &request, AsyncReadState_t &state, bool bFixedBuffer )
 {
 	Assert( request.nBytes >=0 );
 
+	state.pHeldFile = NULL;
+	state.hFile = FILESYSTEM_INVALID_HANDLE;
+	state.pDest = NULL;
+	state.nBytesToRead = 0;
+	state.nBytesBuffer = 0;
+
 	if ( request.nBytes < 0 || request.nOffset < 0 )
 	{
 		Msg( "Invalid async read of %s\n", request.pszFilename );
@@ -1301,8 +2008,6 @@ FSAsyncStatus_t CBaseFileSystem::SyncRead( const FileAsyncRequest_t &request )
 		return FSASYNC_ERR_FILEOPEN;
 	}
 
-	FSAsyncStatus_t result;
-
 	AsyncOpenedFile_t *pHeldFile = ( request.hSpecificAsyncFile != FS_INVALID_ASYNC_FILE ) ? g_AsyncOpenedFiles.Get( request.hSpecificAsyncFile ) : NULL;
 
 	FileHandle_t hFile;
@@ -1320,35 +2025,61 @@ FSAsyncStatus_t CBaseFileSystem::SyncRead( const FileAsyncRequest_t &request )
 		hFile = pHeldFile->hFile;
 	}
 
-	if ( hFile )
+	if ( !hFile )
 	{
-		// ------------------------------------------------------
-		int nBytesToRead = ( request.nBytes ) ? request.nBytes : Size( hFile ) - request.nOffset;
-		int nBytesBuffer;
-		void *pDest;
+		DoAsyncCallback( request, NULL, 0, FSASYNC_ERR_FILEOPEN );
+
+		if ( pHeldFile )
+		{
+			g_AsyncOpenedFiles.Release( request.hSpecificAsyncFile );
+		}
 
-		if ( nBytesToRead < 0 )
+		if ( m_fwLevel >= FILESYSTEM_WARNING_REPORTALLACCESSES_ASYNC )
 		{
-			nBytesToRead = 0; // bad offset?
+			LogAccessToFile( "async", request.pszFilename, "" );
 		}
 
-		if ( request.pData )
+		return FSASYNC_ERR_FILEOPEN;
+	}
+
+	// ------------------------------------------------------
+	int nBytesToRead = ( request.nBytes ) ? request.nBytes : Size( hFile ) - request.nOffset;
+	int nBytesBuffer;
+	void *pDest = NULL;
+
+	if ( nBytesToRead < 0 )
+	{
+		nBytesToRead = 0; // bad offset?
+	}
+
+	if ( request.pData )
+	{
+		// caller provided buffer
+		Assert( !( request.flags & FSASYNC_FLAGS_NULLTERMINATE ) );
+		pDest = request.pData;
+		nBytesBuffer = nBytesToRead;
+	}
+	else
+	{
+		// allocate an optimal buffer
+		unsigned nOffsetAlign;
+		nBytesBuffer = nBytesToRead + ( ( request.flags & FSASYNC_FLAGS_NULLTERMINATE ) ? 1 : 0 );
+		if ( GetOptimalIOConstraints( hFile, &nOffsetAlign, NULL, NULL) && ( request.nOffset % nOffsetAlign == 0 ) )
 		{
-			// caller provided buffer
-			Assert( !( request.flags & FSASYNC_FLAGS_NULLTERMINATE ) );
-			pDest = request.pData;
-			nBytesBuffer = nBytesToRead;
+			nBytesBuffer = GetOptimalReadSize( hFile, nBytesBuffer );
 		}
-		else
+
+#ifdef LINUX
+		// only buffers the caller gives back through FreeOptimalReadBuffer() can come from the ring
+		const unsigned fixedFlags = FSASYNC_FLAGS_FIXEDBUFFER | FSASYNC_FLAGS_ALLOCNOFREE;
+		if ( bFixedBuffer && m_pAsyncRing && ( request.flags & fixedFlags ) == fixedFlags && !request.pfnAlloc )
 		{
-			// allocate an optimal buffer
-			unsigned nOffsetAlign;
-			nBytesBuffer = nBytesToRead + ( ( request.flags & FSASYNC_FLAGS_NULLTERMINATE ) ? 1 : 0 );
-			if ( GetOptimalIOConstraints( hFile, &nOffsetAlign, NULL, NULL) && ( request.nOffset % nOffsetAlign == 0 ) )
-			{
-				nBytesBuffer = GetOptimalReadSize( hFile, nBytesBuffer );
-			}
+			pDest = m_pAsyncRing->AllocFixedBuffer( nBytesBuffer );
+		}
+#endif
 
+		if ( !pDest )
+		{
 			if ( !request.pfnAlloc )
 			{
 				pDest = AllocOptimalReadBuffer( hFile, nBytesBuffer, request.nOffset );
@@ -1358,39 +2089,46 @@ FSAsyncStatus_t CBaseFileSystem::SyncRead( const FileAsyncRequest_t &request )
 				pDest = (*request.pfnAlloc)( request.pszFilename, nBytesBuffer );
 			}
 		}
+	}
 
-		SetBufferSize( hFile, 0 ); // TODO: what if it's a pack file? restore buffer size?
-
-		if ( request.nOffset > 0 )
-		{
-			Seek( hFile, request.nOffset, FILESYSTEM_SEEK_HEAD );
-		}
-
-		// perform the read operation
-		int nBytesRead = ReadEx( pDest, nBytesBuffer, nBytesToRead, hFile );
+	SetBufferSize( hFile, 0 ); // TODO: what if it's a pack file? restore buffer size?
 
-		if ( !pHeldFile )
-		{
-			Close( hFile );
-		}
+	state.pHeldFile = pHeldFile;
+	state.hFile = hFile;
+	state.pDest = pDest;
+	state.nBytesToRead = nBytesToRead;
+	state.nBytesBuffer = nBytesBuffer;
+	return FSASYNC_OK;
+}
 
-		if ( request.flags & FSASYNC_FLAGS_NULLTERMINATE )
-		{
-			((char *)pDest)[nBytesRead] = 0;
-		}
+//-----------------------------------------------------------------------------
+// Closes the file and runs the callback once the bytes are in
+//-----------------------------------------------------------------------------
+FSAsyncStatus_t CBaseFileSystem::EndAsyncRead( const FileAsyncRequest_t &request, AsyncReadState_t &state, int nBytesRead )
+{
+	if ( nBytesRead < 0 )
+	{
+		nBytesRead = 0;
+	}
 
-		result = ( ( nBytesRead == 0 ) && ( nBytesToRead != 0 ) ) ? FSASYNC_ERR_READING : FSASYNC_OK;
-		DoAsyncCallback( request, pDest, min( nBytesRead, nBytesToRead ), result );
+	if ( !state.pHeldFile )
+	{
+		Close( state.hFile );
 	}
-	else
+	state.hFile = FILESYSTEM_INVALID_HANDLE;
+
+	if ( request.flags & FSASYNC_FLAGS_NULLTERMINATE )
 	{
-		DoAsyncCallback( request, NULL, 0, FSASYNC_ERR_FILEOPEN );
-		result = FSASYNC_ERR_FILEOPEN;
+		((char *)state.pDest)[nBytesRead] = 0;
 	}
 
-	if ( pHeldFile )
+	FSAsyncStatus_t result = ( ( nBytesRead == 0 ) && ( state.nBytesToRead != 0 ) ) ? FSASYNC_ERR_READING : FSASYNC_OK;
+	DoAsyncCallback( request, state.pDest, min( nBytesRead, state.nBytesToRead ), result );
+
+	if ( state.pHeldFile )
 	{
 		g_AsyncOpenedFiles.Release( request.hSpecificAsyncFile );
+		state.pHeldFile = NULL;
 	}
 
 	if ( m_fwLevel >= FILESYSTEM_WARNING_REPORTALLACCESSES_ASYNC )
@@ -1536,3 +2274,203 @@ void CBaseFileSystem::DoAsyncCallback( const FileAsyncRequest_t &request, void *
 	}
 }
 
+
+//-----------------------------------------------------------------------------
+// Loader benchmark. Reads a map and a set of model files the way the queued
+// loader does, through the thread pool and then the io_uring ring, each time
+// first with the files dropped from the page cache and then again warm.
+//-----------------------------------------------------------------------------
+struct AsyncBenchmarkRun_t
+{
+	CInterlockedIntT< int64 >	m_nBytes;
+	CInterlockedInt				m_nFailed;
+};
+
+static void AsyncBenchmarkCallback( const FileAsyncRequest_t &request, int nBytesRead, FSAsyncStatus_t result )
+{
+	AsyncBenchmarkRun_t *pRun = (AsyncBenchmarkRun_t *)request.pContext;
+	if ( result == FSASYNC_OK )
+	{
+		pRun->m_nBytes += nBytesRead;
+	}
+	else
+	{
+		++pRun->m_nFailed;
+	}
+
+	if ( request.pData )
+	{
+		BaseFileSystem()->FreeOptimalReadBuffer( request.pData );
+	}
+}
+
+static void AddAsyncBenchmarkModels( const char *pszDirectory, CUtlVector< CUtlString > &files, int nMaxFiles )
+{
+	char szWildcard[MAX_PATH];
+	V_snprintf( szWildcard, sizeof( szWildcard ), "%s/*", pszDirectory );
+
+	CUtlVector< CUtlString > subDirectories;
+	FileFindHandle_t hFind;
+	for ( const char *pszName = BaseFileSystem()->FindFirstEx( szWildcard, "GAME", &hFind ); pszName && files.Count() < nMaxFiles; pszName = BaseFileSystem()->FindNext( hFind ) )
+	{
+		if ( pszName[0] == '.' )
+			continue;
+
+		char szPath[MAX_PATH];
+		V_snprintf( szPath, sizeof( szPath ), "%s/%s", pszDirectory, pszName );
+		if ( BaseFileSystem()->FindIsDirectory( hFind ) )
+		{
+			subDirectories.AddToTail( szPath );
+			continue;
+		}
+
+		const char *pszExtension = V_GetFileExtension( pszName );
+		if ( pszExtension && ( !V_stricmp( pszExtension, "mdl" ) || !V_stricmp( pszExtension, "vvd" ) || !V_stricmp( pszExtension, "vtx" ) || !V_stricmp( pszExtension, "phy" ) ) )
+		{
+			files.AddToTail( szPath );
+		}
+	}
+	BaseFileSystem()->FindClose( hFind );
+
+	FOR_EACH_VEC( subDirectories, i )
+	{
+		if ( files.Count() >= nMaxFiles )
+			break;
+		AddAsyncBenchmarkModels( subDirectories[i].Get(), files, nMaxFiles );
+	}
+}
+
+// Best effort, pages something still has mapped stay resident
+static int EvictFromPageCache( const CUtlVector< CUtlString > &files )
+{
+	int nEvicted = 0;
+#ifdef LINUX
+	CBaseFileSystem *pFileSystem = BaseFileSystem();
+	FOR_EACH_VEC( files, i )
+	{
+		FileHandle_t hFile = pFileSystem->OpenEx( files[i].Get(), "rb", 0, "GAME" );
+		if ( !hFile )
+			continue;
+
+		int fd;
+		int64 nFileOffset;
+		bool bOwnDescriptor;
+		if ( pFileSystem->GetFileBacking( hFile, 0, &fd, &nFileOffset, &bOwnDescriptor ) )
+		{
+			if ( posix_fadvise( fd, nFileOffset, pFileSystem->Size( hFile ), POSIX_FADV_DONTNEED ) == 0 )
+			{
+				++nEvicted;
+			}
+			if ( bOwnDescriptor )
+			{
+				CBaseFileSystem::CloseFileBacking( fd );
+			}
+		}
+		pFileSystem->Close( hFile );
+	}
+#endif
+	return nEvicted;
+}
+
+static void RunAsyncBenchmark( const CUtlVector< CUtlString > &files, const char *pszBackend, bool bCold )
+{
+	CBaseFileSystem *pFileSystem = BaseFileSystem();
+	int nEvicted = bCold ? EvictFromPageCache( files ) : 0;
+
+	AsyncBenchmarkRun_t run;
+	CUtlVector< FSAsyncControl_t > controls;
+	controls.SetCount( files.Count() );
+
+	FileAsyncRequest_t request;
+	request.pfnCallback = AsyncBenchmarkCallback;
+	request.pContext = &run;
+	request.pszPathID = "GAME";
+	request.flags = FSASYNC_FLAGS_ALLOCNOFREE | FSASYNC_FLAGS_FIXEDBUFFER;
+
+	CFastTimer timer;
+	timer.Start();
+	FOR_EACH_VEC( files, i )
+	{
+		request.pszFilename = files[i].Get();
+		pFileSystem->AsyncReadMultiple( &request, 1, &controls[i] );
+	}
+
+	// Wait on the jobs rather than AsyncFinish() them, which would run queued ones on this thread
+	FOR_EACH_VEC( controls, i )
+	{
+		( (CJob *)controls[i] )->AccessEvent()->Wait();
+		pFileSystem->AsyncRelease( controls[i] );
+	}
+	timer.End();
+
+	float flMS = timer.GetDuration().GetMillisecondsF();
+	float flMB = run.m_nBytes / ( 1024.0f * 1024.0f );
+	Msg( "%-6s %-4s: %d files (%d failed), %.1f MB in %.1f ms, %.1f MB/s, %.0f files/s",
+		pszBackend, bCold ? "cold" : "warm", files.Count(), (int)run.m_nFailed, flMB, flMS,
+		flMS > 0.0f ? flMB * 1000.0f / flMS : 0.0f, flMS > 0.0f ? files.Count() * 1000.0f / flMS : 0.0f );
+	if ( bCold )
+	{
+		Msg( ", %d of %d dropped from the page cache", nEvicted, files.Count() );
+	}
+	Msg( "\n" );
+}
+
+CON_COMMAND( fs_async_benchmark, "Times async reads of a map and model files through each backend, with a cold and then a warm page cache. Usage: fs_async_benchmark <map> [max model files]" )
+{
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: fs_async_benchmark <map> [max model files]\n" );
+		return;
+	}
+
+	if ( GetAsyncMode() != FSAM_ASYNC || !BaseFileSystem()->m_pThreadPool )
+	{
+		Msg( "Async I/O is off (async_mode or -noasync), nothing to measure\n" );
+		return;
+	}
+
+	CUtlVector< CUtlString > files;
+	char szMap[MAX_PATH];
+	V_snprintf( szMap, sizeof( szMap ), "maps/%s.bsp", args[1] );
+	if ( BaseFileSystem()->FileExists( szMap, "GAME" ) )
+	{
+		files.AddToTail( szMap );
+	}
+	else
+	{
+		Msg( "%s not found, timing models only\n", szMap );
+	}
+
+	int nMaxModels = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 512;
+	AddAsyncBenchmarkModels( "models", files, files.Count() + MAX( nMaxModels, 0 ) );
+	if ( !files.Count() )
+	{
+		Msg( "Nothing to read\n" );
+		return;
+	}
+
+	BaseFileSystem()->AsyncFinishAll();
+
+#ifdef LINUX
+	bool bRing = fs_async_uring.GetBool();
+	fs_async_uring.SetValue( 0 );
+#endif
+	RunAsyncBenchmark( files, "IOJob", true );
+	RunAsyncBenchmark( files, "IOJob", false );
+
+#ifdef LINUX
+	if ( BaseFileSystem()->m_pAsyncRing )
+	{
+		fs_async_uring.SetValue( 1 );
+		g_AsyncReadRing.ResetStats();
+		RunAsyncBenchmark( files, "IORing", true );
+		RunAsyncBenchmark( files, "IORing", false );
+		g_AsyncReadRing.PrintStats();
+	}
+	else
+	{
+		Msg( "io_uring isn't available, only the thread pool was timed\n" );
+	}
+	fs_async_uring.SetValue( bRing );
+#endif
+}
@@ -85,6 +85,7 @@ protected:
 	virtual bool FS_FindNextFile(HANDLE handle, WIN32_FIND_DATA *dat);
 	virtual bool FS_FindClose(HANDLE handle);
 	virtual int FS_GetSectorSize( FILE * );
+	virtual int FS_fileno( FILE * );
 
 private:
 	bool CanAsync() const
@@ -117,6 +118,7 @@ public:
 	virtual int FS_fflush() = 0;
 	virtual char *FS_fgets( char *dest, int destSize ) = 0;
 	virtual int FS_GetSectorSize() { return 1; }
+	virtual int FS_fileno() { return -1; }
 };
 
 //---------------------------------------------------------
@@ -138,6 +140,7 @@ public:
 	virtual int FS_ferror();
 	virtual int FS_fflush();
 	virtual char *FS_fgets( char *dest, int destSize );
+	virtual int FS_fileno() { return fileno( m_pFile ); }
 
 #ifdef POSIX
 	static CUtlMap< ino_t, CThreadMutex * > m_LockedFDMap;
@@ -387,6 +390,11 @@ void *CFileSystem_Stdio::AllocOptimalReadBuffer( FileHandle_t hFile, unsigned nS
 //-----------------------------------------------------------------------------
 void CFileSystem_Stdio::FreeOptimalReadBuffer( void *p )
 {
+	if ( AsyncFreeFixedBuffer( p ) )
+	{
+		return;
+	}
+
 	if ( !UseOptimalBufferAllocation() )
 	{
 		CBaseFileSystem::FreeOptimalReadBuffer( p );
@@ -762,6 +770,15 @@ int CFileSystem_Stdio::FS_GetSectorSize( FILE *fp )
 	return pFile->FS_GetSectorSize();
 }
 
+//-----------------------------------------------------------------------------
+// 
+//-----------------------------------------------------------------------------
+int CFileSystem_Stdio::FS_fileno( FILE *fp )
+{
+	CStdFilesystemFile *pFile = ((CStdFilesystemFile *)fp);
+	return pFile->FS_fileno();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: files are always immediately available on disk
 //-----------------------------------------------------------------------------
@@ -856,6 +873,13 @@ CStdioFile *CStdioFile::FS_fopen( const char *filenameT, const char *options, in
 
 
 	pFile = fopen(filename, options);
+#if defined(LINUX)
+	// Creating a file changes what its directory would resolve to
+	if ( pFile && ( strchr( options, 'w' ) || strchr( options, 'a' ) || strchr( options, '+' ) ) )
+	{
+		InvalidateCaseInsensitiveDirCache( filename );
+	}
+#endif
 	if (pFile && size)
 	{
 		// todo: replace with filelength()? 
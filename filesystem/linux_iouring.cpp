@@ -0,0 +1,256 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Minimal io_uring submission/completion ring
+//
+//=============================================================================
+
+#include "linux_iouring.h"
+
+#if defined( LINUX ) && defined( __has_include )
+#if __has_include( <linux/io_uring.h> )
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// IORING_OP_READ arrived in 5.6 and fast poll in 5.7, so a header with the latter has both
+#if defined( IORING_FEAT_FAST_POLL ) && defined( __NR_io_uring_setup )
+#define HAVE_IO_URING
+#endif
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+CIOURing::CIOURing()
+{
+	m_fd = -1;
+	m_nSQEntries = 0;
+	m_nToSubmit = 0;
+	m_bBuffersRegistered = false;
+	m_pSQHead = m_pSQTail = m_pSQMask = m_pSQArray = NULL;
+	m_pSQEs = NULL;
+	m_pCQHead = m_pCQTail = m_pCQMask = NULL;
+	m_pCQEs = NULL;
+	m_pSQRing = m_pCQRing = NULL;
+	m_nSQRingSize = m_nCQRingSize = m_nSQEsSize = 0;
+}
+
+CIOURing::~CIOURing()
+{
+	Shutdown();
+}
+
+#ifdef HAVE_IO_URING
+
+bool CIOURing::Init( unsigned nEntries )
+{
+	Shutdown();
+
+	struct io_uring_params params;
+	memset( &params, 0, sizeof( params ) );
+	int fd = (int)syscall( __NR_io_uring_setup, nEntries, &params );
+	if ( fd < 0 )
+		return false;
+
+	if ( !( params.features & IORING_FEAT_FAST_POLL ) )
+	{
+		close( fd );
+		return false;
+	}
+
+	m_fd = fd;
+	m_nSQRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+	m_nCQRingSize = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+	if ( params.features & IORING_FEAT_SINGLE_MMAP )
+	{
+		m_nSQRingSize = m_nCQRingSize = MAX( m_nSQRingSize, m_nCQRingSize );
+	}
+
+	m_pSQRing = mmap( NULL, m_nSQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+	if ( m_pSQRing == MAP_FAILED )
+	{
+		m_pSQRing = NULL;
+		Shutdown();
+		return false;
+	}
+
+	if ( params.features & IORING_FEAT_SINGLE_MMAP )
+	{
+		m_pCQRing = m_pSQRing;
+	}
+	else
+	{
+		m_pCQRing = mmap( NULL, m_nCQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+		if ( m_pCQRing == MAP_FAILED )
+		{
+			m_pCQRing = NULL;
+			Shutdown();
+			return false;
+		}
+	}
+
+	m_nSQEsSize = params.sq_entries * sizeof( struct io_uring_sqe );
+	void *pSQEs = mmap( NULL, m_nSQEsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+	if ( pSQEs == MAP_FAILED )
+	{
+		Shutdown();
+		return false;
+	}
+	m_pSQEs = (struct io_uring_sqe *)pSQEs;
+
+	byte *pSQ = (byte *)m_pSQRing;
+	m_pSQHead = (unsigned *)( pSQ + params.sq_off.head );
+	m_pSQTail = (unsigned *)( pSQ + params.sq_off.tail );
+	m_pSQMask = (unsigned *)( pSQ + params.sq_off.ring_mask );
+	m_pSQArray = (unsigned *)( pSQ + params.sq_off.array );
+
+	byte *pCQ = (byte *)m_pCQRing;
+	m_pCQHead = (unsigned *)( pCQ + params.cq_off.head );
+	m_pCQTail = (unsigned *)( pCQ + params.cq_off.tail );
+	m_pCQMask = (unsigned *)( pCQ + params.cq_off.ring_mask );
+	m_pCQEs = (struct io_uring_cqe *)( pCQ + params.cq_off.cqes );
+
+	m_nSQEntries = params.sq_entries;
+	m_nToSubmit = 0;
+	return true;
+}
+
+void CIOURing::Shutdown()
+{
+	if ( m_fd < 0 )
+		return;
+
+	UnregisterBuffers();
+
+	if ( m_pSQEs )
+	{
+		munmap( m_pSQEs, m_nSQEsSize );
+	}
+	if ( m_pCQRing && m_pCQRing != m_pSQRing )
+	{
+		munmap( m_pCQRing, m_nCQRingSize );
+	}
+	if ( m_pSQRing )
+	{
+		munmap( m_pSQRing, m_nSQRingSize );
+	}
+	close( m_fd );
+
+	m_fd = -1;
+	m_nSQEntries = 0;
+	m_nToSubmit = 0;
+	m_pSQHead = m_pSQTail = m_pSQMask = m_pSQArray = NULL;
+	m_pSQEs = NULL;
+	m_pCQHead = m_pCQTail = m_pCQMask = NULL;
+	m_pCQEs = NULL;
+	m_pSQRing = m_pCQRing = NULL;
+}
+
+bool CIOURing::RegisterBuffers( const struct iovec *pBuffers, unsigned nBuffers )
+{
+	if ( m_fd < 0 || m_bBuffersRegistered )
+		return false;
+
+	// Fails when the buffers don't fit under RLIMIT_MEMLOCK
+	m_bBuffersRegistered = ( syscall( __NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, pBuffers, nBuffers ) == 0 );
+	return m_bBuffersRegistered;
+}
+
+void CIOURing::UnregisterBuffers()
+{
+	if ( m_fd < 0 || !m_bBuffersRegistered )
+		return;
+
+	syscall( __NR_io_uring_register, m_fd, IORING_UNREGISTER_BUFFERS, NULL, 0 );
+	m_bBuffersRegistered = false;
+}
+
+bool CIOURing::PrepRead( int fd, void *pBuffer, unsigned nBytes, int64 nOffset, uint64 nUserData, int nFixedBuffer )
+{
+	if ( m_fd < 0 )
+		return false;
+
+	// Only the kernel moves the head
+	unsigned nHead = __atomic_load_n( m_pSQHead, __ATOMIC_ACQUIRE );
+	unsigned nTail = *m_pSQTail;
+	if ( nTail - nHead >= m_nSQEntries )
+		return false;
+
+	unsigned nIndex = nTail & *m_pSQMask;
+	struct io_uring_sqe *pSQE = &m_pSQEs[nIndex];
+	memset( pSQE, 0, sizeof( *pSQE ) );
+	pSQE->fd = fd;
+	pSQE->off = nOffset;
+	pSQE->addr = (uint64)(uintp)pBuffer;
+	pSQE->len = nBytes;
+	pSQE->user_data = nUserData;
+	if ( nFixedBuffer >= 0 && m_bBuffersRegistered )
+	{
+		pSQE->opcode = IORING_OP_READ_FIXED;
+		pSQE->buf_index = nFixedBuffer;
+	}
+	else
+	{
+		pSQE->opcode = IORING_OP_READ;
+	}
+
+	m_pSQArray[nIndex] = nIndex;
+	__atomic_store_n( m_pSQTail, nTail + 1, __ATOMIC_RELEASE );
+	++m_nToSubmit;
+	return true;
+}
+
+int CIOURing::Submit( unsigned nWaitFor )
+{
+	if ( m_fd < 0 )
+		return -EBADF;
+
+	unsigned nFlags = nWaitFor ? IORING_ENTER_GETEVENTS : 0;
+	for ( ;; )
+	{
+		int nResult = (int)syscall( __NR_io_uring_enter, m_fd, m_nToSubmit, nWaitFor, nFlags, NULL, 0 );
+		if ( nResult >= 0 )
+		{
+			m_nToSubmit -= MIN( (unsigned)nResult, m_nToSubmit );
+			return nResult;
+		}
+
+		// A signal interrupted the wait, or the kernel is short of memory for a moment
+		if ( errno != EINTR && errno != EAGAIN )
+			return -errno;
+	}
+}
+
+bool CIOURing::PopCompletion( uint64 *pnUserData, int *pnResult )
+{
+	if ( m_fd < 0 )
+		return false;
+
+	unsigned nHead = *m_pCQHead;
+	if ( nHead == __atomic_load_n( m_pCQTail, __ATOMIC_ACQUIRE ) )
+		return false;
+
+	struct io_uring_cqe *pCQE = &m_pCQEs[nHead & *m_pCQMask];
+	*pnUserData = pCQE->user_data;
+	*pnResult = pCQE->res;
+	__atomic_store_n( m_pCQHead, nHead + 1, __ATOMIC_RELEASE );
+	return true;
+}
+
+#else
+
+bool CIOURing::Init( unsigned nEntries )														{ return false; }
+void CIOURing::Shutdown()																		{}
+bool CIOURing::RegisterBuffers( const struct iovec *pBuffers, unsigned nBuffers )				{ return false; }
+void CIOURing::UnregisterBuffers()																{}
+bool CIOURing::PrepRead( int fd, void *pBuffer, unsigned nBytes, int64 nOffset, uint64 nUserData, int nFixedBuffer ) { return false; }
+int CIOURing::Submit( unsigned nWaitFor )														{ return -ENOSYS; }
+bool CIOURing::PopCompletion( uint64 *pnUserData, int *pnResult )								{ return false; }
+
+#endif // HAVE_IO_URING
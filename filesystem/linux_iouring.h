@@ -0,0 +1,73 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Minimal io_uring submission/completion ring, driven through the
+//			raw system calls so there's no dependency on liburing.
+//
+//			Only one thread may prepare, submit and reap on a ring.
+//
+//=============================================================================
+
+#ifndef LINUX_IOURING_H
+#define LINUX_IOURING_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct iovec;
+
+class CIOURing
+{
+public:
+	CIOURing();
+	~CIOURing();
+
+	// False when the kernel doesn't support io_uring or IORING_OP_READ (5.7+), or it's blocked
+	bool Init( unsigned nEntries );
+	void Shutdown();
+	bool IsValid() const		{ return m_fd >= 0; }
+	unsigned Entries() const	{ return m_nSQEntries; }
+
+	// Registered buffers are pinned once, reads into them skip mapping the pages per I/O
+	bool RegisterBuffers( const struct iovec *pBuffers, unsigned nBuffers );
+	void UnregisterBuffers();
+
+	// Queues a read of nBytes at nOffset. nFixedBuffer is the registered buffer pBuffer lies
+	// in, or -1. False when the submission queue is full.
+	bool PrepRead( int fd, void *pBuffer, unsigned nBytes, int64 nOffset, uint64 nUserData, int nFixedBuffer = -1 );
+
+	// Hands everything queued to the kernel, then blocks until at least nWaitFor completions
+	// are ready. Returns the number submitted, or -errno.
+	int Submit( unsigned nWaitFor = 0 );
+
+	// Pops a completion, false when none are ready. nResult is bytes read or -errno.
+	bool PopCompletion( uint64 *pnUserData, int *pnResult );
+
+private:
+	int						m_fd;
+	unsigned				m_nSQEntries;
+	unsigned				m_nToSubmit;
+	bool					m_bBuffersRegistered;
+
+	// Shared with the kernel
+	unsigned				*m_pSQHead;
+	unsigned				*m_pSQTail;
+	unsigned				*m_pSQMask;
+	unsigned				*m_pSQArray;
+	struct io_uring_sqe		*m_pSQEs;
+	unsigned				*m_pCQHead;
+	unsigned				*m_pCQTail;
+	unsigned				*m_pCQMask;
+	struct io_uring_cqe		*m_pCQEs;
+
+	void					*m_pSQRing;
+	size_t					m_nSQRingSize;
+	void					*m_pCQRing;
+	size_t					m_nCQRingSize;
+	size_t					m_nSQEsSize;
+};
+
+#endif // LINUX_IOURING_H
@@ -8,6 +8,11 @@
 #include "linux_support.h"
 #include "tier0/threadtools.h" // For ThreadInMainThread()
 #include "tier1/strtools.h"
+#include "tier1/utlhashtable.h"
+#include "tier1/utlstring.h"
+#ifdef LINUX
+#include <sys/inotify.h>
+#endif
 
 char selectBuf[PATH_MAX];
 
@@ -199,62 +204,393 @@ bool FindClose(HANDLE handle)
 
 
 
-// Pass this function a full path and it will look for files in the specified
-// directory that match the file name but potentially with different case.
-// The directory name itself is not treated specially.
-// If multiple names that match are found then lowercase letters take precedence.
-bool findFileInDirCaseInsensitive( const char *file, char* output, size_t bufSize)
+//-----------------------------------------------------------------------------
+// Directory listings for case insensitive lookups. A directory is read once,
+// the first time a lookup misses in it, into a table from lowercased name to
+// the best matching real name. Listings are dropped when inotify reports a
+// change in the directory (or, without a watch, when its mtime changes) and
+// when the filesystem itself writes to it. A watch is removed again once no
+// listing uses it. Lookups only take a read lock, so the async IO threads can
+// resolve names alongside the main thread.
+//-----------------------------------------------------------------------------
+class CCaseInsensitiveDirCache
 {
-	// Make sure the output buffer is always null-terminated.
-	output[0] = 0;
+public:
+	CCaseInsensitiveDirCache();
+	~CCaseInsensitiveDirCache();
 
-	// Find where the file part starts.
-	const char *dirSep = strrchr(file,'/');
-	if( !dirSep )
+	// False if the directory can't be read. Otherwise pRealName is the matching name, or empty if there is none.
+	bool FindFile( const char *pDirName, const char *pFileName, char *pRealName, int nRealNameSize );
+
+	void InvalidateDir( const char *pDirName );
+
+private:
+	struct DirListing_t
 	{
-		dirSep=strrchr(file,'\\');
-		if( !dirSep ) 
+		CUtlHashtable<CUtlString, CUtlString> m_Names;
+		int m_nWatch;					// -1 when the directory isn't watched
+		struct timespec m_ModifyTime;	// Checked instead when it isn't
+	};
+
+	struct Watch_t
+	{
+		int m_nUsers;		// Listings plus reads in progress
+		int m_nChanges;		// Notifications received, a read that saw this change may be stale
+	};
+
+	static void LowercaseName( const char *pName, char *pLower, int nLowerSize );
+	DirListing_t *ReadDir( const char *pDirName, int nWatch );
+	bool IsStale( const char *pDirName, const DirListing_t *pListing );
+	void ProcessNotifications();
+	int AddWatch( const char *pDirName );
+	void ReleaseWatch( int nWatch );
+	void DeleteListing( DirListing_t *pListing );
+	void RemoveDir( const char *pDirName );
+	void RemoveWatch( int nWatch );
+	void RemoveAll();
+
+	CThreadRWLock m_Lock;
+	CUtlHashtable<CUtlString, DirListing_t *> m_Dirs;
+	CUtlHashtable<int, Watch_t> m_Watches;
+	int m_nNotify;
+};
+
+static CCaseInsensitiveDirCache &CaseInsensitiveDirCache()
+{
+	static CCaseInsensitiveDirCache s_DirCache;
+	return s_DirCache;
+}
+
+CCaseInsensitiveDirCache::CCaseInsensitiveDirCache()
+{
+#ifdef LINUX
+	m_nNotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+#else
+	m_nNotify = -1;
+#endif
+}
+
+CCaseInsensitiveDirCache::~CCaseInsensitiveDirCache()
+{
+	RemoveAll();
+	if ( m_nNotify >= 0 )
+	{
+		close( m_nNotify );
+	}
+}
+
+void CCaseInsensitiveDirCache::LowercaseName( const char *pName, char *pLower, int nLowerSize )
+{
+	// Folds the same way strcasecmp does
+	int i = 0;
+	for ( ; pName[i] && i < nLowerSize - 1; ++i )
+	{
+		pLower[i] = tolower( (unsigned char)pName[i] );
+	}
+	pLower[i] = 0;
+}
+
+CCaseInsensitiveDirCache::DirListing_t *CCaseInsensitiveDirCache::ReadDir( const char *pDirName, int nWatch )
+{
+	struct stat dirStat;
+	DIR *pDir = opendir( pDirName );
+	if ( !pDir || fstat( dirfd( pDir ), &dirStat ) != 0 )
+	{
+		if ( pDir )
+			closedir( pDir );
+		return NULL;
+	}
+
+	DirListing_t *pListing = new DirListing_t;
+	pListing->m_nWatch = nWatch;
+	pListing->m_ModifyTime = dirStat.st_mtim;
+
+	char lowerName[ MAX_PATH ];
+	for ( dirent *pEntry = NULL; ( pEntry = readdir( pDir ) ); /**/ )
+	{
+		LowercaseName( pEntry->d_name, lowerName, sizeof( lowerName ) );
+
+		// If there are several candidates keep the best one. A 'better'
+		// candidate means that test beats tesT which beats tEst -- more
+		// lowercase letters earlier equals victory.
+		UtlHashHandle_t h = pListing->m_Names.Find( lowerName );
+		if ( h == pListing->m_Names.InvalidHandle() )
 		{
-			return false;
+			pListing->m_Names.Insert( lowerName, pEntry->d_name );
+		}
+		else if ( strcmp( pListing->m_Names.Element( h ).Get(), pEntry->d_name ) < 0 )
+		{
+			pListing->m_Names.Element( h ) = pEntry->d_name;
 		}
 	}
 
-	// Allocate space for the directory portion.
-	size_t dirSize = ( dirSep - file ) + 1;
-	char *dirName = static_cast<char *>( alloca( dirSize ) ); 
-
-	V_strncpy( dirName , file, dirSize );
+	closedir( pDir );
+	return pListing;
+}
 
-	DIR* pDir = opendir( dirName );
-	if ( !pDir )
+bool CCaseInsensitiveDirCache::IsStale( const char *pDirName, const DirListing_t *pListing )
+{
+	if ( pListing->m_nWatch >= 0 )
 		return false;
 
-	const char* filePart = dirSep + 1;
-	// The best matching file name will be placed in this array.
-	char outputFileName[ MAX_PATH ];
-	bool foundMatch = false;
+	struct stat dirStat;
+	if ( stat( pDirName, &dirStat ) != 0 )
+		return true;
 
-	// Scan through the directory.
-	for ( dirent* pEntry = NULL; ( pEntry = readdir( pDir ) ); /**/ )
+	return dirStat.st_mtim.tv_sec != pListing->m_ModifyTime.tv_sec || dirStat.st_mtim.tv_nsec != pListing->m_ModifyTime.tv_nsec;
+}
+
+void CCaseInsensitiveDirCache::ProcessNotifications()
+{
+#ifdef LINUX
+	if ( m_nNotify < 0 )
+		return;
+
+	char buf[ 4096 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+	for ( ;; )
 	{
-		if ( strcasecmp( pEntry->d_name, filePart ) == 0 )
+		ssize_t nBytes = read( m_nNotify, buf, sizeof( buf ) );
+		if ( nBytes <= 0 )
+			break;
+
+		m_Lock.LockForWrite();
+		for ( char *p = buf; p < buf + nBytes; /**/ )
 		{
-			// If we don't have an existing candidate or if this name is
-			// a better candidate then copy it in. A 'better' candidate
-			// means that test beats tesT which beats tEst -- more lowercase
-			// letters earlier equals victory.
-			if ( !foundMatch || strcmp( outputFileName, pEntry->d_name ) < 0 )
+			const struct inotify_event *pEvent = (const struct inotify_event *)p;
+			if ( pEvent->mask & IN_Q_OVERFLOW )
 			{
-				foundMatch = true;
-				V_strcpy_safe( outputFileName, pEntry->d_name );
+				RemoveAll();
 			}
+			else
+			{
+				UtlHashHandle_t h = m_Watches.Find( pEvent->wd );
+				if ( h != m_Watches.InvalidHandle() )
+				{
+					++m_Watches.Element( h ).m_nChanges;
+				}
+				RemoveWatch( pEvent->wd );
+			}
+			p += sizeof( struct inotify_event ) + pEvent->len;
 		}
+		m_Lock.UnlockWrite();
 	}
+#endif
+}
 
-	closedir( pDir );
+// Expects the write lock. Adding a directory that is already watched returns its
+// existing watch, so every user holds a reference.
+int CCaseInsensitiveDirCache::AddWatch( const char *pDirName )
+{
+	int nWatch = -1;
+#ifdef LINUX
+	if ( m_nNotify >= 0 )
+	{
+		nWatch = inotify_add_watch( m_nNotify, pDirName, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR );
+	}
+#endif
+	if ( nWatch < 0 )
+		return -1;
+
+	UtlHashHandle_t h = m_Watches.Find( nWatch );
+	if ( h == m_Watches.InvalidHandle() )
+	{
+		Watch_t watch = { 0, 0 };
+		h = m_Watches.Insert( nWatch, watch );
+	}
+	++m_Watches.Element( h ).m_nUsers;
+	return nWatch;
+}
+
+// Expects the write lock. Removes the watch with its last user; that fails
+// harmlessly when the kernel already dropped it because the directory is gone.
+void CCaseInsensitiveDirCache::ReleaseWatch( int nWatch )
+{
+	if ( nWatch < 0 )
+		return;
+
+	UtlHashHandle_t h = m_Watches.Find( nWatch );
+	if ( h == m_Watches.InvalidHandle() || --m_Watches.Element( h ).m_nUsers > 0 )
+		return;
+
+	m_Watches.RemoveByHandle( h );
+#ifdef LINUX
+	inotify_rm_watch( m_nNotify, nWatch );
+#endif
+}
+
+// Expects the write lock
+void CCaseInsensitiveDirCache::DeleteListing( DirListing_t *pListing )
+{
+	ReleaseWatch( pListing->m_nWatch );
+	delete pListing;
+}
+
+// Expects the write lock
+void CCaseInsensitiveDirCache::RemoveDir( const char *pDirName )
+{
+	UtlHashHandle_t h = m_Dirs.Find( pDirName );
+	if ( h != m_Dirs.InvalidHandle() )
+	{
+		DeleteListing( m_Dirs.Element( h ) );
+		m_Dirs.RemoveByHandle( h );
+	}
+}
+
+// Expects the write lock. Directories reached through symlinks share a watch.
+void CCaseInsensitiveDirCache::RemoveWatch( int nWatch )
+{
+	for ( UtlHashHandle_t h = m_Dirs.FirstHandle(); h != m_Dirs.InvalidHandle(); )
+	{
+		if ( m_Dirs.Element( h )->m_nWatch == nWatch )
+		{
+			DeleteListing( m_Dirs.Element( h ) );
+			h = m_Dirs.RemoveAndAdvance( h );
+		}
+		else
+		{
+			h = m_Dirs.NextHandle( h );
+		}
+	}
+}
+
+// Expects the write lock. Reads in progress may have missed a change, so they count it too.
+void CCaseInsensitiveDirCache::RemoveAll()
+{
+	FOR_EACH_HASHTABLE( m_Watches, h )
+	{
+		++m_Watches.Element( h ).m_nChanges;
+	}
+
+	FOR_EACH_HASHTABLE( m_Dirs, h )
+	{
+		DeleteListing( m_Dirs.Element( h ) );
+	}
+	m_Dirs.RemoveAll();
+}
+
+bool CCaseInsensitiveDirCache::FindFile( const char *pDirName, const char *pFileName, char *pRealName, int nRealNameSize )
+{
+	pRealName[0] = 0;
+
+	ProcessNotifications();
+
+	char lowerName[ MAX_PATH ];
+	LowercaseName( pFileName, lowerName, sizeof( lowerName ) );
+
+	m_Lock.LockForRead();
+	UtlHashHandle_t hDir = m_Dirs.Find( pDirName );
+	if ( hDir != m_Dirs.InvalidHandle() && !IsStale( pDirName, m_Dirs.Element( hDir ) ) )
+	{
+		const DirListing_t *pListing = m_Dirs.Element( hDir );
+		UtlHashHandle_t hName = pListing->m_Names.Find( lowerName );
+		if ( hName != pListing->m_Names.InvalidHandle() )
+		{
+			V_strncpy( pRealName, pListing->m_Names.Element( hName ).Get(), nRealNameSize );
+		}
+		m_Lock.UnlockRead();
+		return true;
+	}
+	m_Lock.UnlockRead();
+
+	// Watch before reading so a change made while we read is noticed
+	m_Lock.LockForWrite();
+	int nWatch = AddWatch( pDirName );
+	int nChanges = ( nWatch >= 0 ) ? m_Watches.Element( m_Watches.Find( nWatch ) ).m_nChanges : 0;
+	m_Lock.UnlockWrite();
+
+	// Read the directory without holding the lock; if another thread got there first replace theirs
+	DirListing_t *pListing = ReadDir( pDirName, nWatch );
+
+	m_Lock.LockForWrite();
+	RemoveDir( pDirName );
+	if ( !pListing )
+	{
+		ReleaseWatch( nWatch );
+		m_Lock.UnlockWrite();
+		return false;
+	}
+
+	UtlHashHandle_t hName = pListing->m_Names.Find( lowerName );
+	if ( hName != pListing->m_Names.InvalidHandle() )
+	{
+		V_strncpy( pRealName, pListing->m_Names.Element( hName ).Get(), nRealNameSize );
+	}
+
+	// Answer from a listing that raced a change, but don't keep it
+	UtlHashHandle_t hWatch = ( nWatch >= 0 ) ? m_Watches.Find( nWatch ) : m_Watches.InvalidHandle();
+	if ( hWatch != m_Watches.InvalidHandle() && m_Watches.Element( hWatch ).m_nChanges != nChanges )
+	{
+		DeleteListing( pListing );
+	}
+	else
+	{
+		m_Dirs.Insert( pDirName, pListing );
+	}
+	m_Lock.UnlockWrite();
+	return true;
+}
+
+void CCaseInsensitiveDirCache::InvalidateDir( const char *pDirName )
+{
+	m_Lock.LockForWrite();
+	RemoveDir( pDirName );
+	m_Lock.UnlockWrite();
+}
+
+// Splits off the directory part of a path, without the trailing separator
+static bool GetCaseInsensitiveDirName( const char *file, char *dirName, size_t dirNameSize, const char **ppFilePart )
+{
+	const char *dirSep = strrchr(file,'/');
+	if( !dirSep )
+	{
+		dirSep=strrchr(file,'\\');
+		if( !dirSep ) 
+		{
+			return false;
+		}
+	}
+
+	V_strncpy( dirName, file, MIN( (size_t)( dirSep - file ) + 1, dirNameSize ) );
+	if ( ppFilePart )
+	{
+		*ppFilePart = dirSep + 1;
+	}
+	return true;
+}
+
+void InvalidateCaseInsensitiveDirCache( const char *file )
+{
+	char dirName[ MAX_PATH ];
+	if ( GetCaseInsensitiveDirName( file, dirName, sizeof( dirName ), NULL ) )
+	{
+		CaseInsensitiveDirCache().InvalidateDir( dirName );
+	}
+}
+
+
+// Pass this function a full path and it will look for files in the specified
+// directory that match the file name but potentially with different case.
+// The directory name itself is not treated specially.
+// If multiple names that match are found then lowercase letters take precedence.
+bool findFileInDirCaseInsensitive( const char *file, char* output, size_t bufSize)
+{
+	// Make sure the output buffer is always null-terminated.
+	output[0] = 0;
+
+	// Find where the file part starts.
+	char dirName[ MAX_PATH ];
+	const char *filePart;
+	if ( !GetCaseInsensitiveDirName( file, dirName, sizeof( dirName ), &filePart ) )
+		return false;
+
+	// The best matching file name will be placed in this array.
+	char outputFileName[ MAX_PATH ];
+	if ( !CaseInsensitiveDirCache().FindFile( dirName, filePart, outputFileName, sizeof( outputFileName ) ) )
+		return false;
 
 	// If we didn't find any matching names then lowercase the passed in
 	// file name and use that.
+	bool foundMatch = ( outputFileName[0] != 0 );
 	if ( !foundMatch )
 	{
 		V_strcpy_safe( outputFileName, filePart );
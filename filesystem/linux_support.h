@@ -44,8 +44,8 @@ bool FindClose(HANDLE handle);
 // filename will be returned in the user's buffer and 'true' will be returned.
 // If the file does not exist then the filename will be lowercased and 'false'
 // will be returned.
-// This function uses a static buffer for internal purposes and is therefore
-// not thread safe, so it must only be called from the main thread.
+// Directory listings are cached, so only the first miss in a directory reads
+// it. This is safe to call from any thread.
 bool findFileInDirCaseInsensitive( const char *file, OUT_Z_BYTECAP(bufSize) char* output, size_t bufSize );
 // The _safe version of this function should be preferred since it always infers
 // the directory size correctly.
@@ -55,4 +55,8 @@ bool findFileInDirCaseInsensitive_safe( const char *file, OUT_Z_ARRAY char (&out
 	return findFileInDirCaseInsensitive( file, output, bufSize );
 }
 
+// Drops the cached listing of the directory the file is in. Call after the
+// filesystem creates, removes or renames something there.
+void InvalidateCaseInsensitiveDirCache( const char *file );
+
 #endif // LINUX_SUPPORT_H
@@ -14,6 +14,7 @@
 #include "tier1/generichash.h"
 
 ConVar fs_monitor_read_from_pack( "fs_monitor_read_from_pack", "0", 0, "0:Off, 1:Any, 2:Sync only" );
+extern ConVar fs_mmap;
 
 // How many bytes we should decode at a time when doing pseudo-reads to seek forward in a compressed file handle,
 // (affects maximum stack allocation by a forward seek)
@@ -279,7 +280,23 @@ int CZipPackFile::ReadFromPack( int nEntryIndex, void* pBuffer, int nDestBytes,
 		Msg( "Read From Pack: Sync I/O: Requested:%7d, Offset:0x%16.16llx, %s\n", nBytes, m_nBaseOffset + nOffset, szName );
 	}
 
+	if ( !m_bTriedMapping && m_hPackFileHandleFS && fs_mmap.GetBool() )
+	{
+		m_bTriedMapping = true;
+		m_pMappedPack = (byte *)CBaseFileSystem::MapFileRange( m_fs->FS_fileno( m_hPackFileHandleFS ), m_nBaseOffset, m_FileLength, false, &m_pMappedBase, &m_nMappedBaseSize );
+	}
+
 	int nBytesRead = 0;
+	if ( m_pMappedPack )
+	{
+		// The mapping never changes, so only setting it up needs the lock
+		m_mutex.Unlock();
+
+		nBytesRead = (int)clamp( m_FileLength - nOffset, (int64)0, (int64)nBytes );
+		V_memcpy( pBuffer, m_pMappedPack + nOffset, nBytesRead );
+		return nBytesRead;
+	}
+
 	// Seek to the start of the read area and perform the read: TODO: CHANGE THIS INTO A CFileHandle
 	if ( m_hPackFileHandleFS )
 	{
@@ -809,6 +826,10 @@ CZipPackFile::CZipPackFile( CBaseFileSystem* fs, void *pSection )
 	m_pPreloadRemapTable = NULL;
 	m_nPreloadSectionOffset = 0;
 	m_nPreloadSectionSize = 0;
+	m_bTriedMapping = false;
+	m_pMappedPack = NULL;
+	m_pMappedBase = NULL;
+	m_nMappedBaseSize = 0;
 
 #if defined( _X360 )
 	m_pSection = pSection;
@@ -818,6 +839,11 @@ CZipPackFile::CZipPackFile( CBaseFileSystem* fs, void *pSection )
 CZipPackFile::~CZipPackFile()
 {
 	DiscardPreloadData();
+
+	if ( m_pMappedBase )
+	{
+		CBaseFileSystem::UnmapFileRange( m_pMappedBase, m_nMappedBaseSize );
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -879,6 +905,17 @@ int64 CZipPackFileHandle::AbsoluteBaseOffset()
 	return m_pOwner->GetPackFileBaseOffset() + m_nBase;
 }
 
+bool CZipPackFileHandle::GetBackingFile( FILE **ppFile, int64 *pnOffset )
+{
+	// Packs embedded in a VPK are read through the VPK
+	if ( !m_pOwner->m_hPackFileHandleFS )
+		return false;
+
+	*ppFile = m_pOwner->m_hPackFileHandleFS;
+	*pnOffset = AbsoluteBaseOffset();
+	return true;
+}
+
 #if defined( _DEBUG ) && !defined( OSX ) && !defined( ANDROID )
 #include <atomic>
 static std::atomic<int> sLZMAPackFileHandles( 0 );
@@ -45,6 +45,9 @@ public:
 	virtual void   SetBufferSize( int nBytes ) = 0;
 	virtual int    GetSectorSize()             = 0;
 	virtual int64  AbsoluteBaseOffset()        = 0;
+
+	// The on disk file and offset this file's bytes are stored at unchanged, for mapping them
+	virtual bool   GetBackingFile( FILE **ppFile, int64 *pnOffset ) { return false; }
 };
 
 class CZipPackFileHandle : public CPackFileHandle
@@ -63,6 +66,8 @@ public:
 	virtual int    GetSectorSize()             OVERRIDE;
 	virtual int64  AbsoluteBaseOffset()        OVERRIDE;
 
+	virtual bool   GetBackingFile( FILE **ppFile, int64 *pnOffset ) OVERRIDE;
+
 protected:
 	int64         m_nBase;        // Base offset of the file inside the pack file.
 	unsigned int  m_nFilePointer; // Current seek pointer (0 based from the beginning of the file).
@@ -84,6 +89,9 @@ public:
 	virtual int Tell() OVERRIDE;
 	virtual int Size() OVERRIDE;
 
+	// Stored compressed, there is nothing to map
+	virtual bool GetBackingFile( FILE **ppFile, int64 *pnOffset ) OVERRIDE { return false; }
+
 private:
 	// Ensure there are bytes in the read buffer, assuming we're not at the end of the underlying data
 	int FillReadBuffer();
@@ -129,6 +137,7 @@ public:
 
 	// Returns the filename for a given file in the pack. Returns true if a filename is found, otherwise buffer is filled with "unknown"
 	virtual bool IndexToFilename( int nIndex, char* buffer, int nBufferSize ) = 0;
+	virtual int GetFileCount() = 0;
 
 	inline int GetSectorSize();
 
@@ -199,6 +208,7 @@ public:
 	virtual int64 GetPackFileBaseOffset() OVERRIDE { return m_nBaseOffset; }
 
 	virtual bool IndexToFilename( int nIndex, char *pBuffer, int nBufferSize ) OVERRIDE;
+	virtual int GetFileCount() OVERRIDE { return m_PackFiles.Count(); }
 
 protected:
 	virtual int  ReadFromPack( int nIndex, void* buffer, int nDestBytes, int nBytes, int64 nOffset  ) OVERRIDE;
@@ -269,6 +279,12 @@ protected:
 	void*						m_pPreloadData;
 	CByteswap					m_swap;
 
+	// The whole pack, mapped on the first read from disk when fs_mmap is set
+	bool						m_bTriedMapping;
+	byte						*m_pMappedPack;
+	void						*m_pMappedBase;
+	size_t						m_nMappedBaseSize;
+
 #if defined ( _X360 )
 	void						*m_pSection;
 #endif
@@ -13,9 +13,7 @@
 #include "NextBotBodyInterface.h"
 #include "NextBotUtil.h"
 
-#ifdef TERROR
 #include "querycache.h"
-#endif
 
 #include "tier0/vprof.h"
 
@@ -698,12 +696,22 @@ bool IVision::IsLineOfSightClear( const Vector &pos ) const
 	VPROF_BUDGET( "IVision::IsLineOfSightClear", "NextBot" );
 	VPROF_INCREMENT_COUNTER( "IVision::IsLineOfSightClear", 1 );
 
+	Vector vecEyePosition = GetBot()->GetBodyInterface()->GetEyePosition();
+
+	CLOSQuery query( ELOSQUERY_NEXTBOT_VISION, GetBot()->GetEntity(), NULL, vecEyePosition, pos, MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE );
+	if ( query.IsCached() )
+	{
+		return query.IsClear();
+	}
+
 	trace_t result;
 	NextBotVisionTraceFilter filter( GetBot()->GetEntity(), COLLISION_GROUP_NONE );
 	
-	UTIL_TraceLine( GetBot()->GetBodyInterface()->GetEyePosition(), pos, MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
+	UTIL_TraceLine( vecEyePosition, pos, MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
 	
-	return ( result.fraction >= 1.0f && !result.startsolid );
+	query.Store( result.fraction >= 1.0f && !result.startsolid, result.m_pEnt );
+
+	return query.IsClear();
 }
 
 
@@ -746,9 +754,22 @@ bool IVision::IsLineOfSightClearToEntity( const CBaseEntity *subject, Vector *vi
 
 #else
 
-	// TODO: Use plain-old traces until querycache/etc gets integrated
 	VPROF_BUDGET( "IVision::IsLineOfSightClearToEntity", "NextBot" );
 
+	// The cache can't hand back the spot that was seen, so only callers that don't want it go through it
+	if ( !visibleSpot )
+	{
+		CLOSQuery query( ELOSQUERY_NEXTBOT_VISION, GetBot()->GetEntity(), subject, GetBot()->GetBodyInterface()->GetEyePosition(),
+						 subject->WorldSpaceCenter(), MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, 1 );
+		if ( !query.IsCached() )
+		{
+			Vector vecSpot;
+			query.Store( IVision::IsLineOfSightClearToEntity( subject, &vecSpot ) );
+		}
+
+		return query.IsClear();
+	}
+
 	trace_t result;
 	NextBotTraceFilterIgnoreActors filter( subject, COLLISION_GROUP_NONE );
 
@@ -62,6 +62,8 @@
 #include "env_debughistory.h"
 #include "tier1/utlstring.h"
 #include "utlhashtable.h"
+#include "entitypool.h"
+#include "querycache.h"
 
 #if defined( TF_DLL )
 #include "tf_gamerules.h"
@@ -2785,12 +2787,8 @@ bool CBaseEntity::FVisible( CBaseEntity *pEntity, int traceMask, CBaseEntity **p
 	Vector vecLookerOrigin = EyePosition();//look through the caller's 'eyes'
 	Vector vecTargetOrigin = pEntity->EyePosition();
 
-	trace_t tr;
-	if ( !IsXbox() && ai_LOS_mode.GetBool() )
-	{
-		UTIL_TraceLine(vecLookerOrigin, vecTargetOrigin, traceMask, this, COLLISION_GROUP_NONE, &tr);
-	}
-	else
+	bool bSimpleLOS = !IsXbox() && ai_LOS_mode.GetBool();
+	if ( !bSimpleLOS )
 	{
 		// If we're doing an LOS search, include NPCs.
 		if ( traceMask == MASK_BLOCKLOS )
@@ -2803,29 +2801,46 @@ bool CBaseEntity::FVisible( CBaseEntity *pEntity, int traceMask, CBaseEntity **p
 		{
 			traceMask &= ~CONTENTS_BLOCKLOS;
 		}
-
-		// Use the custom LOS trace filter
-		CTraceFilterLOS traceFilter( this, COLLISION_GROUP_NONE, pEntity );
-		UTIL_TraceLine( vecLookerOrigin, vecTargetOrigin, traceMask, &traceFilter, &tr );
 	}
-	
-	if (tr.fraction != 1.0 || tr.startsolid )
+
+	// Senses and squads ask the same question many times a tick
+	CLOSQuery query( ELOSQUERY_FVISIBLE_ENTITY, this, pEntity, vecLookerOrigin, vecTargetOrigin, traceMask, bSimpleLOS );
+	if ( !query.IsCached() )
 	{
-		// If we hit the entity we're looking for, it's visible
-		if ( tr.m_pEnt == pEntity )
-			return true;
+		trace_t tr;
+		if ( bSimpleLOS )
+		{
+			UTIL_TraceLine(vecLookerOrigin, vecTargetOrigin, traceMask, this, COLLISION_GROUP_NONE, &tr);
+		}
+		else
+		{
+			// Use the custom LOS trace filter
+			CTraceFilterLOS traceFilter( this, COLLISION_GROUP_NONE, pEntity );
+			UTIL_TraceLine( vecLookerOrigin, vecTargetOrigin, traceMask, &traceFilter, &tr );
+		}
 
-		// Got line of sight on the vehicle the player is driving!
-		if ( pEntity && pEntity->IsPlayer() )
+		bool bVisible = true;
+		if (tr.fraction != 1.0 || tr.startsolid )
 		{
-			CBasePlayer *pPlayer = assert_cast<CBasePlayer*>( pEntity );
-			if ( tr.m_pEnt == pPlayer->GetVehicleEntity() )
-				return true;
+			// If we hit the entity we're looking for, it's visible
+			bVisible = ( tr.m_pEnt == pEntity );
+
+			// Got line of sight on the vehicle the player is driving!
+			if ( !bVisible && pEntity->IsPlayer() )
+			{
+				CBasePlayer *pPlayer = assert_cast<CBasePlayer*>( pEntity );
+				bVisible = ( tr.m_pEnt == pPlayer->GetVehicleEntity() );
+			}
 		}
 
+		query.Store( bVisible, bVisible ? NULL : tr.m_pEnt );
+	}
+
+	if ( !query.IsClear() )
+	{
 		if (ppBlocker)
 		{
-			*ppBlocker = tr.m_pEnt;
+			*ppBlocker = query.GetBlocker();
 		}
 
 		return false;// Line of sight is not established
@@ -2852,14 +2867,10 @@ bool CBaseEntity::FVisible( const Vector &vecTarget, int traceMask, CBaseEntity
 
 #endif 
 
-	trace_t tr;
 	Vector vecLookerOrigin = EyePosition();// look through the caller's 'eyes'
 
-	if ( ai_LOS_mode.GetBool() )
-	{
-		UTIL_TraceLine( vecLookerOrigin, vecTarget, traceMask, this, COLLISION_GROUP_NONE, &tr);
-	}
-	else
+	bool bSimpleLOS = ai_LOS_mode.GetBool();
+	if ( !bSimpleLOS )
 	{
 		// If we're doing an LOS search, include NPCs.
 		if ( traceMask == MASK_BLOCKLOS )
@@ -2873,17 +2884,31 @@ bool CBaseEntity::FVisible( const Vector &vecTarget, int traceMask, CBaseEntity
 			traceMask |= CONTENTS_IGNORE_NODRAW_OPAQUE;
 			traceMask &= ~CONTENTS_BLOCKLOS;
 		}
+	}
 
-		// Use the custom LOS trace filter
-		CTraceFilterLOS traceFilter( this, COLLISION_GROUP_NONE );
-		UTIL_TraceLine( vecLookerOrigin, vecTarget, traceMask, &traceFilter, &tr );
+	CLOSQuery query( ELOSQUERY_FVISIBLE_POSITION, this, NULL, vecLookerOrigin, vecTarget, traceMask, bSimpleLOS );
+	if ( !query.IsCached() )
+	{
+		trace_t tr;
+		if ( bSimpleLOS )
+		{
+			UTIL_TraceLine( vecLookerOrigin, vecTarget, traceMask, this, COLLISION_GROUP_NONE, &tr);
+		}
+		else
+		{
+			// Use the custom LOS trace filter
+			CTraceFilterLOS traceFilter( this, COLLISION_GROUP_NONE );
+			UTIL_TraceLine( vecLookerOrigin, vecTarget, traceMask, &traceFilter, &tr );
+		}
+
+		query.Store( tr.fraction == 1.0, tr.m_pEnt );
 	}
 
-	if (tr.fraction != 1.0)
+	if ( !query.IsClear() )
 	{
 		if (ppBlocker)
 		{
-			*ppBlocker = tr.m_pEnt;
+			*ppBlocker = query.GetBlocker();
 		}
 		return false;// Line of sight is not established
 	}
@@ -3337,22 +3362,22 @@ bool CBaseEntity::ShouldSavePhysics()
 //-----------------------------------------------------------------------------
 void *CBaseEntity::operator new( size_t stAllocateBlock )
 {
-	// call into engine to get memory
+	// get memory from the class pool, or from the engine if there isn't one
 	Assert( stAllocateBlock != 0 );
-	return engine->PvAllocEntPrivateData(stAllocateBlock);
+	return EntityPool_Alloc( stAllocateBlock );
 };
 
 void *CBaseEntity::operator new( size_t stAllocateBlock, int nBlockUse, const char *pFileName, int nLine )
 {
-	// call into engine to get memory
+	// get memory from the class pool, or from the engine if there isn't one
 	Assert( stAllocateBlock != 0 );
-	return engine->PvAllocEntPrivateData(stAllocateBlock);
+	return EntityPool_Alloc( stAllocateBlock );
 }
 
 void CBaseEntity::operator delete( void *pMem )
 {
-	// get the engine to free the memory
-	engine->FreeEntPrivateData( pMem );
+	// hand the memory back to wherever it came from
+	EntityPool_Free( pMem );
 }
 
 #include "tier0/memdbgon.h"
@@ -4522,6 +4547,14 @@ void CBaseEntity::Teleport( const Vector *newPosition, const QAngle *newAngles,
 	for (i = 0; i < teleportList.Count(); i++)
 	{
 		teleportList[i].pEntity->CollisionRulesChanged();
+
+		// Nothing seen from or of the old spot still holds
+		LOSQueryCacheEntityTeleported( teleportList[i].pEntity );
+		CBaseCombatCharacter *pBCC = teleportList[i].pEntity->MyCombatCharacterPointer();
+		if ( pBCC )
+		{
+			CBaseCombatCharacter::ResetVisibilityCache( pBCC );
+		}
 	}
 
 	if ( IsPlayer() )
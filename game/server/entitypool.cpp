@@ -0,0 +1,269 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-class slab allocators for server entities.
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "entitypool.h"
+#include "mempool.h"
+#include "utldict.h"
+#include "igamesystem.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static ConVar sv_entity_pools( "sv_entity_pools", "1", FCVAR_NONE, "Allocate server entities from per-class slab pools instead of the general heap." );
+
+// Target size of a single slab; large classes still get at least one object per slab
+#define ENTITY_POOL_SLAB_BYTES	( 64 * 1024 )
+
+#define ENTITY_POOL_MAGIC		0x45504f4c	// 'EPOL'
+
+//-----------------------------------------------------------------------------
+// Sits in the ENTITY_POOL_ALIGN bytes in front of every entity
+//-----------------------------------------------------------------------------
+struct EntityPoolHeader_t
+{
+	CEntityClassPool	*m_pPool;	// NULL when the entity lives on the general heap
+	unsigned int		m_nMagic;
+};
+
+COMPILE_TIME_ASSERT( sizeof( EntityPoolHeader_t ) <= ENTITY_POOL_ALIGN );
+
+static inline int EntityPool_BlockSize( size_t nSize )
+{
+	return ENTITY_POOL_ALIGN + AlignValue( (int)nSize, ENTITY_POOL_ALIGN );
+}
+
+static inline int EntityPool_BlocksPerSlab( size_t nSize )
+{
+	return MAX( 1, ENTITY_POOL_SLAB_BYTES / EntityPool_BlockSize( nSize ) );
+}
+
+//-----------------------------------------------------------------------------
+// A slab pool dedicated to one entity class
+//-----------------------------------------------------------------------------
+class CEntityClassPool
+{
+public:
+	CEntityClassPool( const char *pClassName, size_t nSize ) :
+		m_Pool( EntityPool_BlockSize( nSize ), EntityPool_BlocksPerSlab( nSize ), CUtlMemoryPool::GROW_SLOW, pClassName, ENTITY_POOL_ALIGN )
+	{
+		m_pClassName = pClassName;
+		m_nObjectSize = nSize;
+		m_nLive = 0;
+		m_nHighWater = 0;
+		m_nPeak = 0;
+		m_nTotalAllocs = 0;
+		m_nRecycled = 0;
+	}
+
+	EntityPoolHeader_t *Alloc()
+	{
+		// The free list is LIFO, so below the high water mark we always get a block back that a removed entity used
+		if ( m_nLive < m_nHighWater )
+		{
+			++m_nRecycled;
+		}
+
+		++m_nLive;
+		++m_nTotalAllocs;
+		m_nHighWater = MAX( m_nHighWater, m_nLive );
+		m_nPeak = MAX( m_nPeak, m_nLive );
+		return (EntityPoolHeader_t *)m_Pool.AllocZero();
+	}
+
+	void Free( EntityPoolHeader_t *pHeader )
+	{
+		Assert( m_nLive > 0 );
+		--m_nLive;
+#ifdef _DEBUG
+		memset( (byte *)pHeader + ENTITY_POOL_ALIGN, 0xDD, m_nObjectSize );
+#endif
+		m_Pool.Free( pHeader );
+	}
+
+	// Returns the slabs to the heap once nothing of this class is alive
+	void PurgeIfEmpty()
+	{
+		if ( m_nLive != 0 || m_Pool.Size() == 0 )
+			return;
+
+		m_Pool.Clear();
+		m_nHighWater = 0;
+	}
+
+	// The peak reported by mem_entitypools covers the current level only
+	void ResetPeak()
+	{
+		m_nPeak = m_nLive;
+	}
+
+	const char *GetClassName() const	{ return m_pClassName; }
+	size_t GetObjectSize() const		{ return m_nObjectSize; }
+	int GetLiveCount() const			{ return m_nLive; }
+	int GetPeakCount() const			{ return m_nPeak; }
+	int GetTotalAllocs() const			{ return m_nTotalAllocs; }
+	int GetRecycledCount() const		{ return m_nRecycled; }
+	int GetReservedBytes() const		{ return m_Pool.Size(); }
+
+private:
+	const char		*m_pClassName;
+	size_t			m_nObjectSize;
+	int				m_nLive;
+	int				m_nHighWater;
+	int				m_nPeak;
+	int				m_nTotalAllocs;
+	int				m_nRecycled;
+	CUtlMemoryPool	m_Pool;
+};
+
+static CUtlDict< CEntityClassPool *, unsigned short > s_EntityPools( true, 0, 128 );
+static CEntityClassPool *s_pNextAllocPool = NULL;
+static int s_nHeapAllocs = 0;
+static int s_nHeapLive = 0;
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the pool for a class name, creating it on first use
+//-----------------------------------------------------------------------------
+CEntityClassPool *EntityPool_FindOrCreate( const char *pClassName, size_t nSize )
+{
+	unsigned short nIndex = s_EntityPools.Find( pClassName );
+	if ( nIndex != s_EntityPools.InvalidIndex() )
+	{
+		Assert( s_EntityPools[nIndex]->GetObjectSize() == nSize );
+		return s_EntityPools[nIndex];
+	}
+
+	nIndex = s_EntityPools.Insert( pClassName, NULL );
+	CEntityClassPool *pPool = new CEntityClassPool( s_EntityPools.GetElementName( nIndex ), nSize );
+	s_EntityPools[nIndex] = pPool;
+	return pPool;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Called by the factory dictionary right before the factory news up the entity
+//-----------------------------------------------------------------------------
+void EntityPool_SetNextAlloc( CEntityClassPool *pPool )
+{
+	s_pNextAllocPool = pPool;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Allocates zeroed memory for an entity
+//-----------------------------------------------------------------------------
+void *EntityPool_Alloc( size_t nSize )
+{
+	// The pending pool is only good for one allocation; entities created inside
+	// the constructor of this one go through their own factory or the heap.
+	CEntityClassPool *pPool = s_pNextAllocPool;
+	s_pNextAllocPool = NULL;
+
+	EntityPoolHeader_t *pHeader;
+	if ( pPool && pPool->GetObjectSize() == nSize && sv_entity_pools.GetBool() )
+	{
+		pHeader = pPool->Alloc();
+	}
+	else
+	{
+		pPool = NULL;
+		// Same alignment as the slabs, the engine's private data heap only guarantees malloc alignment
+		pHeader = (EntityPoolHeader_t *)MemAlloc_AllocAligned( ENTITY_POOL_ALIGN + nSize, ENTITY_POOL_ALIGN );
+		memset( pHeader, 0, ENTITY_POOL_ALIGN + nSize );
+		++s_nHeapAllocs;
+		++s_nHeapLive;
+	}
+
+	pHeader->m_pPool = pPool;
+	pHeader->m_nMagic = ENTITY_POOL_MAGIC;
+	return (byte *)pHeader + ENTITY_POOL_ALIGN;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns entity memory to the pool it came from
+//-----------------------------------------------------------------------------
+void EntityPool_Free( void *pMem )
+{
+	if ( !pMem )
+		return;
+
+	EntityPoolHeader_t *pHeader = (EntityPoolHeader_t *)( (byte *)pMem - ENTITY_POOL_ALIGN );
+	Assert( pHeader->m_nMagic == ENTITY_POOL_MAGIC );
+	pHeader->m_nMagic = 0;
+
+	if ( pHeader->m_pPool )
+	{
+		pHeader->m_pPool->Free( pHeader );
+	}
+	else
+	{
+		--s_nHeapLive;
+		MemAlloc_FreeAligned( pHeader );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Gives slabs of classes that are no longer around back between levels
+//-----------------------------------------------------------------------------
+class CEntityPoolSystem : public CAutoGameSystem
+{
+public:
+	CEntityPoolSystem() : CAutoGameSystem( "CEntityPoolSystem" )
+	{
+	}
+
+	virtual void LevelShutdownPostEntity()
+	{
+		for ( int i = s_EntityPools.First(); i != s_EntityPools.InvalidIndex(); i = s_EntityPools.Next( i ) )
+		{
+			s_EntityPools[i]->PurgeIfEmpty();
+			s_EntityPools[i]->ResetPeak();
+		}
+	}
+
+	virtual void Shutdown()
+	{
+		s_EntityPools.PurgeAndDeleteElements();
+	}
+};
+
+static CEntityPoolSystem g_EntityPoolSystem;
+
+static int EntityPoolSortFunc( CEntityClassPool * const *ppLeft, CEntityClassPool * const *ppRight )
+{
+	return (*ppRight)->GetReservedBytes() - (*ppLeft)->GetReservedBytes();
+}
+
+CON_COMMAND( mem_entitypools, "Reports the per-class server entity slab pools." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	CUtlVector< CEntityClassPool * > pools;
+	for ( int i = s_EntityPools.First(); i != s_EntityPools.InvalidIndex(); i = s_EntityPools.Next( i ) )
+	{
+		pools.AddToTail( s_EntityPools[i] );
+	}
+	pools.Sort( EntityPoolSortFunc );
+
+	int nTotalLive = 0;
+	int nTotalBytes = 0;
+	int nTotalRecycled = 0;
+
+	Msg( "%-40s %8s %6s %6s %8s %8s %8s\n", "class", "size", "live", "peak", "allocs", "recycled", "KB" );
+	for ( int i = 0; i < pools.Count(); ++i )
+	{
+		CEntityClassPool *pPool = pools[i];
+		Msg( "%-40s %8d %6d %6d %8d %8d %8.1f\n", pPool->GetClassName(), (int)pPool->GetObjectSize(),
+			pPool->GetLiveCount(), pPool->GetPeakCount(), pPool->GetTotalAllocs(), pPool->GetRecycledCount(),
+			pPool->GetReservedBytes() / 1024.0f );
+
+		nTotalLive += pPool->GetLiveCount();
+		nTotalBytes += pPool->GetReservedBytes();
+		nTotalRecycled += pPool->GetRecycledCount();
+	}
+
+	Msg( "%d pools, %d live entities, %d recycled allocations, %.1f KB reserved\n", pools.Count(), nTotalLive, nTotalRecycled, nTotalBytes / 1024.0f );
+	Msg( "%d entities on the general heap (%d allocations)%s\n", s_nHeapLive, s_nHeapAllocs, sv_entity_pools.GetBool() ? "" : ", pooling disabled by sv_entity_pools" );
+}
@@ -0,0 +1,34 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-class slab allocators for server entities.
+//
+//			Every entity class created through the factory dictionary gets its
+//			own CUtlMemoryPool. Objects start on a cache line boundary so two
+//			entities never share a line, and memory released by UTIL_Remove is
+//			handed straight to the next entity of the same class.
+//
+//=============================================================================//
+
+#ifndef ENTITYPOOL_H
+#define ENTITYPOOL_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+// Entities are aligned to this many bytes; the pool header occupies one slot in front of the object
+#define ENTITY_POOL_ALIGN		64
+
+class CEntityClassPool;
+
+// Returns the pool for a class name, creating it the first time the class is instantiated
+CEntityClassPool *EntityPool_FindOrCreate( const char *pClassName, size_t nSize );
+
+// Routes the next CBaseEntity::operator new into pPool if it asks for the size the pool was created with
+void EntityPool_SetNextAlloc( CEntityClassPool *pPool );
+
+// Backing for CBaseEntity::operator new/delete. Falls back to an aligned heap allocation
+// when pooling is disabled or the allocation was not set up by the factory dictionary.
+void *EntityPool_Alloc( size_t nSize );
+void EntityPool_Free( void *pMem );
+
+#endif // ENTITYPOOL_H
@@ -27,6 +27,7 @@
 #include "datacache/imdlcache.h"
 #include "ispatialpartition.h"
 #include "tier0/vprof.h"
+#include "tier0/framearena.h"
 #include "movevars_shared.h"
 #include "hierarchy.h"
 #include "trains.h"
@@ -2047,12 +2048,14 @@ void Physics_RunThinkFunctions( bool simulating )
 		UTIL_DisableRemoveImmediate();
 		int listMax = SimThink_ListCount();
 		listMax = MAX(listMax,1);
-		CBaseEntity **list = (CBaseEntity **)stackalloc( sizeof(CBaseEntity *) * listMax );
+		CFrameArenaScope arenaScope;
+		CBaseEntity **list = (CBaseEntity **)FrameArena_Alloc( sizeof(CBaseEntity *) * listMax );
 		// iterate through all entities and have them think or simulate
 		
 		// UNDONE: This has problems with UTIL_RemoveImmediate() (now disabled during this loop).  
 		// Do we really need UTIL_RemoveImmediate()?
 		int count = SimThink_ListCopy( list, listMax );
+		VPROF_INCREMENT_GROUP_COUNTER( "thinking entities", COUNTER_GROUP_NO_RESET, count );
 
 		//DevMsg(1, "Count: %d\n", count );
 		for ( int i = 0; i < count; i++ )
@@ -2064,7 +2067,6 @@ void Physics_RunThinkFunctions( bool simulating )
 			Physics_SimulateEntity( list[i] );
 		}
 
-		stackfree( list );
 		UTIL_EnableRemoveImmediate();
 	}
 
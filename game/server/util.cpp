@@ -36,6 +36,7 @@
 #include "datacache/imdlcache.h"
 #include "util.h"
 #include "cdll_int.h"
+#include "entitypool.h"
 
 #ifdef PORTAL
 #include "PortalSimulation.h"
@@ -167,6 +168,7 @@ IServerNetworkable *CEntityFactoryDictionary::Create( const char *pClassName )
 #if defined(TRACK_ENTITY_MEMORY) && defined(USE_MEM_DEBUG)
 	MEM_ALLOC_CREDIT_( m_Factories.GetElementName( m_Factories.Find( pClassName ) ) );
 #endif
+	EntityPool_SetNextAlloc( EntityPool_FindOrCreate( pClassName, pFactory->GetEntitySize() ) );
 	return pFactory->Create( pClassName );
 }
 
@@ -7,6 +7,9 @@
 
 #include "cbase.h"
 #include "ammodef.h"
+#ifdef GAME_DLL
+#include "querycache.h"
+#endif
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -680,31 +683,44 @@ bool CBaseCombatCharacter::IsLineOfSightClear( const Vector &pos, LineOfSightChe
 	}
 	count++;
 #endif
+#if defined(GAME_DLL) && defined(TERROR)
 	if( checkType == IGNORE_ACTORS )
 	{
-
 		// use the query cache unless it causes problems
-#if defined(GAME_DLL) && defined(TERROR)
 		return IsLineOfSightBetweenTwoEntitiesClear( const_cast<CBaseCombatCharacter *>(this), EOFFSET_MODE_EYEPOSITION,
 			entityToIgnore, EOFFSET_MODE_WORLDSPACE_CENTER,
 			entityToIgnore, COLLISION_GROUP_NONE,
 			MASK_L4D_VISION, TraceFilterNoCombatCharacters, 1.0 );
-#else
-		trace_t trace;
-		CTraceFilterNoCombatCharacters traceFilter( entityToIgnore, COLLISION_GROUP_NONE );
-		UTIL_TraceLine( EyePosition(), pos, MASK_OPAQUE | CONTENTS_IGNORE_NODRAW_OPAQUE | CONTENTS_MONSTER, &traceFilter, &trace );
+	}
+#endif
+
+	Vector vecEyePosition = EyePosition();
+	unsigned int nMask = ( checkType == IGNORE_ACTORS ) ? ( MASK_OPAQUE | CONTENTS_IGNORE_NODRAW_OPAQUE | CONTENTS_MONSTER ) : ( MASK_OPAQUE | CONTENTS_IGNORE_NODRAW_OPAQUE );
 
-		return trace.fraction == 1.0f;
+#ifdef GAME_DLL
+	// IsAbleToSee and the bots check the same pairs over and over within a tick
+	CLOSQuery query( ELOSQUERY_COMBATCHAR_LOS, this, entityToIgnore, vecEyePosition, pos, nMask, checkType );
+	if ( query.IsCached() )
+		return query.IsClear();
 #endif
+
+	trace_t trace;
+	if( checkType == IGNORE_ACTORS )
+	{
+		CTraceFilterNoCombatCharacters traceFilter( entityToIgnore, COLLISION_GROUP_NONE );
+		UTIL_TraceLine( vecEyePosition, pos, nMask, &traceFilter, &trace );
 	}
 	else
 	{
-		trace_t trace;
 		CTraceFilterSkipTwoEntities traceFilter( this, entityToIgnore, COLLISION_GROUP_NONE );
-		UTIL_TraceLine( EyePosition(), pos, MASK_OPAQUE | CONTENTS_IGNORE_NODRAW_OPAQUE, &traceFilter, &trace );
-
-		return trace.fraction == 1.0f;
+		UTIL_TraceLine( vecEyePosition, pos, nMask, &traceFilter, &trace );
 	}
+
+#ifdef GAME_DLL
+	query.Store( trace.fraction == 1.0f, trace.m_pEnt );
+#endif
+
+	return trace.fraction == 1.0f;
 }
 
 
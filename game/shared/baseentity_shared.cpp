@@ -1703,11 +1703,67 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 	
 	float flCumulativeDamage = 0.0f;
 
+#if !defined( PORTAL ) && !defined( TF_DLL )
+	// Player pellets reseed the random stream every shot, so their directions are
+	// known ahead of time and a run of them can be traced together. A run is only
+	// traced while no damage is waiting to be applied to an entity, and it ends at
+	// the first pellet that hits one: that entity may die, break or move before the
+	// next pellet flies, so everything after it is traced again against the world
+	// as it is then. This keeps the traces identical to tracing pellet by pellet.
+	const int nPelletBatchSize = 4;
+	Ray_t pelletRays[nPelletBatchSize];
+	trace_t pelletTraces[nPelletBatchSize];
+	bool bBatchPellets = IsPlayer() && ( info.m_iShots > 1 );
+	int iFirstBatchedShot = 0;
+	int nBatchedShots = 0;
+#endif
+
 	for (int iShot = 0; iShot < info.m_iShots; iShot++)
 	{
 		bool bHitWater = false;
 		bool bHitGlass = false;
 
+#if !defined( PORTAL ) && !defined( TF_DLL )
+		if ( bBatchPellets && ( iShot >= iFirstBatchedShot + nBatchedShots ) )
+		{
+			CBaseEntity *pDamageTarget = g_MultiDamage.GetTarget();
+			nBatchedShots = 0;
+			if ( !pDamageTarget || pDamageTarget->IsWorld() )
+			{
+				iFirstBatchedShot = iShot;
+				nBatchedShots = MIN( nPelletBatchSize, info.m_iShots - iShot );
+				for ( int i = 0; i < nBatchedShots; i++ )
+				{
+					int iBatchedShot = iShot + i;
+					RandomSeed( iSeed + i );
+
+					if ( iBatchedShot == 0 && (info.m_nFlags & FIRE_BULLETS_FIRST_SHOT_ACCURATE) )
+					{
+						vecDir = Manipulator.GetShotDirection();
+					}
+					else
+					{
+						vecDir = Manipulator.ApplySpread( info.m_vecSpread );
+					}
+
+					vecEnd = info.m_vecSrc + vecDir * info.m_flDistance;
+
+					// Same hull/line split as the per-shot traces below
+					if ( iBatchedShot % 2 )
+					{
+						pelletRays[i].Init( info.m_vecSrc, vecEnd, Vector( -3, -3, -3 ), Vector( 3, 3, 3 ) );
+					}
+					else
+					{
+						pelletRays[i].Init( info.m_vecSrc, vecEnd );
+					}
+				}
+
+				UTIL_TraceRayBatch( pelletRays, nBatchedShots, MASK_SHOT, &traceFilter, pelletTraces );
+			}
+		}
+#endif
+
 		// Prediction is only usable on players
 		if ( IsPlayer() )
 		{
@@ -1734,6 +1790,13 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 #endif
 
 
+#if !defined( PORTAL ) && !defined( TF_DLL )
+		if ( iShot < iFirstBatchedShot + nBatchedShots )
+		{
+			tr = pelletTraces[iShot - iFirstBatchedShot];
+		}
+		else
+#endif
 		if( IsPlayer() && info.m_iShots > 1 && iShot % 2 )
 		{
 			// Half of the shotgun pellets are hulls that make it easier to hit targets with the shotgun.
@@ -2019,6 +2082,15 @@ void CBaseEntity::FireBullets( const FireBulletsInfo_t &info )
 		}
 #endif
 
+#if !defined( PORTAL ) && !defined( TF_DLL )
+		// Whatever this pellet hit may have changed, and water impacts can spawn a
+		// water bullet entity, so the rest of the run is stale
+		if ( tr.DidHitNonWorldEntity() || bHitWater )
+		{
+			nBatchedShots = 0;
+		}
+#endif
+
 		iSeed++;
 	}
 
@@ -27,7 +27,8 @@
 #include "tier0/memdbgon.h"
 
 // memory pool for storing links between entities
-static CUtlMemoryPool g_EdictTouchLinks( sizeof(touchlink_t), MAX_EDICTS, CUtlMemoryPool::GROW_NONE, "g_EdictTouchLinks");
+// Trigger-heavy maps can have more live touch links than edicts, so let this one grow instead of dropping touches
+static CUtlMemoryPool g_EdictTouchLinks( sizeof(touchlink_t), MAX_EDICTS, CUtlMemoryPool::GROW_SLOW, "g_EdictTouchLinks");
 static CUtlMemoryPool g_EntityGroundLinks( sizeof( groundlink_t ), MAX_EDICTS, CUtlMemoryPool::GROW_NONE, "g_EntityGroundLinks");
 
 struct watcher_t
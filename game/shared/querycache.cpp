@@ -11,6 +11,8 @@
 #include "tier1/utlintrusivelist.h"
 #include "datacache/imdlcache.h"
 #include "vstdlib/jobthread.h"
+#include "tier1/utlhashtable.h"
+#include "tier1/generichash.h"
 
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -212,6 +214,162 @@ void ProcessQueryCacheUpdate( QueryCacheUpdateRecord_t &workItem )
 }
 
 
+//-----------------------------------------------------------------------------
+// Line of sight memoization
+//-----------------------------------------------------------------------------
+ConVar sv_querycache_los( "sv_querycache_los", "1", 0, "Reuse line of sight traces that are repeated with identical endpoints" );
+ConVar sv_querycache_ttl_fvisible( "sv_querycache_ttl_fvisible", "0", 0, "Seconds an FVisible result against an entity may be reused for (0 = this tick only)", true, 0, true, 1 );
+ConVar sv_querycache_ttl_fvisible_pos( "sv_querycache_ttl_fvisible_pos", "0", 0, "Seconds an FVisible result against a position may be reused for (0 = this tick only)", true, 0, true, 1 );
+ConVar sv_querycache_ttl_combatchar( "sv_querycache_ttl_combatchar", "0", 0, "Seconds a combat character line of sight result may be reused for (0 = this tick only)", true, 0, true, 1 );
+ConVar sv_querycache_ttl_nextbot( "sv_querycache_ttl_nextbot", "0", 0, "Seconds a NextBot vision line of sight result may be reused for (0 = this tick only)", true, 0, true, 1 );
+
+struct LOSQueryTypeInfo_t
+{
+	const char *m_pszName;
+	ConVar *m_pTTL;
+	int m_nHits;
+	int m_nMisses;
+};
+
+static LOSQueryTypeInfo_t s_LOSQueryTypes[NUM_LOSQUERY_TYPES] =
+{
+	{ "FVisible (entity)",		&sv_querycache_ttl_fvisible,		0, 0 },
+	{ "FVisible (position)",	&sv_querycache_ttl_fvisible_pos,	0, 0 },
+	{ "combat character LOS",	&sv_querycache_ttl_combatchar,		0, 0 },
+	{ "NextBot vision",			&sv_querycache_ttl_nextbot,			0, 0 },
+};
+
+struct LOSQueryValue_t
+{
+	int m_nTick;
+	bool m_bClear;
+	EHANDLE m_hBlocker;
+};
+
+struct LOSQueryKeyHash
+{
+	unsigned int operator()( const LOSQueryKey_t &key ) const { return HashBlock( &key, sizeof( key ) ); }
+};
+
+struct LOSQueryKeyEqual
+{
+	bool operator()( const LOSQueryKey_t &a, const LOSQueryKey_t &b ) const { return !memcmp( &a, &b, sizeof( a ) ); }
+};
+
+static CUtlHashtable<LOSQueryKey_t, LOSQueryValue_t, LOSQueryKeyHash, LOSQueryKeyEqual> s_LOSQueries;
+
+// Bumped when an entity teleports; part of the key so its old results can't match
+static unsigned int s_nTeleportCount[NUM_ENT_ENTRIES];
+static int s_nLOSTeleports = 0;
+
+static void GetLOSQueryEndpoint( const CBaseEntity *pEntity, unsigned int *pHandle, unsigned int *pTeleports )
+{
+	if ( !pEntity )
+	{
+		*pHandle = INVALID_EHANDLE_INDEX;
+		*pTeleports = 0;
+		return;
+	}
+
+	const CBaseHandle &hEntity = pEntity->GetRefEHandle();
+	*pHandle = hEntity.ToInt();
+	*pTeleports = s_nTeleportCount[hEntity.GetEntryIndex()];
+}
+
+static int LOSQueryTTLTicks( int nType )
+{
+	return TIME_TO_TICKS( s_LOSQueryTypes[nType].m_pTTL->GetFloat() );
+}
+
+CLOSQuery::CLOSQuery( ELOSQueryType_t nType, const CBaseEntity *pSrc, const CBaseEntity *pDest,
+					  const Vector &vecStart, const Vector &vecEnd, unsigned int nTraceMask, int nVariant )
+{
+	m_bCached = false;
+	m_bClear = false;
+
+	// NextBots and the AI can be updated from jobs; only the main thread shares the table
+	m_bEnabled = sv_querycache_los.GetBool() && !sv_disable_querycache.GetBool() && ThreadInMainThread();
+	if ( !m_bEnabled )
+		return;
+
+	m_Key.m_nType = nType;
+	m_Key.m_nVariant = nVariant;
+	m_Key.m_nTraceMask = nTraceMask;
+	GetLOSQueryEndpoint( pSrc, &m_Key.m_hSrc, &m_Key.m_nSrcTeleports );
+	GetLOSQueryEndpoint( pDest, &m_Key.m_hDest, &m_Key.m_nDestTeleports );
+	m_Key.m_vecStart = vecStart;
+	m_Key.m_vecEnd = vecEnd;
+
+	UtlHashHandle_t h = s_LOSQueries.Find( m_Key );
+	if ( h != s_LOSQueries.InvalidHandle() )
+	{
+		const LOSQueryValue_t &value = s_LOSQueries.Element( h );
+		if ( gpGlobals->tickcount - value.m_nTick <= LOSQueryTTLTicks( nType ) )
+		{
+			m_bCached = true;
+			m_bClear = value.m_bClear;
+			m_hBlocker = value.m_hBlocker;
+			s_LOSQueryTypes[nType].m_nHits++;
+			return;
+		}
+	}
+
+	s_LOSQueryTypes[nType].m_nMisses++;
+}
+
+void CLOSQuery::Store( bool bClear, CBaseEntity *pBlocker )
+{
+	m_bClear = bClear;
+	m_hBlocker = pBlocker;
+
+	if ( !m_bEnabled )
+		return;
+
+	LOSQueryValue_t value;
+	value.m_nTick = gpGlobals->tickcount;
+	value.m_bClear = bClear;
+	value.m_hBlocker = pBlocker;
+
+	UtlHashHandle_t h = s_LOSQueries.Find( m_Key );
+	if ( h != s_LOSQueries.InvalidHandle() )
+	{
+		s_LOSQueries.Element( h ) = value;
+	}
+	else
+	{
+		s_LOSQueries.Insert( m_Key, value );
+	}
+}
+
+void LOSQueryCacheEntityTeleported( const CBaseEntity *pEntity )
+{
+	s_nTeleportCount[pEntity->GetRefEHandle().GetEntryIndex()]++;
+	s_nLOSTeleports++;
+}
+
+// Drops results no query type will accept any more
+static void ExpireLOSQueries( void )
+{
+	int nMaxTTL = 0;
+	for ( int i = 0; i < NUM_LOSQUERY_TYPES; i++ )
+	{
+		nMaxTTL = MAX( nMaxTTL, LOSQueryTTLTicks( i ) );
+	}
+
+	for ( UtlHashHandle_t h = s_LOSQueries.FirstHandle(); h != s_LOSQueries.InvalidHandle(); )
+	{
+		if ( gpGlobals->tickcount - s_LOSQueries.Element( h ).m_nTick > nMaxTTL )
+		{
+			h = s_LOSQueries.RemoveAndAdvance( h );
+		}
+		else
+		{
+			h = s_LOSQueries.NextHandle( h );
+		}
+	}
+}
+
+
 #define N_WAYS_TO_SPLIT_CACHE_UPDATE 8
 
 static void PreUpdateQueryCache()
@@ -248,6 +406,8 @@ void UpdateQueryCache( void )
 	{
 		PrependDListWithTailToDList( workList[i].m_KilledList, s_VictimList );
 	}
+
+	ExpireLOSQueries();
 }
 
 void InvalidateQueryCache( void )
@@ -261,6 +421,13 @@ void InvalidateQueryCache( void )
 		s_QCache[i].m_QueryParams.m_Type = EQUERY_INVALID;
 		s_VictimList.AddToHead( s_QCache + i );
 	}
+
+	s_LOSQueries.RemoveAll();
+	for ( int i = 0; i < NUM_LOSQUERY_TYPES; i++ )
+	{
+		s_LOSQueryTypes[i].m_nHits = 0;
+		s_LOSQueryTypes[i].m_nMisses = 0;
+	}
 }
 
 
@@ -337,6 +504,15 @@ CON_COMMAND( sv_querycache_stats, "Display status of the query cache (client onl
 	Warning( "%d queries, %d misses (%d free) suc spec = %d wasted spec=%d\n",
 			 s_nNumCacheQueries, s_nNumCacheMisses, s_VictimList.Count(),
 			 s_SuccessfulSpeculatives, s_WastedSpeculativeUpdates );
+
+	Warning( "line of sight: %d results held, %d teleports\n", s_LOSQueries.Count(), s_nLOSTeleports );
+	for ( int i = 0; i < NUM_LOSQUERY_TYPES; i++ )
+	{
+		const LOSQueryTypeInfo_t &info = s_LOSQueryTypes[i];
+		int nTotal = info.m_nHits + info.m_nMisses;
+		Warning( "  %-22s %8d queries, %8d hits (%.1f%%), ttl %.3fs\n", info.m_pszName, nTotal, info.m_nHits,
+				 nTotal ? 100.0f * info.m_nHits / nTotal : 0.0f, info.m_pTTL->GetFloat() );
+	}
 }
 
 
@@ -90,6 +90,62 @@ bool IsLineOfSightBetweenTwoEntitiesClear( CBaseEntity *pSrcEntity,
 
 
 
+//-----------------------------------------------------------------------------
+// Line of sight memoization. Unlike the hysteresis queries above these are
+// exact: a result is keyed on the caller, both entities, both trace endpoints
+// and the mask, so it is only reused when the same trace is asked for again.
+// Each query type keeps its results for its sv_querycache_ttl_* convar (0 =
+// the current tick only), and an entity teleporting drops every result it is
+// an endpoint of.
+//-----------------------------------------------------------------------------
+enum ELOSQueryType_t
+{
+	ELOSQUERY_FVISIBLE_ENTITY,								// CBaseEntity::FVisible( CBaseEntity * ), CAI_Senses
+	ELOSQUERY_FVISIBLE_POSITION,							// CBaseEntity::FVisible( const Vector & )
+	ELOSQUERY_COMBATCHAR_LOS,								// CBaseCombatCharacter::IsLineOfSightClear, IsAbleToSee
+	ELOSQUERY_NEXTBOT_VISION,								// IVision::IsLineOfSightClear[ToEntity]
+
+	NUM_LOSQUERY_TYPES
+};
+
+struct LOSQueryKey_t
+{
+	int m_nType;
+	int m_nVariant;											// tells apart filters used by the same query type
+	unsigned int m_nTraceMask;
+	unsigned int m_hSrc;
+	unsigned int m_hDest;
+	unsigned int m_nSrcTeleports;
+	unsigned int m_nDestTeleports;
+	Vector m_vecStart;
+	Vector m_vecEnd;
+};
+
+class CLOSQuery
+{
+public:
+	CLOSQuery( ELOSQueryType_t nType, const CBaseEntity *pSrc, const CBaseEntity *pDest,
+			   const Vector &vecStart, const Vector &vecEnd, unsigned int nTraceMask, int nVariant = 0 );
+
+	bool IsCached() const			{ return m_bCached; }
+	bool IsClear() const			{ return m_bClear; }
+	CBaseEntity *GetBlocker() const	{ return m_hBlocker; }
+
+	// Remember the result of the trace the caller ran after a miss
+	void Store( bool bClear, CBaseEntity *pBlocker = NULL );
+
+private:
+	LOSQueryKey_t m_Key;
+	bool m_bEnabled;
+	bool m_bCached;
+	bool m_bClear;
+	EHANDLE m_hBlocker;
+};
+
+// call when an entity is moved without travelling, so results it took part in are not reused
+void LOSQueryCacheEntityTeleported( const CBaseEntity *pEntity );
+
+
 // call during main loop for threaded update of the query cache
 void UpdateQueryCache( void );
 
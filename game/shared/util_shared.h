@@ -317,6 +317,19 @@ inline void UTIL_TraceRay( const Ray_t &ray, unsigned int mask,
 	}
 }
 
+inline void UTIL_TraceRayBatch( const Ray_t *pRays, int nRayCount, unsigned int mask, ITraceFilter *pFilter, trace_t *pTraces )
+{
+	enginetrace->TraceRayBatch( pRays, nRayCount, mask, pFilter, pTraces );
+
+	if( r_visualizetraces.GetBool() )
+	{
+		for ( int i = 0; i < nRayCount; ++i )
+		{
+			DebugDrawLine( pTraces[i].startpos, pTraces[i].endpos, 255, 0, 0, true, -1.0f );
+		}
+	}
+}
+
 
 // Sweeps a particular entity through the world
 void UTIL_TraceEntity( CBaseEntity *pEntity, const Vector &vecAbsStart, const Vector &vecAbsEnd, unsigned int mask, trace_t *ptr );
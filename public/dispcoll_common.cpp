@@ -148,6 +148,19 @@ void CDispCollTri::FindMinMax( CDispVector<Vector> &m_aVerts )
 }
 
 
+// Matches ComputeBoxOffset in collisionutils.cpp: how far outside [0,1] a box sweep may still hit a triangle
+static float DispCollBoxOffset( const Ray_t &ray )
+{
+	if ( ray.m_IsRay )
+		return 1e-3f;
+
+	float offset = FloatMakePositive( ray.m_Extents[0] * ray.m_Delta[0] ) +
+				   FloatMakePositive( ray.m_Extents[1] * ray.m_Delta[1] ) +
+				   FloatMakePositive( ray.m_Extents[2] * ray.m_Delta[2] );
+	offset *= InvRSquared( ray.m_Delta );
+	return offset + 1e-3f;
+}
+
 // SIMD Routines for intersecting with the quad tree
 FORCEINLINE int IntersectRayWithFourBoxes( const FourVectors &rayStart, const FourVectors &invDelta, const FourVectors &rayExtents, const FourVectors &boxMins, const FourVectors &boxMaxs )
 {
@@ -288,6 +301,93 @@ int FORCEINLINE CDispCollTree::BuildRayLeafList( int iNode, rayleaflist_t &list
 	return listIndex;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Which lanes of a hit leaf's packet to test. Siblings are listed
+//          next to each other, so when both were hit they share one test.
+//-----------------------------------------------------------------------------
+FORCEINLINE int CDispCollTree::TriPackets_LeafLanes( const rayleaflist_t &list, int &listIndex, int *pPacket )
+{
+	int leafIndex = list.nodeList[listIndex] - m_nodes.Count();
+	*pPacket = leafIndex >> 1;
+	if ( leafIndex & 1 )
+		return 0xC;
+
+	if ( listIndex < list.maxIndex && list.nodeList[listIndex + 1] == list.nodeList[listIndex] + 1 )
+	{
+		++listIndex;
+		return 0xF;
+	}
+
+	return 0x3;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The same barycentric ray/triangle test as IntersectRayWithTriangle,
+//          four triangles at a time. Only rejects lanes that are out by more
+//          than the tolerance; the lanes left are rerun with the scalar test.
+//-----------------------------------------------------------------------------
+int CDispCollTree::TriPackets_RayMask( const CDispCollTriPacket &packet, const FourVectors &rayStart, const FourVectors &rayDelta,
+									   const fltx4 &fl4MinT, const fltx4 &fl4MaxT, bool bSide )
+{
+	const fltx4 fl4Tolerance = ReplicateX4( DISPCOLL_SIMD_FRAC_TOLERANCE );
+	const fltx4 fl4MinUV = NegSIMD( fl4Tolerance );
+	const fltx4 fl4MaxUV = AddSIMD( Four_Ones, fl4Tolerance );
+
+	FourVectors dirCrossEdge2 = rayDelta ^ packet.m_vecEdge2;
+	fltx4 fl4Denom = dirCrossEdge2 * packet.m_vecEdge1;
+
+	// Nearly parallel lanes are left for the scalar test to reject with its own threshold
+	fltx4 parallel = CmpLtSIMD( fabs( fl4Denom ), ReplicateX4( 2e-6f ) );
+	fltx4 fl4InvDenom = ReciprocalSIMD( fl4Denom );
+
+	FourVectors org = rayStart;
+	org -= packet.m_vecOrigin;
+	fltx4 u = MulSIMD( dirCrossEdge2 * org, fl4InvDenom );
+
+	FourVectors orgCrossEdge1 = org ^ packet.m_vecEdge1;
+	fltx4 v = MulSIMD( orgCrossEdge1 * rayDelta, fl4InvDenom );
+	fltx4 t = MulSIMD( orgCrossEdge1 * packet.m_vecEdge2, fl4InvDenom );
+
+	fltx4 hit = AndSIMD( CmpGeSIMD( u, fl4MinUV ), CmpLeSIMD( u, fl4MaxUV ) );
+	hit = AndSIMD( hit, CmpGeSIMD( v, fl4MinUV ) );
+	hit = AndSIMD( hit, CmpLeSIMD( AddSIMD( u, v ), fl4MaxUV ) );
+	hit = AndSIMD( hit, CmpGeSIMD( t, fl4MinT ) );
+	hit = AndSIMD( hit, CmpLeSIMD( t, fl4MaxT ) );
+	hit = OrSIMD( hit, parallel );
+
+	if ( bSide )
+	{
+		// Cull back faces, computed exactly as the scalar test does
+		FourVectors normal = packet.m_vecEdge1 ^ packet.m_vecEdge2;
+		hit = AndSIMD( hit, CmpLtSIMD( normal * rayDelta, Four_Zeros ) );
+	}
+
+	return TestSignSIMD( hit );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The first tests of SweepAABBTriIntersect - moving away from the
+//          triangle, or staying in front of its plane - four at a time.
+//-----------------------------------------------------------------------------
+int CDispCollTree::TriPackets_SweepMask( const CDispCollTriPacket &packet, const FourVectors &rayStart, const FourVectors &rayDelta, const FourVectors &rayExtents )
+{
+	const fltx4 fl4Tolerance = ReplicateX4( DISPCOLL_SIMD_DIST_TOLERANCE );
+
+	fltx4 fl4DistAlongNormal = packet.m_vecNormal * rayDelta;
+	fltx4 approaching = CmpLeSIMD( fl4DistAlongNormal, ReplicateX4( DISPCOLL_DIST_EPSILON + DISPCOLL_SIMD_DIST_TOLERANCE ) );
+
+	// Push each plane out to the box corner closest to it
+	fltx4 fl4Expand = MulSIMD( fabs( packet.m_vecNormal.x ), rayExtents.x );
+	fl4Expand = MaddSIMD( fabs( packet.m_vecNormal.y ), rayExtents.y, fl4Expand );
+	fl4Expand = MaddSIMD( fabs( packet.m_vecNormal.z ), rayExtents.z, fl4Expand );
+
+	fltx4 fl4Start = SubSIMD( SubSIMD( packet.m_vecNormal * rayStart, packet.m_flDist ), fl4Expand );
+	fltx4 fl4End = AddSIMD( fl4Start, fl4DistAlongNormal );
+	fltx4 inFront = AndSIMD( CmpGtSIMD( fl4Start, fl4Tolerance ), CmpGtSIMD( fl4End, fl4Tolerance ) );
+
+	return TestSignSIMD( AndNotSIMD( inFront, approaching ) );
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: Create the AABB tree.
@@ -429,6 +529,43 @@ void CDispCollTree::AABBTree_CreateLeafs( void )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Pack the triangles of each pair of sibling leaves into a SIMD packet.
+//-----------------------------------------------------------------------------
+void CDispCollTree::AABBTree_CreateTriPackets( void )
+{
+	if ( m_triPackets.Count() || m_leaves.Count() < 2 )
+		return;
+
+	int nPackets = m_leaves.Count() >> 1;
+	m_triPackets.SetCount( nPackets );
+	for ( int iPacket = 0; iPacket < nPackets; ++iPacket )
+	{
+		CDispCollTriPacket &packet = m_triPackets[iPacket];
+		for ( int iLane = 0; iLane < 4; ++iLane )
+		{
+			const CDispCollTri &tri = m_aTris[TriPackets_LaneTri( iPacket, iLane )];
+
+			// Same vertex order the scalar tests use
+			const Vector &vecOrigin = m_aVerts[tri.GetVert( 0 )];
+			Vector vecEdge1, vecEdge2;
+			VectorSubtract( m_aVerts[tri.GetVert( 2 )], vecOrigin, vecEdge1 );
+			VectorSubtract( m_aVerts[tri.GetVert( 1 )], vecOrigin, vecEdge2 );
+
+			for ( int iAxis = 0; iAxis < 3; ++iAxis )
+			{
+				SubFloat( packet.m_vecOrigin[iAxis], iLane ) = vecOrigin[iAxis];
+				SubFloat( packet.m_vecEdge1[iAxis], iLane ) = vecEdge1[iAxis];
+				SubFloat( packet.m_vecEdge2[iAxis], iLane ) = vecEdge2[iAxis];
+				SubFloat( packet.m_vecNormal[iAxis], iLane ) = tri.m_vecNormal[iAxis];
+			}
+			SubFloat( packet.m_flDist, iLane ) = tri.m_flDist;
+		}
+	}
+
+	m_nSize += sizeof( m_triPackets[0] ) * m_triPackets.Count();
+}
+
 #if COMPILER_CLANG
 #define NOASAN __attribute__((no_sanitize("address")))
 #else
@@ -613,6 +750,45 @@ void CDispCollTree::AABBTree_TreeTrisRayBarycentricTest( const Ray_t &ray, const
 	int listIndex = BuildRayLeafList( iNode, list );
 
 	float flU, flV, flT;
+	if ( HasTriPackets() )
+	{
+		FourVectors rayDelta;
+		rayDelta.DuplicateVector( ray.m_Delta );
+		fltx4 fl4MinT = ReplicateX4( -DISPCOLL_SIMD_FRAC_TOLERANCE );
+		float flMaxT = 1.0f + DispCollBoxOffset( ray );
+
+		for ( ; listIndex <= list.maxIndex; listIndex++ )
+		{
+			int iPacket;
+			int nLanes = TriPackets_LeafLanes( list, listIndex, &iPacket );
+			fltx4 fl4MaxT = ReplicateX4( MIN( output.dist, flMaxT ) + DISPCOLL_SIMD_FRAC_TOLERANCE );
+			nLanes &= TriPackets_RayMask( m_triPackets[iPacket], list.rayStart, rayDelta, fl4MinT, fl4MaxT, false );
+
+			for ( int iLane = 0; nLanes; ++iLane, nLanes >>= 1 )
+			{
+				if ( !( nLanes & 1 ) )
+					continue;
+
+				CDispCollTri *pTri = &m_aTris[TriPackets_LaneTri( iPacket, iLane )];
+				if ( ComputeIntersectionBarycentricCoordinates( ray, m_aVerts[pTri->GetVert( 0 )], m_aVerts[pTri->GetVert( 2 )], m_aVerts[pTri->GetVert( 1 )], flU, flV, &flT ) )
+				{
+					// Make sure it's inside the range
+					if ( ( flU >= 0.0f ) && ( flV >= 0.0f ) && ( ( flU + flV ) <= 1.0f ) )
+					{
+						if( ( flT > 0.0f ) && ( flT < output.dist ) )
+						{
+							(*pImpactTri) = pTri;
+							output.u = flU;
+							output.v = flV;
+							output.dist = flT;
+						}
+					}
+				}
+			}
+		}
+		return;
+	}
+
 	for ( ; listIndex <= list.maxIndex; listIndex++ )
 	{
 		int leafIndex = list.nodeList[listIndex] - m_nodes.Count();
@@ -698,6 +874,36 @@ void CDispCollTree::AABBTree_TreeTrisRayTest( const Ray_t &ray, const Vector &ve
 	list.rayExtents.DuplicateVector(ext);
 	int listIndex = BuildRayLeafList( iNode, list );
 
+	if ( HasTriPackets() )
+	{
+		FourVectors rayDelta;
+		rayDelta.DuplicateVector( ray.m_Delta );
+		fltx4 fl4MinT = ReplicateX4( -DispCollBoxOffset( ray ) - DISPCOLL_SIMD_FRAC_TOLERANCE );
+
+		for ( ; listIndex <= list.maxIndex; listIndex++ )
+		{
+			int iPacket;
+			int nLanes = TriPackets_LeafLanes( list, listIndex, &iPacket );
+			fltx4 fl4MaxT = ReplicateX4( pTrace->fraction + DISPCOLL_SIMD_FRAC_TOLERANCE );
+			nLanes &= TriPackets_RayMask( m_triPackets[iPacket], list.rayStart, rayDelta, fl4MinT, fl4MaxT, bSide );
+
+			for ( int iLane = 0; nLanes; ++iLane, nLanes >>= 1 )
+			{
+				if ( !( nLanes & 1 ) )
+					continue;
+
+				CDispCollTri *pTri = &m_aTris[TriPackets_LaneTri( iPacket, iLane )];
+				float flFrac = IntersectRayWithTriangle( ray, m_aVerts[pTri->GetVert( 0 )], m_aVerts[pTri->GetVert( 2 )], m_aVerts[pTri->GetVert( 1 )], bSide );
+				if( ( flFrac >= 0.0f ) && ( flFrac < pTrace->fraction ) )
+				{
+					pTrace->fraction = flFrac;
+					(*pImpactTri) = pTri;
+				}
+			}
+		}
+		return;
+	}
+
 	for ( ;listIndex <= list.maxIndex; listIndex++ )
 	{
 		int leafIndex = list.nodeList[listIndex] - m_nodes.Count();
@@ -922,16 +1128,42 @@ bool CDispCollTree::AABBTree_SweepAABB( const Ray_t &ray, const Vector &vecInvDe
 	if ( listIndex <= list.maxIndex )
 	{
 		LockCache();
-		for ( ; listIndex <= list.maxIndex; listIndex++ )
+		if ( HasTriPackets() )
 		{
-			int leafIndex = list.nodeList[listIndex] - m_nodes.Count();
-			int iTri0 = m_leaves[leafIndex].m_tris[0];
-			int iTri1 = m_leaves[leafIndex].m_tris[1];
-			CDispCollTri *pTri0 = &m_aTris[iTri0];
-			CDispCollTri *pTri1 = &m_aTris[iTri1];
-
-			SweepAABBTriIntersect( ray, rayDir, iTri0, pTri0, pTrace );
-			SweepAABBTriIntersect( ray, rayDir, iTri1, pTri1, pTrace );
+			FourVectors rayDelta;
+			rayDelta.DuplicateVector( ray.m_Delta );
+			FourVectors rayExtents;
+			rayExtents.DuplicateVector( ray.m_Extents );
+
+			for ( ; listIndex <= list.maxIndex; listIndex++ )
+			{
+				int iPacket;
+				int nLanes = TriPackets_LeafLanes( list, listIndex, &iPacket );
+				nLanes &= TriPackets_SweepMask( m_triPackets[iPacket], list.rayStart, rayDelta, rayExtents );
+
+				for ( int iLane = 0; nLanes; ++iLane, nLanes >>= 1 )
+				{
+					if ( nLanes & 1 )
+					{
+						int iTri = TriPackets_LaneTri( iPacket, iLane );
+						SweepAABBTriIntersect( ray, rayDir, iTri, &m_aTris[iTri], pTrace );
+					}
+				}
+			}
+		}
+		else
+		{
+			for ( ; listIndex <= list.maxIndex; listIndex++ )
+			{
+				int leafIndex = list.nodeList[listIndex] - m_nodes.Count();
+				int iTri0 = m_leaves[leafIndex].m_tris[0];
+				int iTri1 = m_leaves[leafIndex].m_tris[1];
+				CDispCollTri *pTri0 = &m_aTris[iTri0];
+				CDispCollTri *pTri1 = &m_aTris[iTri1];
+
+				SweepAABBTriIntersect( ray, rayDir, iTri0, pTri0, pTrace );
+				SweepAABBTriIntersect( ray, rayDir, iTri1, pTri1, pTrace );
+			}
 		}
 		UnlockCache();
 	}
@@ -37,6 +37,11 @@ FORWARD_DECLARE_HANDLE( memhandle_t );
 #define DISPCOLL_INVALID_FRAC		-99999.9f
 #define DISPCOLL_NORMAL_UNDEF		0xffff
 
+// How far the SIMD triangle packet tests lean towards passing a triangle on to
+// the scalar test, so rounding differences between the two can't drop a hit
+#define DISPCOLL_SIMD_FRAC_TOLERANCE	1e-3f
+#define DISPCOLL_SIMD_DIST_TOLERANCE	0.1f
+
 extern double g_flDispCollSweepTimer;
 extern double g_flDispCollIntersectTimer;
 extern double g_flDispCollInCallTimer;
@@ -135,6 +140,18 @@ public:
 	short	m_tris[2];
 };
 
+// The four triangles of two sibling leaves, laid out so a ray or hull can be
+// tested against all of them at once. Lanes 0,1 are the even leaf's triangles.
+class CDispCollTriPacket
+{
+public:
+	FourVectors m_vecOrigin;		// vert 0
+	FourVectors m_vecEdge1;			// vert 2 - vert 0
+	FourVectors m_vecEdge2;			// vert 1 - vert 0
+	FourVectors m_vecNormal;
+	fltx4		m_flDist;
+};
+
 // a power 4 displacement can have 341 nodes, pad out to 344 for 16-byte alignment
 const int MAX_DISP_AABB_NODES = 341;
 const int MAX_AABB_LIST = 344;
@@ -175,6 +192,10 @@ public:
 	// Hull Intersection.
 	bool AABBTree_IntersectAABB( const Vector &absMins, const Vector &absMaxs );
 
+	// SIMD triangle packets. Once created, ray and hull traces reject triangles four at a time.
+	void AABBTree_CreateTriPackets( void );
+	inline bool HasTriPackets( void )								{ return m_triPackets.Count() > 0; }
+
 	// Point/Box vs. Bounds.
 	bool PointInBounds( Vector const &vecBoxCenter, Vector const &vecBoxMin, Vector const &vecBoxMax, bool bPoint );
 
@@ -264,6 +285,11 @@ protected:
 	void AABBTree_TreeTrisRayTest( const Ray_t &ray, const Vector &vecInvDelta, int iNode, CBaseTrace *pTrace, bool bSide, CDispCollTri **pImpactTri );
 	void AABBTree_TreeTrisRayBarycentricTest( const Ray_t &ray, const Vector &vecInvDelta, int iNode, RayDispOutput_t &output, CDispCollTri **pImpactTri );
 
+	FORCEINLINE int TriPackets_LeafLanes( const rayleaflist_t &list, int &listIndex, int *pPacket );
+	FORCEINLINE int TriPackets_LaneTri( int iPacket, int iLane )	{ return m_leaves[( iPacket << 1 ) + ( iLane >> 1 )].m_tris[iLane & 1]; }
+	int TriPackets_RayMask( const CDispCollTriPacket &packet, const FourVectors &rayStart, const FourVectors &rayDelta, const fltx4 &fl4MinT, const fltx4 &fl4MaxT, bool bSide );
+	int TriPackets_SweepMask( const CDispCollTriPacket &packet, const FourVectors &rayStart, const FourVectors &rayDelta, const FourVectors &rayExtents );
+
 	int FORCEINLINE BuildRayLeafList( int iNode, rayleaflist_t &list );
 
 	struct AABBTree_TreeTrisSweepTest_Args_t
@@ -325,6 +351,7 @@ protected:
 	CDispVector<CDispCollTri>		m_aTris;								// Displacement triangles.
 	CDispVector<CDispCollNode>		m_nodes;					// Nodes.
 	CDispVector<CDispCollLeaf>		m_leaves;								// Leaves.
+	CDispVector<CDispCollTriPacket>	m_triPackets;							// Leaf triangles packed for SIMD tests (optional).
 	// Cache
 	CUtlVector<CDispCollTriCache>	m_aTrisCache;
 	CUtlVector<Vector> m_aEdgePlanes;
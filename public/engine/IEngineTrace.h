@@ -185,6 +185,27 @@ public:
 
 	// Walks bsp to find the leaf containing the specified point
 	virtual int GetLeafContainingPoint( const Vector &ptTest ) = 0;
+
+	// Traces nRayCount rays that share a mask and filter, writing one trace per ray.
+	// Every ray sees the world as it is at the time of the call, so results match
+	// calling TraceRay on each ray back to back with nothing moving, dying or being
+	// removed in between; callers that act on a result before tracing the next ray
+	// must not batch past that point. The filter is consulted at most once per entity
+	// for the whole batch. Works best on rays that start close together and point
+	// roughly the same way (shotgun pellets, vision cones).
+	virtual void	TraceRayBatch( const Ray_t *pRays, int nRayCount, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTraces ) = 0;
+
+	// Between these calls TraceRay, TraceRayBatch, EnumerateEntities and GetPointContents
+	// may be called from any thread created through tier0 (g_pThreadPool jobs, CThread).
+	// In exchange nothing may be inserted into, moved in or removed from the spatial
+	// partition until the phase ends; the engine asserts if that happens. Dirty entities
+	// are brought up to date when the phase begins.
+	//
+	// The engine side of the trace is thread safe during the phase. Trace filters,
+	// enumerators and hitbox traces call back into game code, which must be safe to run
+	// on the calling thread. Both calls must be made from the main thread and may nest.
+	virtual void	BeginConcurrentTracePhase() = 0;
+	virtual void	EndConcurrentTracePhase() = 0;
 };
 
 
@@ -39,6 +39,7 @@ class CMemoryFileBacking;
 
 typedef void * FileHandle_t;
 typedef void * FileCacheHandle_t;
+typedef void * FileViewHandle_t;
 typedef int FileFindHandle_t;
 typedef void (*FileSystemLoggingFunc_t)( const char *fileName, const char *accessType );
 typedef int WaitForResourcesHandle_t;
@@ -337,6 +338,7 @@ enum FSAsyncFlags_t
 	FSASYNC_FLAGS_FREEDATAPTR		= ( 1 << 1 ),	// free the memory for the dataPtr post callback
 	FSASYNC_FLAGS_SYNC				= ( 1 << 2 ),	// Actually perform the operation synchronously. Used to simplify client code paths
 	FSASYNC_FLAGS_NULLTERMINATE		= ( 1 << 3 ),	// allocate an extra byte and null terminate the buffer read in
+	FSASYNC_FLAGS_FIXEDBUFFER		= ( 1 << 4 ),	// with ALLOCNOFREE, the allocation may come from the async reader's registered buffers. Free with FreeOptimalReadBuffer()
 };
 
 //---------------------------------------------------------
@@ -928,6 +930,19 @@ public:
 	{
 		return GetCaseCorrectFullPath_Ptr( pFullPath, pDest, (int)maxLenInChars );
 	}
+
+	//--------------------------------------------------------
+	// Memory mapped views
+	//--------------------------------------------------------
+
+	// Maps nSize bytes of an open file starting at nOffset, so they can be used
+	// in place instead of being read into a buffer. The view is copy on write:
+	// pages the caller changes become private to it. Returns NULL if the range
+	// can't be mapped (compressed or preloaded data, memory files, platforms
+	// without mmap), read it instead. The view outlives the file handle and must
+	// be released with ReleaseFileView.
+	virtual void			*MapFileView( FileHandle_t file, int64 nOffset, int64 nSize, FileViewHandle_t *phView ) = 0;
+	virtual void			ReleaseFileView( FileViewHandle_t hView ) = 0;
 };
 
 //-----------------------------------------------------------------------------
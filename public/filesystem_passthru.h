@@ -248,6 +248,10 @@ public:
 		{ return m_pFileSystemPassThru->CheckVPKFileHash( PackFileID, nPackFileNumber, nFileFraction, md5Value ); }
 	virtual void			NotifyFileUnloaded( const char *pszFilename, const char *pPathId ) OVERRIDE
 		{ m_pFileSystemPassThru->NotifyFileUnloaded( pszFilename, pPathId ); }
+	virtual void			*MapFileView( FileHandle_t file, int64 nOffset, int64 nSize, FileViewHandle_t *phView ) OVERRIDE
+		{ return m_pFileSystemPassThru->MapFileView( file, nOffset, nSize, phView ); }
+	virtual void			ReleaseFileView( FileViewHandle_t hView ) OVERRIDE
+		{ m_pFileSystemPassThru->ReleaseFileView( hView ); }
 
 protected:
 	IFileSystem *m_pFileSystemPassThru;
@@ -0,0 +1,68 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-thread linear arenas for temporaries that die with the frame.
+//
+//			Allocating bumps a pointer in the calling thread's arena. Nothing
+//			is freed on its own: the thread hands everything back at once at
+//			its frame boundary with FrameArena_Reset(), or back to where a
+//			CFrameArenaScope started. Arenas keep their memory from frame to
+//			frame, so once a thread has seen its busiest frame it stops
+//			touching the heap.
+//
+//			With -framearenadebug each frame gets fresh pages, and released
+//			ones are poisoned and kept inaccessible for a few frames, so a
+//			pointer that escapes its frame faults the first time it is used.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef FRAMEARENA_H
+#define FRAMEARENA_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+
+struct FrameArenaStats_t
+{
+	int		nArenas;			// Threads that have used an arena
+	uint64	nCommittedBytes;	// Memory the arenas hold on to
+	uint64	nHighWaterBytes;	// Most any arena had handed out in one frame
+	uint64	nOverflowBytes;		// Heap allocations made because an arena was full
+};
+
+PLATFORM_INTERFACE void *FrameArena_Alloc( size_t nSize, size_t nAlignment = 16 );
+
+// Grows the block in place when it was the last one handed out, copies it otherwise
+PLATFORM_INTERFACE void *FrameArena_Realloc( void *pMem, size_t nOldSize, size_t nNewSize, size_t nAlignment = 16 );
+
+// Frame boundary for the calling thread, everything it allocated is released
+PLATFORM_INTERFACE void FrameArena_Reset();
+
+// Counts the calling thread's frame boundaries, used to spot memory kept past its frame
+PLATFORM_INTERFACE uint32 FrameArena_GetFrame();
+
+PLATFORM_INTERFACE bool FrameArena_IsDebugEnabled();
+
+PLATFORM_INTERFACE size_t FrameArena_BeginScope();
+PLATFORM_INTERFACE void FrameArena_EndScope( size_t nMark );
+
+PLATFORM_INTERFACE void FrameArena_GetStats( FrameArenaStats_t *pStats );
+
+//-----------------------------------------------------------------------------
+// Releases what was allocated inside it, for temporaries shorter lived than
+// the frame or code that runs outside of any frame
+//-----------------------------------------------------------------------------
+class CFrameArenaScope
+{
+public:
+	CFrameArenaScope() : m_nMark( FrameArena_BeginScope() ) {}
+	~CFrameArenaScope() { FrameArena_EndScope( m_nMark ); }
+
+private:
+	size_t m_nMark;
+};
+
+#endif // FRAMEARENA_H
@@ -133,6 +133,13 @@ public:
 //-----------------------------------------------------------------------------
 MEM_INTERFACE IMemAlloc *g_pMemAlloc;
 
+#ifdef POSIX
+// The small block heap behind g_pMemAlloc is off on POSIX unless -sbh is on the
+// command line. Turns it on from then on, for tests and benchmarks; returns false
+// when it isn't built or can't reserve its address space.
+PLATFORM_INTERFACE bool MemAlloc_EnableSmallBlockHeap();
+#endif
+
 //-----------------------------------------------------------------------------
 
 #ifdef MEMALLOC_REGIONS
@@ -0,0 +1,47 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Cross-process store of immutable asset data, so server processes
+//			sharing a host keep one copy of the models they all load.
+//
+//			Opt in with -sharedassets. Blobs are keyed by a hash of their
+//			contents; the first process to load one publishes it, the rest
+//			map the published copy. Mappings are copy-on-write, so a process
+//			writing per-process fields into a blob copies only the pages it
+//			writes. Linux only, elsewhere every call falls back to private data.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef SHAREDASSETS_H
+#define SHAREDASSETS_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+
+struct SharedAssetStats_t
+{
+	int		nMapped;			// Blobs this process maps from the store
+	int		nPublished;			// Of those, the ones this process published
+	int		nFallbacks;			// Blobs kept private because sharing failed
+	uint64	nMappedBytes;		// Size of the mapped blobs
+	uint64	nSharedBytes;		// Resident pages of the mapped blobs other processes map too
+	uint64	nPrivateBytes;		// Resident pages of the mapped blobs only this process has
+	uint64	nFallbackBytes;		// Size of the blobs kept private
+};
+
+PLATFORM_INTERFACE bool SharedAssets_Enabled();
+
+// Returns a mapping of a published blob equal to pData, publishing it first if need be.
+// NULL when sharing is off or failed, the caller keeps its own copy then. The mapping
+// stays valid until SharedAssets_Release().
+PLATFORM_INTERFACE void *SharedAssets_Map( uint64 nContentHash, const void *pData, size_t nSize );
+
+PLATFORM_INTERFACE bool SharedAssets_Owns( const void *pMapping );
+PLATFORM_INTERFACE void SharedAssets_Release( void *pMapping );
+
+PLATFORM_INTERFACE void SharedAssets_GetStats( SharedAssetStats_t *pStats );
+
+#endif // SHAREDASSETS_H
@@ -13,6 +13,7 @@
 #include "tier0/l2cache.h"
 #include "tier0/threadtools.h"
 #include "tier0/vprof_telemetry.h"
+#include "tier0/vproftrace.h"
 
 // VProf is enabled by default in all configurations -except- X360 Retail.
 #if !( defined( _X360 ) && defined( _CERT ) )
@@ -771,6 +772,7 @@ public:
 
 private:
 	bool m_bEnabled;
+	bool m_bTraced;
 };
 
 //-----------------------------------------------------------------------------
@@ -1286,18 +1288,27 @@ inline unsigned int CVProfile::GetMultiTraceIndex()
 //-----------------------------------------------------------------------------
 
 inline CVProfScope::CVProfScope( const tchar * pszName, int detailLevel, const tchar *pBudgetGroupName, bool bAssertAccounted, int budgetFlags )
-	: m_bEnabled( g_VProfCurrentProfile.IsEnabled() )
+	: m_bEnabled( g_VProfCurrentProfile.IsEnabled() ),
+	m_bTraced( g_bVProfTraceEnabled )
 { 
 	if ( m_bEnabled )
 	{
 		g_VProfCurrentProfile.EnterScope( pszName, detailLevel, pBudgetGroupName, bAssertAccounted, budgetFlags ); 
 	}
+	if ( m_bTraced )
+	{
+		VProfTrace_Record( VPROFTRACE_SCOPE_BEGIN, pszName );
+	}
 }
 
 //-------------------------------------
 
 inline CVProfScope::~CVProfScope()					
 { 
+	if ( m_bTraced )
+	{
+		VProfTrace_Record( VPROFTRACE_SCOPE_END, NULL );
+	}
 	if ( m_bEnabled )
 	{
 		g_VProfCurrentProfile.ExitScope(); 
@@ -0,0 +1,62 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-thread event trace of VProf scopes and thread pool jobs.
+//
+//			While tracing is on every thread that enters a VPROF_BUDGET scope
+//			or services a job appends begin/end events stamped with the TSC
+//			to a ring of its own. Only the owning thread writes its ring, so
+//			recording takes no locks; the oldest events are overwritten once
+//			a ring is full. The rings can be written out as Chrome trace
+//			event JSON, which chrome://tracing and Perfetto load, to see how
+//			the work of all threads lines up within a tick.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef VPROFTRACE_H
+#define VPROFTRACE_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/dbg.h"
+
+enum VProfTraceEvent_t
+{
+	VPROFTRACE_SCOPE_BEGIN = 0,
+	VPROFTRACE_SCOPE_END,
+	VPROFTRACE_JOB_BEGIN,
+	VPROFTRACE_JOB_END,
+};
+
+// Checked by every instrumented scope, change it with VProfTrace_Enable()
+DBG_INTERFACE bool g_bVProfTraceEnabled;
+
+// Counts its users: the trace runs while more have enabled it than disabled it,
+// so each user has to pair its calls. Main thread only.
+DBG_INTERFACE void VProfTrace_Enable( bool bEnable );
+
+// pszName has to stay valid until the trace is written, like a VProf node name
+DBG_INTERFACE void VProfTrace_Record( VProfTraceEvent_t type, const tchar *pszName );
+
+// Job descriptions live in the job, they get copied to a table that is never freed
+DBG_INTERFACE void VProfTrace_RecordJob( VProfTraceEvent_t type, const char *pszDescription );
+
+// Receives the JSON in pieces, in order
+typedef void ( *VProfTraceWriteFunc_t )( const char *pData, int nLength, void *pContext );
+
+// Writes the last flSeconds of every thread's ring as Chrome trace event JSON,
+// returns the number of events written
+DBG_INTERFACE int VProfTrace_WriteChromeTrace( float flSeconds, VProfTraceWriteFunc_t pfnWrite, void *pContext );
+
+// Rate of the Plat_Rdtsc() time stamps the events carry
+DBG_INTERFACE double VProfTrace_GetTicksPerSecond();
+
+// Writes the events stamped from nStartStamp on, timed in microseconds since
+// nStartStamp. pszExtraEvents are more comma separated event objects for the
+// traceEvents array, pszOtherData the members of the otherData object; both
+// are optional.
+DBG_INTERFACE int VProfTrace_WriteChromeTraceFrom( uint64 nStartStamp, const char *pszExtraEvents, const char *pszOtherData, VProfTraceWriteFunc_t pfnWrite, void *pContext );
+
+#endif // VPROFTRACE_H
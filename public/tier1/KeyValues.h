@@ -216,6 +216,12 @@ public:
 	bool WriteAsBinary( CUtlBuffer &buffer );
 	bool ReadAsBinary( CUtlBuffer &buffer, int nStackDepth = 0 );
 
+	// Compact form of a tree parsed from text, kept by the -keyvaluescache cache.
+	// Reading it needs no tokenizing and looks each distinct key name up once.
+	// nSourceHash identifies the text; reading fails if it doesn't match.
+	bool WriteAsCompiled( CUtlBuffer &buffer, uint64 nSourceHash );
+	bool ReadAsCompiled( CUtlBuffer &buffer, uint64 nSourceHash );
+
 	// Allocate & create a new copy of the keys
 	KeyValues *MakeCopy( void ) const;
 
@@ -266,6 +272,9 @@ public:
 private:
 	KeyValues( KeyValues& );	// prevent copy constructor being used
 
+	// For ReadAsCompiled, which sets the name symbol itself
+	KeyValues();
+
 	// prevent delete being called except through deleteThis()
 	~KeyValues();
 
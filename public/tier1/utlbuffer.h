@@ -634,6 +634,21 @@ public:
 };
 
 
+//-----------------------------------------------------------------------------
+// A buffer in the calling thread's frame arena (see tier0/framearena.h), for
+// messages and scratch data built and thrown away within a frame. Puts past
+// the end grow it within the arena. Must not outlive the frame.
+//-----------------------------------------------------------------------------
+class CUtlFrameArenaBuffer : public CUtlBuffer
+{
+public:
+	CUtlFrameArenaBuffer( int nInitSize = 256, int nFlags = 0 );
+
+protected:
+	bool FrameArenaPutOverflow( int nSize );
+};
+
+
 //-----------------------------------------------------------------------------
 // Where am I reading?
 //-----------------------------------------------------------------------------
@@ -19,6 +19,7 @@
 #include "tier0/platform.h"
 
 #include "tier0/memalloc.h"
+#include "tier0/framearena.h"
 #include "mathlib/mathlib.h"
 #include "tier0/memdbgon.h"
 
@@ -408,6 +409,121 @@ private:
 };
 
 
+//-----------------------------------------------------------------------------
+// The CUtlMemoryFrameArena class:
+// Memory from the calling thread's frame arena (see tier0/framearena.h), for
+// temporaries that die with the frame. Nothing is ever freed, growing copies
+// within the arena. Must not outlive the frame it was allocated in.
+//-----------------------------------------------------------------------------
+template< typename T >
+class CUtlMemoryFrameArena
+{
+public:
+	// constructor, destructor
+	CUtlMemoryFrameArena( int nGrowSize = 0, int nInitSize = 0 ) : m_pMemory( NULL ), m_nAllocationCount( 0 ), m_nFrame( 0 )
+	{
+		if ( nInitSize )
+		{
+			EnsureCapacity( nInitSize );
+		}
+	}
+	CUtlMemoryFrameArena( T* pMemory, int numElements )		{ Assert( 0 ); }
+	~CUtlMemoryFrameArena()									{ AssertFrame(); }
+
+	// Can we use this index?
+	bool IsIdxValid( int i ) const							{ return ( i >= 0 ) && ( i < m_nAllocationCount ); }
+	static int InvalidIndex()								{ return -1; }
+
+	// Gets the base address
+	T* Base()												{ return m_pMemory; }
+	const T* Base() const									{ return m_pMemory; }
+
+	// element access
+	T& operator[]( int i )									{ Assert( IsIdxValid(i) ); return Base()[i];	}
+	const T& operator[]( int i ) const						{ Assert( IsIdxValid(i) ); return Base()[i];	}
+	T& Element( int i )										{ Assert( IsIdxValid(i) ); return Base()[i];	}
+	const T& Element( int i ) const							{ Assert( IsIdxValid(i) ); return Base()[i];	}
+
+	// Attaches the buffer to external memory....
+	void SetExternalBuffer( T* pMemory, int numElements )	{ Assert( 0 ); }
+
+	// Size
+	int NumAllocated() const								{ return m_nAllocationCount; }
+	int Count() const										{ return m_nAllocationCount; }
+
+	// Grows the memory, doubling it like CUtlMemory does
+	void Grow( int num = 1 )
+	{
+		EnsureCapacity( m_nAllocationCount + MAX( num, MAX( m_nAllocationCount, 4 ) ) );
+	}
+
+	// Makes sure we've got at least this much memory
+	void EnsureCapacity( int num )
+	{
+		if ( num <= m_nAllocationCount )
+			return;
+
+		AssertFrame();
+		m_pMemory = (T*)FrameArena_Realloc( m_pMemory, m_nAllocationCount * sizeof(T), num * sizeof(T), MAX( VALIGNOF( T ), 16 ) );
+		m_nAllocationCount = m_pMemory ? num : 0;
+#ifdef DBGFLAG_ASSERT
+		m_nFrame = FrameArena_GetFrame();
+#endif
+	}
+
+	// Memory deallocation, the arena takes it back at the end of the frame
+	void Purge()
+	{
+		AssertFrame();
+		m_pMemory = NULL;
+		m_nAllocationCount = 0;
+	}
+
+	// Purge all but the given number of elements
+	void Purge( int numElements )							{ Assert( numElements <= m_nAllocationCount ); }
+
+	// is the memory externally allocated?
+	bool IsExternallyAllocated() const						{ return false; }
+
+	// Set the size by which the memory grows
+	void SetGrowSize( int size )							{}
+
+	void Swap( CUtlMemoryFrameArena< T > &mem )
+	{
+		V_swap( m_pMemory, mem.m_pMemory );
+		V_swap( m_nAllocationCount, mem.m_nAllocationCount );
+		V_swap( m_nFrame, mem.m_nFrame );
+	}
+
+	class Iterator_t
+	{
+	public:
+		Iterator_t( int i, int _limit ) : index( i ), limit( _limit ) {}
+		int index;
+		int limit;
+		bool operator==( const Iterator_t it ) const	{ return index == it.index; }
+		bool operator!=( const Iterator_t it ) const	{ return index != it.index; }
+	};
+	Iterator_t First() const							{ int limit = NumAllocated(); return Iterator_t( limit ? 0 : InvalidIndex(), limit ); }
+	Iterator_t Next( const Iterator_t &it ) const		{ return Iterator_t( ( it.index + 1 < it.limit ) ? it.index + 1 : InvalidIndex(), it.limit ); }
+	int GetIndex( const Iterator_t &it ) const			{ return it.index; }
+	bool IsIdxAfter( int i, const Iterator_t &it ) const { return i > it.index; }
+	bool IsValidIterator( const Iterator_t &it ) const	{ return IsIdxValid( it.index ) && ( it.index < it.limit ); }
+	Iterator_t InvalidIterator() const					{ return Iterator_t( InvalidIndex(), 0 ); }
+
+private:
+	// Memory kept past its frame has been handed out again by now
+	void AssertFrame() const
+	{
+		AssertMsg( !m_pMemory || m_nFrame == FrameArena_GetFrame(), "CUtlMemoryFrameArena used after the frame it was allocated in\n" );
+	}
+
+	T *m_pMemory;
+	int m_nAllocationCount;
+	uint32 m_nFrame;
+};
+
+
 //-----------------------------------------------------------------------------
 // constructor, destructor
 //-----------------------------------------------------------------------------
@@ -319,6 +319,22 @@ public:
 };
 
 
+//-----------------------------------------------------------------------------
+// The CUtlVectorFrameArena class:
+// A growable array of temporaries living in the thread's frame arena, in place
+// of large CUtlVectorFixed locals or heap vectors built and dropped every frame
+//-----------------------------------------------------------------------------
+template< class T >
+class CUtlVectorFrameArena : public CUtlVector< T, CUtlMemoryFrameArena<T> >
+{
+	typedef CUtlVector< T, CUtlMemoryFrameArena<T> > BaseClass;
+public:
+
+	// constructor, destructor
+	explicit CUtlVectorFrameArena( int initSize = 0 ) : BaseClass( 0, initSize ) {}
+};
+
+
 //-----------------------------------------------------------------------------
 // The CUtlVectorUltra Conservative class:
 // A array class with a very conservative allocation scheme, with customizable allocator
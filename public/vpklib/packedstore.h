@@ -130,10 +130,14 @@ struct FileHandleTracker_t
 	PackDataFileHandle_t m_hFileHandle;
 	int m_nCurOfs;
 	CThreadFastMutex m_Mutex;
+	uint8 const *m_pMappedData;								// the whole file, if mapped reads are on
+	int64 m_nMappedSize;
 
 	FileHandleTracker_t( void )
 	{
 		m_nFileNumber = -1;
+		m_pMappedData = NULL;
+		m_nMappedSize = 0;
 	}
 };
 
@@ -382,6 +386,15 @@ public:
 
 	void SetUseDirFile() { m_bUseDirFile = true; }
 
+	// Read chunk files through read only memory mappings instead of seeking a
+	// shared handle. Only has an effect on 64 bit POSIX, and only for chunk
+	// files opened after the call.
+	void SetUseMappedReads( bool bEnable ) { m_bUseMappedReads = bEnable; }
+
+	// Where the data of a file starts in its chunk file, from nOffsetInFile
+	// on. Fails for offsets inside the metadata, which is kept in the directory.
+	bool GetDataFileLocation( CPackedStoreFileHandle &handle, int nOffsetInFile, char *pchFileNameOut, int cchFileNameOut, int64 &nDataFileOffset ) const;
+
 	int m_PackFileID;
 private:
 	char m_pszFileBaseName[MAX_PATH];
@@ -389,6 +402,7 @@ private:
 	int m_nDirectoryDataSize;
 	int m_nWriteChunkSize;
 	bool m_bUseDirFile;
+	bool m_bUseMappedReads;
 
 	IBaseFileSystem *m_pFileSystem;
 	IThreadedFileMD5Processor *m_pFileTracker;
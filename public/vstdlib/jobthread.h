@@ -787,6 +787,64 @@ FUNC_GENERATE_ALL( DEFINE_NON_MEMBER_ITER_RANGE_PARALLEL );
 
 FUNC_GENERATE_ALL( DEFINE_MEMBER_ITER_RANGE_PARALLEL );
 
+//-----------------------------------------------------------------------------
+// Range splitting: the calling thread and up to nMaxParallel pool threads run
+// Process() over [nBegin, nEnd) in chunks of at least nGrain items. Each thread
+// offers half of what it has left in its own deque whenever the previous offer
+// was taken, and threads that run dry steal the offers of others, so a chunk
+// costs an owner-only push or pop rather than a shared queue operation.
+// nGrain 0 picks a grain from the range and thread count. Begin() and End()
+// run once on each thread that processes any part of the range.
+//-----------------------------------------------------------------------------
+
+abstract_class IParallelForBody
+{
+public:
+	virtual void Begin() {}
+	virtual void Process( int nBegin, int nEnd ) = 0;
+	virtual void End() {}
+};
+
+JOB_INTERFACE void ParallelFor( const char *pszDescription, IParallelForBody *pBody, int nBegin, int nEnd, int nGrain = 0, int nMaxParallel = INT_MAX, IThreadPool *pThreadPool = NULL );
+
+template <typename FUNCTOR>
+class CParallelForFunctorBody : public IParallelForBody
+{
+public:
+	CParallelForFunctorBody( const FUNCTOR &functor ) : m_Functor( functor ) {}
+	virtual void Process( int nBegin, int nEnd )	{ m_Functor( nBegin, nEnd ); }
+
+private:
+	FUNCTOR m_Functor;
+};
+
+template <typename OBJECT_TYPE, typename FUNCTION_CLASS>
+class CParallelForMemberBody : public IParallelForBody
+{
+public:
+	CParallelForMemberBody( OBJECT_TYPE *pObject, void (FUNCTION_CLASS::*pfnProcess)( int, int ) ) : m_pObject( pObject ), m_pfnProcess( pfnProcess ) {}
+	virtual void Process( int nBegin, int nEnd )	{ ((*m_pObject).*m_pfnProcess)( nBegin, nEnd ); }
+
+private:
+	OBJECT_TYPE *m_pObject;
+	void (FUNCTION_CLASS::*m_pfnProcess)( int, int );
+};
+
+// functor is anything callable as functor( nBegin, nEnd ), including a plain function
+template <typename FUNCTOR>
+inline void ParallelFor( const char *pszDescription, int nBegin, int nEnd, int nGrain, const FUNCTOR &functor, int nMaxParallel = INT_MAX )
+{
+	CParallelForFunctorBody<FUNCTOR> body( functor );
+	ParallelFor( pszDescription, &body, nBegin, nEnd, nGrain, nMaxParallel );
+}
+
+template <typename OBJECT_TYPE, typename FUNCTION_CLASS>
+inline void ParallelFor( const char *pszDescription, int nBegin, int nEnd, int nGrain, OBJECT_TYPE *pObject, void (FUNCTION_CLASS::*pfnProcess)( int, int ), int nMaxParallel = INT_MAX )
+{
+	CParallelForMemberBody<OBJECT_TYPE, FUNCTION_CLASS> body( pObject, pfnProcess );
+	ParallelFor( pszDescription, &body, nBegin, nEnd, nGrain, nMaxParallel );
+}
+
 //-----------------------------------------------------------------------------
 // Work splitting: competitive, best when cost per item varies a lot
 //-----------------------------------------------------------------------------
@@ -847,12 +905,12 @@ protected:
 };
 
 template <typename ITEM_TYPE, class ITEM_PROCESSOR_TYPE>
-class CParallelProcessor
+class CParallelProcessor : public IParallelForBody
 {
 public:
 	CParallelProcessor( const char *pszDescription )
 	{
-		m_pItems = m_pLimit= 0;
+		m_pItems = NULL;
 		m_szDescription = pszDescription;
 	}
 
@@ -863,89 +921,32 @@ public:
 		if ( nItems == 0 )
 			return;
 
-		if ( !pThreadPool )
-		{
-			pThreadPool = g_pThreadPool;
-		}
-
 		m_pItems = pItems;
-		m_pLimit = pItems + nItems;
-
-		int nJobs = nItems - 1;
-
-		if ( nJobs > nMaxParallel )
-		{
-			nJobs = nMaxParallel;
-		}
-
-		if (! pThreadPool )									// only possible on linux
-		{
-			DoExecute( );
-			return;
-		}
-
-		int nThreads = pThreadPool->NumThreads();
-		if ( nJobs > nThreads )
-		{
-			nJobs = nThreads;
-		}
-
-		if ( nJobs > 1 )
-		{
-			CJob **jobs = (CJob **)stackalloc( nJobs * sizeof(CJob **) );
-			int i = nJobs;
-
-			while( i-- )
-			{
-				jobs[i] = pThreadPool->QueueCall( this, &CParallelProcessor<ITEM_TYPE, ITEM_PROCESSOR_TYPE>::DoExecute );
-				jobs[i]->SetDescription( m_szDescription );
-			}
-
-			DoExecute();
-
-			for ( i = 0; i < nJobs; i++ )
-			{
-				jobs[i]->Abort(); // will either abort ones that never got a thread, or noop on ones that did
-				jobs[i]->Release();
-			}
-		}
-		else
-		{
-			DoExecute();
-		}
+		ParallelFor( m_szDescription, this, 0, nItems, 0, nMaxParallel, pThreadPool );
 	}
 
 	ITEM_PROCESSOR_TYPE m_ItemProcessor;
 
 private:
-	void DoExecute()
+	virtual void Begin()
 	{
-		tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "DoExecute %s", m_szDescription );
+		m_ItemProcessor.Begin();
+	}
 
-		if ( m_pItems < m_pLimit )
+	virtual void Process( int nBegin, int nEnd )
+	{
+		for ( int i = nBegin; i < nEnd; i++ )
 		{
-			m_ItemProcessor.Begin();
-
-			ITEM_TYPE *pLimit = m_pLimit;
-
-			for (;;)
-			{
-				ITEM_TYPE *pCurrent = m_pItems++;
-				if ( pCurrent < pLimit )
-				{
-					m_ItemProcessor.Process( *pCurrent );
-				}
-				else
-				{
-					break;
-				}
-			}
-
-			m_ItemProcessor.End();
+			m_ItemProcessor.Process( m_pItems[i] );
 		}
 	}
-	CInterlockedPtr<ITEM_TYPE>	m_pItems;
-	ITEM_TYPE *					m_pLimit;
+
+	virtual void End()
+	{
+		m_ItemProcessor.End();
+	}
+
+	ITEM_TYPE *					m_pItems;
 	const char *				m_szDescription;
 };
 
@@ -0,0 +1,377 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-thread linear arenas for temporaries that die with the frame
+//
+// Each arena reserves address space once and commits it as the thread's
+// busiest frame grows, so steady state frames allocate by bumping an offset
+// and release by zeroing it. A frame that runs out of reserved space gets the
+// rest of its temporaries from the heap, those are freed at the next reset,
+// or when the outermost scope they were allocated in ends, so a thread that
+// only ever uses scopes doesn't keep them.
+//
+// In debug mode an arena rotates through several regions, one per frame. A
+// region is poisoned and made inaccessible when its frame ends and stays that
+// way until the rotation comes back to it.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "pch_tier0.h"
+#include "tier0/platform.h"
+#include "tier0/framearena.h"
+#include "tier0/icommandline.h"
+#include "tier0/threadtools.h"
+#include "tier0/memalloc.h"
+#include "tier0/dbg.h"
+
+#ifdef POSIX
+#include <sys/mman.h>
+#endif
+
+// NOTE: This has to be the last file included!
+#include "tier0/memdbgon.h"
+
+#define FRAMEARENA_COMMIT_SIZE		(64*1024)
+#ifdef PLATFORM_64BITS
+#define FRAMEARENA_RESERVE_SIZE		(64*1024*1024)
+#else
+#define FRAMEARENA_RESERVE_SIZE		(16*1024*1024)
+#endif
+#define FRAMEARENA_DEBUG_REGIONS	4
+#define FRAMEARENA_POISON			0xdd
+
+//-----------------------------------------------------------------------------
+// Address space: reserved inaccessible, committed read/write as needed
+//-----------------------------------------------------------------------------
+static byte *FrameArenaReserve( size_t nBytes )
+{
+#ifdef _WIN32
+	return (byte *)VirtualAlloc( NULL, nBytes, MEM_RESERVE, PAGE_NOACCESS );
+#else
+	void *p = mmap( NULL, nBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	return ( p != MAP_FAILED ) ? (byte *)p : NULL;
+#endif
+}
+
+static bool FrameArenaCommit( byte *p, size_t nBytes )
+{
+#ifdef _WIN32
+	return ( VirtualAlloc( p, nBytes, MEM_COMMIT, PAGE_READWRITE ) != NULL );
+#else
+	return ( mprotect( p, nBytes, PROT_READ | PROT_WRITE ) == 0 );
+#endif
+}
+
+static void FrameArenaProtect( byte *p, size_t nBytes, bool bAccessible )
+{
+	if ( !nBytes )
+		return;
+
+#ifdef _WIN32
+	DWORD nOldProtect;
+	VirtualProtect( p, nBytes, bAccessible ? PAGE_READWRITE : PAGE_NOACCESS, &nOldProtect );
+#else
+	mprotect( p, nBytes, bAccessible ? ( PROT_READ | PROT_WRITE ) : PROT_NONE );
+#endif
+}
+
+static bool s_bFrameArenaDebug;
+static bool s_bFrameArenaDebugChecked;
+
+static bool IsFrameArenaDebug()
+{
+	if ( !s_bFrameArenaDebugChecked )
+	{
+		s_bFrameArenaDebug = ( CommandLine()->FindParm( "-framearenadebug" ) != 0 );
+		s_bFrameArenaDebugChecked = true;
+	}
+	return s_bFrameArenaDebug;
+}
+
+//-----------------------------------------------------------------------------
+// One thread's arena
+//-----------------------------------------------------------------------------
+class CFrameArena
+{
+public:
+	CFrameArena();
+
+	void *Alloc( size_t nSize, size_t nAlignment );
+	void *Realloc( void *pMem, size_t nOldSize, size_t nNewSize, size_t nAlignment );
+	void Reset();
+	size_t BeginScope();
+	void EndScope( size_t nMark );
+	uint32 GetFrame() const		{ return m_nFrame; }
+
+	size_t GetCommittedSize() const;
+	size_t GetHighWater() const		{ return MAX( m_nHighWater, m_nUsed ); }
+	uint64 GetOverflowSize() const	{ return m_nOverflowBytes; }
+
+	CFrameArena *m_pNext;
+
+private:
+	struct Region_t
+	{
+		byte *	m_pBase;
+		size_t	m_nCommitted;
+	};
+
+	// Heap allocations made once the region is full, linked ahead of their data
+	struct OverflowBlock_t
+	{
+		OverflowBlock_t *m_pNext;
+	};
+
+	bool EnsureCommitted( size_t nBytes );
+	void *AllocOverflow( size_t nSize, size_t nAlignment );
+	// Frees the heap blocks allocated since pKeep was the newest
+	void FreeOverflow( OverflowBlock_t *pKeep = NULL );
+
+	Region_t			m_Regions[FRAMEARENA_DEBUG_REGIONS];
+	int					m_nRegions;
+	int					m_iRegion;
+	size_t				m_nUsed;
+	size_t				m_nHighWater;
+	int					m_nScopeDepth;
+	uint32				m_nFrame;
+	OverflowBlock_t *	m_pOverflow;
+	OverflowBlock_t *	m_pScopeOverflow;	// m_pOverflow when the outermost scope began
+	uint64				m_nOverflowBytes;
+};
+
+CFrameArena::CFrameArena()
+{
+	memset( m_Regions, 0, sizeof( m_Regions ) );
+	m_nRegions = IsFrameArenaDebug() ? FRAMEARENA_DEBUG_REGIONS : 1;
+	for ( int i = 0; i < m_nRegions; i++ )
+	{
+		m_Regions[i].m_pBase = FrameArenaReserve( FRAMEARENA_RESERVE_SIZE );
+	}
+	m_iRegion = 0;
+	m_nUsed = 0;
+	m_nHighWater = 0;
+	m_nScopeDepth = 0;
+	m_nFrame = 0;
+	m_pOverflow = NULL;
+	m_pScopeOverflow = NULL;
+	m_nOverflowBytes = 0;
+	m_pNext = NULL;
+}
+
+bool CFrameArena::EnsureCommitted( size_t nBytes )
+{
+	Region_t &region = m_Regions[m_iRegion];
+	if ( nBytes <= region.m_nCommitted )
+		return true;
+
+	size_t nCommit = AlignValue( nBytes, FRAMEARENA_COMMIT_SIZE );
+	if ( !region.m_pBase || nCommit > FRAMEARENA_RESERVE_SIZE )
+		return false;
+
+	if ( !FrameArenaCommit( region.m_pBase + region.m_nCommitted, nCommit - region.m_nCommitted ) )
+		return false;
+
+	region.m_nCommitted = nCommit;
+	return true;
+}
+
+void *CFrameArena::AllocOverflow( size_t nSize, size_t nAlignment )
+{
+	if ( !m_nOverflowBytes )
+	{
+		Warning( "Frame arena is out of its %d MB, temporaries go to the heap until the next frame\n", FRAMEARENA_RESERVE_SIZE / ( 1024 * 1024 ) );
+	}
+
+	size_t nHeader = AlignValue( sizeof( OverflowBlock_t ), nAlignment );
+	OverflowBlock_t *pBlock = (OverflowBlock_t *)MemAlloc_AllocAligned( nHeader + nSize, nAlignment );
+	if ( !pBlock )
+		return NULL;
+
+	pBlock->m_pNext = m_pOverflow;
+	m_pOverflow = pBlock;
+	m_nOverflowBytes += nSize;
+	return (byte *)pBlock + nHeader;
+}
+
+void CFrameArena::FreeOverflow( OverflowBlock_t *pKeep )
+{
+	while ( m_pOverflow && m_pOverflow != pKeep )
+	{
+		OverflowBlock_t *pNext = m_pOverflow->m_pNext;
+		MemAlloc_FreeAligned( m_pOverflow );
+		m_pOverflow = pNext;
+	}
+}
+
+void *CFrameArena::Alloc( size_t nSize, size_t nAlignment )
+{
+	size_t nStart = AlignValue( m_nUsed, nAlignment );
+	if ( !EnsureCommitted( nStart + nSize ) )
+		return AllocOverflow( nSize, nAlignment );
+
+	m_nUsed = nStart + nSize;
+	return m_Regions[m_iRegion].m_pBase + nStart;
+}
+
+void *CFrameArena::Realloc( void *pMem, size_t nOldSize, size_t nNewSize, size_t nAlignment )
+{
+	if ( !pMem )
+		return Alloc( nNewSize, nAlignment );
+
+	byte *pBase = m_Regions[m_iRegion].m_pBase;
+	if ( (byte *)pMem + nOldSize == pBase + m_nUsed )
+	{
+		// The last block handed out can grow or shrink where it is
+		size_t nStart = (byte *)pMem - pBase;
+		if ( EnsureCommitted( nStart + nNewSize ) )
+		{
+			m_nUsed = nStart + nNewSize;
+			return pMem;
+		}
+	}
+	else if ( nNewSize <= nOldSize )
+	{
+		return pMem;
+	}
+
+	void *pNewMem = Alloc( nNewSize, nAlignment );
+	if ( pNewMem )
+	{
+		memcpy( pNewMem, pMem, MIN( nOldSize, nNewSize ) );
+	}
+	return pNewMem;
+}
+
+void CFrameArena::Reset()
+{
+	AssertMsg( m_nScopeDepth == 0, "Frame arena reset inside a CFrameArenaScope\n" );
+	m_nScopeDepth = 0;
+
+	m_nHighWater = MAX( m_nHighWater, m_nUsed );
+	FreeOverflow();
+	m_pScopeOverflow = NULL;
+
+	if ( m_nRegions > 1 )
+	{
+		// Lock this frame's region and move on to the one locked longest ago
+		Region_t &region = m_Regions[m_iRegion];
+		memset( region.m_pBase, FRAMEARENA_POISON, m_nUsed );
+		FrameArenaProtect( region.m_pBase, region.m_nCommitted, false );
+
+		m_iRegion = ( m_iRegion + 1 ) % m_nRegions;
+		FrameArenaProtect( m_Regions[m_iRegion].m_pBase, m_Regions[m_iRegion].m_nCommitted, true );
+	}
+
+	m_nUsed = 0;
+	++m_nFrame;
+}
+
+size_t CFrameArena::BeginScope()
+{
+	if ( !m_nScopeDepth )
+	{
+		m_pScopeOverflow = m_pOverflow;
+	}
+	++m_nScopeDepth;
+	return m_nUsed;
+}
+
+void CFrameArena::EndScope( size_t nMark )
+{
+	Assert( m_nScopeDepth > 0 && nMark <= m_nUsed );
+	--m_nScopeDepth;
+
+	m_nHighWater = MAX( m_nHighWater, m_nUsed );
+	if ( m_nRegions > 1 )
+	{
+		memset( m_Regions[m_iRegion].m_pBase + nMark, FRAMEARENA_POISON, m_nUsed - nMark );
+	}
+	m_nUsed = nMark;
+
+	// Heap blocks from before the outermost scope still belong to the frame
+	if ( !m_nScopeDepth )
+	{
+		FreeOverflow( m_pScopeOverflow );
+	}
+}
+
+size_t CFrameArena::GetCommittedSize() const
+{
+	size_t nCommitted = 0;
+	for ( int i = 0; i < m_nRegions; i++ )
+	{
+		nCommitted += m_Regions[i].m_nCommitted;
+	}
+	return nCommitted;
+}
+
+//-----------------------------------------------------------------------------
+// Arenas are made on a thread's first use and kept for the life of the process
+//-----------------------------------------------------------------------------
+static CTHREADLOCALPTR( CFrameArena ) s_pThreadArena;
+static CFrameArena *s_pArenas;
+static CThreadFastMutex s_ArenasMutex;
+
+static CFrameArena *GetThreadArena()
+{
+	CFrameArena *pArena = s_pThreadArena;
+	if ( !pArena )
+	{
+		pArena = new CFrameArena;
+		s_pThreadArena = pArena;
+
+		AUTO_LOCK( s_ArenasMutex );
+		pArena->m_pNext = s_pArenas;
+		s_pArenas = pArena;
+	}
+	return pArena;
+}
+
+void *FrameArena_Alloc( size_t nSize, size_t nAlignment )
+{
+	return GetThreadArena()->Alloc( nSize, nAlignment );
+}
+
+void *FrameArena_Realloc( void *pMem, size_t nOldSize, size_t nNewSize, size_t nAlignment )
+{
+	return GetThreadArena()->Realloc( pMem, nOldSize, nNewSize, nAlignment );
+}
+
+void FrameArena_Reset()
+{
+	GetThreadArena()->Reset();
+}
+
+uint32 FrameArena_GetFrame()
+{
+	return GetThreadArena()->GetFrame();
+}
+
+bool FrameArena_IsDebugEnabled()
+{
+	return IsFrameArenaDebug();
+}
+
+size_t FrameArena_BeginScope()
+{
+	return GetThreadArena()->BeginScope();
+}
+
+void FrameArena_EndScope( size_t nMark )
+{
+	GetThreadArena()->EndScope( nMark );
+}
+
+void FrameArena_GetStats( FrameArenaStats_t *pStats )
+{
+	memset( pStats, 0, sizeof( *pStats ) );
+
+	AUTO_LOCK( s_ArenasMutex );
+	for ( CFrameArena *pArena = s_pArenas; pArena; pArena = pArena->m_pNext )
+	{
+		pStats->nArenas++;
+		pStats->nCommittedBytes += pArena->GetCommittedSize();
+		pStats->nHighWaterBytes = MAX( pStats->nHighWaterBytes, (uint64)pArena->GetHighWater() );
+		pStats->nOverflowBytes += pArena->GetOverflowSize();
+	}
+}
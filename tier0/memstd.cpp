@@ -18,6 +18,9 @@
 #undef Verify
 #define VA_COMMIT_FLAGS (MEM_COMMIT|MEM_NOZERO|MEM_LARGE_PAGES)
 #define VA_RESERVE_FLAGS (MEM_RESERVE|MEM_LARGE_PAGES)
+#elif defined( POSIX )
+#include <sys/mman.h>
+#include <pthread.h>
 #endif
 
 #ifdef OSX
@@ -544,13 +547,18 @@ public:
 CInitGlobalMemAllocPtr sg_InitGlobalMemAllocPtr;
 #endif
 
-#ifdef _WIN32
+#ifdef MEM_SBH_ENABLED
 //-----------------------------------------------------------------------------
 // Small block heap (multi-pool)
 //-----------------------------------------------------------------------------
 
 #ifndef NO_SBH
-#ifdef ALLOW_NOSBH
+#ifdef POSIX
+// Off until the heap has reserved its address space, anything allocated before
+// then comes from libc and is handed back to it
+static bool g_UsingSBH = false;
+#define UsingSBH() g_UsingSBH
+#elif defined( ALLOW_NOSBH )
 static bool g_UsingSBH = true;
 #define UsingSBH() g_UsingSBH
 #else
@@ -560,6 +568,44 @@ static bool g_UsingSBH = true;
 #define UsingSBH() false
 #endif
 
+//-----------------------------------------------------------------------------
+// Address space for the pools is reserved up front and committed as they grow
+//-----------------------------------------------------------------------------
+#ifdef _WIN32
+static byte *SBHReserve( size_t nBytes )
+{
+	return (byte *)VirtualAlloc( NULL, nBytes, VA_RESERVE_FLAGS, PAGE_NOACCESS );
+}
+
+static bool SBHCommit( byte *p, size_t nBytes )
+{
+	return ( VirtualAlloc( p, nBytes, VA_COMMIT_FLAGS, PAGE_READWRITE ) != NULL );
+}
+
+static void SBHDecommit( byte *p, size_t nBytes )
+{
+	VirtualFree( p, nBytes, MEM_DECOMMIT );
+}
+#else
+static byte *SBHReserve( size_t nBytes )
+{
+	void *p = mmap( NULL, nBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	return ( p != MAP_FAILED ) ? (byte *)p : NULL;
+}
+
+static bool SBHCommit( byte *p, size_t nBytes )
+{
+	return ( mprotect( p, nBytes, PROT_READ | PROT_WRITE ) == 0 );
+}
+
+// The pages stay readable, so a thread popping a free list while it is compacted
+// reads zeroes instead of faulting. The kernel gets the memory back either way.
+static void SBHDecommit( byte *p, size_t nBytes )
+{
+	madvise( p, nBytes, MADV_DONTNEED );
+}
+#endif
+
 
 //-----------------------------------------------------------------------------
 //
@@ -582,10 +628,15 @@ void CSmallBlockPool::Init( unsigned nBlockSize, byte *pBase, unsigned initialCo
 	m_pCommitLimit = m_pNextAlloc = m_pBase = pBase;
 	m_pAllocLimit = m_pBase + MAX_POOL_REGION;
 
+#ifdef MEM_SBH_THREAD_CACHE
+	// Around a page of blocks per batch
+	m_nBatchSize = MAX( 2, MIN( 32, (int)( 4096 / nBlockSize ) ) );
+#endif
+
 	if ( initialCommit )
 	{
 		initialCommit = MemAlign( initialCommit, SBH_PAGE_SIZE );
-		if ( !VirtualAlloc( m_pCommitLimit, initialCommit, VA_COMMIT_FLAGS, PAGE_READWRITE ) )
+		if ( !SBHCommit( m_pCommitLimit, initialCommit ) )
 		{
 			Assert( 0 );
 			return;
@@ -594,60 +645,70 @@ void CSmallBlockPool::Init( unsigned nBlockSize, byte *pBase, unsigned initialCo
 	}
 }
 
-size_t CSmallBlockPool::GetBlockSize()
+inline size_t CSmallBlockPool::GetBlockSize()
 {
 	return m_nBlockSize;
 }
 
-bool CSmallBlockPool::IsOwner( void *p )
+inline bool CSmallBlockPool::IsOwner( void *p )
 {
 	return ( p >= m_pBase && p < m_pAllocLimit );
 	}
 
 void *CSmallBlockPool::Alloc()
-	{
+{
 	void *pResult = m_FreeList.Pop();
-		if ( !pResult )
+	if ( !pResult )
+	{
+		int nBlocks = 1;
+		pResult = AllocFresh( nBlocks );
+	}
+	return pResult;
+}
+
+// Takes up to nBlocks contiguous blocks that have never been handed out, committing
+// more of the pool as needed. nBlocks is set to the number taken.
+byte *CSmallBlockPool::AllocFresh( int &nBlocks )
+{
+	int nBlockSize = m_nBlockSize;
+	byte *pCommitLimit;
+	byte *pNextAlloc;
+	for (;;)
+	{
+		pCommitLimit = m_pCommitLimit;
+		pNextAlloc = m_pNextAlloc;
+		int nAvailable = ( pNextAlloc < pCommitLimit ) ? ( pCommitLimit - pNextAlloc ) / nBlockSize : 0;
+		if ( nAvailable )
 		{
-			int nBlockSize = m_nBlockSize;
-		byte *pCommitLimit;
-			byte *pNextAlloc;
-		for (;;)
+			int nTake = MIN( nBlocks, nAvailable );
+			if ( m_pNextAlloc.AssignIf( pNextAlloc, pNextAlloc + nTake * nBlockSize ) )
+			{
+				nBlocks = nTake;
+				return pNextAlloc;
+			}
+		}
+		else
+		{
+			AUTO_LOCK( m_CommitMutex );
+			if ( pCommitLimit == m_pCommitLimit )
+			{
+				if ( pCommitLimit + COMMIT_SIZE <= m_pAllocLimit )
 				{
-			pCommitLimit = m_pCommitLimit;
-			pNextAlloc = m_pNextAlloc;
-			if ( pNextAlloc + nBlockSize <= pCommitLimit )
-					{
-				if ( m_pNextAlloc.AssignIf( pNextAlloc, pNextAlloc + m_nBlockSize ) )
+					if ( !SBHCommit( pCommitLimit, COMMIT_SIZE ) )
 					{
-					pResult = pNextAlloc;
-						break;
+						Assert( 0 );
+						return NULL;
 					}
-				}
-						else
-						{
-				AUTO_LOCK( m_CommitMutex );
-				if ( pCommitLimit == m_pCommitLimit )
-							{
-					if ( pCommitLimit + COMMIT_SIZE <= m_pAllocLimit )
-								{
-						if ( !VirtualAlloc( pCommitLimit, COMMIT_SIZE, VA_COMMIT_FLAGS, PAGE_READWRITE ) )
-								{
-							Assert( 0 );
-							return NULL;
-							}
 
-						m_pCommitLimit = pCommitLimit + COMMIT_SIZE;
-						}
-						else
-						{
-							return NULL;
-						}
-					}
-					}
+					m_pCommitLimit = pCommitLimit + COMMIT_SIZE;
+				}
+				else
+				{
+					return NULL;
 				}
 			}
-	return pResult;
+		}
+	}
 }
 
 void CSmallBlockPool::Free( void *p )
@@ -657,10 +718,78 @@ void CSmallBlockPool::Free( void *p )
 	m_FreeList.Push( p );
 }
 
+#ifdef MEM_SBH_THREAD_CACHE
+inline int CSmallBlockPool::GetBatchSize()
+{
+	return m_nBatchSize;
+}
+
+// Hands out a chain of blocks linked through their first word, returns its length.
+// Whole batches other threads gave back come first, they cost a single pop.
+int CSmallBlockPool::AllocBatch( void **ppHead )
+{
+	void **pBatch = (void **)m_BatchList.Pop();
+	if ( pBatch )
+	{
+		pBatch[0] = pBatch[1];
+		*ppHead = pBatch;
+		return m_nBatchSize;
+	}
+
+	void *pHead = NULL;
+	int nBlocks = 0;
+	while ( nBlocks < m_nBatchSize )
+	{
+		void *p = m_FreeList.Pop();
+		if ( !p )
+		{
+			break;
+		}
+		*(void **)p = pHead;
+		pHead = p;
+		nBlocks++;
+	}
+
+	if ( !nBlocks )
+	{
+		nBlocks = m_nBatchSize;
+		byte *pFresh = AllocFresh( nBlocks );
+		if ( !pFresh )
+		{
+			nBlocks = 0;
+		}
+		for ( int i = nBlocks - 1; i >= 0; i-- )
+		{
+			void *p = pFresh + i * m_nBlockSize;
+			*(void **)p = pHead;
+			pHead = p;
+		}
+	}
+
+	*ppHead = pHead;
+	return nBlocks;
+}
+
+// Takes back a chain of exactly GetBatchSize() blocks. The list push reuses the
+// first word of the head block, so the rest of the chain moves to its second.
+void CSmallBlockPool::FreeBatch( void *pHead )
+{
+	Assert( IsOwner( pHead ) );
+
+	void **pBatch = (void **)pHead;
+	pBatch[1] = pBatch[0];
+	m_BatchList.Push( pBatch );
+}
+#endif
+
 // Count the free blocks.  
 int CSmallBlockPool::CountFreeBlocks()
 {
+#ifdef MEM_SBH_THREAD_CACHE
+	return m_FreeList.Count() + m_BatchList.Count() * m_nBatchSize;
+#else
 	return m_FreeList.Count();
+#endif
 }
 
 // Size of committed memory managed by this heap:
@@ -687,6 +816,22 @@ int CSmallBlockPool::CountAllocatedBlocks()
 int CSmallBlockPool::Compact()
 {
 	int nBytesFreed = 0;
+
+#ifdef MEM_SBH_THREAD_CACHE
+	// Break up the batches so their blocks are sorted with the rest
+	for ( void **pBatch = (void **)m_BatchList.Pop(); pBatch; pBatch = (void **)m_BatchList.Pop() )
+	{
+		void *p = pBatch[1];
+		m_FreeList.Push( pBatch );
+		while ( p )
+		{
+			void *pNext = *(void **)p;
+			m_FreeList.Push( p );
+			p = pNext;
+		}
+	}
+#endif
+
 	if ( m_FreeList.Count() )
 {
 	int i;
@@ -727,7 +872,7 @@ int CSmallBlockPool::Compact()
 			if ( pNewCommitLimit < m_pCommitLimit )
 		{
 				nBytesFreed = m_pCommitLimit - pNewCommitLimit;
-				VirtualFree( pNewCommitLimit, nBytesFreed, MEM_DECOMMIT );
+				SBHDecommit( pNewCommitLimit, nBytesFreed );
 				m_pCommitLimit = pNewCommitLimit;
 		}
 	}
@@ -751,6 +896,156 @@ int CSmallBlockPool::Compact()
 }
 
 
+//-----------------------------------------------------------------------------
+// Per-thread caches. A thread allocates from and frees to its own bins, and only
+// trades with the pools a batch at a time when a bin runs dry or holds two batches.
+//-----------------------------------------------------------------------------
+#ifdef MEM_SBH_THREAD_CACHE
+enum SBHThreadCacheState_t
+{
+	SBH_CACHE_UNUSED = 0,
+	SBH_CACHE_LIVE,
+	SBH_CACHE_DEAD,		// Flushed at thread exit, later calls on the thread go straight to the pools
+};
+
+static __thread SBHThreadCache_t g_SBHThreadCache;
+static pthread_key_t g_SBHThreadCacheKey;
+
+inline SBHThreadCache_t *CSmallBlockHeap::GetThreadCache()
+{
+	SBHThreadCache_t *pCache = &g_SBHThreadCache;
+	if ( pCache->m_nState == SBH_CACHE_LIVE )
+	{
+		return pCache;
+	}
+	if ( pCache->m_nState == SBH_CACHE_DEAD )
+	{
+		return NULL;
+	}
+
+	// First use on this thread, register it for the flush at exit and for the stats
+	pthread_setspecific( g_SBHThreadCacheKey, this );
+
+	AUTO_LOCK( m_ThreadCacheMutex );
+	pCache->m_pPrev = NULL;
+	pCache->m_pNext = m_pThreadCaches;
+	if ( m_pThreadCaches )
+	{
+		m_pThreadCaches->m_pPrev = pCache;
+	}
+	m_pThreadCaches = pCache;
+	pCache->m_nState = SBH_CACHE_LIVE;
+	return pCache;
+}
+
+void CSmallBlockHeap::OnThreadExit( void *pHeap )
+{
+	CSmallBlockHeap *pThis = (CSmallBlockHeap *)pHeap;
+	SBHThreadCache_t *pCache = &g_SBHThreadCache;
+	if ( pCache->m_nState != SBH_CACHE_LIVE )
+	{
+		return;
+	}
+
+	{
+		AUTO_LOCK( pThis->m_ThreadCacheMutex );
+		if ( pCache->m_pPrev )
+		{
+			pCache->m_pPrev->m_pNext = pCache->m_pNext;
+		}
+		else
+		{
+			pThis->m_pThreadCaches = pCache->m_pNext;
+		}
+		if ( pCache->m_pNext )
+		{
+			pCache->m_pNext->m_pPrev = pCache->m_pPrev;
+		}
+		pCache->m_nState = SBH_CACHE_DEAD;
+	}
+
+	for ( int i = 0; i < NUM_POOLS; i++ )
+	{
+		void *p = pCache->m_Bins[i].m_pHead;
+		while ( p )
+		{
+			void *pNext = *(void **)p;
+			pThis->m_Pools[i].Free( p );
+			p = pNext;
+		}
+		pCache->m_Bins[i].m_pHead = NULL;
+		pCache->m_Bins[i].m_nCount = 0;
+	}
+}
+
+// Blocks of a pool sitting in thread caches, which the pool counts as allocated
+int CSmallBlockHeap::CountCachedBlocks( int iPool )
+{
+	AUTO_LOCK( m_ThreadCacheMutex );
+	int nBlocks = 0;
+	for ( SBHThreadCache_t *pCache = m_pThreadCaches; pCache; pCache = pCache->m_pNext )
+	{
+		nBlocks += pCache->m_Bins[iPool].m_nCount;
+	}
+	return nBlocks;
+}
+#endif
+
+inline void *CSmallBlockHeap::PoolAlloc( CSmallBlockPool *pPool )
+{
+#ifdef MEM_SBH_THREAD_CACHE
+	SBHThreadCache_t *pCache = GetThreadCache();
+	if ( pCache )
+	{
+		SBHThreadCache_t::Bin_t &bin = pCache->m_Bins[pPool - m_Pools];
+		if ( !bin.m_pHead )
+		{
+			bin.m_nCount = pPool->AllocBatch( &bin.m_pHead );
+			if ( !bin.m_nCount )
+			{
+				return NULL;
+			}
+		}
+
+		void *p = bin.m_pHead;
+		bin.m_pHead = *(void **)p;
+		bin.m_nCount--;
+		return p;
+	}
+#endif
+	return pPool->Alloc();
+}
+
+inline void CSmallBlockHeap::PoolFree( CSmallBlockPool *pPool, void *p )
+{
+#ifdef MEM_SBH_THREAD_CACHE
+	SBHThreadCache_t *pCache = GetThreadCache();
+	if ( pCache )
+	{
+		SBHThreadCache_t::Bin_t &bin = pCache->m_Bins[pPool - m_Pools];
+		*(void **)p = bin.m_pHead;
+		bin.m_pHead = p;
+
+		int nBatchSize = pPool->GetBatchSize();
+		if ( ++bin.m_nCount >= 2 * nBatchSize )
+		{
+			// Keep the recently freed half, it is the one most likely still in cache
+			void *pLast = bin.m_pHead;
+			for ( int i = 1; i < nBatchSize; i++ )
+			{
+				pLast = *(void **)pLast;
+			}
+			void *pBatch = *(void **)pLast;
+			*(void **)pLast = NULL;
+			bin.m_nCount -= nBatchSize;
+			pPool->FreeBatch( pBatch );
+		}
+		return;
+	}
+#endif
+	pPool->Free( p );
+}
+
 //-----------------------------------------------------------------------------
 //
 //-----------------------------------------------------------------------------
@@ -761,13 +1056,47 @@ CSmallBlockHeap::CSmallBlockHeap()
 	// Make sure that we return 64-bit addresses in 64-bit builds.
 	ReserveBottomMemory();
 
+#ifdef POSIX
+	// Opt in only, see the note on MEM_SBH_ENABLED
+	if ( !strstr( Plat_GetCommandLineA(), "-sbh" ) )
+	{
+		return;
+	}
+#else
 	if ( !UsingSBH() )
 	{
 		return;
 	}
+#endif
+
+	Init();
+}
+
+#ifdef POSIX
+//-----------------------------------------------------------------------------
+// Turns the heap on after startup. Blocks allocated before then came from libc
+// and still go back to it. Not for use while other threads are allocating.
+//-----------------------------------------------------------------------------
+bool CSmallBlockHeap::Enable()
+{
+	if ( !UsingSBH() )
+	{
+		Init();
+	}
+	return UsingSBH();
+}
+#endif
 
-	m_pBase = (byte *)VirtualAlloc( NULL, NUM_POOLS * MAX_POOL_REGION, VA_RESERVE_FLAGS, PAGE_NOACCESS );
+void CSmallBlockHeap::Init()
+{
+	m_pBase = SBHReserve( NUM_POOLS * MAX_POOL_REGION );
 	m_pLimit = m_pBase + NUM_POOLS * MAX_POOL_REGION;
+#ifdef POSIX
+	if ( !m_pBase )
+	{
+		return;
+	}
+#endif
 
 	// Build a lookup table used to find the correct pool based on size
 	const int MAX_TABLE = MAX_SBH_BLOCK >> 2;
@@ -777,7 +1106,7 @@ CSmallBlockHeap::CSmallBlockHeap()
 	CSmallBlockPool *pCurPool = NULL;
 	int iCurPool = 0;
 
-#if _M_X64
+#ifdef PLATFORM_64BITS
 	// Blocks sized 0 - 256 are in pools in increments of 16
 	for ( ; i < 64 && i < MAX_TABLE; i++ )
 	{
@@ -906,19 +1235,29 @@ CSmallBlockHeap::CSmallBlockHeap()
 	}
 
 	Assert( iCurPool == NUM_POOLS );
+
+#ifdef POSIX
+#ifdef MEM_SBH_THREAD_CACHE
+	m_pThreadCaches = NULL;
+	pthread_key_create( &g_SBHThreadCacheKey, &CSmallBlockHeap::OnThreadExit );
+#endif
+	// The pools have to be visible before anything can be allocated from them
+	ThreadMemoryBarrier();
+	g_UsingSBH = true;
+#endif
 }
 
-bool CSmallBlockHeap::ShouldUse( size_t nBytes )
+inline bool CSmallBlockHeap::ShouldUse( size_t nBytes )
 {
 	return ( UsingSBH() && nBytes <= MAX_SBH_BLOCK );
 }
 
-bool CSmallBlockHeap::IsOwner( void * p )
+inline bool CSmallBlockHeap::IsOwner( void * p )
 {
 	return ( UsingSBH() && p >= m_pBase && p < m_pLimit );
 }
 
-void *CSmallBlockHeap::Alloc( size_t nBytes )
+inline void *CSmallBlockHeap::Alloc( size_t nBytes )
 {
 	if ( nBytes == 0)
 	{
@@ -927,7 +1266,7 @@ void *CSmallBlockHeap::Alloc( size_t nBytes )
 	Assert( ShouldUse( nBytes ) );
 	CSmallBlockPool *pPool = FindPool( nBytes );
 	
-	void *p = pPool->Alloc();
+	void *p = PoolAlloc( pPool );
 	if ( p )
 	{
 		return p;
@@ -935,7 +1274,7 @@ void *CSmallBlockHeap::Alloc( size_t nBytes )
 
 	if ( s_StdMemAlloc.CallAllocFailHandler( nBytes ) >= nBytes )
 	{
-		p = pPool->Alloc();
+		p = PoolAlloc( pPool );
 		if ( p )
 		{
 	return p;
@@ -969,13 +1308,13 @@ void *CSmallBlockHeap::Realloc( void *p, size_t nBytes )
 
 	if ( pNewPool )
 	{
-		pNewBlock = pNewPool->Alloc();
+		pNewBlock = PoolAlloc( pNewPool );
 
 	if ( !pNewBlock )
 	{
 			if ( s_StdMemAlloc.CallAllocFailHandler( nBytes ) >= nBytes )
 			{
-				pNewBlock = pNewPool->Alloc();
+				pNewBlock = PoolAlloc( pNewPool );
 			}
 		}
 	}
@@ -991,20 +1330,20 @@ void *CSmallBlockHeap::Realloc( void *p, size_t nBytes )
 
 	if ( pNewBlock )
 	{
-		int nBytesCopy = min( nBytes, pOldPool->GetBlockSize() );
+		int nBytesCopy = MIN( nBytes, pOldPool->GetBlockSize() );
 		memcpy( pNewBlock, p, nBytesCopy );
 	} 
 
-	pOldPool->Free( p );
+	PoolFree( pOldPool, p );
 
 	return pNewBlock;
 }
 
-void CSmallBlockHeap::Free( void *p )
+inline void CSmallBlockHeap::Free( void *p )
 	{
 	CSmallBlockPool *pPool = FindPool( p );
-		pPool->Free( p );
-	}
+	PoolFree( pPool, p );
+}
 
 size_t CSmallBlockHeap::GetSize( void *p )
 {
@@ -1014,20 +1353,37 @@ size_t CSmallBlockHeap::GetSize( void *p )
 
 void CSmallBlockHeap::DumpStats( FILE *pFile )
 {
+	if ( !UsingSBH() )
+	{
+		return;
+	}
+
 	bool bSpew = true;
 
+	// Blocks in thread caches are neither in use nor free in the pool, report them on their own
+	int nCached[NUM_POOLS];
+	for ( int i = 0; i < NUM_POOLS; i++ )
+	{
+#ifdef MEM_SBH_THREAD_CACHE
+		nCached[i] = CountCachedBlocks( i );
+#else
+		nCached[i] = 0;
+#endif
+	}
+
 	if ( pFile )
 	{
 		for ( int i = 0; i < NUM_POOLS; i++ )
 		{
 			// output for vxconsole parsing
-			fprintf( pFile, "Pool %i: Size: %llu Allocated: %i Free: %i Committed: %i CommittedSize: %i\n", 
+			fprintf( pFile, "Pool %i: Size: %llu Allocated: %i Free: %i Committed: %i CommittedSize: %i Cached: %i\n", 
 				i, 
 				(uint64)m_Pools[i].GetBlockSize(), 
-				m_Pools[i].CountAllocatedBlocks(), 
+				m_Pools[i].CountAllocatedBlocks() - nCached[i], 
 				m_Pools[i].CountFreeBlocks(),
 				m_Pools[i].CountCommittedBlocks(), 
-				m_Pools[i].GetCommittedSize() );
+				m_Pools[i].GetCommittedSize(),
+				nCached[i] );
 		}
 		bSpew = false;
 	}
@@ -1036,16 +1392,19 @@ void CSmallBlockHeap::DumpStats( FILE *pFile )
 	{
 		unsigned bytesCommitted = 0;
 		unsigned bytesAllocated = 0;
+		unsigned bytesCached = 0;
 
 		for ( int i = 0; i < NUM_POOLS; i++ )
 		{
-			Msg( "Pool %i: (size: %llu) blocks: allocated:%i free:%i committed:%i (committed size:%u kb)\n",i, (uint64)m_Pools[i].GetBlockSize(),m_Pools[i].CountAllocatedBlocks(), m_Pools[i].CountFreeBlocks(),m_Pools[i].CountCommittedBlocks(), m_Pools[i].GetCommittedSize() / 1024);
+			int nAllocated = m_Pools[i].CountAllocatedBlocks() - nCached[i];
+			Msg( "Pool %i: (size: %llu) blocks: allocated:%i free:%i cached:%i committed:%i (committed size:%u kb)\n",i, (uint64)m_Pools[i].GetBlockSize(), nAllocated, m_Pools[i].CountFreeBlocks(), nCached[i], m_Pools[i].CountCommittedBlocks(), m_Pools[i].GetCommittedSize() / 1024);
 
 			bytesCommitted += m_Pools[i].GetCommittedSize();
-			bytesAllocated += ( m_Pools[i].CountAllocatedBlocks() * m_Pools[i].GetBlockSize() );
+			bytesAllocated += ( nAllocated * m_Pools[i].GetBlockSize() );
+			bytesCached += ( nCached[i] * m_Pools[i].GetBlockSize() );
 		}
 
-		Msg( "Totals: Committed:%u kb Allocated:%u kb\n", bytesCommitted / 1024, bytesAllocated / 1024 );
+		Msg( "Totals: Committed:%u kb Allocated:%u kb Cached:%u kb\n", bytesCommitted / 1024, bytesAllocated / 1024, bytesCached / 1024 );
 	}
 }
 
@@ -1059,12 +1418,12 @@ int CSmallBlockHeap::Compact()
 	return nBytesFreed;
 }
 
-CSmallBlockPool *CSmallBlockHeap::FindPool( size_t nBytes )
+inline CSmallBlockPool *CSmallBlockHeap::FindPool( size_t nBytes )
 {
 	return m_PoolLookup[(nBytes - 1) >> 2];
 }
 
-CSmallBlockPool *CSmallBlockHeap::FindPool( void *p )
+inline CSmallBlockPool *CSmallBlockHeap::FindPool( void *p )
 {
 	size_t i = ((byte *)p - m_pBase) / MAX_POOL_REGION;
 	return &m_Pools[i];
@@ -1384,7 +1743,7 @@ void *CX360SmallBlockHeap::Realloc( void *p, size_t nBytes )
 
 	if ( pNewBlock )
 	{
-		int nBytesCopy = min( nBytes, pOldPool->GetBlockSize() );
+		int nBytesCopy = MIN( nBytes, pOldPool->GetBlockSize() );
 		memcpy( pNewBlock, p, nBytesCopy );
 	}
 
@@ -1469,7 +1828,7 @@ void *CStdMemAlloc::Alloc( size_t nSize )
 	
 	void *pMem;
 
-#ifdef _WIN32
+#ifdef MEM_SBH_ENABLED
 #ifdef USE_PHYSICAL_SMALL_BLOCK_HEAP
 	if ( m_LargePageSmallBlockHeap.ShouldUse( nSize ) )
 		{
@@ -1614,7 +1973,11 @@ size_t CStdMemAlloc::GetSize( void *pMem )
 		{
 			return m_SmallBlockHeap.GetSize( pMem );
 		}
+#ifdef _WIN32
 		return _msize( pMem );
+#else
+		return malloc_usable_size( pMem );
+#endif
 	}
 #else
 	return malloc_usable_size( pMem );
@@ -1703,11 +2066,15 @@ void CStdMemAlloc::DumpStats()
 
 void CStdMemAlloc::DumpStatsFileBase( char const *pchFileBase )
 {
-#ifdef _WIN32
+#ifdef MEM_SBH_ENABLED
 	char filename[ 512 ];
 	_snprintf( filename, sizeof( filename ) - 1, ( IsX360() ) ? "D:\\%s.txt" : "%s.txt", pchFileBase );
 	filename[ sizeof( filename ) - 1 ] = 0;
 	FILE *pFile = fopen( filename, "wt" );
+	if ( !pFile )
+	{
+		return;
+	}
 #ifdef USE_PHYSICAL_SMALL_BLOCK_HEAP
 	fprintf( pFile, "X360 Large Page SBH:\n" );
 	m_LargePageSmallBlockHeap.DumpStats(pFile);
@@ -1759,9 +2126,21 @@ void CStdMemAlloc::GlobalMemoryStatus( size_t *pUsedMemory, size_t *pFreeMemory
 #endif
 }
 
+#if defined( POSIX ) && !defined( NO_SBH ) && defined( MEM_SBH_ENABLED )
+PLATFORM_INTERFACE bool MemAlloc_EnableSmallBlockHeap()
+{
+	return s_StdMemAlloc.m_SmallBlockHeap.Enable();
+}
+#elif defined( POSIX )
+PLATFORM_INTERFACE bool MemAlloc_EnableSmallBlockHeap()
+{
+	return false;
+}
+#endif
+
 void CStdMemAlloc::CompactHeap()
 {
-#if !defined( NO_SBH ) && defined( _WIN32 )
+#if !defined( NO_SBH ) && defined( MEM_SBH_ENABLED )
 	int nBytesRecovered = m_SmallBlockHeap.Compact();
 	Msg( "Compact freed %d bytes\n", nBytesRecovered );
 #endif
@@ -30,7 +30,11 @@
 #include "tier0/tslist.h"
 #include "mem_helpers.h"
 
+// GCC lets the pack cap the alignment of ALIGN16 members too, and the free lists
+// of the small block heap need theirs
+#ifndef POSIX
 #pragma pack(4)
+#endif
 
 #ifdef _X360
 #define USE_PHYSICAL_SMALL_BLOCK_HEAP 1
@@ -43,7 +47,11 @@
 #define MIN_SBH_BLOCK	8
 #define MIN_SBH_ALIGN	8
 #define MAX_SBH_BLOCK	2048
+#if defined( LINUX ) && defined( PLATFORM_64BITS )
+#define MAX_POOL_REGION (32*1024*1024)	// Address space is cheap, and a full pool falls back to libc
+#else
 #define MAX_POOL_REGION (4*1024*1024)
+#endif
 #if !defined(_X360)
 #define SBH_PAGE_SIZE		(4*1024)
 #define COMMIT_SIZE		(16*SBH_PAGE_SIZE)
@@ -51,28 +59,33 @@
 #define SBH_PAGE_SIZE		(64*1024)
 #define COMMIT_SIZE		(SBH_PAGE_SIZE)
 #endif
-#if _M_X64
+#ifdef PLATFORM_64BITS
 #define NUM_POOLS		34
 #else
 #define NUM_POOLS		42
 #endif
 
-// SBH not enabled for LINUX right now. Unlike on Windows, we can't globally hook malloc. Well,
-//  we can and did in override_init_hook(), but that unfortunately causes all malloc functions
-//	to get hooked - including the nVidia driver, etc. And these hooks appear to happen after
-//	nVidia has alloc'd some memory and it crashes when they try to free that.
-// So we need things to work without this global hook - which means we rely on memdbgon.h / memdbgoff.h.
-//  Unfortunately, that stuff always comes in source files after the headers are included, and
-//  that means any alloc calls in the header files call the real libc functions. It's a mess.
-// I believe I've cleaned most of it up, and it appears to be working. However right now we are totally
-// 	gated on other performance issues, and the SBH doesn't give us any win, so I've disabled it for now.
-// Once those perf issues are worked out, it might make sense to do perf tests with SBH, libc, and tcmalloc.
-//
-//$ #if defined( _WIN32 ) || defined( _PS3 ) || defined( LINUX )
-#if defined( _WIN32 ) || defined( _PS3 )
+// Unlike on Windows, we can't globally hook malloc on LINUX. Well, we can and did in
+//  override_init_hook(), but that unfortunately causes all malloc functions to get hooked -
+//	including the nVidia driver, etc. And these hooks appear to happen after nVidia has
+//	alloc'd some memory and it crashes when they try to free that.
+// So the SBH only sees what comes through g_pMemAlloc: new/delete and memdbgon.h mapped calls.
+//  Blocks libc hands out are still freed by libc, as the SBH only claims addresses in its own
+//  reservation. The reverse can't be caught: a free() in a header included ahead of
+//  memdbgon.h, or in code built without it, can be handed a block that came from the SBH,
+//  and libc then corrupts its heap or aborts.
+// That's why on LINUX the SBH is compiled in but only turned on by -sbh on the command line
+//  (or MemAlloc_EnableSmallBlockHeap() for tests), for perf tests against libc. With it on,
+//  each thread keeps a small cache of blocks per pool and trades whole batches of them with
+//  the pools, so threads allocating and freeing in parallel rarely touch shared state.
+#if defined( _WIN32 ) || defined( _PS3 ) || defined( LINUX )
 #define MEM_SBH_ENABLED 1
 #endif
 
+#ifdef LINUX
+#define MEM_SBH_THREAD_CACHE 1
+#endif
+
 class ALIGN16 CSmallBlockPool
 {
 public:
@@ -87,7 +100,16 @@ public:
 	int CountAllocatedBlocks();
 	int Compact();
 
+#ifdef MEM_SBH_THREAD_CACHE
+	// Thread caches take and return blocks a batch at a time, as chains linked through
+	// the first word of each block
+	int GetBatchSize();
+	int AllocBatch( void **ppHead );
+	void FreeBatch( void *pHead );
+#endif
+
 private:
+	byte *AllocFresh( int &nBlocks );
 
 	typedef TSLNodeBase_t FreeBlock_t;
 	class CFreeList : public CTSListBase
@@ -97,6 +119,10 @@ private:
 	};
 
 	CFreeList		m_FreeList;
+#ifdef MEM_SBH_THREAD_CACHE
+	CFreeList		m_BatchList;		// Full batches, the head block of each links the rest through its second word
+	int				m_nBatchSize;
+#endif
 
 	unsigned		m_nBlockSize;
 
@@ -109,10 +135,29 @@ private:
 } ALIGN16_POST;
 
 
+#ifdef MEM_SBH_THREAD_CACHE
+struct SBHThreadCache_t
+{
+	struct Bin_t
+	{
+		void *	m_pHead;
+		int		m_nCount;
+	};
+
+	Bin_t				m_Bins[NUM_POOLS];
+	SBHThreadCache_t *	m_pPrev;
+	SBHThreadCache_t *	m_pNext;
+	int					m_nState;
+};
+#endif
+
 class ALIGN16 CSmallBlockHeap
 {
 public:
 	CSmallBlockHeap();
+#ifdef POSIX
+	bool Enable();
+#endif
 	bool ShouldUse( size_t nBytes );
 	bool IsOwner( void * p );
 	void *Alloc( size_t nBytes );
@@ -123,9 +168,22 @@ public:
 	int Compact();
 
 private:
+	void Init();
 	CSmallBlockPool *FindPool( size_t nBytes );
 	CSmallBlockPool *FindPool( void *p );
 
+	void *PoolAlloc( CSmallBlockPool *pPool );
+	void PoolFree( CSmallBlockPool *pPool, void *p );
+
+#ifdef MEM_SBH_THREAD_CACHE
+	SBHThreadCache_t *GetThreadCache();
+	static void OnThreadExit( void *pHeap );
+	int CountCachedBlocks( int iPool );
+
+	SBHThreadCache_t *m_pThreadCaches;
+	CThreadFastMutex m_ThreadCacheMutex;
+#endif
+
 	CSmallBlockPool *m_PoolLookup[MAX_SBH_BLOCK >> 2];
 	CSmallBlockPool m_Pools[NUM_POOLS];
 	byte *m_pBase;
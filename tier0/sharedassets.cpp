@@ -0,0 +1,396 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Cross-process store of immutable asset data
+//
+// Each blob is a file in the tmpfs shm_open() uses, named for its owner,
+// content hash and size. A header page ahead of the data says whether the
+// publisher finished writing it. Publishing creates the file exclusively,
+// so one process writes each blob; everyone else maps it once it's ready.
+//
+// Every process using the store holds a shared lock on a lock file. The
+// process that can take it exclusively, on start or on exit, is the only one
+// left and removes every blob, which is what cleans up after crashes. Blobs
+// a crashed publisher left half-written are replaced by whoever finds them.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "pch_tier0.h"
+#include "tier0/platform.h"
+#include "tier0/sharedassets.h"
+#include "tier0/icommandline.h"
+#include "tier0/threadtools.h"
+#include "tier0/dbg.h"
+
+#ifdef LINUX
+#include <map>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// NOTE: This has to be the last file included!
+#include "tier0/memdbgon.h"
+
+#ifdef LINUX
+
+#define SHARED_ASSET_DIR			"/dev/shm"
+#define SHARED_ASSET_PREFIX			"srcds-asset-"
+#define SHARED_ASSET_MAGIC			0x54534153	// 'SAST'
+#define SHARED_ASSET_VERSION		1
+#define SHARED_ASSET_DATA_OFFSET	4096
+
+// A blob not ready after this long was left by a publisher that died
+#define SHARED_ASSET_STALE_SECONDS	60
+
+enum SharedAssetState_t
+{
+	SHARED_ASSET_WRITING = 0,
+	SHARED_ASSET_READY,
+};
+
+struct SharedAssetHeader_t
+{
+	uint32	magic;
+	uint32	version;
+	uint32	state;
+	uint32	writerPid;
+	uint64	hash;
+	uint64	size;
+};
+
+struct SharedAssetMapping_t
+{
+	void	*pBase;
+	size_t	nMapSize;
+	bool	bPublished;
+};
+
+static CThreadFastMutex s_SharedAssetMutex;
+static bool s_bSharedAssetsInitialized = false;
+static int s_nSharedAssetLockFd = -1;
+static std::map<const void *, SharedAssetMapping_t> s_SharedAssetMappings;
+static int s_nSharedAssetFallbacks = 0;
+static uint64 s_nSharedAssetFallbackBytes = 0;
+
+//-----------------------------------------------------------------------------
+// Removes every blob this user published. Only safe with the lock file held
+// exclusively.
+//-----------------------------------------------------------------------------
+static void SharedAssets_RemoveAll()
+{
+	char szPrefix[64];
+	snprintf( szPrefix, sizeof( szPrefix ), SHARED_ASSET_PREFIX "%u-", (unsigned)geteuid() );
+	size_t nPrefixLen = strlen( szPrefix );
+
+	DIR *pDir = opendir( SHARED_ASSET_DIR );
+	if ( !pDir )
+		return;
+
+	struct dirent *pEntry;
+	while ( ( pEntry = readdir( pDir ) ) != NULL )
+	{
+		// Relative to the open directory, so no name is too long to remove
+		if ( !strncmp( pEntry->d_name, szPrefix, nPrefixLen ) )
+		{
+			unlinkat( dirfd( pDir ), pEntry->d_name, 0 );
+		}
+	}
+	closedir( pDir );
+}
+
+//-----------------------------------------------------------------------------
+// Joins the processes using the store, under s_SharedAssetMutex
+//-----------------------------------------------------------------------------
+static void SharedAssets_Init()
+{
+	s_bSharedAssetsInitialized = true;
+	if ( !CommandLine()->FindParm( "-sharedassets" ) )
+		return;
+
+	char szLockPath[MAX_PATH];
+	snprintf( szLockPath, sizeof( szLockPath ), SHARED_ASSET_DIR "/" SHARED_ASSET_PREFIX "%u.lock", (unsigned)geteuid() );
+	int fd = open( szLockPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600 );
+	if ( fd < 0 )
+	{
+		Warning( "Shared assets: can't open %s (%s), models stay private\n", szLockPath, strerror( errno ) );
+		return;
+	}
+
+	// Nobody else is using the store, so anything in it was left by a crash
+	if ( flock( fd, LOCK_EX | LOCK_NB ) == 0 )
+	{
+		SharedAssets_RemoveAll();
+	}
+
+	if ( flock( fd, LOCK_SH ) != 0 )
+	{
+		close( fd );
+		return;
+	}
+
+	s_nSharedAssetLockFd = fd;
+}
+
+//-----------------------------------------------------------------------------
+// The last process out removes the blobs
+//-----------------------------------------------------------------------------
+class CSharedAssetsShutdown
+{
+public:
+	~CSharedAssetsShutdown()
+	{
+		if ( s_nSharedAssetLockFd < 0 )
+			return;
+
+		flock( s_nSharedAssetLockFd, LOCK_UN );
+		if ( flock( s_nSharedAssetLockFd, LOCK_EX | LOCK_NB ) == 0 )
+		{
+			SharedAssets_RemoveAll();
+		}
+		close( s_nSharedAssetLockFd );
+		s_nSharedAssetLockFd = -1;
+	}
+};
+static CSharedAssetsShutdown s_SharedAssetsShutdown;
+
+bool SharedAssets_Enabled()
+{
+	if ( !s_bSharedAssetsInitialized )
+	{
+		AUTO_LOCK( s_SharedAssetMutex );
+		if ( !s_bSharedAssetsInitialized )
+		{
+			SharedAssets_Init();
+		}
+	}
+	return s_nSharedAssetLockFd >= 0;
+}
+
+//-----------------------------------------------------------------------------
+// Mappings are private so per-process writes copy pages rather than failing.
+// Unwritten pages are the published ones, shared with every process mapping them.
+//-----------------------------------------------------------------------------
+static void *SharedAssets_MapPrivate( int fd, size_t nMapSize, bool bPublished )
+{
+	void *pBase = mmap( NULL, nMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	if ( pBase == MAP_FAILED )
+		return NULL;
+
+	SharedAssetMapping_t mapping = { pBase, nMapSize, bPublished };
+	void *pData = (byte *)pBase + SHARED_ASSET_DATA_OFFSET;
+	s_SharedAssetMappings[pData] = mapping;
+	return pData;
+}
+
+//-----------------------------------------------------------------------------
+// Maps a blob another process published. Sets bStale when the blob is one a
+// dead publisher never finished.
+//-----------------------------------------------------------------------------
+static void *SharedAssets_OpenPublished( int fd, uint64 nContentHash, const void *pData, size_t nSize, bool *pbStale )
+{
+	*pbStale = false;
+
+	// Only trust blobs nobody but this user could have written
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || st.st_uid != geteuid() || ( st.st_mode & 077 ) )
+		return NULL;
+
+	SharedAssetHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	if ( pread( fd, &header, sizeof( header ), 0 ) != sizeof( header ) || header.magic != SHARED_ASSET_MAGIC || header.state != SHARED_ASSET_READY )
+	{
+		// Still being written, unless its publisher is gone
+		bool bWriterDead = ( header.magic == SHARED_ASSET_MAGIC && header.writerPid && kill( header.writerPid, 0 ) != 0 && errno == ESRCH );
+		*pbStale = bWriterDead || ( time( NULL ) - st.st_mtime > SHARED_ASSET_STALE_SECONDS );
+		return NULL;
+	}
+
+	size_t nMapSize = SHARED_ASSET_DATA_OFFSET + nSize;
+	if ( header.version != SHARED_ASSET_VERSION || header.hash != nContentHash || header.size != nSize || (size_t)st.st_size != nMapSize )
+		return NULL;
+
+	void *pMapping = SharedAssets_MapPrivate( fd, nMapSize, false );
+
+	// The hash picks the blob, the contents have to match to use it
+	if ( pMapping && memcmp( pMapping, pData, nSize ) )
+	{
+		SharedAssets_Release( pMapping );
+		return NULL;
+	}
+	return pMapping;
+}
+
+//-----------------------------------------------------------------------------
+// Creates a blob, fails with EEXIST when another process got there first
+//-----------------------------------------------------------------------------
+static void *SharedAssets_Publish( const char *pszPath, uint64 nContentHash, const void *pData, size_t nSize )
+{
+	int fd = open( pszPath, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600 );
+	if ( fd < 0 )
+		return NULL;
+
+	// Reserve the space up front, running out of tmpfs while writing would be a SIGBUS
+	size_t nMapSize = SHARED_ASSET_DATA_OFFSET + nSize;
+	void *pWrite = MAP_FAILED;
+	if ( posix_fallocate( fd, 0, nMapSize ) == 0 )
+	{
+		pWrite = mmap( NULL, nMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	}
+	if ( pWrite == MAP_FAILED )
+	{
+		unlink( pszPath );
+		close( fd );
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	SharedAssetHeader_t *pHeader = (SharedAssetHeader_t *)pWrite;
+	pHeader->magic = SHARED_ASSET_MAGIC;
+	pHeader->version = SHARED_ASSET_VERSION;
+	pHeader->writerPid = getpid();
+	pHeader->hash = nContentHash;
+	pHeader->size = nSize;
+	memcpy( (byte *)pWrite + SHARED_ASSET_DATA_OFFSET, pData, nSize );
+	__atomic_store_n( &pHeader->state, (uint32)SHARED_ASSET_READY, __ATOMIC_RELEASE );
+	munmap( pWrite, nMapSize );
+
+	void *pMapping = SharedAssets_MapPrivate( fd, nMapSize, true );
+	close( fd );
+	return pMapping;
+}
+
+void *SharedAssets_Map( uint64 nContentHash, const void *pData, size_t nSize )
+{
+	if ( !nSize || !SharedAssets_Enabled() )
+		return NULL;
+
+	AUTO_LOCK( s_SharedAssetMutex );
+
+	char szPath[MAX_PATH];
+	snprintf( szPath, sizeof( szPath ), SHARED_ASSET_DIR "/" SHARED_ASSET_PREFIX "%u-%016llx-%llx", (unsigned)geteuid(), (unsigned long long)nContentHash, (unsigned long long)nSize );
+
+	void *pMapping = NULL;
+	for ( int nAttempt = 0; nAttempt < 2 && !pMapping; nAttempt++ )
+	{
+		int fd = open( szPath, O_RDONLY | O_CLOEXEC );
+		if ( fd >= 0 )
+		{
+			bool bStale;
+			pMapping = SharedAssets_OpenPublished( fd, nContentHash, pData, nSize, &bStale );
+			close( fd );
+			if ( pMapping || !bStale )
+				break;
+
+			unlink( szPath );
+		}
+		else if ( errno == ENOENT )
+		{
+			pMapping = SharedAssets_Publish( szPath, nContentHash, pData, nSize );
+			if ( !pMapping && errno != EEXIST )
+				break;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if ( !pMapping )
+	{
+		s_nSharedAssetFallbacks++;
+		s_nSharedAssetFallbackBytes += nSize;
+	}
+	return pMapping;
+}
+
+bool SharedAssets_Owns( const void *pMapping )
+{
+	if ( s_nSharedAssetLockFd < 0 )
+		return false;
+
+	AUTO_LOCK( s_SharedAssetMutex );
+	return s_SharedAssetMappings.find( pMapping ) != s_SharedAssetMappings.end();
+}
+
+void SharedAssets_Release( void *pMapping )
+{
+	AUTO_LOCK( s_SharedAssetMutex );
+	std::map<const void *, SharedAssetMapping_t>::iterator it = s_SharedAssetMappings.find( pMapping );
+	if ( it == s_SharedAssetMappings.end() )
+	{
+		AssertMsg( 0, "Releasing memory the shared asset store doesn't own" );
+		return;
+	}
+
+	// The blob stays published for the next load, here or elsewhere
+	munmap( it->second.pBase, it->second.nMapSize );
+	s_SharedAssetMappings.erase( it );
+}
+
+//-----------------------------------------------------------------------------
+// Resident bytes come from the kernel's view of each blob mapping
+//-----------------------------------------------------------------------------
+void SharedAssets_GetStats( SharedAssetStats_t *pStats )
+{
+	memset( pStats, 0, sizeof( *pStats ) );
+
+	AUTO_LOCK( s_SharedAssetMutex );
+	pStats->nFallbacks = s_nSharedAssetFallbacks;
+	pStats->nFallbackBytes = s_nSharedAssetFallbackBytes;
+
+	std::map<const void *, SharedAssetMapping_t>::iterator it;
+	for ( it = s_SharedAssetMappings.begin(); it != s_SharedAssetMappings.end(); ++it )
+	{
+		pStats->nMapped++;
+		pStats->nPublished += it->second.bPublished ? 1 : 0;
+		pStats->nMappedBytes += it->second.nMapSize - SHARED_ASSET_DATA_OFFSET;
+	}
+
+	FILE *fp = fopen( "/proc/self/smaps", "r" );
+	if ( !fp )
+		return;
+
+	char szLine[1024];
+	bool bInBlob = false;
+	while ( fgets( szLine, sizeof( szLine ), fp ) )
+	{
+		unsigned long nStart, nEnd;
+		if ( sscanf( szLine, "%lx-%lx", &nStart, &nEnd ) == 2 )
+		{
+			bInBlob = ( strstr( szLine, SHARED_ASSET_DIR "/" SHARED_ASSET_PREFIX ) != NULL );
+			continue;
+		}
+
+		unsigned long nKB;
+		if ( !bInBlob )
+			continue;
+		if ( sscanf( szLine, "Shared_Clean: %lu kB", &nKB ) == 1 || sscanf( szLine, "Shared_Dirty: %lu kB", &nKB ) == 1 )
+		{
+			pStats->nSharedBytes += (uint64)nKB * 1024;
+		}
+		else if ( sscanf( szLine, "Private_Clean: %lu kB", &nKB ) == 1 || sscanf( szLine, "Private_Dirty: %lu kB", &nKB ) == 1 )
+		{
+			pStats->nPrivateBytes += (uint64)nKB * 1024;
+		}
+	}
+	fclose( fp );
+}
+
+#else
+
+bool SharedAssets_Enabled()																		{ return false; }
+void *SharedAssets_Map( uint64 nContentHash, const void *pData, size_t nSize )					{ return NULL; }
+bool SharedAssets_Owns( const void *pMapping )													{ return false; }
+void SharedAssets_Release( void *pMapping )														{}
+void SharedAssets_GetStats( SharedAssetStats_t *pStats )										{ memset( pStats, 0, sizeof( *pStats ) ); }
+
+#endif // LINUX
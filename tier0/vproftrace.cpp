@@ -0,0 +1,424 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-thread event trace of VProf scopes and thread pool jobs
+//
+// Each thread appends to a ring of its own and publishes an event by bumping
+// its write count, so recording is a TSC read and two stores. The writer
+// never waits for a reader: a reader copies a ring and then throws away the
+// part of the copy the writer may have lapped while it was copying.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "pch_tier0.h"
+#include "tier0/platform.h"
+#include "tier0/vproftrace.h"
+#include "tier0/threadtools.h"
+#include "tier0/dbg.h"
+#include <stdio.h>
+#include <stdarg.h>
+
+// NOTE: This has to be the last file included!
+#include "tier0/memdbgon.h"
+
+#define VPROFTRACE_RING_EVENTS		( 64 * 1024 )		// Per thread, a power of two
+#define VPROFTRACE_RING_MASK		( VPROFTRACE_RING_EVENTS - 1 )
+#define VPROFTRACE_NAME_CACHE		64					// Per thread, a power of two
+#define VPROFTRACE_MAX_JOB_NAMES	1024
+#define VPROFTRACE_WRITE_BUFFER		( 16 * 1024 )
+
+bool g_bVProfTraceEnabled = false;
+
+// The event type lives in the low bits of the time stamp
+struct TraceEvent_t
+{
+	uint64			m_nStamp;
+	const tchar *	m_pszName;
+
+	VProfTraceEvent_t GetType() const	{ return (VProfTraceEvent_t)( m_nStamp & 3 ); }
+	uint64 GetTime() const				{ return m_nStamp & ~(uint64)3; }
+};
+
+static inline uint32 HashJobName( const char *pszName )
+{
+	uint32 nHash = 2166136261u;
+	for ( ; *pszName; ++pszName )
+	{
+		nHash = ( nHash ^ (uint8)*pszName ) * 16777619u;
+	}
+	return nHash;
+}
+
+//-----------------------------------------------------------------------------
+// Job names, copied once and kept for the life of the process
+//-----------------------------------------------------------------------------
+static const char *s_JobNames[VPROFTRACE_MAX_JOB_NAMES];
+static uint32 s_JobNameHashes[VPROFTRACE_MAX_JOB_NAMES];
+static CThreadFastMutex s_JobNamesMutex;
+
+static const char *InternJobName( const char *pszName, uint32 nHash )
+{
+	AUTO_LOCK( s_JobNamesMutex );
+	for ( int i = nHash & ( VPROFTRACE_MAX_JOB_NAMES - 1 ), nProbes = 0; nProbes < VPROFTRACE_MAX_JOB_NAMES; i = ( i + 1 ) & ( VPROFTRACE_MAX_JOB_NAMES - 1 ), ++nProbes )
+	{
+		if ( !s_JobNames[i] )
+		{
+			size_t nLength = strlen( pszName ) + 1;
+			char *pszCopy = new char[nLength];
+			memcpy( pszCopy, pszName, nLength );
+			s_JobNameHashes[i] = nHash;
+			s_JobNames[i] = pszCopy;
+			return pszCopy;
+		}
+		if ( s_JobNameHashes[i] == nHash && !strcmp( s_JobNames[i], pszName ) )
+			return s_JobNames[i];
+	}
+	return "Job";
+}
+
+//-----------------------------------------------------------------------------
+// One thread's events
+//-----------------------------------------------------------------------------
+class CVProfTraceRing
+{
+public:
+	CVProfTraceRing();
+
+	void Record( VProfTraceEvent_t type, const tchar *pszName )
+	{
+		uint32 nWritten = m_nWritten;
+		TraceEvent_t &event = m_pEvents[nWritten & VPROFTRACE_RING_MASK];
+		event.m_nStamp = ( Plat_Rdtsc() & ~(uint64)3 ) | type;
+		event.m_pszName = pszName;
+		if ( ( nWritten & VPROFTRACE_RING_MASK ) == VPROFTRACE_RING_MASK )
+		{
+			m_bWrapped = true;
+		}
+		ThreadMemoryBarrier();
+		m_nWritten = nWritten + 1;
+	}
+
+	const char *GetJobName( const char *pszDescription );
+
+	// Copies the ring oldest first, returns the number of events copied
+	int Snapshot( TraceEvent_t *pEvents ) const;
+
+	ThreadId_t GetThreadId() const	{ return m_nThreadId; }
+	const char *GetName() const		{ return m_szName; }
+
+	CVProfTraceRing *m_pNext;
+
+private:
+	struct NameCacheEntry_t
+	{
+		uint32			m_nHash;
+		const char *	m_pszName;
+	};
+
+	TraceEvent_t *		m_pEvents;
+	volatile uint32		m_nWritten;
+	volatile bool		m_bWrapped;
+	ThreadId_t			m_nThreadId;
+	char				m_szName[32];
+	NameCacheEntry_t	m_NameCache[VPROFTRACE_NAME_CACHE];
+};
+
+CVProfTraceRing::CVProfTraceRing()
+{
+	m_pEvents = new TraceEvent_t[VPROFTRACE_RING_EVENTS];
+	m_nWritten = 0;
+	m_bWrapped = false;
+	m_nThreadId = ThreadGetCurrentId();
+	memset( m_NameCache, 0, sizeof( m_NameCache ) );
+	m_pNext = NULL;
+
+	CThread *pThread = CThread::GetCurrentCThread();
+	if ( pThread && pThread->GetName()[0] )
+	{
+		snprintf( m_szName, sizeof( m_szName ), "%s", pThread->GetName() );
+	}
+	else if ( ThreadInMainThread() )
+	{
+		snprintf( m_szName, sizeof( m_szName ), "Main" );
+	}
+	else
+	{
+		snprintf( m_szName, sizeof( m_szName ), "Thread %u", (uint)m_nThreadId );
+	}
+}
+
+// Job descriptions are short and few, a thread sees the same handful every tick
+const char *CVProfTraceRing::GetJobName( const char *pszDescription )
+{
+	uint32 nHash = HashJobName( pszDescription );
+	NameCacheEntry_t &entry = m_NameCache[nHash & ( VPROFTRACE_NAME_CACHE - 1 )];
+	if ( !entry.m_pszName || entry.m_nHash != nHash || strcmp( entry.m_pszName, pszDescription ) )
+	{
+		entry.m_nHash = nHash;
+		entry.m_pszName = InternJobName( pszDescription, nHash );
+	}
+	return entry.m_pszName;
+}
+
+int CVProfTraceRing::Snapshot( TraceEvent_t *pEvents ) const
+{
+	uint32 nEnd = m_nWritten;
+	ThreadMemoryBarrier();
+	uint32 nCount = m_bWrapped ? VPROFTRACE_RING_EVENTS : nEnd;
+
+	uint32 nFirst = nEnd - nCount;
+	for ( uint32 i = 0; i < nCount; i++ )
+	{
+		pEvents[i] = m_pEvents[( nFirst + i ) & VPROFTRACE_RING_MASK];
+	}
+
+	// Whatever the writer added meanwhile has overwritten as many of the oldest
+	ThreadMemoryBarrier();
+	uint32 nLapped = MIN( m_nWritten - nEnd, nCount );
+	if ( nLapped )
+	{
+		memmove( pEvents, pEvents + nLapped, ( nCount - nLapped ) * sizeof( TraceEvent_t ) );
+	}
+	return nCount - nLapped;
+}
+
+//-----------------------------------------------------------------------------
+// Rings are made on a thread's first event and kept, with the events of
+// threads that have exited, for the life of the process
+//-----------------------------------------------------------------------------
+static CTHREADLOCALPTR( CVProfTraceRing ) s_pThreadRing;
+static CVProfTraceRing *s_pRings;
+static CThreadFastMutex s_RingsMutex;
+
+// Time stamps are converted with the rate measured since tracing started
+static uint64 s_nEnableStamp;
+static double s_flEnableTime;
+
+static int s_nEnableCount;
+
+static CVProfTraceRing *GetThreadRing()
+{
+	CVProfTraceRing *pRing = s_pThreadRing;
+	if ( !pRing )
+	{
+		pRing = new CVProfTraceRing;
+		s_pThreadRing = pRing;
+
+		AUTO_LOCK( s_RingsMutex );
+		pRing->m_pNext = s_pRings;
+		s_pRings = pRing;
+	}
+	return pRing;
+}
+
+void VProfTrace_Enable( bool bEnable )
+{
+	if ( bEnable )
+	{
+		if ( s_nEnableCount++ == 0 )
+		{
+			s_nEnableStamp = Plat_Rdtsc();
+			s_flEnableTime = Plat_FloatTime();
+		}
+	}
+	else
+	{
+		AssertMsg( s_nEnableCount > 0, "VProfTrace_Enable( false ) without a matching enable" );
+		s_nEnableCount = MAX( s_nEnableCount - 1, 0 );
+	}
+	g_bVProfTraceEnabled = ( s_nEnableCount > 0 );
+}
+
+void VProfTrace_Record( VProfTraceEvent_t type, const tchar *pszName )
+{
+	GetThreadRing()->Record( type, pszName );
+}
+
+void VProfTrace_RecordJob( VProfTraceEvent_t type, const char *pszDescription )
+{
+	CVProfTraceRing *pRing = GetThreadRing();
+	pRing->Record( type, pszDescription ? pRing->GetJobName( pszDescription ) : NULL );
+}
+
+//-----------------------------------------------------------------------------
+// Chrome trace event JSON
+//-----------------------------------------------------------------------------
+class CTraceWriter
+{
+public:
+	CTraceWriter( VProfTraceWriteFunc_t pfnWrite, void *pContext ) : m_pfnWrite( pfnWrite ), m_pContext( pContext ), m_nUsed( 0 ) {}
+	~CTraceWriter()	{ Flush(); }
+
+	void Printf( PRINTF_FORMAT_STRING const char *pszFormat, ... ) FMTFUNCTION( 2, 3 )
+	{
+		if ( m_nUsed > VPROFTRACE_WRITE_BUFFER - 256 )
+		{
+			Flush();
+		}
+
+		va_list args;
+		va_start( args, pszFormat );
+		int nLength = vsnprintf( m_Buffer + m_nUsed, sizeof( m_Buffer ) - m_nUsed, pszFormat, args );
+		va_end( args );
+		if ( nLength > 0 )
+		{
+			m_nUsed = MIN( m_nUsed + nLength, (int)sizeof( m_Buffer ) - 1 );
+		}
+	}
+
+	void Write( const char *pData, int nLength )
+	{
+		if ( m_nUsed + nLength > (int)sizeof( m_Buffer ) )
+		{
+			Flush();
+			if ( nLength > (int)sizeof( m_Buffer ) )
+			{
+				m_pfnWrite( pData, nLength, m_pContext );
+				return;
+			}
+		}
+		memcpy( m_Buffer + m_nUsed, pData, nLength );
+		m_nUsed += nLength;
+	}
+
+	void String( const char *pszString )
+	{
+		Put( '"' );
+		for ( const char *p = pszString; *p; ++p )
+		{
+			if ( *p == '"' || *p == '\\' )
+			{
+				Put( '\\' );
+				Put( *p );
+			}
+			else if ( (uint8)*p < ' ' )
+			{
+				Printf( "\\u%04x", (uint8)*p );
+			}
+			else
+			{
+				Put( *p );
+			}
+		}
+		Put( '"' );
+	}
+
+	void Flush()
+	{
+		if ( m_nUsed )
+		{
+			m_pfnWrite( m_Buffer, m_nUsed, m_pContext );
+			m_nUsed = 0;
+		}
+	}
+
+private:
+	void Put( char c )
+	{
+		if ( m_nUsed == sizeof( m_Buffer ) )
+		{
+			Flush();
+		}
+		m_Buffer[m_nUsed++] = c;
+	}
+
+	VProfTraceWriteFunc_t	m_pfnWrite;
+	void *					m_pContext;
+	int						m_nUsed;
+	char					m_Buffer[VPROFTRACE_WRITE_BUFFER];
+};
+
+double VProfTrace_GetTicksPerSecond()
+{
+	double flElapsed = Plat_FloatTime() - s_flEnableTime;
+	if ( s_nEnableStamp && flElapsed > 0.1 )
+		return ( Plat_Rdtsc() - s_nEnableStamp ) / flElapsed;
+	return (double)GetCPUInformation()->m_Speed;
+}
+
+int VProfTrace_WriteChromeTrace( float flSeconds, VProfTraceWriteFunc_t pfnWrite, void *pContext )
+{
+	uint64 nNowStamp = Plat_Rdtsc();
+	uint64 nWindow = (uint64)( flSeconds * VProfTrace_GetTicksPerSecond() );
+	return VProfTrace_WriteChromeTraceFrom( ( nWindow < nNowStamp ) ? nNowStamp - nWindow : 0, NULL, NULL, pfnWrite, pContext );
+}
+
+int VProfTrace_WriteChromeTraceFrom( uint64 nStartStamp, const char *pszExtraEvents, const char *pszOtherData, VProfTraceWriteFunc_t pfnWrite, void *pContext )
+{
+	double flTicksPerSecond = VProfTrace_GetTicksPerSecond();
+	if ( flTicksPerSecond <= 0.0 )
+		return 0;
+
+	double flMicrosecondsPerTick = 1000000.0 / flTicksPerSecond;
+
+	CTraceWriter *pWriter = new CTraceWriter( pfnWrite, pContext );
+	TraceEvent_t *pEvents = new TraceEvent_t[VPROFTRACE_RING_EVENTS];
+	int nWritten = 0;
+
+	pWriter->Printf( "{\"displayTimeUnit\":\"ms\",\"otherData\":{" );
+	if ( pszOtherData )
+	{
+		pWriter->Write( pszOtherData, strlen( pszOtherData ) );
+	}
+	pWriter->Printf( "},\"traceEvents\":[\n" );
+
+	CVProfTraceRing *pRings;
+	{
+		AUTO_LOCK( s_RingsMutex );
+		pRings = s_pRings;
+	}
+
+	// Rings are only ever pushed on the front, the ones after the head stay put
+	for ( CVProfTraceRing *pRing = pRings; pRing; pRing = pRing->m_pNext )
+	{
+		uint tid = (uint)pRing->GetThreadId();
+		pWriter->Printf( "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":", nWritten ? ",\n" : "", tid );
+		pWriter->String( pRing->GetName() );
+		pWriter->Printf( "}}" );
+		nWritten++;
+
+		int nEvents = pRing->Snapshot( pEvents );
+		int nDepth = 0;
+		for ( int i = 0; i < nEvents; i++ )
+		{
+			const TraceEvent_t &event = pEvents[i];
+			if ( event.GetTime() < nStartStamp )
+				continue;
+
+			double flTime = ( event.GetTime() - nStartStamp ) * flMicrosecondsPerTick;
+			switch ( event.GetType() )
+			{
+			case VPROFTRACE_SCOPE_BEGIN:
+			case VPROFTRACE_JOB_BEGIN:
+				pWriter->Printf( ",\n{\"name\":" );
+				pWriter->String( event.m_pszName ? event.m_pszName : "?" );
+				pWriter->Printf( ",\"cat\":\"%s\",\"ph\":\"B\",\"pid\":0,\"tid\":%u,\"ts\":%.3f}", ( event.GetType() == VPROFTRACE_JOB_BEGIN ) ? "job" : "vprof", tid, flTime );
+				nDepth++;
+				break;
+
+			default:
+				// An end whose begin fell out of the window has nothing to close
+				if ( !nDepth )
+					continue;
+				pWriter->Printf( ",\n{\"ph\":\"E\",\"pid\":0,\"tid\":%u,\"ts\":%.3f}", tid, flTime );
+				nDepth--;
+				break;
+			}
+			nWritten++;
+		}
+	}
+
+	if ( pszExtraEvents && *pszExtraEvents )
+	{
+		if ( nWritten )
+		{
+			pWriter->Printf( ",\n" );
+		}
+		pWriter->Write( pszExtraEvents, strlen( pszExtraEvents ) );
+	}
+
+	pWriter->Printf( "\n]}\n" );
+	delete pWriter;
+	delete [] pEvents;
+	return nWritten;
+}
@@ -26,10 +26,12 @@
 #include "tier0/mem.h"
 #include "utlbuffer.h"
 #include "utlhash.h"
+#include "utlhashtable.h"
 #include "utlvector.h"
 #include "utlqueue.h"
 #include "UtlSortVector.h"
 #include "convar.h"
+#include "generichash.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -53,7 +55,7 @@ const int MAX_ERROR_STACK = 64;
 class CKeyValuesErrorStack
 {
 public:
-	CKeyValuesErrorStack() : m_pFilename("NULL"), m_errorIndex(0), m_maxErrorIndex(0) {}
+	CKeyValuesErrorStack() : m_pFilename("NULL"), m_errorIndex(0), m_maxErrorIndex(0), m_nErrors(0) {}
 
 	void SetFilename( const char *pFilename )
 	{
@@ -95,6 +97,7 @@ public:
 	{
 		bool bSpewCR = false;
 
+		m_nErrors++;
 		Warning( "KeyValues Error: %s in file %s\n", pError, m_pFilename );
 		for ( int i = 0; i < m_maxErrorIndex; i++ )
 		{
@@ -117,13 +120,20 @@ public:
 			Warning( "\n" );
 	}
 
+	// Errors reported so far, a parse with errors isn't cached
+	int GetErrorCount() const { return m_nErrors; }
+
 private:
 	intp		m_errorStack[MAX_ERROR_STACK];
 	const char *m_pFilename;
 	int		m_errorIndex;
 	int		m_maxErrorIndex;
+	int		m_nErrors;
 } g_KeyValuesErrorStack;
 
+// Files pulled in by #include and #base, a parse using any isn't cached
+static int s_nKeyValuesIncludes = 0;
+
 
 // a simple helper that creates stack entries as it goes in & out of scope
 class CKeyErrorContext
@@ -381,6 +391,16 @@ KeyValues::KeyValues( const char *setName )
 	SetName ( setName );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Constructor for keys that get their name symbol directly
+//-----------------------------------------------------------------------------
+KeyValues::KeyValues()
+{
+	TRACK_KV_ADD( this, "" );
+
+	Init();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Constructor
 //-----------------------------------------------------------------------------
@@ -2071,6 +2091,8 @@ void KeyValues::ParseIncludedKeys( char const *resourceName, const char *filetoi
 	Assert( resourceName );
 	Assert( filetoinclude );
 	Assert( pFileSystem );
+
+	s_nKeyValuesIncludes++;
 	
 	// Load it...
 	if ( !pFileSystem )
@@ -2220,6 +2242,92 @@ bool EvaluateConditional( const char *str )
 }
 
 
+//-----------------------------------------------------------------------------
+// Compiled form, see WriteAsCompiled. The header is followed by the offsets of
+// the distinct key names in the string pool, the keys depth first with each
+// section's keys right after it, and the string pool.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_COMPILED_ID		MAKEID( 'K', 'V', 'C', 'B' )
+#define KEYVALUES_COMPILED_VERSION	1
+
+struct KVCompiledHeader_t
+{
+	int		id;
+	int		version;
+	uint64	sourceHash;
+	uint64	payloadHash;	// everything after the header
+	int		numNames;
+	int		numKeys;
+	int		numRootKeys;	// the top level peers
+	int		stringBytes;
+};
+
+struct KVCompiledKey_t
+{
+	int		name;			// index into the name offsets
+	int		type;
+	int		value;			// int or float bits, string offset, low word of a uint64, or a section's key count
+	int		valueExtra;		// string length or high word of a uint64
+};
+
+// Deeper than the text parser allows
+#define KEYVALUES_COMPILED_MAX_DEPTH	128
+
+
+//-----------------------------------------------------------------------------
+// Opt-in (-keyvaluescache) disk cache of compiled text. Entries are named by
+// the hash of the text they were parsed from, so an edited file misses and
+// is parsed and cached again. Small files parse faster than a cache lookup.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_CACHE_DIR			"cache/keyvalues"
+#define KEYVALUES_CACHE_PATH_ID		"DEFAULT_WRITE_PATH"
+#define KEYVALUES_CACHE_MIN_SIZE	4096
+
+static bool KeyValuesCache_Enabled( IBaseFileSystem *pFileSystem, int nLen )
+{
+	static bool s_bEnabled = ( CommandLine()->FindParm( "-keyvaluescache" ) != 0 );
+	return s_bEnabled && pFileSystem && nLen >= KEYVALUES_CACHE_MIN_SIZE;
+}
+
+static void KeyValuesCache_FileName( uint64 nSourceHash, char *pFileName, int nFileNameSize )
+{
+	Q_snprintf( pFileName, nFileNameSize, KEYVALUES_CACHE_DIR "/%016llx.kvc", (unsigned long long)nSourceHash );
+}
+
+static bool KeyValuesCache_Read( KeyValues *pKeyValues, IBaseFileSystem *pFileSystem, uint64 nSourceHash )
+{
+	char szFileName[MAX_PATH];
+	KeyValuesCache_FileName( nSourceHash, szFileName, sizeof( szFileName ) );
+
+	CUtlBuffer buf;
+	if ( !pFileSystem->ReadFile( szFileName, KEYVALUES_CACHE_PATH_ID, buf ) )
+		return false;
+
+	return pKeyValues->ReadAsCompiled( buf, nSourceHash );
+}
+
+static void KeyValuesCache_Write( KeyValues *pKeyValues, IBaseFileSystem *pFileSystem, uint64 nSourceHash )
+{
+	CUtlBuffer buf;
+	if ( !pKeyValues->WriteAsCompiled( buf, nSourceHash ) )
+		return;
+
+	static bool s_bCreatedDir = false;
+	if ( !s_bCreatedDir )
+	{
+		// LoadFromFile makes the same assumption that this is a full filesystem
+		((IFileSystem *)pFileSystem)->CreateDirHierarchy( KEYVALUES_CACHE_DIR, KEYVALUES_CACHE_PATH_ID );
+		s_bCreatedDir = true;
+	}
+
+	// Processes racing to write an entry write the same bytes, and one read
+	// half written fails its payload hash and falls back to the text
+	char szFileName[MAX_PATH];
+	KeyValuesCache_FileName( nSourceHash, szFileName, sizeof( szFileName ) );
+	pFileSystem->WriteFile( szFileName, KEYVALUES_CACHE_PATH_ID, buf );
+}
+
+
 //-----------------------------------------------------------------------------
 // Read from a buffer...
 //-----------------------------------------------------------------------------
@@ -2369,6 +2477,9 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, const char *pBuffer, I
 	int nLen = Q_strlen( pBuffer );
 	CUtlBuffer buf( pBuffer, nLen, CUtlBuffer::READ_ONLY | CUtlBuffer::TEXT_BUFFER );
 
+	// Only a parse into an empty tree can be replaced by a cached one
+	bool bUseCache = KeyValuesCache_Enabled( pFileSystem, nLen ) && !m_pSub && !m_pPeer && m_iDataType == TYPE_NONE;
+
 	// Translate Unicode files into UTF-8 before proceeding
 	if ( nLen > 2 && (uint8)pBuffer[0] == 0xFF && (uint8)pBuffer[1] == 0xFE )
 	{
@@ -2376,10 +2487,33 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, const char *pBuffer, I
 		char *pUTF8Buf = new char[nUTF8Len];
 		V_UnicodeToUTF8( (wchar_t*)(pBuffer+2), pUTF8Buf, nUTF8Len );
 		buf.AssumeMemory( pUTF8Buf, nUTF8Len, nUTF8Len, CUtlBuffer::READ_ONLY | CUtlBuffer::TEXT_BUFFER );
+
+		// nLen stopped at the first zero byte, it doesn't cover the text
+		bUseCache = false;
+	}
+
+	// The parse depends on the text and on these flags only
+	uint64 nSourceHash = 0;
+	if ( bUseCache )
+	{
+		nSourceHash = MurmurHash64( pBuffer, nLen, KEYVALUES_COMPILED_VERSION | ( m_bHasEscapeSequences ? 0x100 : 0 ) | ( m_bEvaluateConditionals ? 0x200 : 0 ) );
+		if ( KeyValuesCache_Read( this, pFileSystem, nSourceHash ) )
+		{
+			COM_TimestampedLog("KeyValues::LoadFromBuffer(%s%s%s): End / CacheHit", pPathID ? pPathID : "", pPathID && resourceName ? "/" : "", resourceName ? resourceName : "");
+			return true;
+		}
 	}
 
+	int nErrors = g_KeyValuesErrorStack.GetErrorCount();
+	int nIncludes = s_nKeyValuesIncludes;
+
 	bool retVal = LoadFromBuffer( resourceName, buf, pFileSystem, pPathID );
 
+	if ( bUseCache && retVal && nErrors == g_KeyValuesErrorStack.GetErrorCount() && nIncludes == s_nKeyValuesIncludes )
+	{
+		KeyValuesCache_Write( this, pFileSystem, nSourceHash );
+	}
+
 	COM_TimestampedLog("KeyValues::LoadFromBuffer(%s%s%s): End", pPathID ? pPathID : "", pPathID && resourceName ? "/" : "", resourceName ? resourceName : "");
 
 	return retVal;
@@ -2785,6 +2919,303 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 	return buffer.IsValid();
 }
 
+//-----------------------------------------------------------------------------
+// Writes this key and its peers in the compiled form. Fails on value types
+// the text parser doesn't produce.
+//-----------------------------------------------------------------------------
+bool KeyValues::WriteAsCompiled( CUtlBuffer &buffer, uint64 nSourceHash )
+{
+	if ( buffer.IsText() ) // must be a binary buffer
+		return false;
+
+	CUtlVector< int > nameOffsets;
+	CUtlVector< KVCompiledKey_t > keys;
+	CUtlHashtable< intp, int > nameIndices;
+	CUtlBuffer strings;
+
+	// Depth first, so pending keys go on the stack in reverse
+	CUtlVector< KeyValues * > stack;
+	CUtlVector< KeyValues * > peers;
+	for ( KeyValues *dat = this; dat != NULL; dat = dat->m_pPeer )
+	{
+		peers.AddToTail( dat );
+	}
+	int numRootKeys = peers.Count();
+	for ( int i = peers.Count() - 1; i >= 0; --i )
+	{
+		stack.AddToTail( peers[i] );
+	}
+
+	while ( stack.Count() )
+	{
+		KeyValues *dat = stack.Tail();
+		stack.RemoveMultipleFromTail( 1 );
+
+		UtlHashHandle_t hName = nameIndices.Find( dat->m_iKeyName );
+		if ( hName == nameIndices.InvalidHandle() )
+		{
+			hName = nameIndices.Insert( dat->m_iKeyName, nameOffsets.Count() );
+			nameOffsets.AddToTail( strings.TellPut() );
+			strings.PutString( dat->GetName() );
+		}
+
+		KVCompiledKey_t &key = keys[ keys.AddToTail() ];
+		key.name = nameIndices[ hName ];
+		key.type = dat->m_iDataType;
+		key.value = 0;
+		key.valueExtra = 0;
+
+		if ( dat->m_pSub && dat->m_iDataType != TYPE_NONE )
+			return false;
+
+		switch ( dat->m_iDataType )
+		{
+		case TYPE_NONE:
+			{
+				peers.RemoveAll();
+				for ( KeyValues *pSub = dat->m_pSub; pSub != NULL; pSub = pSub->m_pPeer )
+				{
+					peers.AddToTail( pSub );
+				}
+				key.value = peers.Count();
+				for ( int i = peers.Count() - 1; i >= 0; --i )
+				{
+					stack.AddToTail( peers[i] );
+				}
+				break;
+			}
+		case TYPE_STRING:
+			{
+				const char *pValue = dat->m_sValue ? dat->m_sValue : "";
+				key.value = strings.TellPut();
+				key.valueExtra = Q_strlen( pValue );
+				strings.PutString( pValue );
+				break;
+			}
+		case TYPE_INT:
+		case TYPE_FLOAT:
+			{
+				// The union holds a float's bits too
+				key.value = dat->m_iValue;
+				break;
+			}
+		case TYPE_UINT64:
+			{
+				uint64 nValue = *((uint64 *)dat->m_sValue);
+				key.value = (int)(uint32)nValue;
+				key.valueExtra = (int)(uint32)( nValue >> 32 );
+				break;
+			}
+		default:
+			return false;
+		}
+	}
+
+	int nHeader = buffer.TellPut();
+	KVCompiledHeader_t header;
+	header.id = KEYVALUES_COMPILED_ID;
+	header.version = KEYVALUES_COMPILED_VERSION;
+	header.sourceHash = nSourceHash;
+	header.payloadHash = 0;
+	header.numNames = nameOffsets.Count();
+	header.numKeys = keys.Count();
+	header.numRootKeys = numRootKeys;
+	header.stringBytes = strings.TellPut();
+	buffer.Put( &header, sizeof( header ) );
+	buffer.Put( nameOffsets.Base(), nameOffsets.Count() * sizeof( int ) );
+	buffer.Put( keys.Base(), keys.Count() * sizeof( KVCompiledKey_t ) );
+	buffer.Put( strings.Base(), strings.TellPut() );
+	if ( !buffer.IsValid() )
+		return false;
+
+	KVCompiledHeader_t *pHeader = (KVCompiledHeader_t *)( (byte *)buffer.Base() + nHeader );
+	int nPayload = buffer.TellPut() - nHeader - sizeof( header );
+	pHeader->payloadHash = MurmurHash64( pHeader + 1, nPayload, KEYVALUES_COMPILED_VERSION );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Replaces this key with the tree WriteAsCompiled wrote, keeping the parse
+// flags. The whole input is checked before anything is built, so on failure
+// this key is left as it was.
+//-----------------------------------------------------------------------------
+bool KeyValues::ReadAsCompiled( CUtlBuffer &buffer, uint64 nSourceHash )
+{
+	if ( buffer.IsText() ) // must be a binary buffer
+		return false;
+
+	int nSize = buffer.GetBytesRemaining();
+	if ( nSize < (int)sizeof( KVCompiledHeader_t ) )
+		return false;
+
+	const KVCompiledHeader_t *pHeader = (const KVCompiledHeader_t *)buffer.PeekGet();
+	if ( pHeader->id != KEYVALUES_COMPILED_ID || pHeader->version != KEYVALUES_COMPILED_VERSION || pHeader->sourceHash != nSourceHash )
+		return false;
+
+	int numNames = pHeader->numNames;
+	int numKeys = pHeader->numKeys;
+	int stringBytes = pHeader->stringBytes;
+	if ( numNames < 1 || numKeys < 1 || pHeader->numRootKeys < 1 || stringBytes < 1 )
+		return false;
+
+	int64 nPayload = (int64)numNames * sizeof( int ) + (int64)numKeys * sizeof( KVCompiledKey_t ) + stringBytes;
+	if ( nPayload != nSize - (int)sizeof( KVCompiledHeader_t ) )
+		return false;
+
+	if ( MurmurHash64( pHeader + 1, (int)nPayload, KEYVALUES_COMPILED_VERSION ) != pHeader->payloadHash )
+		return false;
+
+	const int *pNameOffsets = (const int *)( pHeader + 1 );
+	const KVCompiledKey_t *pKeys = (const KVCompiledKey_t *)( pNameOffsets + numNames );
+	const char *pStrings = (const char *)( pKeys + numKeys );
+
+	// The pool ends in a terminator, so any offset into it is a valid string
+	if ( pStrings[stringBytes - 1] != 0 )
+		return false;
+
+	for ( int i = 0; i < numNames; ++i )
+	{
+		if ( pNameOffsets[i] < 0 || pNameOffsets[i] >= stringBytes )
+			return false;
+	}
+
+	// Check the keys, and that the section counts describe exactly numKeys keys
+	CUtlVector< int > remaining;
+	remaining.AddToTail( pHeader->numRootKeys );
+	for ( int i = 0; i < numKeys; ++i )
+	{
+		while ( remaining.Count() && remaining.Tail() == 0 )
+		{
+			remaining.RemoveMultipleFromTail( 1 );
+		}
+		if ( !remaining.Count() )
+			return false;
+		remaining.Tail()--;
+
+		const KVCompiledKey_t &key = pKeys[i];
+		if ( key.name < 0 || key.name >= numNames )
+			return false;
+
+		switch ( key.type )
+		{
+		case TYPE_NONE:
+			if ( key.value < 0 || key.value > numKeys - i - 1 )
+				return false;
+			if ( key.value )
+			{
+				if ( remaining.Count() >= KEYVALUES_COMPILED_MAX_DEPTH )
+					return false;
+				remaining.AddToTail( key.value );
+			}
+			break;
+		case TYPE_STRING:
+			if ( key.value < 0 || key.valueExtra < 0 || key.valueExtra >= stringBytes - key.value || pStrings[key.value + key.valueExtra] != 0 )
+				return false;
+			break;
+		case TYPE_INT:
+		case TYPE_FLOAT:
+		case TYPE_UINT64:
+			break;
+		default:
+			return false;
+		}
+	}
+	FOR_EACH_VEC( remaining, i )
+	{
+		if ( remaining[i] )
+			return false;
+	}
+
+	// One lookup per distinct name rather than one per key
+	CUtlVector< intp > symbols;
+	symbols.SetCount( numNames );
+	for ( int i = 0; i < numNames; ++i )
+	{
+		symbols[i] = s_pfGetSymbolForString( pStrings + pNameOffsets[i], true );
+	}
+
+	bool bHasEscapeSequences = ( m_bHasEscapeSequences != 0 );
+	bool bEvaluateConditionals = ( m_bEvaluateConditionals != 0 );
+	RemoveEverything(); // remove current content
+	Init();	// reset
+	UsesEscapeSequences( bHasEscapeSequences );
+	UsesConditionals( bEvaluateConditionals );
+
+	struct Section_t
+	{
+		KeyValues	*m_pParent;		// NULL for the top level
+		KeyValues	*m_pLastKey;
+		int			m_nRemaining;
+	};
+	CUtlVector< Section_t > sections;
+	Section_t &root = sections[ sections.AddToTail() ];
+	root.m_pParent = NULL;
+	root.m_pLastKey = NULL;
+	root.m_nRemaining = pHeader->numRootKeys;
+
+	for ( int i = 0; i < numKeys; ++i )
+	{
+		while ( sections.Tail().m_nRemaining == 0 )
+		{
+			sections.RemoveMultipleFromTail( 1 );
+		}
+		Section_t &section = sections.Tail();
+		section.m_nRemaining--;
+
+		const KVCompiledKey_t &key = pKeys[i];
+		KeyValues *dat;
+		if ( i == 0 )
+		{
+			dat = this;
+		}
+		else
+		{
+			dat = new KeyValues;
+			dat->UsesEscapeSequences( bHasEscapeSequences );
+			dat->UsesConditionals( bEvaluateConditionals );
+			if ( section.m_pLastKey )
+			{
+				section.m_pLastKey->m_pPeer = dat;
+			}
+			else
+			{
+				section.m_pParent->m_pSub = dat;
+			}
+		}
+		section.m_pLastKey = dat;
+
+		dat->m_iKeyName = symbols[ key.name ];
+		dat->m_iDataType = key.type;
+		switch ( key.type )
+		{
+		case TYPE_NONE:
+			if ( key.value )
+			{
+				Section_t &sub = sections[ sections.AddToTail() ];
+				sub.m_pParent = dat;
+				sub.m_pLastKey = NULL;
+				sub.m_nRemaining = key.value;
+			}
+			break;
+		case TYPE_STRING:
+			dat->m_sValue = new char[ key.valueExtra + 1 ];
+			Q_memcpy( dat->m_sValue, pStrings + key.value, key.valueExtra + 1 );
+			break;
+		case TYPE_INT:
+		case TYPE_FLOAT:
+			dat->m_iValue = key.value;
+			break;
+		case TYPE_UINT64:
+			dat->m_sValue = new char[ sizeof( uint64 ) ];
+			*((uint64 *)dat->m_sValue) = ( (uint64)(uint32)key.valueExtra << 32 ) | (uint32)key.value;
+			break;
+		}
+	}
+
+	buffer.SeekGet( CUtlBuffer::SEEK_CURRENT, nSize );
+	return true;
+}
+
 #include "tier0/memdbgoff.h"
 
 //-----------------------------------------------------------------------------
@@ -1935,3 +1935,25 @@ char * CUtlInplaceBuffer::InplaceGetLinePtr( void )
 
 	return pszLine;
 }
+
+
+//-----------------------------------------------------------------------------
+// Frame arena buffer
+//-----------------------------------------------------------------------------
+CUtlFrameArenaBuffer::CUtlFrameArenaBuffer( int nInitSize /* = 256 */, int nFlags /* = 0 */ ) :
+	CUtlBuffer( FrameArena_Alloc( MAX( nInitSize, 1 ) ), MAX( nInitSize, 1 ), nFlags )
+{
+	SetUtlBufferOverflowFuncs( &CUtlFrameArenaBuffer::GetOverflow, &CUtlFrameArenaBuffer::FrameArenaPutOverflow );
+}
+
+bool CUtlFrameArenaBuffer::FrameArenaPutOverflow( int nSize )
+{
+	int nAllocated = m_Memory.NumAllocated();
+	int nNewSize = MAX( m_Put - m_nOffset + nSize, nAllocated * 2 );
+	void *pMemory = FrameArena_Realloc( m_Memory.Base(), nAllocated, nNewSize );
+	if ( !pMemory )
+		return false;
+
+	m_Memory.SetExternalBuffer( (unsigned char *)pMemory, nNewSize );
+	return true;
+}
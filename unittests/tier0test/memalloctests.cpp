@@ -0,0 +1,267 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Stress test for the small block heap behind g_pMemAlloc, and a
+//			reproducible benchmark of it against libc malloc. Every thread
+//			churns a window of live blocks sized like the engine's small
+//			allocations (8 - 512 bytes) from a fixed seed, then frees blocks
+//			another thread allocated. Block contents are checked throughout.
+//			On Linux the small block heap is off without -sbh, so the
+//			tests turn it on first rather than benchmark libc against itself.
+//
+//=============================================================================
+
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+#include "tier0/threadtools.h"
+#include "tier0/memalloc.h"
+
+#include "unitlib/unitlib.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// No memdbgon.h here, malloc and free below have to be the libc ones
+
+DEFINE_TESTSUITE( MemAllocTestSuite )
+
+#define MA_MAX_THREADS		4
+#define MA_WINDOW			1024
+#define MA_OPERATIONS		200000
+#define MA_HANDOFF			4096
+#define MA_MIN_SIZE			8
+#define MA_MAX_SIZE			512
+
+struct MAAllocator_t
+{
+	const char *m_pName;
+	void *( *m_pfnAlloc )( size_t nSize );
+	void ( *m_pfnFree )( void *p );
+};
+
+// Everything the heap hands out from here on is freed through g_pMemAlloc, see memstd.h
+static bool MAEnableSmallBlockHeap()
+{
+#ifdef POSIX
+	return MemAlloc_EnableSmallBlockHeap();
+#else
+	return true;
+#endif
+}
+
+static void *MAHeapAlloc( size_t nSize )	{ return g_pMemAlloc->Alloc( nSize ); }
+static void MAHeapFree( void *p )			{ g_pMemAlloc->Free( p ); }
+static void *MALibcAlloc( size_t nSize )	{ return malloc( nSize ); }
+static void MALibcFree( void *p )			{ free( p ); }
+
+static const MAAllocator_t s_Allocators[] =
+{
+	{ "g_pMemAlloc", MAHeapAlloc, MAHeapFree },
+	{ "libc", MALibcAlloc, MALibcFree },
+};
+
+struct MABlock_t
+{
+	unsigned char *m_pData;
+	int m_nSize;
+};
+
+struct MAThreadParams_t
+{
+	const MAAllocator_t *m_pAllocator;
+	unsigned m_nSeed;
+	MABlock_t *m_pHandoff;		// Filled by this thread, freed by its neighbour
+};
+
+static MABlock_t s_Handoff[MA_MAX_THREADS][MA_HANDOFF];
+static CInterlockedInt s_nFailures;
+
+static inline unsigned MARandom( unsigned &nSeed )
+{
+	nSeed = nSeed * 1664525 + 1013904223;
+	return nSeed >> 8;
+}
+
+// Sizes skew small the way the engine's do: half of them are 64 bytes or less
+static inline int MARandomSize( unsigned &nSeed )
+{
+	unsigned r = MARandom( nSeed );
+	int nMax = ( r & 1 ) ? 64 : MA_MAX_SIZE;
+	return MA_MIN_SIZE + ( r >> 1 ) % ( nMax - MA_MIN_SIZE + 1 );
+}
+
+static inline unsigned char MAPattern( const MABlock_t &block )
+{
+	return (unsigned char)( ( (uintp)block.m_pData >> 4 ) ^ block.m_nSize );
+}
+
+static void MAFill( MABlock_t &block )
+{
+	memset( block.m_pData, MAPattern( block ), block.m_nSize );
+}
+
+static void MACheck( const MABlock_t &block )
+{
+	unsigned char pattern = MAPattern( block );
+	if ( block.m_pData[0] != pattern || block.m_pData[block.m_nSize / 2] != pattern || block.m_pData[block.m_nSize - 1] != pattern )
+	{
+		++s_nFailures;
+	}
+}
+
+static bool MAAllocBlock( const MAAllocator_t *pAllocator, MABlock_t &block, int nSize )
+{
+	block.m_nSize = nSize;
+	block.m_pData = (unsigned char *)pAllocator->m_pfnAlloc( nSize );
+	if ( !block.m_pData )
+	{
+		++s_nFailures;
+		return false;
+	}
+	MAFill( block );
+	return true;
+}
+
+static uintp MAChurnThread( void *pParam )
+{
+	MAThreadParams_t *pParams = (MAThreadParams_t *)pParam;
+	const MAAllocator_t *pAllocator = pParams->m_pAllocator;
+	unsigned nSeed = pParams->m_nSeed;
+
+	MABlock_t window[MA_WINDOW];
+	memset( window, 0, sizeof( window ) );
+
+	for ( int i = 0; i < MA_OPERATIONS; ++i )
+	{
+		MABlock_t &block = window[MARandom( nSeed ) % MA_WINDOW];
+		if ( block.m_pData )
+		{
+			MACheck( block );
+			pAllocator->m_pfnFree( block.m_pData );
+			block.m_pData = NULL;
+		}
+		else
+		{
+			MAAllocBlock( pAllocator, block, MARandomSize( nSeed ) );
+		}
+	}
+
+	for ( int i = 0; i < MA_WINDOW; ++i )
+	{
+		if ( window[i].m_pData )
+		{
+			MACheck( window[i] );
+			pAllocator->m_pfnFree( window[i].m_pData );
+		}
+	}
+
+	for ( int i = 0; i < MA_HANDOFF; ++i )
+	{
+		MAAllocBlock( pAllocator, pParams->m_pHandoff[i], MARandomSize( nSeed ) );
+	}
+	return 0;
+}
+
+static uintp MAHandoffThread( void *pParam )
+{
+	MAThreadParams_t *pParams = (MAThreadParams_t *)pParam;
+	for ( int i = 0; i < MA_HANDOFF; ++i )
+	{
+		MABlock_t &block = pParams->m_pHandoff[i];
+		if ( block.m_pData )
+		{
+			MACheck( block );
+			pParams->m_pAllocator->m_pfnFree( block.m_pData );
+			block.m_pData = NULL;
+		}
+	}
+	return 0;
+}
+
+// Runs pfnThread on nThreads threads, the calling thread being the last of them
+static void MARunThreads( ThreadFunc_t pfnThread, MAThreadParams_t *pParams, int nThreads )
+{
+	ThreadHandle_t hThreads[MA_MAX_THREADS];
+	for ( int i = 0; i < nThreads - 1; ++i )
+	{
+		hThreads[i] = CreateSimpleThread( pfnThread, &pParams[i] );
+	}
+
+	pfnThread( &pParams[nThreads - 1] );
+
+	for ( int i = 0; i < nThreads - 1; ++i )
+	{
+		ThreadJoin( hThreads[i] );
+		ReleaseThreadHandle( hThreads[i] );
+	}
+}
+
+// Returns the milliseconds the churn took; the handoff frees are timed on their own
+static double MARun( const MAAllocator_t *pAllocator, int nThreads, double *pflHandoffMs )
+{
+	MAThreadParams_t params[MA_MAX_THREADS];
+	for ( int i = 0; i < nThreads; ++i )
+	{
+		params[i].m_pAllocator = pAllocator;
+		params[i].m_nSeed = 0x5eed + i * 7919;
+		params[i].m_pHandoff = s_Handoff[i];
+	}
+
+	double flStart = Plat_FloatTime();
+	MARunThreads( MAChurnThread, params, nThreads );
+	double flChurn = ( Plat_FloatTime() - flStart ) * 1000.0;
+
+	// Each thread frees what its neighbour allocated
+	for ( int i = 0; i < nThreads; ++i )
+	{
+		params[i].m_pHandoff = s_Handoff[( i + 1 ) % nThreads];
+	}
+
+	flStart = Plat_FloatTime();
+	MARunThreads( MAHandoffThread, params, nThreads );
+	*pflHandoffMs = ( Plat_FloatTime() - flStart ) * 1000.0;
+
+	return flChurn;
+}
+
+DEFINE_TESTCASE( MemAllocSizeTest, MemAllocTestSuite )
+{
+	Msg( "MemAlloc size test...\n" );
+	Shipping_Assert( MAEnableSmallBlockHeap() );
+
+	// Every size the small block heap serves, and a few past it
+	for ( int nSize = 1; nSize <= 4096; ++nSize )
+	{
+		void *p = g_pMemAlloc->Alloc( nSize );
+		Shipping_Assert( p != NULL );
+		Shipping_Assert( ( (uintp)p & 7 ) == 0 );
+		Shipping_Assert( g_pMemAlloc->GetSize( p ) >= (size_t)nSize );
+		memset( p, 0xcd, nSize );
+
+		void *pGrown = g_pMemAlloc->Realloc( p, nSize * 2 );
+		Shipping_Assert( pGrown != NULL );
+		Shipping_Assert( ( (unsigned char *)pGrown )[nSize - 1] == 0xcd );
+		g_pMemAlloc->Free( pGrown );
+	}
+}
+
+DEFINE_TESTCASE( MemAllocBenchmark, MemAllocTestSuite )
+{
+	s_nFailures = 0;
+
+	Shipping_Assert( MAEnableSmallBlockHeap() );
+
+	Msg( "MemAlloc benchmark, %d operations per thread, %d - %d bytes, seed 0x5eed:\n", MA_OPERATIONS, MA_MIN_SIZE, MA_MAX_SIZE );
+	Msg( "  allocator    threads  churn ms  Mops/s  cross thread free ms\n" );
+	for ( int nThreads = 1; nThreads <= MA_MAX_THREADS; nThreads *= 2 )
+	{
+		for ( size_t i = 0; i < ARRAYSIZE( s_Allocators ); ++i )
+		{
+			double flHandoff;
+			double flChurn = MARun( &s_Allocators[i], nThreads, &flHandoff );
+			double flMops = flChurn > 0.0 ? ( (double)MA_OPERATIONS * nThreads ) / ( flChurn * 1000.0 ) : 0.0;
+			Msg( "  %-11s  %7d  %8.2f  %6.2f  %20.2f\n", s_Allocators[i].m_pName, nThreads, flChurn, flMops, flHandoff );
+		}
+	}
+
+	Shipping_Assert( s_nFailures == 0 );
+}
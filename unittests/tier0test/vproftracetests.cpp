@@ -0,0 +1,156 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Unit test program for the VProf trace: scopes recorded on several
+//			threads come out as balanced Chrome trace events, and what a
+//			traced scope costs against an untraced one
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+#include "tier0/threadtools.h"
+#include "tier0/vprof.h"
+#include "tier0/vproftrace.h"
+#include "tier1/utlbuffer.h"
+
+#include "unitlib/unitlib.h"
+
+DEFINE_TESTSUITE( VProfTraceTestSuite )
+
+#define VT_THREADS			3
+#define VT_ITERATIONS		1000
+#define VT_BENCH_SCOPES		1000000
+
+static void TraceInner()
+{
+	VPROF_BUDGET( "VProfTraceInner", "VProfTraceTest" );
+}
+
+static void TraceOuter()
+{
+	VPROF_BUDGET( "VProfTraceOuter \"quoted\"", "VProfTraceTest" );
+	TraceInner();
+	TraceInner();
+}
+
+static uintp TraceThread( void *pParam )
+{
+	for ( int i = 0; i < VT_ITERATIONS; i++ )
+	{
+		TraceOuter();
+	}
+	VProfTrace_RecordJob( VPROFTRACE_JOB_BEGIN, "VProfTraceJob" );
+	VProfTrace_RecordJob( VPROFTRACE_JOB_END, NULL );
+	return 0;
+}
+
+static void WriteToBuffer( const char *pData, int nLength, void *pContext )
+{
+	( (CUtlBuffer *)pContext )->Put( pData, nLength );
+}
+
+static int CountOccurrences( const char *pszText, const char *pszFind )
+{
+	int nCount = 0;
+	for ( const char *p = strstr( pszText, pszFind ); p; p = strstr( p + 1, pszFind ) )
+	{
+		nCount++;
+	}
+	return nCount;
+}
+
+DEFINE_TESTCASE( VProfTraceTestEnableCount, VProfTraceTestSuite )
+{
+	Msg( "VProf trace enable count test...\n" );
+
+	// Two users turning the trace on, it stays on until both turn it off
+	VProfTrace_Enable( true );
+	VProfTrace_Enable( true );
+	VProfTrace_Enable( false );
+	Shipping_Assert( g_bVProfTraceEnabled );
+	VProfTrace_Enable( false );
+	Shipping_Assert( !g_bVProfTraceEnabled );
+}
+
+DEFINE_TESTCASE( VProfTraceTestThreads, VProfTraceTestSuite )
+{
+	Msg( "VProf trace thread test...\n" );
+
+	VProfTrace_Enable( true );
+
+	ThreadHandle_t hThreads[VT_THREADS];
+	for ( int i = 0; i < VT_THREADS; i++ )
+	{
+		hThreads[i] = CreateSimpleThread( TraceThread, NULL );
+	}
+	TraceThread( NULL );
+	for ( int i = 0; i < VT_THREADS; i++ )
+	{
+		ThreadJoin( hThreads[i] );
+		ReleaseThreadHandle( hThreads[i] );
+	}
+
+	VProfTrace_Enable( false );
+
+	CUtlBuffer buf;
+	int nEvents = VProfTrace_WriteChromeTrace( 60.0f, WriteToBuffer, &buf );
+	buf.PutChar( 0 );
+	const char *pszJSON = (const char *)buf.Base();
+
+	// Every thread's scopes and its job, each begin matched by an end
+	int nThreads = VT_THREADS + 1;
+	Shipping_Assert( CountOccurrences( pszJSON, "\"VProfTraceInner\"" ) >= nThreads * VT_ITERATIONS * 2 );
+	Shipping_Assert( CountOccurrences( pszJSON, "\"VProfTraceOuter \\\"quoted\\\"\"" ) >= nThreads * VT_ITERATIONS );
+	Shipping_Assert( CountOccurrences( pszJSON, "\"VProfTraceJob\",\"cat\":\"job\"" ) >= nThreads );
+	Shipping_Assert( CountOccurrences( pszJSON, "\"ph\":\"B\"" ) == CountOccurrences( pszJSON, "\"ph\":\"E\"" ) );
+	Shipping_Assert( CountOccurrences( pszJSON, "\"thread_name\"" ) >= nThreads );
+	Shipping_Assert( nEvents == CountOccurrences( pszJSON, "\"ph\":" ) );
+	Shipping_Assert( !strncmp( pszJSON, "{", 1 ) && strstr( pszJSON, "]}" ) );
+}
+
+DEFINE_TESTCASE( VProfTraceTestRange, VProfTraceTestSuite )
+{
+	Msg( "VProf trace range test...\n" );
+
+	VProfTrace_Enable( true );
+	TraceInner();
+	uint64 nStartStamp = Plat_Rdtsc();
+	TraceOuter();
+	VProfTrace_Enable( false );
+	Shipping_Assert( VProfTrace_GetTicksPerSecond() > 0.0 );
+
+	// Only what started after the stamp, with the caller's events and data added
+	CUtlBuffer buf;
+	int nEvents = VProfTrace_WriteChromeTraceFrom( nStartStamp, "{\"name\":\"Extra\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":0,\"ts\":0}", "\"test\":1", WriteToBuffer, &buf );
+	buf.PutChar( 0 );
+	const char *pszJSON = (const char *)buf.Base();
+
+	Shipping_Assert( nEvents > 0 );
+	Shipping_Assert( strstr( pszJSON, "\"otherData\":{\"test\":1}" ) != NULL );
+	Shipping_Assert( strstr( pszJSON, ",\n{\"name\":\"Extra\"" ) != NULL );
+	Shipping_Assert( CountOccurrences( pszJSON, "\"VProfTraceOuter" ) == 1 );
+	Shipping_Assert( CountOccurrences( pszJSON, "\"VProfTraceInner\"" ) == 2 );
+	Shipping_Assert( CountOccurrences( pszJSON, "\"ph\":\"B\"" ) == CountOccurrences( pszJSON, "\"ph\":\"E\"" ) );
+}
+
+DEFINE_TESTCASE( VProfTraceBenchmark, VProfTraceTestSuite )
+{
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < VT_BENCH_SCOPES; i++ )
+	{
+		TraceInner();
+	}
+	double flOff = ( Plat_FloatTime() - flStart ) * 1e9 / VT_BENCH_SCOPES;
+
+	VProfTrace_Enable( true );
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < VT_BENCH_SCOPES; i++ )
+	{
+		TraceInner();
+	}
+	double flOn = ( Plat_FloatTime() - flStart ) * 1e9 / VT_BENCH_SCOPES;
+	VProfTrace_Enable( false );
+
+	Msg( "VProf trace benchmark, %d scopes: %.1f ns per scope untraced, %.1f ns traced\n", VT_BENCH_SCOPES, flOff, flOn );
+}
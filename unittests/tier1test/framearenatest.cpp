@@ -0,0 +1,157 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Unit test program for the frame arenas and the containers that
+//			allocate from them, and a benchmark of per-tick temporaries on
+//			the arena against the same churn on the heap
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "unitlib/unitlib.h"
+#include "tier0/platform.h"
+#include "tier0/framearena.h"
+#include "tier1/utlvector.h"
+#include "tier1/utlbuffer.h"
+
+
+DEFINE_TESTSUITE( FrameArenaTestSuite )
+
+DEFINE_TESTCASE( FrameArenaTestAlloc, FrameArenaTestSuite )
+{
+	Msg( "Frame arena alloc test...\n" );
+
+	FrameArena_Reset();
+	uint32 nFrame = FrameArena_GetFrame();
+
+	{
+		CFrameArenaScope scope;
+
+		static const size_t s_Alignments[] = { 1, 4, 16, 64, 128 };
+		for ( size_t i = 0; i < ARRAYSIZE( s_Alignments ); i++ )
+		{
+			byte *p = (byte *)FrameArena_Alloc( 3 + i, s_Alignments[i] );
+			Shipping_Assert( p && ( (uintp)p & ( s_Alignments[i] - 1 ) ) == 0 );
+			memset( p, i, 3 + i );
+		}
+
+		// The newest block grows where it is, an older one moves
+		byte *pFirst = (byte *)FrameArena_Alloc( 32 );
+		memset( pFirst, 0x11, 32 );
+		byte *pLast = (byte *)FrameArena_Alloc( 32 );
+		memset( pLast, 0x22, 32 );
+		Shipping_Assert( FrameArena_Realloc( pLast, 32, 4096 ) == pLast );
+		byte *pMoved = (byte *)FrameArena_Realloc( pFirst, 32, 64 );
+		Shipping_Assert( pMoved != pFirst && pMoved[0] == 0x11 && pMoved[31] == 0x11 );
+		Shipping_Assert( pLast[31] == 0x22 );
+
+		// A scope gives back what was allocated inside it
+		size_t nMark = FrameArena_BeginScope();
+		void *pInner = FrameArena_Alloc( 1000 );
+		FrameArena_EndScope( nMark );
+		Shipping_Assert( FrameArena_Alloc( 1000 ) == pInner );
+
+		// More than one commit's worth
+		byte *pBig = (byte *)FrameArena_Alloc( 1024 * 1024 );
+		Shipping_Assert( pBig != NULL );
+		memset( pBig, 0x33, 1024 * 1024 );
+	}
+
+	FrameArenaStats_t stats;
+	FrameArena_GetStats( &stats );
+	Shipping_Assert( stats.nArenas >= 1 && stats.nCommittedBytes >= 1024 * 1024 );
+
+	FrameArena_Reset();
+	Shipping_Assert( FrameArena_GetFrame() == nFrame + 1 );
+
+	FrameArena_GetStats( &stats );
+	Shipping_Assert( stats.nHighWaterBytes >= 1024 * 1024 );
+}
+
+DEFINE_TESTCASE( FrameArenaTestContainers, FrameArenaTestSuite )
+{
+	Msg( "Frame arena container test...\n" );
+
+	FrameArena_Reset();
+	CFrameArenaScope scope;
+
+	CUtlVectorFrameArena< int > vec;
+	CUtlVectorFrameArena< double > interleaved;
+	for ( int i = 0; i < 10000; i++ )
+	{
+		vec.AddToTail( i );
+		if ( ( i % 100 ) == 0 )
+		{
+			interleaved.AddToTail( i );
+		}
+	}
+	Shipping_Assert( vec.Count() == 10000 && interleaved.Count() == 100 );
+	for ( int i = 0; i < 10000; i++ )
+	{
+		Shipping_Assert( vec[i] == i );
+	}
+	vec.Remove( 0 );
+	Shipping_Assert( vec[0] == 1 && vec.Count() == 9999 );
+	vec.Purge();
+	Shipping_Assert( vec.Count() == 0 );
+
+	CUtlFrameArenaBuffer buf( 16 );
+	for ( int i = 0; i < 5000; i++ )
+	{
+		buf.PutInt( i );
+	}
+	Shipping_Assert( buf.TellPut() == 5000 * sizeof( int ) );
+	for ( int i = 0; i < 5000; i++ )
+	{
+		Shipping_Assert( buf.GetInt() == i );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Benchmark: a tick's worth of short lived vectors, the kind the server packs
+// entities and runs think functions with
+//-----------------------------------------------------------------------------
+
+#define FA_TICKS			2000
+#define FA_VECTORS			1024
+#define FA_ITEMS			16
+
+template< class VECTOR >
+static int RunTicks( bool bReset )
+{
+	int nSum = 0;
+	for ( int nTick = 0; nTick < FA_TICKS; nTick++ )
+	{
+		if ( bReset )
+		{
+			FrameArena_Reset();
+		}
+		for ( int i = 0; i < FA_VECTORS; i++ )
+		{
+			VECTOR vec;
+			for ( int j = 0; j < FA_ITEMS; j++ )
+			{
+				vec.AddToTail( j ^ i );
+			}
+			nSum += vec[( nTick + i ) % FA_ITEMS];
+		}
+	}
+	return nSum;
+}
+
+DEFINE_TESTCASE( FrameArenaBenchmark, FrameArenaTestSuite )
+{
+	Msg( "Frame arena benchmark, %d ticks of %d vectors of %d ints:\n", FA_TICKS, FA_VECTORS, FA_ITEMS );
+
+	double flStart = Plat_FloatTime();
+	int nHeapSum = RunTicks< CUtlVector< int > >( false );
+	double flHeap = ( Plat_FloatTime() - flStart ) * 1000.0;
+
+	flStart = Plat_FloatTime();
+	int nArenaSum = RunTicks< CUtlVectorFrameArena< int > >( true );
+	double flArena = ( Plat_FloatTime() - flStart ) * 1000.0;
+
+	Shipping_Assert( nHeapSum == nArenaSum );
+	Msg( "  heap %.2f ms, frame arena %.2f ms\n", flHeap, flArena );
+
+	FrameArena_Reset();
+}
@@ -0,0 +1,150 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Unit test program for KeyValues, and a benchmark of text parsing
+//			against reading the compiled form the KeyValues cache keeps
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "unitlib/unitlib.h"
+#include "tier1/KeyValues.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/strtools.h"
+#include "tier0/platform.h"
+
+
+DEFINE_TESTSUITE( KeyValuesTestSuite )
+
+//-----------------------------------------------------------------------------
+// Text shaped like an item schema: nested sections, every value type the
+// parser produces, conditionals, empty sections and a second top level key
+//-----------------------------------------------------------------------------
+static void BuildTestText( CUtlBuffer &buf, int nItems )
+{
+	buf.Printf( "\"items_game\"\n{\n" );
+	for ( int i = 0; i < nItems; ++i )
+	{
+		buf.Printf( "\t\"%d\"\n\t{\n", i );
+		buf.Printf( "\t\t\"name\"\t\t\"Item %d\"\n", i );
+		buf.Printf( "\t\t\"item_class\"\t\"tf_weapon_%d\"\n", i % 37 );
+		buf.Printf( "\t\t\"min_ilevel\"\t\"%d\"\n", i % 100 );
+		buf.Printf( "\t\t\"scale\"\t\t\"%d.25\"\n", i % 10 );
+		buf.Printf( "\t\t\"id\"\t\t\"0x%08x%08x\"\n", i, i * 7 );
+		buf.Printf( "\t\t\"model\"\t\t\"models/weapons/w_%d.mdl\" [$WIN32]\n", i );
+		buf.Printf( "\t\t\"model\"\t\t\"models/weapons/x_%d.mdl\" [$X360]\n", i );
+		buf.Printf( "\t\t\"attributes\"\n\t\t{\n" );
+		buf.Printf( "\t\t\t\"damage bonus\"\t{ \"value\" \"1.5\" }\n" );
+		buf.Printf( "\t\t\t\"empty\"\t{ }\n" );
+		buf.Printf( "\t\t}\n\t}\n" );
+	}
+	buf.Printf( "}\n\"second_root\"\n{\n\t\"key\"\t\"\"\n}\n" );
+	buf.PutChar( 0 );
+}
+
+static bool KeyValuesEqual( KeyValues *pA, KeyValues *pB )
+{
+	for ( ; pA && pB; pA = pA->GetNextKey(), pB = pB->GetNextKey() )
+	{
+		if ( Q_strcmp( pA->GetName(), pB->GetName() ) || pA->GetDataType() != pB->GetDataType() )
+			return false;
+
+		switch ( pA->GetDataType() )
+		{
+		case KeyValues::TYPE_NONE:
+			if ( !KeyValuesEqual( pA->GetFirstSubKey(), pB->GetFirstSubKey() ) )
+				return false;
+			break;
+		case KeyValues::TYPE_STRING:
+			if ( Q_strcmp( pA->GetString(), pB->GetString() ) )
+				return false;
+			break;
+		case KeyValues::TYPE_INT:
+			if ( pA->GetInt() != pB->GetInt() )
+				return false;
+			break;
+		case KeyValues::TYPE_FLOAT:
+			if ( pA->GetFloat() != pB->GetFloat() )
+				return false;
+			break;
+		case KeyValues::TYPE_UINT64:
+			if ( pA->GetUint64() != pB->GetUint64() )
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+	return pA == pB;
+}
+
+DEFINE_TESTCASE( KeyValuesCompiledRoundTrip, KeyValuesTestSuite )
+{
+	Msg( "KeyValues compiled round trip test...\n" );
+
+	CUtlBuffer text( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	BuildTestText( text, 50 );
+
+	KeyValues *pParsed = new KeyValues( "" );
+	Shipping_Assert( pParsed->LoadFromBuffer( "test", (const char *)text.Base() ) );
+	Shipping_Assert( pParsed->GetNextKey() != NULL );
+	Shipping_Assert( pParsed->FindKey( "7/id" )->GetDataType() == KeyValues::TYPE_UINT64 );
+
+	CUtlBuffer compiled;
+	Shipping_Assert( pParsed->WriteAsCompiled( compiled, 1234 ) );
+
+	KeyValues *pRead = new KeyValues( "" );
+	Shipping_Assert( pRead->ReadAsCompiled( compiled, 1234 ) );
+	Shipping_Assert( KeyValuesEqual( pParsed, pRead ) );
+	pRead->deleteThis();
+
+	// Another source's hash, or a damaged payload, leaves the key untouched
+	KeyValues *pRejected = new KeyValues( "untouched" );
+	compiled.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+	Shipping_Assert( !pRejected->ReadAsCompiled( compiled, 4321 ) );
+	( (char *)compiled.Base() )[ compiled.TellPut() / 2 ] ^= 1;
+	compiled.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+	Shipping_Assert( !pRejected->ReadAsCompiled( compiled, 1234 ) );
+	Shipping_Assert( !Q_strcmp( pRejected->GetName(), "untouched" ) && !pRejected->GetFirstSubKey() );
+	pRejected->deleteThis();
+
+	pParsed->deleteThis();
+}
+
+DEFINE_TESTCASE( KeyValuesParseBenchmark, KeyValuesTestSuite )
+{
+	const int nItems = 2000;
+	const int nIterations = 10;
+
+	CUtlBuffer text( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	BuildTestText( text, nItems );
+
+	CUtlBuffer compiled;
+	{
+		KeyValues *pKeyValues = new KeyValues( "" );
+		pKeyValues->LoadFromBuffer( "benchmark", (const char *)text.Base() );
+		Shipping_Assert( pKeyValues->WriteAsCompiled( compiled, 1 ) );
+		pKeyValues->deleteThis();
+	}
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nIterations; ++i )
+	{
+		KeyValues *pKeyValues = new KeyValues( "" );
+		pKeyValues->LoadFromBuffer( "benchmark", (const char *)text.Base() );
+		pKeyValues->deleteThis();
+	}
+	double flText = ( Plat_FloatTime() - flStart ) * 1000.0 / nIterations;
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nIterations; ++i )
+	{
+		KeyValues *pKeyValues = new KeyValues( "" );
+		compiled.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+		Shipping_Assert( pKeyValues->ReadAsCompiled( compiled, 1 ) );
+		pKeyValues->deleteThis();
+	}
+	double flCompiled = ( Plat_FloatTime() - flStart ) * 1000.0 / nIterations;
+
+	Msg( "KeyValues parse benchmark: %d KB of text, %.2f ms parsed, %.2f ms compiled (%d KB), %.1fx\n",
+		text.TellPut() / 1024, flText, flCompiled, compiled.TellPut() / 1024, flCompiled > 0.0 ? flText / flCompiled : 0.0 );
+}
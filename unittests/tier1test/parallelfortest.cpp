@@ -0,0 +1,193 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Unit test program for ParallelFor, and a benchmark of how it
+//			scales against handing out items one at a time from a shared counter
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "unitlib/unitlib.h"
+#include "vstdlib/jobthread.h"
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
+#include <math.h>
+
+
+DEFINE_TESTSUITE( ParallelForTestSuite )
+
+class CCountingBody : public IParallelForBody
+{
+public:
+	CCountingBody( int nItems )
+	{
+		m_Counts.SetCount( nItems );
+		m_Counts.FillWithValue( 0 );
+		m_nBegins = m_nEnds = 0;
+	}
+
+	virtual void Begin()							{ ++m_nBegins; }
+	virtual void Process( int nBegin, int nEnd )
+	{
+		for ( int i = nBegin; i < nEnd; i++ )
+		{
+			++m_Counts[i];
+		}
+	}
+	virtual void End()								{ ++m_nEnds; }
+
+	bool AllCountedOnce()
+	{
+		FOR_EACH_VEC( m_Counts, i )
+		{
+			if ( m_Counts[i] != 1 )
+				return false;
+		}
+		return true;
+	}
+
+	CUtlVector<int>	m_Counts;
+	CInterlockedInt	m_nBegins;
+	CInterlockedInt	m_nEnds;
+};
+
+DEFINE_TESTCASE( ParallelForTestCoverage, ParallelForTestSuite )
+{
+	Msg( "ParallelFor coverage test...\n" );
+
+	IThreadPool *pPool = CreateThreadPool();
+	ThreadPoolStartParams_t params;
+	params.nThreads = 3;
+	pPool->Start( params, "PFTst" );
+
+	static const int s_Sizes[] = { 1, 2, 7, 100, 4096, 100003 };
+	static const int s_Grains[] = { 0, 1, 16, 1000 };
+	for ( size_t i = 0; i < ARRAYSIZE( s_Sizes ); i++ )
+	{
+		for ( size_t j = 0; j < ARRAYSIZE( s_Grains ); j++ )
+		{
+			CCountingBody body( s_Sizes[i] );
+			ParallelFor( "ParallelForTestCoverage", &body, 0, s_Sizes[i], s_Grains[j], INT_MAX, pPool );
+			Shipping_Assert( body.AllCountedOnce() );
+			Shipping_Assert( body.m_nBegins == body.m_nEnds && body.m_nBegins >= 1 && body.m_nBegins <= 4 );
+		}
+	}
+
+	// No helpers allowed runs everything on the calling thread
+	CCountingBody body( 1000 );
+	ParallelFor( "ParallelForTestCoverage", &body, 0, 1000, 0, 0, pPool );
+	Shipping_Assert( body.AllCountedOnce() && body.m_nBegins == 1 );
+
+	pPool->Stop();
+	DestroyThreadPool( pPool );
+}
+
+//-----------------------------------------------------------------------------
+// Benchmark: a small, even cost per item, the case the shared counter is
+// worst at
+//-----------------------------------------------------------------------------
+
+static float ItemWork( int i )
+{
+	float f = (float)i;
+	for ( int j = 0; j < 8; j++ )
+	{
+		f = sqrtf( f * 1.0001f + 1.0f );
+	}
+	return f;
+}
+
+class CItemWorkBody : public IParallelForBody
+{
+public:
+	CItemWorkBody( float *pResults ) : m_pResults( pResults ) {}
+
+	virtual void Process( int nBegin, int nEnd )
+	{
+		for ( int i = nBegin; i < nEnd; i++ )
+		{
+			m_pResults[i] = ItemWork( i );
+		}
+	}
+
+	float *m_pResults;
+};
+
+// Every thread takes the next item from one interlocked counter
+class CSharedCounterLoop
+{
+public:
+	CSharedCounterLoop( float *pResults, int nItems ) : m_pResults( pResults ), m_nItems( nItems ) { m_nNext = 0; }
+
+	void Run( IThreadPool *pPool )
+	{
+		CUtlVector<CJob *> jobs;
+		for ( int i = 0; i < pPool->NumThreads(); i++ )
+		{
+			jobs.AddToTail( pPool->QueueCall( this, &CSharedCounterLoop::DoExecute ) );
+		}
+		DoExecute();
+		FOR_EACH_VEC( jobs, i )
+		{
+			jobs[i]->Abort();
+			jobs[i]->Release();
+		}
+	}
+
+private:
+	void DoExecute()
+	{
+		for ( ;; )
+		{
+			int i = m_nNext++;
+			if ( i >= m_nItems )
+				break;
+			m_pResults[i] = ItemWork( i );
+		}
+	}
+
+	float *			m_pResults;
+	int				m_nItems;
+	CInterlockedInt	m_nNext;
+};
+
+DEFINE_TESTCASE( ParallelForScalingBenchmark, ParallelForTestSuite )
+{
+	const int nItems = 1 << 20;
+	const int nIterations = 4;
+	int nMaxThreads = MIN( GetCPUInformation()->m_nLogicalProcessors, 8 );
+
+	CUtlVector<float> results;
+	results.SetCount( nItems );
+
+	Msg( "ParallelFor scaling benchmark, %d items:\n", nItems );
+	Msg( "  threads  shared counter ms  ParallelFor ms\n" );
+	for ( int nThreads = 1; nThreads <= nMaxThreads; nThreads++ )
+	{
+		IThreadPool *pPool = CreateThreadPool();
+		ThreadPoolStartParams_t params;
+		params.nThreads = nThreads - 1;
+		pPool->Start( params, "PFBench" );
+
+		double flStart = Plat_FloatTime();
+		for ( int i = 0; i < nIterations; i++ )
+		{
+			CSharedCounterLoop loop( results.Base(), nItems );
+			loop.Run( pPool );
+		}
+		double flShared = ( Plat_FloatTime() - flStart ) * 1000.0 / nIterations;
+
+		flStart = Plat_FloatTime();
+		for ( int i = 0; i < nIterations; i++ )
+		{
+			CItemWorkBody body( results.Base() );
+			ParallelFor( "ParallelForScalingBenchmark", &body, 0, nItems, 0, INT_MAX, pPool );
+		}
+		double flParallelFor = ( Plat_FloatTime() - flStart ) * 1000.0 / nIterations;
+
+		Msg( "  %7d  %17.2f  %14.2f\n", nThreads, flShared, flParallelFor );
+
+		pPool->Stop();
+		DestroyThreadPool( pPool );
+	}
+}
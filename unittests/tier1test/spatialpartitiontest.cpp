@@ -0,0 +1,395 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Unit test for the spatial partition's concurrent query phase. The
+//			engine's own CSpatialPartition is compiled into this test so the
+//			queries run against the real voxel tree, loose grid and trigger index.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "unitlib/unitlib.h"
+#include "vstdlib/jobthread.h"
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier0/icommandline.h"
+#include "tier1/utlvector.h"
+#include "vstdlib/random.h"
+#include "collisionutils.h"
+#include "datacache/imdlcache.h"
+#include "ihandleentity.h"
+#include "basehandle.h"
+
+// The partition only locks the model cache for the game's enumerators, and
+// there is no model cache here
+#undef MDLCACHE_CRITICAL_SECTION_
+#define MDLCACHE_CRITICAL_SECTION_( pCache ) ((void)(0))
+
+#include "../../engine/spatialpartition.cpp"
+
+// Normally in host_cmd.cpp; only the think trace counter asks for it
+EUniverse GetSteamUniverse()
+{
+	return k_EUniverseDev;
+}
+
+
+DEFINE_TESTSUITE( SpatialPartitionTestSuite )
+
+namespace
+{
+
+const int TEST_ELEMENT_COUNT = 2000;
+const int TEST_QUERY_COUNT = 4000;
+const float TEST_WORLD_SIZE = 8192.0f;
+
+class CTestHandleEntity : public IHandleEntity
+{
+public:
+	virtual void SetRefEHandle( const CBaseHandle &handle )	{ m_RefEHandle = handle; }
+	virtual const CBaseHandle& GetRefEHandle() const		{ return m_RefEHandle; }
+
+	int							m_nIndex;
+	Vector						m_vecMin;
+	Vector						m_vecMax;
+	SpatialPartitionListMask_t	m_fList;
+	SpatialPartitionHandle_t	m_hPartition;
+	CBaseHandle					m_RefEHandle;
+};
+
+// Folds every element a query finds into an order independent signature
+class CSignatureEnum : public IPartitionEnumerator
+{
+public:
+	CSignatureEnum() : m_nCount( 0 ), m_nHash( 0 ) {}
+
+	virtual IterationRetval_t EnumElement( IHandleEntity *pHandleEntity )
+	{
+		uint32 nIndex = static_cast<CTestHandleEntity *>( pHandleEntity )->m_nIndex;
+		++m_nCount;
+		m_nHash += ( nIndex + 1 ) * 2654435761u;
+		return ITERATION_CONTINUE;
+	}
+
+	int		m_nCount;
+	uint32	m_nHash;
+};
+
+class CCountingQueryCallback : public IPartitionQueryCallback
+{
+public:
+	CCountingQueryCallback() : m_nPreQueries( 0 ), m_nPostQueries( 0 ), m_bOffMainThread( false ) {}
+
+	virtual void OnPreQuery_V1()								{}
+	virtual void OnPreQuery( SpatialPartitionListMask_t listMask )	{ ++m_nPreQueries; m_bOffMainThread |= !ThreadInMainThread(); }
+	virtual void OnPostQuery( SpatialPartitionListMask_t listMask )	{ ++m_nPostQueries; m_bOffMainThread |= !ThreadInMainThread(); }
+
+	CInterlockedInt	m_nPreQueries;
+	CInterlockedInt	m_nPostQueries;
+	bool			m_bOffMainThread;
+};
+
+struct TestQuery_t
+{
+	enum QueryType_t
+	{
+		QUERY_BOX,
+		QUERY_SPHERE,
+		QUERY_RAY,
+		QUERY_POINT,
+		QUERY_TYPE_COUNT,
+	};
+
+	QueryType_t					m_nType;
+	SpatialPartitionListMask_t	m_fList;
+	Vector						m_vecMin;	// box mins, sphere origin, ray start or point
+	Vector						m_vecMax;	// box maxs, ray end
+	float						m_flRadius;
+};
+
+struct TestResult_t
+{
+	int		m_nCount;
+	uint32	m_nHash;
+};
+
+static const SpatialPartitionListMask_t s_TestLists[] =
+{
+	PARTITION_ENGINE_SOLID_EDICTS,
+	PARTITION_ENGINE_TRIGGER_EDICTS,
+	PARTITION_ENGINE_SOLID_EDICTS | PARTITION_ENGINE_TRIGGER_EDICTS,
+	PARTITION_CLIENT_SOLID_EDICTS,
+};
+
+static float RandomCoord( float flExtent )
+{
+	return RandomFloat( -0.5f * TEST_WORLD_SIZE + flExtent, 0.5f * TEST_WORLD_SIZE - flExtent );
+}
+
+static void BuildScene( CSpatialPartition *pPartition, CUtlVector<CTestHandleEntity> &elements )
+{
+	RandomSeed( 0x5917 );
+	elements.SetCount( TEST_ELEMENT_COUNT );
+	FOR_EACH_VEC( elements, i )
+	{
+		CTestHandleEntity &elem = elements[i];
+		elem.m_nIndex = i;
+
+		// Mostly small things, with the occasional huge one to fill the upper levels
+		float flSize = ( i % 50 ) ? RandomFloat( 8.0f, 256.0f ) : RandomFloat( 1024.0f, 3000.0f );
+		Vector vecCenter( RandomCoord( flSize ), RandomCoord( flSize ), RandomCoord( flSize ) );
+		elem.m_vecMin = vecCenter - Vector( flSize, flSize, flSize ) * 0.5f;
+		elem.m_vecMax = vecCenter + Vector( flSize, flSize, flSize ) * 0.5f;
+
+		switch ( i % 4 )
+		{
+		case 0:		elem.m_fList = PARTITION_ENGINE_TRIGGER_EDICTS; break;
+		case 1:		elem.m_fList = PARTITION_CLIENT_SOLID_EDICTS; break;
+		default:	elem.m_fList = PARTITION_ENGINE_SOLID_EDICTS; break;
+		}
+		elem.m_hPartition = pPartition->CreateHandle( &elem, elem.m_fList, elem.m_vecMin, elem.m_vecMax );
+	}
+
+	// Move some of them so the queries don't only see freshly inserted elements
+	for ( int i = 0; i < elements.Count(); i += 3 )
+	{
+		CTestHandleEntity &elem = elements[i];
+		Vector vecDelta( RandomFloat( -300.0f, 300.0f ), RandomFloat( -300.0f, 300.0f ), RandomFloat( -300.0f, 300.0f ) );
+		elem.m_vecMin += vecDelta;
+		elem.m_vecMax += vecDelta;
+		pPartition->ElementMoved( elem.m_hPartition, elem.m_vecMin, elem.m_vecMax );
+	}
+}
+
+static void BuildQueries( CUtlVector<TestQuery_t> &queries )
+{
+	queries.SetCount( TEST_QUERY_COUNT );
+	FOR_EACH_VEC( queries, i )
+	{
+		TestQuery_t &query = queries[i];
+		query.m_nType = (TestQuery_t::QueryType_t)( i % TestQuery_t::QUERY_TYPE_COUNT );
+		query.m_fList = s_TestLists[ ( i / TestQuery_t::QUERY_TYPE_COUNT ) % ARRAYSIZE( s_TestLists ) ];
+		query.m_vecMin.Init( RandomCoord( 0.0f ), RandomCoord( 0.0f ), RandomCoord( 0.0f ) );
+		query.m_flRadius = RandomFloat( 16.0f, 512.0f );
+		if ( query.m_nType == TestQuery_t::QUERY_RAY )
+		{
+			query.m_vecMax.Init( RandomCoord( 0.0f ), RandomCoord( 0.0f ), RandomCoord( 0.0f ) );
+		}
+		else
+		{
+			query.m_vecMax = query.m_vecMin + Vector( query.m_flRadius, query.m_flRadius, query.m_flRadius );
+		}
+	}
+}
+
+static TestResult_t RunQuery( CSpatialPartition *pPartition, const TestQuery_t &query )
+{
+	CSignatureEnum enumerator;
+	switch ( query.m_nType )
+	{
+	case TestQuery_t::QUERY_BOX:
+		pPartition->EnumerateElementsInBox( query.m_fList, query.m_vecMin, query.m_vecMax, false, &enumerator );
+		break;
+
+	case TestQuery_t::QUERY_SPHERE:
+		pPartition->EnumerateElementsInSphere( query.m_fList, query.m_vecMin, query.m_flRadius, false, &enumerator );
+		break;
+
+	case TestQuery_t::QUERY_RAY:
+		{
+			Ray_t ray;
+			ray.Init( query.m_vecMin, query.m_vecMax );
+			pPartition->EnumerateElementsAlongRay( query.m_fList, ray, false, &enumerator );
+		}
+		break;
+
+	case TestQuery_t::QUERY_POINT:
+		pPartition->EnumerateElementsAtPoint( query.m_fList, query.m_vecMin, false, &enumerator );
+		break;
+
+	default:
+		Assert( 0 );
+		break;
+	}
+
+	TestResult_t result;
+	result.m_nCount = enumerator.m_nCount;
+	result.m_nHash = enumerator.m_nHash;
+	return result;
+}
+
+class CConcurrentQueryBody : public IParallelForBody
+{
+public:
+	CConcurrentQueryBody( CSpatialPartition *pPartition, const CUtlVector<TestQuery_t> &queries, const CUtlVector<TestResult_t> &expected ) :
+		m_pPartition( pPartition ), m_Queries( queries ), m_Expected( expected )
+	{
+		m_nMismatches = 0;
+	}
+
+	virtual void Process( int nBegin, int nEnd )
+	{
+		for ( int i = nBegin; i < nEnd; i++ )
+		{
+			TestResult_t result = RunQuery( m_pPartition, m_Queries[i] );
+			if ( result.m_nCount != m_Expected[i].m_nCount || result.m_nHash != m_Expected[i].m_nHash )
+			{
+				++m_nMismatches;
+			}
+		}
+	}
+
+	CSpatialPartition				*m_pPartition;
+	const CUtlVector<TestQuery_t>	&m_Queries;
+	const CUtlVector<TestResult_t>	&m_Expected;
+	CInterlockedInt					m_nMismatches;
+};
+
+// Box queries are exact in every implementation, so they can be checked
+// against a brute force walk of the elements. Ignore anything within an
+// epsilon of the query bounds, since the implementations bloat slightly.
+static bool CheckBoxQueriesAgainstBruteForce( CSpatialPartition *pPartition, const CUtlVector<CTestHandleEntity> &elements, const CUtlVector<TestQuery_t> &queries )
+{
+	const Vector vecEps( 1.0f, 1.0f, 1.0f );
+
+	class CCollectEnum : public IPartitionEnumerator
+	{
+	public:
+		virtual IterationRetval_t EnumElement( IHandleEntity *pHandleEntity )
+		{
+			m_Found.AddToTail( static_cast<CTestHandleEntity *>( pHandleEntity )->m_nIndex );
+			return ITERATION_CONTINUE;
+		}
+		CUtlVector<int> m_Found;
+	};
+
+	FOR_EACH_VEC( queries, i )
+	{
+		const TestQuery_t &query = queries[i];
+		if ( query.m_nType != TestQuery_t::QUERY_BOX )
+			continue;
+
+		CCollectEnum enumerator;
+		pPartition->EnumerateElementsInBox( query.m_fList, query.m_vecMin, query.m_vecMax, false, &enumerator );
+
+		FOR_EACH_VEC( elements, j )
+		{
+			const CTestHandleEntity &elem = elements[j];
+			if ( ( elem.m_fList & query.m_fList ) == 0 )
+				continue;
+
+			bool bFound = enumerator.m_Found.HasElement( j );
+			if ( IsBoxIntersectingBox( elem.m_vecMin - vecEps, elem.m_vecMax + vecEps, query.m_vecMin, query.m_vecMax ) == false && bFound )
+				return false;
+			if ( IsBoxIntersectingBox( elem.m_vecMin + vecEps, elem.m_vecMax - vecEps, query.m_vecMin, query.m_vecMax ) && !bFound )
+				return false;
+		}
+	}
+	return true;
+}
+
+static void TestConcurrentQueries( bool bLooseGrid )
+{
+	if ( bLooseGrid )
+	{
+		CommandLine()->AppendParm( "-partition_loosegrid", NULL );
+	}
+
+	CSpatialPartition *pPartition = new CSpatialPartition;
+	Vector vecWorldMax( 0.5f * TEST_WORLD_SIZE, 0.5f * TEST_WORLD_SIZE, 0.5f * TEST_WORLD_SIZE );
+	pPartition->Init( -vecWorldMax, vecWorldMax );
+	if ( bLooseGrid )
+	{
+		CommandLine()->RemoveParm( "-partition_loosegrid" );
+	}
+
+	CCountingQueryCallback callback;
+	pPartition->InstallQueryCallback( &callback );
+
+	CUtlVector<CTestHandleEntity> elements;
+	BuildScene( pPartition, elements );
+
+	CUtlVector<TestQuery_t> queries;
+	BuildQueries( queries );
+
+	Shipping_Assert( CheckBoxQueriesAgainstBruteForce( pPartition, elements, queries ) );
+
+	// Single threaded answers, outside the concurrent phase
+	CUtlVector<TestResult_t> expected;
+	expected.SetCount( queries.Count() );
+	int nTotalFound = 0;
+	FOR_EACH_VEC( queries, i )
+	{
+		expected[i] = RunQuery( pPartition, queries[i] );
+		nTotalFound += expected[i].m_nCount;
+	}
+	Shipping_Assert( nTotalFound > 0 );
+
+	IThreadPool *pPool = CreateThreadPool();
+	ThreadPoolStartParams_t params;
+	params.nThreads = MAX( 3, MIN( GetCPUInformation()->m_nLogicalProcessors - 1, 7 ) );
+	pPool->Start( params, "SPTst" );
+
+	// Move an element so the phase has pending work to flush when it begins
+	CTestHandleEntity &moved = elements[0];
+	pPartition->ElementMoved( moved.m_hPartition, moved.m_vecMin, moved.m_vecMax );
+
+	pPartition->BeginConcurrentQueries();
+	Shipping_Assert( pPartition->IsInConcurrentQueries() );
+
+	int nPreQueries = callback.m_nPreQueries;
+	int nPostQueries = callback.m_nPostQueries;
+	for ( int nPass = 0; nPass < 8; nPass++ )
+	{
+		CConcurrentQueryBody body( pPartition, queries, expected );
+		ParallelFor( "SpatialPartitionConcurrentQueries", &body, 0, queries.Count(), 1, INT_MAX, pPool );
+		Shipping_Assert( body.m_nMismatches == 0 );
+	}
+
+	// Nested phases are allowed, and the callbacks stay off for all of it
+	pPartition->BeginConcurrentQueries();
+	RunQuery( pPartition, queries[0] );
+	pPartition->EndConcurrentQueries();
+	Shipping_Assert( pPartition->IsInConcurrentQueries() );
+	Shipping_Assert( callback.m_nPreQueries == nPreQueries && callback.m_nPostQueries == nPostQueries );
+
+	pPartition->EndConcurrentQueries();
+	Shipping_Assert( !pPartition->IsInConcurrentQueries() );
+	Shipping_Assert( !callback.m_bOffMainThread );
+
+	// Back to normal afterwards: the callbacks run again and the partition can change
+	RunQuery( pPartition, queries[0] );
+	Shipping_Assert( callback.m_nPreQueries > nPreQueries && callback.m_nPostQueries > nPostQueries );
+
+	FOR_EACH_VEC( elements, i )
+	{
+		pPartition->RemoveFromTree( elements[i].m_hPartition );
+	}
+	FOR_EACH_VEC( queries, i )
+	{
+		Shipping_Assert( RunQuery( pPartition, queries[i] ).m_nCount == 0 );
+	}
+
+	pPool->Stop();
+	DestroyThreadPool( pPool );
+
+	pPartition->RemoveQueryCallback( &callback );
+	FOR_EACH_VEC( elements, i )
+	{
+		pPartition->DestroyHandle( elements[i].m_hPartition );
+	}
+	delete pPartition;
+}
+
+}
+
+DEFINE_TESTCASE( SpatialPartitionConcurrentQueriesVoxelTree, SpatialPartitionTestSuite )
+{
+	Msg( "Spatial partition concurrent query test, voxel tree...\n" );
+	TestConcurrentQueries( false );
+}
+
+DEFINE_TESTCASE( SpatialPartitionConcurrentQueriesLooseGrid, SpatialPartitionTestSuite )
+{
+	Msg( "Spatial partition concurrent query test, loose grid...\n" );
+	TestConcurrentQueries( true );
+}
@@ -23,6 +23,15 @@
 #include <windows.h>
 #endif
 
+// Chunk files are mapped whole, which wants the address space of a 64 bit process
+#if defined( POSIX ) && defined( PLATFORM_64BITS )
+#define VPK_MAPPED_READS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
@@ -212,6 +221,7 @@ void CPackedStore::Init( void )
 {
 	m_nHighestChunkFileIndex = -1;
 	m_bUseDirFile = false;
+	m_bUseMappedReads = false;
 	m_pszFileBaseName[0] = 0;
 	m_pszFullPathName[0] = 0;
 	memset( m_pExtensionData, 0, sizeof( m_pExtensionData ) );
@@ -470,6 +480,12 @@ CPackedStore::~CPackedStore( void )
 #endif
 
 		}
+#ifdef VPK_MAPPED_READS
+		if ( m_FileHandles[i].m_pMappedData )
+		{
+			munmap( (void *)m_FileHandles[i].m_pMappedData, m_FileHandles[i].m_nMappedSize );
+		}
+#endif
 	}
 
 	// Free the FindFirst cache data
@@ -870,6 +886,14 @@ bool CPackedStoreReadCache::BCanSatisfyFromReadCache( uint8 *pOutData, CPackedSt
 bool CPackedStoreReadCache::ReadCacheLine( FileHandleTracker_t &fHandle, CachedVPKRead_t &cachedVPKRead )
 {
 	cachedVPKRead.m_cubBuffer = 0;
+	if ( fHandle.m_pMappedData )
+	{
+		int64 nAvailable = MAX( fHandle.m_nMappedSize - cachedVPKRead.m_nFileFraction, (int64)0 );
+		cachedVPKRead.m_cubBuffer = (int)MIN( nAvailable, (int64)k_cubCacheBufferSize );
+		memcpy( cachedVPKRead.m_pubBuffer, fHandle.m_pMappedData + cachedVPKRead.m_nFileFraction, cachedVPKRead.m_cubBuffer );
+	}
+	else
+	{
 #ifdef IS_WINDOWS_PC
 	if ( cachedVPKRead.m_nFileFraction != fHandle.m_nCurOfs )
 		SetFilePointer ( fHandle.m_hFileHandle, cachedVPKRead.m_nFileFraction, NULL,  FILE_BEGIN); 
@@ -880,6 +904,7 @@ bool CPackedStoreReadCache::ReadCacheLine( FileHandleTracker_t &fHandle, CachedV
 	cachedVPKRead.m_cubBuffer = m_pFileSystem->Read( cachedVPKRead.m_pubBuffer, k_cubCacheBufferSize, fHandle.m_hFileHandle );
 	m_pFileSystem->Seek( fHandle.m_hFileHandle, fHandle.m_nCurOfs, FILESYSTEM_SEEK_HEAD );
 #endif
+	}
 	Assert( cachedVPKRead.m_hMD5RequestHandle == 0 );
 	if ( m_pFileTracker ) // file tracker doesn't exist in the VPK command line tool
 	{
@@ -1179,7 +1204,14 @@ int CPackedStore::ReadData( CPackedStoreFileHandle &handle, void *pOutData, int
 			FileHandleTracker_t &fHandle = GetFileHandle( handle.m_nFileNumber );
 			int nDesiredPos = handle.m_nFileOffset + handle.m_nCurrentFileOffset - handle.m_nMetaDataSize;
 			int nRead;
-			fHandle.m_Mutex.Lock();
+
+			// A mapped file has no seek position to share, so it needs no lock
+			bool bMapped = ( fHandle.m_pMappedData != NULL );
+			if ( !bMapped )
+			{
+				fHandle.m_Mutex.Lock();
+			}
+
 			if ( handle.m_nFileNumber == VPKFILENUMBER_EMBEDDED_IN_DIR_FILE )
 			{
 				// for file data in the directory header, all offsets are relative to the size of the dir header.
@@ -1190,6 +1222,12 @@ int CPackedStore::ReadData( CPackedStoreFileHandle &handle, void *pOutData, int
 			{
 				handle.m_nCurrentFileOffset += nRead;
 			}
+			else if ( bMapped )
+			{
+				nRead = (int)MIN( (int64)nNumBytes, MAX( fHandle.m_nMappedSize - nDesiredPos, (int64)0 ) );
+				memcpy( pOutData, fHandle.m_pMappedData + nDesiredPos, nRead );
+				handle.m_nCurrentFileOffset += nRead;
+			}
 			else
 			{
 #ifdef IS_WINDOWS_PC
@@ -1205,7 +1243,10 @@ int CPackedStore::ReadData( CPackedStoreFileHandle &handle, void *pOutData, int
 			}
 			Assert( nRead == nNumBytes );
 			nRet += nRead;
-			fHandle.m_Mutex.Unlock();
+			if ( !bMapped )
+			{
+				fHandle.m_Mutex.Unlock();
+			}
 		}
 	}
 	m_PackedStoreReadCache.RetryAllBadCacheLines();
@@ -1425,6 +1466,45 @@ void CPackedStore::GetPackFileName( CPackedStoreFileHandle &handle, char *pchFil
 	GetDataFileName( pchFileNameOut, cchFileNameOut, handle.m_nFileNumber );
 }
 
+bool CPackedStore::GetDataFileLocation( CPackedStoreFileHandle &handle, int nOffsetInFile, char *pchFileNameOut, int cchFileNameOut, int64 &nDataFileOffset ) const
+{
+	if ( nOffsetInFile < handle.m_nMetaDataSize || nOffsetInFile > handle.m_nFileSize )
+		return false;
+
+	nDataFileOffset = handle.m_nFileOffset + nOffsetInFile - handle.m_nMetaDataSize;
+	if ( handle.m_nFileNumber == VPKFILENUMBER_EMBEDDED_IN_DIR_FILE )
+	{
+		// for file data in the directory header, all offsets are relative to the size of the dir header.
+		nDataFileOffset += m_nDirectoryDataSize + sizeof( VPKDirHeader_t );
+	}
+
+	GetDataFileName( pchFileNameOut, cchFileNameOut, handle.m_nFileNumber );
+	return true;
+}
+
+#ifdef VPK_MAPPED_READS
+// Leaves the tracker unmapped if anything fails, reads then go through its handle
+static void MapDataFile( const char *pszDataFileName, FileHandleTracker_t &fHandle )
+{
+	int fd = open( pszDataFileName, O_RDONLY | O_CLOEXEC );
+	if ( fd < 0 )
+		return;
+
+	struct stat st;
+	if ( fstat( fd, &st ) == 0 && st.st_size > 0 )
+	{
+		void *pData = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+		if ( pData != MAP_FAILED )
+		{
+			fHandle.m_pMappedData = (uint8 const *)pData;
+			fHandle.m_nMappedSize = st.st_size;
+		}
+	}
+
+	close( fd );
+}
+#endif
+
 FileHandleTracker_t & CPackedStore::GetFileHandle( int nFileNumber )
 {
 	AUTO_LOCK( m_Mutex );
@@ -1458,6 +1538,12 @@ FileHandleTracker_t & CPackedStore::GetFileHandle( int nFileNumber )
 		m_FileHandles[nFileHandleIdx].m_hFileHandle = m_pFileSystem->Open( pszDataFileName, "rb" );
 		if ( m_FileHandles[nFileHandleIdx].m_hFileHandle != FILESYSTEM_INVALID_HANDLE )
 		{
+#ifdef VPK_MAPPED_READS
+			if ( m_bUseMappedReads )
+			{
+				MapDataFile( pszDataFileName, m_FileHandles[nFileHandleIdx] );
+			}
+#endif
 			m_FileHandles[nFileHandleIdx].m_nFileNumber = nFileNumber;
 		}
 #endif
@@ -28,6 +28,22 @@
 
 class CJobThread;
 
+//-----------------------------------------------------------------------------
+// Pauses a thread that just ran out of work spins through before it sleeps,
+// work arriving in that window is picked up without a wakeup. -threadspin 0
+// sleeps right away, for hosts running many processes.
+//-----------------------------------------------------------------------------
+
+static int GetThreadSpinCount()
+{
+	static int s_nSpinCount = -1;
+	if ( s_nSpinCount < 0 )
+	{
+		s_nSpinCount = MAX( CommandLine()->ParmValue( "-threadspin", 2000 ), 0 );
+	}
+	return s_nSpinCount;
+}
+
 //-----------------------------------------------------------------------------
 
 inline void ServiceJobAndRelease( CJob *pJob, int iThread = -1 )
@@ -38,7 +54,16 @@ inline void ServiceJobAndRelease( CJob *pJob, int iThread = -1 )
 	{
 		// ...service the request
 		pJob->SetServiceThread( iThread );
-		pJob->Execute();
+		if ( !g_bVProfTraceEnabled )
+		{
+			pJob->Execute();
+		}
+		else
+		{
+			VProfTrace_RecordJob( VPROFTRACE_JOB_BEGIN, pJob->Describe() );
+			pJob->Execute();
+			VProfTrace_RecordJob( VPROFTRACE_JOB_END, NULL );
+		}
 		pJob->Unlock();
 	}
 	pJob->Release();
@@ -459,8 +484,11 @@ private:
 					{
 						if ( !m_SharedQueue.Pop( &pJob ) )
 						{
-							// Nothing to process, return to wait state
-							break;
+							// Jobs come in bursts, so look for the next one for a moment before
+							// going back to the wait state
+							if ( !bTookJob || !SpinForJob() )
+								break;
+							continue;
 						}
 					}
 					if ( !bTookJob )
@@ -485,6 +513,17 @@ private:
 		return 0;
 	}
 
+	bool SpinForJob()
+	{
+		for ( int i = GetThreadSpinCount(); i > 0; --i )
+		{
+			if ( m_DirectQueue.Count() || m_SharedQueue.Count() || PeekCall() )
+				return true;
+			ThreadPause();
+		}
+		return false;
+	}
+
 	CJobQueue			m_DirectQueue;
 	CJobQueue &			m_SharedQueue;
 	CThreadPool *		m_pOwner;
@@ -1148,6 +1187,316 @@ CJob *CThreadPool::GetDummyJob()
 	return &dummyJob;
 }
 
+//-----------------------------------------------------------------------------
+//
+// ParallelFor
+//
+//-----------------------------------------------------------------------------
+
+struct ParallelForRange_t
+{
+	int nBegin;
+	int nEnd;
+};
+
+//-----------------------------------------------------------------------------
+// Chase-Lev work stealing deque of ranges. Only the owning thread pushes and
+// pops, at the bottom; any thread steals, from the top. A range is split at
+// most once per level, so a small fixed ring never wraps onto a live entry.
+//-----------------------------------------------------------------------------
+
+class CParallelForDeque
+{
+public:
+	enum
+	{
+		CAPACITY = 32,	// Power of two, and more than the 31 halvings of an int range
+	};
+
+	void Init()
+	{
+		m_nTop = m_nBottom = 0;
+	}
+
+	// Owner only
+	bool IsEmpty() const
+	{
+		return ( m_nBottom <= m_nTop );
+	}
+
+	// Owner only
+	bool Push( const ParallelForRange_t &range )
+	{
+		int32 nBottom = m_nBottom;
+		if ( nBottom - m_nTop >= CAPACITY )
+			return false;
+
+		m_Ranges[nBottom & ( CAPACITY - 1 )] = range;
+		ThreadMemoryBarrier();
+		m_nBottom = nBottom + 1;
+		return true;
+	}
+
+	// Owner only
+	bool Pop( ParallelForRange_t *pRange )
+	{
+		int32 nBottom = m_nBottom - 1;
+
+		// Full barrier, a thief must see the claim on the bottom before we read the top
+		ThreadInterlockedExchange( &m_nBottom, nBottom );
+		int32 nTop = m_nTop;
+		if ( nTop > nBottom )
+		{
+			m_nBottom = nBottom + 1;
+			return false;
+		}
+
+		*pRange = m_Ranges[nBottom & ( CAPACITY - 1 )];
+		if ( nTop != nBottom )
+			return true;
+
+		// The last range, thieves may be after it too
+		bool bWon = ThreadInterlockedAssignIf( &m_nTop, nTop + 1, nTop );
+		m_nBottom = nTop + 1;
+		return bWon;
+	}
+
+	// Any thread
+	bool Steal( ParallelForRange_t *pRange )
+	{
+		int32 nTop = m_nTop;
+		ThreadMemoryBarrier();
+		int32 nBottom = m_nBottom;
+		if ( nTop >= nBottom )
+			return false;
+
+		ParallelForRange_t range = m_Ranges[nTop & ( CAPACITY - 1 )];
+		if ( !ThreadInterlockedAssignIf( &m_nTop, nTop + 1, nTop ) )
+			return false;
+
+		*pRange = range;
+		return true;
+	}
+
+private:
+	// Thieves write the top and the owner the bottom, keep them on separate cache lines
+	volatile int32		m_nTop;
+	byte				m_Pad[60];
+	volatile int32		m_nBottom;
+	ParallelForRange_t	m_Ranges[CAPACITY];
+};
+
+//-----------------------------------------------------------------------------
+
+class CParallelForScheduler
+{
+public:
+	enum
+	{
+		MAX_THREADS = 32,
+		AUTO_GRAIN_CHUNKS_PER_THREAD = 8,	// Chunks per thread when picking a grain, slack for stealing to balance
+	};
+
+	CParallelForScheduler( const char *pszDescription, IParallelForBody *pBody, int nBegin, int nEnd, int nGrain, int nThreads )
+	{
+		m_pszDescription = pszDescription;
+		m_pBody = pBody;
+		m_nThreads = nThreads;
+		m_nRemaining = nEnd - nBegin;
+		m_nStarted = 1;
+		m_Initial.nBegin = nBegin;
+		m_Initial.nEnd = nEnd;
+
+		if ( nGrain <= 0 )
+		{
+			nGrain = ( nEnd - nBegin ) / ( nThreads * AUTO_GRAIN_CHUNKS_PER_THREAD );
+		}
+		m_nGrain = MAX( nGrain, 1 );
+
+		for ( int i = 0; i < nThreads; i++ )
+		{
+			m_Deques[i].Init();
+		}
+	}
+
+	// The calling thread, it owns the initial range and returns once every item is done
+	void RunCaller()
+	{
+		Participate( 0, &m_Initial );
+	}
+
+	// Pool threads, they leave when there is nothing left to steal
+	void RunHelper()
+	{
+		int iThread = m_nStarted++;
+		if ( iThread < m_nThreads )
+		{
+			Participate( iThread, NULL );
+		}
+	}
+
+private:
+	void Participate( int iThread, const ParallelForRange_t *pInitial )
+	{
+		tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "ParallelFor %s", m_pszDescription );
+
+		CParallelForDeque &deque = m_Deques[iThread];
+		bool bCaller = ( pInitial != NULL );
+		bool bBegun = false;
+		ParallelForRange_t range;
+		if ( pInitial )
+		{
+			range = *pInitial;
+		}
+
+		for ( ;; )
+		{
+			if ( !pInitial && !deque.Pop( &range ) && !Steal( iThread, &range ) )
+			{
+				if ( m_nRemaining <= 0 )
+					break;
+
+				// Spin, then park: helpers hand their thread back to the pool, the caller
+				// sleeps until the last range is done
+				bool bFound = false;
+				for ( int nSpin = GetThreadSpinCount(); nSpin > 0 && m_nRemaining > 0; --nSpin )
+				{
+					ThreadPause();
+					if ( Steal( iThread, &range ) )
+					{
+						bFound = true;
+						break;
+					}
+				}
+
+				if ( !bFound )
+				{
+					if ( bCaller )
+					{
+						m_Done.Wait();
+					}
+					break;
+				}
+			}
+			pInitial = NULL;
+
+			if ( !bBegun )
+			{
+				m_pBody->Begin();
+				bBegun = true;
+			}
+
+			int nProcessed = RunRange( deque, range );
+			if ( m_nRemaining.AtomicAdd( -nProcessed ) == nProcessed )
+			{
+				m_Done.Set();
+			}
+		}
+
+		if ( bBegun )
+		{
+			m_pBody->End();
+		}
+	}
+
+	// Processes a range a grain at a time, offering half of what is left whenever
+	// the deque is empty. Returns how many items were processed here.
+	int RunRange( CParallelForDeque &deque, ParallelForRange_t range )
+	{
+		int nProcessed = 0;
+		while ( range.nBegin < range.nEnd )
+		{
+			int nCount = range.nEnd - range.nBegin;
+			if ( nCount > m_nGrain && deque.IsEmpty() )
+			{
+				ParallelForRange_t half;
+				half.nBegin = range.nBegin + nCount / 2;
+				half.nEnd = range.nEnd;
+				if ( deque.Push( half ) )
+				{
+					range.nEnd = half.nBegin;
+					continue;
+				}
+			}
+
+			int nChunkEnd = range.nBegin + MIN( nCount, m_nGrain );
+			m_pBody->Process( range.nBegin, nChunkEnd );
+			nProcessed += nChunkEnd - range.nBegin;
+			range.nBegin = nChunkEnd;
+		}
+		return nProcessed;
+	}
+
+	bool Steal( int iThread, ParallelForRange_t *pRange )
+	{
+		int nStarted = MIN( (int)m_nStarted, m_nThreads );
+		for ( int i = 1; i < nStarted; i++ )
+		{
+			if ( m_Deques[( iThread + i ) % nStarted].Steal( pRange ) )
+				return true;
+		}
+		return false;
+	}
+
+	CParallelForDeque	m_Deques[MAX_THREADS];
+	const char *		m_pszDescription;
+	IParallelForBody *	m_pBody;
+	ParallelForRange_t	m_Initial;
+	int					m_nThreads;
+	int					m_nGrain;
+	CInterlockedInt		m_nRemaining;
+	CInterlockedInt		m_nStarted;
+	CThreadManualEvent	m_Done;
+};
+
+//---------------------------------------------------------
+
+JOB_INTERFACE void ParallelFor( const char *pszDescription, IParallelForBody *pBody, int nBegin, int nEnd, int nGrain, int nMaxParallel, IThreadPool *pThreadPool )
+{
+	if ( nEnd <= nBegin )
+		return;
+
+	if ( !pThreadPool )
+	{
+		pThreadPool = g_pThreadPool;
+	}
+
+	int nHelpers = pThreadPool ? pThreadPool->NumThreads() : 0;
+	nHelpers = MIN( nHelpers, nMaxParallel );
+	nHelpers = MIN( nHelpers, nEnd - nBegin - 1 );
+	nHelpers = MIN( nHelpers, CParallelForScheduler::MAX_THREADS - 1 );
+	if ( nGrain > 0 )
+	{
+		nHelpers = MIN( nHelpers, ( nEnd - nBegin - 1 ) / nGrain );
+	}
+
+	if ( nHelpers <= 0 )
+	{
+		tmZone( TELEMETRY_LEVEL0, TMZF_NONE, "ParallelFor %s", pszDescription );
+		pBody->Begin();
+		pBody->Process( nBegin, nEnd );
+		pBody->End();
+		return;
+	}
+
+	CParallelForScheduler scheduler( pszDescription, pBody, nBegin, nEnd, nGrain, nHelpers + 1 );
+
+	CJob **ppHelpers = (CJob **)stackalloc( nHelpers * sizeof( CJob * ) );
+	for ( int i = 0; i < nHelpers; i++ )
+	{
+		ppHelpers[i] = pThreadPool->QueueCall( &scheduler, &CParallelForScheduler::RunHelper );
+		ppHelpers[i]->SetDescription( pszDescription );
+	}
+
+	scheduler.RunCaller();
+
+	for ( int i = 0; i < nHelpers; i++ )
+	{
+		ppHelpers[i]->Abort(); // aborts helpers that never got a thread, waits for the ones that did
+		ppHelpers[i]->Release();
+	}
+}
+
 //-----------------------------------------------------------------------------
 
 